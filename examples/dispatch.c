@@ -0,0 +1,78 @@
+/*
+ *     Copyright (c) 2023 Marc Munro
+ *     Fileset:	libbgpiod - basic/bloodnok gpio device library
+ *     Author:  Marc Munro
+ *     License: CC0 - the contents of this file are dedicated to the
+ *                    public domain.
+ *
+ */
+
+/**
+ * @file   dispatch.c
+ * @brief
+ * Provide the simplest possible example of handling gpio edge
+ * transitions with per-line callbacks using libbgpiod.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "../lib/bgpiod.h"
+
+static void
+on_falling(bgpio_request_t *request, struct gpio_v2_line_event *event,
+	   void *ctx)
+{
+    fprintf(stdout, "%s: falling edge on line %d\n",
+	    (char *) ctx, event->offset);
+}
+
+int
+main(int argc, char *argv[])
+{
+    bgpio_request_t *request;
+    int line = 81;
+    char *line_name;
+    int err;
+    
+    request = bgpio_open_request("/dev/gpiochip1",
+                                 "example-dispatch", 0);
+
+    if (!request) {
+        perror("bgpio_open_request failed\n");
+        exit(errno);
+    }
+
+    line_name = bgpio_configure_line(request, line,
+				     GPIO_V2_LINE_FLAG_INPUT |
+				     GPIO_V2_LINE_FLAG_EDGE_FALLING);
+    if (!line_name) {
+        fprintf(stderr, "Invalid line (%d) for chip.\n", line);
+        exit(EINVAL);
+    }
+
+    err = bgpio_complete_request(request);
+    if (err) {
+        fprintf(stderr, "Error completing bgpio_request: %s\n",
+                strerror(errno));
+        exit(err);
+    }
+    err = bgpio_on_edge(request, line, GPIO_V2_LINE_FLAG_EDGE_FALLING,
+			on_falling, line_name);
+    if (err) {
+        fprintf(stderr, "Error registering callback: %s\n",
+                strerror(err));
+        exit(err);
+    }
+    if (bgpio_dispatch(request, NULL) < 0) {
+	fprintf(stderr, "%s\n", strerror(errno));
+    }
+    err = bgpio_close_request(request);
+    if (err) {
+        fprintf(stderr, "Error closing bgpio_request: %s\n",
+                strerror(err));
+        exit(err);
+    }
+}
@@ -0,0 +1,86 @@
+/*
+ *     Copyright (c) 2023 Marc Munro
+ *     Fileset:	libbgpiod - basic/bloodnok gpio device library
+ *     Author:  Marc Munro
+ *     License: CC0 - the contents of this file are dedicated to the
+ *                    public domain.
+ *
+ */
+
+/**
+ * @file   group_set.c
+ * @brief
+ * Provide the simplest possible example of setting output lines on
+ * two gpio chips together, with minimal skew, using libbgpiod.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "../lib/bgpiod.h"
+
+static bgpio_request_t *
+open_output(char *path, int line)
+{
+    bgpio_request_t *request;
+    char *line_name;
+    int err;
+
+    request = bgpio_open_request(path, "example-group-set", 0);
+    if (!request) {
+        perror("bgpio_open_request failed\n");
+        exit(errno);
+    }
+    line_name = bgpio_configure_line(request, line,
+				     GPIO_V2_LINE_FLAG_OUTPUT, 0);
+    if (!line_name) {
+        fprintf(stderr, "Invalid line (%d) for chip.\n", line);
+        exit(EINVAL);
+    }
+    free(line_name);
+    err = bgpio_complete_request(request);
+    if (err) {
+        fprintf(stderr, "Error completing bgpio_request: %s\n",
+                strerror(errno));
+        exit(err);
+    }
+    return request;
+}
+
+int
+main(int argc, char *argv[])
+{
+    bgpio_request_t *requests[2];
+    bgpio_group_t *group;
+    int value;
+    int err;
+
+    requests[0] = open_output("/dev/gpiochip0", 23);
+    requests[1] = open_output("/dev/gpiochip1", 81);
+
+    /* Ask for SCHED_FIFO workers; we fall back to normal scheduling
+     * if we are not permitted. */
+    group = bgpio_open_group(requests, 2, 50);
+    if (!group) {
+        perror("bgpio_open_group failed\n");
+        exit(errno);
+    }
+    for (value = 0; value < 10; value++) {
+	bgpio_set_line(requests[0], 23, value & 1);
+	bgpio_set_line(requests[1], 81, value & 1);
+	err = bgpio_group_set(group);
+	if (err) {
+	    fprintf(stderr, "Error setting lines: %s\n", strerror(err));
+	    exit(err);
+	}
+	fprintf(stdout, "set %d: skew %" PRIu64 " ns\n",
+		value & 1, group->skew_ns);
+	usleep(500000);
+    }
+    bgpio_close_group(group);
+    bgpio_close_request(requests[0]);
+    bgpio_close_request(requests[1]);
+}
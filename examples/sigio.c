@@ -0,0 +1,99 @@
+/*
+ *     Copyright (c) 2023 Marc Munro
+ *     Fileset:	libbgpiod - basic/bloodnok gpio device library
+ *     Author:  Marc Munro
+ *     License: CC0 - the contents of this file are dedicated to the
+ *                    public domain.
+ *
+ */
+
+/**
+ * @file   sigio.c
+ * @brief
+ * Provide the simplest possible example of being notified of gpio
+ * edge transitions by a real-time signal, without an event loop.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include "../lib/bgpiod.h"
+
+static bgpio_request_t *request;
+static volatile sig_atomic_t edges = 0;
+
+static void
+on_signal(int signo, siginfo_t *info, void *ucontext)
+{
+    struct gpio_v2_line_event events[16];
+    int saved_errno = errno;
+    int count;
+
+    if (bgpio_sigio_fd(info) == bgpio_request_fd(request)) {
+	count = bgpio_sigio_drain(request, events, 16);
+	if (count > 0) {
+	    edges += count;
+	}
+    }
+    errno = saved_errno;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct sigaction action;
+    int line = 81;
+    char *line_name;
+    int err;
+
+    request = bgpio_open_request("/dev/gpiochip1",
+                                 "example-sigio", 0);
+
+    if (!request) {
+        perror("bgpio_open_request failed\n");
+        exit(errno);
+    }
+
+    line_name = bgpio_configure_line(request, line,
+				     GPIO_V2_LINE_FLAG_INPUT |
+				     GPIO_V2_LINE_FLAG_EDGE_FALLING);
+    if (!line_name) {
+        fprintf(stderr, "Invalid line (%d) for chip.\n", line);
+        exit(EINVAL);
+    }
+
+    err = bgpio_complete_request(request);
+    if (err) {
+        fprintf(stderr, "Error completing bgpio_request: %s\n",
+                strerror(errno));
+        exit(err);
+    }
+
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = on_signal;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigaction(SIGRTMIN, &action, NULL);
+
+    err = bgpio_enable_sigio(request, SIGRTMIN, true);
+    if (err) {
+        fprintf(stderr, "Error enabling signals: %s\n", strerror(err));
+        exit(err);
+    }
+
+    /* The rest of the program carries on regardless. */
+    while (edges < 5) {
+	pause();
+    }
+    fprintf(stdout, "%d falling edges on %s\n", edges, line_name);
+
+    err = bgpio_close_request(request);
+    if (err) {
+        fprintf(stderr, "Error closing bgpio_request: %s\n",
+                strerror(err));
+        exit(err);
+    }
+}
@@ -16,6 +16,7 @@
  * deprecated V1 calls of libgpiod.
  */
 
+#define _GNU_SOURCE     // for ppoll()
 
 #include <stdio.h>
 #include <unistd.h>
@@ -26,8 +27,10 @@
 #include <errno.h>
 #include <assert.h>
 #include <poll.h>
+#include <time.h>
 
 #include "bgpiod.h"
+#include "bgpiod_internal.h"
 
 /**
  * Return the index into ::bgpio_request_t->req.offsets[] for the
@@ -40,7 +43,7 @@
  *
  * @result The integer index value, or -1 if line is not found.
  */
-static int
+int
 bgpio_idx_for_line(bgpio_request_t *req, int line)
 {
     int i;
@@ -53,6 +56,23 @@ bgpio_idx_for_line(bgpio_request_t *req, int line)
     return -1;
 }
 
+/**
+ * Return the current time from the monotonic clock, in nanoseconds.
+ * This is the clock used, by default, for the timestamps of gpio
+ * line events, so the results may be directly compared with
+ * ::gpio_v2_line_event->timestamp_ns.
+ *
+ * @result The current CLOCK_MONOTONIC time in nanoseconds.
+ */
+uint64_t
+bgpio_now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t) now.tv_sec * 1000000000ull) + now.tv_nsec;
+}
+
 /**
  * Clear any existing line flags for the given line.
  * This will free up any ::bgpio_request->req.config->attr entries
@@ -172,7 +192,7 @@ bgpio_update_initial_value(bgpio_request_t *req, int line, int output_value)
     for (int i = 0; i < req->req.config.num_attrs; i++) {
 	if (req->req.config.attrs[i].attr.id ==
 	    GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES) {
-	    attr_idx = 0;
+	    attr_idx = i;
 	    break;
 	}
     }
@@ -227,7 +247,7 @@ bgpio_open_request(
 	}
 	strncpy(req->req.consumer, consumer, GPIO_MAX_NAME_SIZE);
 	req->req.config.flags = flags;
-	req->chardev_path = malloc(strlen(device_path + 1));
+	req->chardev_path = malloc(strlen(device_path) + 1);
 	strcpy(req->chardev_path, device_path);
     }
     
@@ -364,6 +384,10 @@ bgpio_set_line(bgpio_request_t *req, int line, int value)
  * Send output values configured by bgpio_set_line() to the gpio
  * device.
  *
+ * The values are merged into any deferred updates (see
+ * bgpio_set_output_mode()).  Unless a deferred-flush window is set
+ * and has not yet expired, they are then sent using bgpio_flush().
+ *
  * @param req The ::bgpio_request_t request  to which the line is to be
  * added. 
  *
@@ -373,8 +397,138 @@ int
 bgpio_set(bgpio_request_t *req)
 {
     assert(req);
-    return ioctl(req->req.fd, GPIO_V2_LINE_SET_VALUES_IOCTL,
-		 &req->line_values);
+    bgpio_output_shadow_t *shadow = &req->shadow;
+    uint64_t mask = req->line_values.mask;
+
+    if (!shadow->pending_mask) {
+	shadow->pending_since_ns = shadow->defer_usecs? bgpio_now_ns(): 0;
+    }
+    shadow->pending_bits = (shadow->pending_bits & ~mask) |
+	(req->line_values.bits & mask);
+    shadow->pending_mask |= mask;
+
+    if (shadow->defer_usecs &&
+	((bgpio_now_ns() - shadow->pending_since_ns) <
+	 (uint64_t) shadow->defer_usecs * 1000)) {
+	return 0;
+    }
+    return bgpio_flush(req);
+}
+
+/**
+ * Choose how bgpio_set() treats output values.
+ *
+ * With \p elide set, a set that would not change the value of any
+ * line, according to the library's shadow of the last values driven,
+ * does not result in an ioctl.  The shadow is initialised from the
+ * initial output values given to bgpio_configure_line() and updated
+ * by each successful set.  It will be wrong if the lines are driven
+ * by anything else, eg another process sharing the request (see
+ * bgpio_send_request()).
+ *
+ * With \p defer_usecs non-zero, updates made by bgpio_set() are held
+ * back until that many microseconds have passed since the oldest
+ * held-back update, so that several updates are sent with a single
+ * ioctl.  Deferred updates are only sent by a subsequent call to
+ * bgpio_set() or bgpio_flush(), so callers should call bgpio_flush()
+ * at the end of each cycle of updates.
+ *
+ * @param req The ::bgpio_request_t request.
+ *
+ * @param elide Whether to skip sets that would change nothing.
+ *
+ * @param defer_usecs The deferred-flush window in microseconds, or
+ * zero to send every update immediately.
+ */
+void
+bgpio_set_output_mode(bgpio_request_t *req, bool elide, uint32_t defer_usecs)
+{
+    assert(req);
+    req->shadow.elide = elide;
+    req->shadow.defer_usecs = defer_usecs;
+}
+
+/**
+ * Invert the values of a set of output lines.  The current values are
+ * taken from the library's shadow of the last values driven (see
+ * bgpio_set_output_mode()), so unless the shadow is missing the value
+ * of some of the lines, no fetch is needed.  A line whose value has
+ * been given by bgpio_set_line(), but not yet sent, is inverted from
+ * that value.  The toggled values are merged into
+ * ::bgpio_request_t->line_values, and sent, along with any values
+ * from bgpio_set_line(), as for bgpio_set().
+ *
+ * @param req The completed ::bgpio_request_t request.
+ *
+ * @param mask Bitmap, by line index (as for
+ * ::bgpio_request_t->line_values), of the lines to be toggled.
+ *
+ * @result 0 on success, else -1 with errno set.
+ */
+int
+bgpio_toggle_lines(bgpio_request_t *req, uint64_t mask)
+{
+    assert(req);
+    bgpio_output_shadow_t *shadow = &req->shadow;
+    uint64_t staged = req->line_values.mask;
+    uint64_t current;
+    uint64_t unknown = mask &
+	~(shadow->known | shadow->pending_mask | staged);
+
+    if (unknown) {
+	struct gpio_v2_line_values values = {0, unknown};
+	if (ioctl(req->req.fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values)) {
+	    return -1;
+	}
+	shadow->bits = (shadow->bits & ~unknown) | (values.bits & unknown);
+	shadow->known |= unknown;
+    }
+    current = (shadow->bits & ~shadow->pending_mask) |
+	(shadow->pending_bits & shadow->pending_mask);
+    current = (current & ~staged) | (req->line_values.bits & staged);
+    req->line_values.mask |= mask;
+    req->line_values.bits = (req->line_values.bits & ~mask) |
+	(~current & mask);
+    return bgpio_set(req);
+}
+
+/**
+ * Send any updates deferred by bgpio_set() to the gpio device.  If
+ * elision is enabled and the updates would change nothing, no ioctl
+ * is made.
+ *
+ * @param req The ::bgpio_request_t request.
+ *
+ * @result 0 on success, else the result of the failing ioctl with
+ * errno set.
+ */
+int
+bgpio_flush(bgpio_request_t *req)
+{
+    assert(req);
+    bgpio_output_shadow_t *shadow = &req->shadow;
+    struct gpio_v2_line_values values = {
+	shadow->pending_bits, shadow->pending_mask};
+    int res;
+
+    if (!values.mask) {
+	return 0;
+    }
+    if (shadow->elide && !(values.mask & ~shadow->known) &&
+	!((values.bits ^ shadow->bits) & values.mask)) {
+	shadow->elided++;
+	shadow->pending_mask = 0;
+	return 0;
+    }
+    res = ioctl(req->req.fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values);
+    if (res == 0) {
+	shadow->ioctls++;
+	shadow->bits = (shadow->bits & ~values.mask) |
+	    (values.bits & values.mask);
+	shadow->known |= values.mask;
+	shadow->pending_mask = 0;
+    }
+    return res;
 }
 
 /**
@@ -404,6 +558,14 @@ bgpio_complete_request(bgpio_request_t *req)
     int res;
     res = ioctl(req->device_fd, GPIO_V2_GET_LINE_IOCTL, &req->req);
     if (!res) {
+	/* Our output shadow starts with the initial output values. */
+	for (int i = 0; i < req->req.config.num_attrs; i++) {
+	    if (req->req.config.attrs[i].attr.id ==
+		GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES) {
+		req->shadow.known = req->req.config.attrs[i].mask;
+		req->shadow.bits = req->req.config.attrs[i].attr.values;
+	    }
+	}
 	
 	res = ioctl(req->req.fd, GPIO_V2_LINE_SET_CONFIG_IOCTL,
 		    &req->req.config);
@@ -419,6 +581,55 @@ bgpio_complete_request(bgpio_request_t *req)
     return res;
 }
 
+/**
+ * Return the effective line flags for a line in a request, taking
+ * account of both the request's default flags and any line-specific
+ * flags.
+ *
+ * @param req The ::bgpio_request_t request.
+ *
+ * @param idx The index of the line within the request.
+ *
+ * @result The line's flags.
+ */
+uint64_t
+bgpio_line_flags_by_idx(bgpio_request_t *req, int idx)
+{
+    struct gpio_v2_line_config *config = &req->req.config;
+    int i;
+
+    for (i = 0; i < config->num_attrs; i++) {
+	if ((config->attrs[i].attr.id == GPIO_V2_LINE_ATTR_ID_FLAGS) &&
+	    BGPIO_BITVALUE(config->attrs[i].mask, idx)) {
+	    return config->attrs[i].attr.flags;
+	}
+    }
+    return config->flags;
+}
+
+/**
+ * Refresh the input mirror of a request by ioctl.
+ *
+ * @param req The ::bgpio_request_t request.
+ *
+ * @result 0 on success, else -1 with errno set.
+ */
+int
+bgpio_mirror_sync(bgpio_request_t *req)
+{
+    bgpio_input_mirror_t *mirror = &req->mirror;
+    struct gpio_v2_line_values values = {0, mirror->valid};
+    uint64_t now = bgpio_now_ns();
+
+    if (ioctl(req->req.fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values)) {
+	return -1;
+    }
+    mirror->fetches++;
+    mirror->bits = values.bits & mirror->valid;
+    mirror->synced_ns = now;
+    return 0;
+}
+
 /**
  * Perform the fetches for a previously set up ::bgpio_request_t.  
  * 
@@ -439,8 +650,137 @@ bgpio_fetch(bgpio_request_t *req)
 {
     assert(req);
     assert(req->req.fd);
-    return ioctl(req->req.fd, GPIO_V2_LINE_GET_VALUES_IOCTL,
-		 &req->line_values);
+    bgpio_input_mirror_t *mirror = &req->mirror;
+    uint64_t mask = req->line_values.mask;
+    int res;
+
+    if (mirror->enabled && mask && !(mask & ~mirror->valid)) {
+	if (mirror->resync_msecs &&
+	    ((bgpio_now_ns() - mirror->synced_ns) >=
+	     (uint64_t) mirror->resync_msecs * 1000000)) {
+	    if (bgpio_mirror_sync(req)) {
+		return -1;
+	    }
+	}
+	req->line_values.bits = (req->line_values.bits & ~mask) |
+	    (mirror->bits & mask);
+	mirror->served++;
+	return 0;
+    }
+
+    res = ioctl(req->req.fd, GPIO_V2_LINE_GET_VALUES_IOCTL,
+		&req->line_values);
+    if ((res == 0) && mirror->enabled) {
+	mirror->fetches++;
+	mask &= mirror->valid;
+	mirror->bits = (mirror->bits & ~mask) |
+	    (req->line_values.bits & mask);
+    }
+    return res;
+}
+
+/**
+ * Start answering bgpio_fetch() calls from a mirror of the line
+ * values that is maintained from edge events, rather than by ioctl.
+ * Only lines configured as inputs with detection of both edges can be
+ * mirrored: fetches that include any other lines are performed by
+ * ioctl as usual.
+ *
+ * The mirror is seeded by a single fetch, and is then updated by
+ * bgpio_note_event() for each edge event read by
+ * bgpio_await_event(), bgpio_dispatch() or bgpio_fanout_update().
+ * Events that have not yet been read are not reflected in the mirror,
+ * so the caller must read events promptly.  To recover from missed
+ * or unread events, the mirror is refreshed by ioctl every \p
+ * resync_msecs milliseconds.
+ *
+ * Events are assumed to be timestamped using CLOCK_MONOTONIC (the
+ * default).  Events timestamped before the latest resync are ignored.
+ *
+ * @param req The completed ::bgpio_request_t request.
+ *
+ * @param resync_msecs How often, in milliseconds, the mirror is to be
+ * refreshed by ioctl.  Zero means never.
+ *
+ * @result 0 on success, else -1 with errno set.  EINVAL means that
+ * no lines in the request can be mirrored.
+ */
+int
+bgpio_enable_mirror(bgpio_request_t *req, uint32_t resync_msecs)
+{
+    assert(req);
+    bgpio_input_mirror_t *mirror = &req->mirror;
+    uint64_t both = GPIO_V2_LINE_FLAG_INPUT |
+	GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+    int idx;
+
+    mirror->valid = 0;
+    for (idx = 0; idx < req->req.num_lines; idx++) {
+	if ((bgpio_line_flags_by_idx(req, idx) & both) == both) {
+	    BGPIO_SETBIT(mirror->valid, idx);
+	}
+    }
+    if (!mirror->valid) {
+	errno = EINVAL;
+	return -1;
+    }
+    mirror->resync_msecs = resync_msecs;
+    if (bgpio_mirror_sync(req)) {
+	return -1;
+    }
+    mirror->enabled = true;
+    return 0;
+}
+
+/**
+ * Account for an edge event read from a request: update the request's
+ * input mirror (see bgpio_enable_mirror()) and count the event against
+ * its rate guard (see bgpio_enable_rate_guard()).  This is called by
+ * the library for each event it reads, and must also be called by
+ * callers that read events from the request's file descriptor
+ * themselves.
+ *
+ * @param req The ::bgpio_request_t request.
+ *
+ * @param event The edge event.
+ */
+void
+bgpio_note_event(bgpio_request_t *req, struct gpio_v2_line_event *event)
+{
+    if (req->guard) {
+	bgpio_guard_event(req, event);
+    }
+    bgpio_mirror_event(req, event);
+}
+
+/**
+ * Update the input mirror (see bgpio_enable_mirror()) from an edge
+ * event.  This does not count the event against any rate guard: use
+ * bgpio_note_event() for that.
+ *
+ * @param req The ::bgpio_request_t request.
+ *
+ * @param event The edge event.
+ */
+void
+bgpio_mirror_event(bgpio_request_t *req, struct gpio_v2_line_event *event)
+{
+    bgpio_input_mirror_t *mirror = &req->mirror;
+    int idx;
+
+    if (!mirror->enabled || (event->timestamp_ns < mirror->synced_ns)) {
+	return;
+    }
+    idx = bgpio_idx_for_line(req, event->offset);
+    if ((idx < 0) || !BGPIO_BITVALUE(mirror->valid, idx)) {
+	return;
+    }
+    if (event->id == GPIO_V2_LINE_EVENT_RISING_EDGE) {
+	BGPIO_SETBIT(mirror->bits, idx);
+    }
+    else {
+	BGPIO_CLEARBIT(mirror->bits, idx);
+    }
 }
 
 /** 
@@ -516,6 +856,15 @@ bgpio_close_request(bgpio_request_t *req)
     int res = 0;
     int res2 = 0;
     free(req->chardev_path);
+    if (req->sigio) {
+	(void) bgpio_disable_sigio(req);
+    }
+    free(req->coalesce);
+    free(req->guard);
+    if (req->dispatch) {
+	free(req->dispatch->line_idx);
+	free(req->dispatch);
+    }
     if (req->req.fd) {
 	res = close(req->req.fd);
 	if (res) {
@@ -528,6 +877,9 @@ bgpio_close_request(bgpio_request_t *req)
 	    perror("Failed to close device file");
 	}
     }
+    if (req->wakeup_fd) {
+	(void) close(req->wakeup_fd);
+    }
     free((void *) req);
     return errno? errno: res? res: res2;
 }
@@ -592,7 +944,11 @@ bgpio_open_chip(char *path)
 	perror("Out of memory in open_gpio_chip().");
 	errno = ENOMEM;
     }
-    chip->path = malloc(strlen(path + 1));
+    if (!chip) {
+	close(fd);
+	return NULL;
+    }
+    chip->path = malloc(strlen(path) + 1);
     strcpy(chip->path, path);
 
     return chip;
@@ -611,6 +967,14 @@ bgpio_close_chip(bgpio_chip_t *chip)
     if (err) {
 	perror("Failed to close gpiochip file");
     }
+    if (chip->cache) {
+	close(chip->cache->watch_fd);
+	free(chip->cache->cached);
+	free(chip->cache->watched);
+	free(chip->cache->infos);
+	free(chip->cache);
+    }
+    free(chip->path);
     free((void *) chip);
 }
 
@@ -638,15 +1002,26 @@ bgpio_close_chip(bgpio_chip_t *chip)
  * Line output values are best retrieved using bgpio_attr_output().
  *
  * Debounce information is best retrieved using bgpio_attr_debounce().
+ *
+ * If the chip has a line-info cache (see
+ * bgpio_enable_lineinfo_cache()), the result is copied from the cache
+ * without any system call, so it reflects changes only up to the last
+ * call of bgpio_refresh_lineinfo_cache().  Callers that want to avoid
+ * the allocation too should use bgpio_cached_lineinfo().
  */
 struct gpio_v2_line_info *
 bgpio_get_lineinfo(bgpio_chip_t *chip, int line)
 {
     assert(chip);
     struct gpio_v2_line_info *info;
+    struct gpio_v2_line_info *cached;
     int err;
     info = (struct gpio_v2_line_info *) calloc(
 	1, sizeof(struct gpio_v2_line_info));
+    if (chip->cache && (cached = bgpio_cached_lineinfo(chip, line))) {
+	*info = *cached;
+	return info;
+    }
     info->offset = line;
     err = ioctl(chip->fd, GPIO_V2_GET_LINEINFO_IOCTL, info);
     if (err) {
@@ -655,6 +1030,61 @@ bgpio_get_lineinfo(bgpio_chip_t *chip, int line)
     return info;
 }
 
+/**
+ * Get information about a contiguous range of lines from a gpio
+ * device, placing it into a caller-provided array.  Unlike
+ * bgpio_get_lineinfo(), this performs no allocation.  The kernel
+ * provides no bulk line-info ioctl, so there is still one ioctl per
+ * line, unless the chip has a line-info cache (see
+ * bgpio_enable_lineinfo_cache()) in which case there are none.
+ *
+ * In the event of an error, errno will be set.
+ *
+ * @param chip A ::bgpio_chip_t as returned by bgpio_open_chip().
+ *
+ * @param first The line number of the first line.
+ *
+ * @param count The number of lines.  \p first + \p count must not
+ * exceed the number of lines on the chip.
+ *
+ * @param infos Array of at least \p count ::gpio_v2_line_info structs
+ * into which the information for each line will be placed.
+ *
+ * @result The number of entries filled, ie \p count, or -1 in the
+ * event of an error.
+ */
+int
+bgpio_chip_snapshot(bgpio_chip_t *chip, int first, int count,
+		    struct gpio_v2_line_info *infos)
+{
+    assert(chip);
+    assert(infos);
+    struct gpio_v2_line_info *cached;
+    int i;
+
+    if ((first < 0) || (count < 0) ||
+	((uint32_t) first + count > chip->info.lines)) {
+	errno = EINVAL;
+	return -1;
+    }
+    memset(infos, 0, count * sizeof(struct gpio_v2_line_info));
+    if (chip->cache) {
+	(void) bgpio_refresh_lineinfo_cache(chip);
+    }
+    for (i = 0; i < count; i++) {
+	if (chip->cache &&
+	    (cached = bgpio_cached_lineinfo(chip, first + i))) {
+	    infos[i] = *cached;
+	    continue;
+	}
+	infos[i].offset = first + i;
+	if (ioctl(chip->fd, GPIO_V2_GET_LINEINFO_IOCTL, &infos[i])) {
+	    return -1;
+	}
+    }
+    return count;
+}
+
 /** 
  * From a ::gpio_v2_line_info record, extract any line-specifc
  * attribute flags.  The set of attribute flags s is defined in the
@@ -759,39 +1189,223 @@ bgpio_reconfigure(bgpio_request_t *req)
 }
 
 /**
- * Await an event on the gpio lines configured in a ::bgpio_request_t
- * request.
+ * Convert a timeout in milliseconds to the form used by ppoll().
  *
- * @param req The ::bgpio_request_t request identifying the lines and
- * events on which we are to wait.
- * 
  * @param timeout_msecs Pointer to a timeout value given in
- * milliseconds.  If no timeout is required, the pointer should be
- * NULL.
- * 
- * @result Zero if successful.  ::bgpio_request_t->event will describe
- * the event that occurred.
+ * milliseconds, or NULL.  A negative value means no timeout.
+ *
+ * @param ts The timespec to be filled in.
+ *
+ * @result \p ts, or NULL if there is no timeout.
  */
-int
-bgpio_await_event(bgpio_request_t *req,
-		  int *timeout_msecs)
+static struct timespec *
+msecs_timespec(int *timeout_msecs, struct timespec *ts)
 {
-    int res;
-    if (timeout_msecs) {
-	struct pollfd poll_fd = {req->req.fd, POLLIN, 0};
-	res = poll(&poll_fd, 1, *timeout_msecs);
-	    
-	if (res == 0) {
-	    /* We timed-out.  Let the caller know. */
+    if (!timeout_msecs || (*timeout_msecs < 0)) {
+	return NULL;
+    }
+    ts->tv_sec = *timeout_msecs / 1000;
+    ts->tv_nsec = (*timeout_msecs % 1000) * 1000000;
+    return ts;
+}
+
+/**
+ * Convert an absolute deadline to the time remaining until it, in the
+ * form used by ppoll().
+ *
+ * @param deadline_ns The deadline, as a CLOCK_MONOTONIC time in
+ * nanoseconds (see bgpio_now_ns()), or 0 for no deadline.
+ *
+ * @param ts The timespec to be filled in.
+ *
+ * @result \p ts, or NULL if there is no deadline.
+ */
+static struct timespec *
+deadline_timespec(uint64_t deadline_ns, struct timespec *ts)
+{
+    uint64_t now;
+    uint64_t left;
+
+    if (!deadline_ns) {
+	return NULL;
+    }
+    now = bgpio_now_ns();
+    left = (deadline_ns > now)? deadline_ns - now: 0;
+    ts->tv_sec = left / 1000000000;
+    ts->tv_nsec = left % 1000000000;
+    return ts;
+}
+
+/**
+ * Record the time remaining until a deadline.
+ *
+ * @param deadline_ns The deadline, or 0 for no deadline.
+ *
+ * @param remaining_ns Where the remaining time, in nanoseconds, is to
+ * be placed, or NULL.  If there is no deadline, nothing is placed.
+ */
+static void
+set_remaining(uint64_t deadline_ns, uint64_t *remaining_ns)
+{
+    uint64_t now;
+
+    if (deadline_ns && remaining_ns) {
+	now = bgpio_now_ns();
+	*remaining_ns = (deadline_ns > now)? deadline_ns - now: 0;
+    }
+}
+
+/**
+ * Await an event on the gpio lines of a request in busy-poll mode,
+ * spinning on a non-blocking read() for at most the time given by \p
+ * timeout.  After each read that finds nothing, we pause the cpu for
+ * a number of iterations that doubles up to
+ * ::bgpio_busy_poll_t->max_backoff, which eases the load on a
+ * hyperthread sibling at some cost in latency.
+ *
+ * @param req The ::bgpio_request_t request, which must be
+ * non-blocking.
+ *
+ * @param timeout The maximum time to wait, or NULL.
+ *
+ * @result Zero if successful, else an errno value, as for
+ * bgpio_await_event().
+ */
+static int
+spin_event(bgpio_request_t *req, struct timespec *timeout)
+{
+    bgpio_busy_poll_t *busy = &req->busy;
+    uint64_t deadline = 0;
+    uint32_t backoff = 0;
+    uint64_t wakeups;
+    ssize_t res;
+    uint32_t i;
+
+    if (timeout) {
+	deadline = bgpio_now_ns() +
+	    ((uint64_t) timeout->tv_sec * 1000000000) + timeout->tv_nsec;
+    }
+    while (true) {
+	res = read(req->req.fd, &(req->event),
+		   sizeof(struct gpio_v2_line_event));
+	busy->reads++;
+	if (res >= 0) {
+	    break;
+	}
+	if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+	    return errno;
+	}
+	busy->empty++;
+	if (req->wakeup_fd &&
+	    (read(req->wakeup_fd, &wakeups, sizeof(wakeups)) > 0)) {
+	    return EINTR;
+	}
+	if (deadline && (bgpio_now_ns() >= deadline)) {
 	    return ETIMEDOUT;
 	}
-	if (res < 0) {
-	    return errno? errno: EINVAL;
+	for (i = 0; i < backoff; i++) {
+	    bgpio_cpu_relax();
+	}
+	if (backoff < busy->max_backoff) {
+	    backoff = backoff? backoff * 2: 1;
+	    if (backoff > busy->max_backoff) {
+		backoff = busy->max_backoff;
+	    }
+	}
+    }
+    req->read_ns = bgpio_now_ns();
+    if (res != sizeof(struct gpio_v2_line_event)) {
+	return EINVAL;
+    }
+    bgpio_note_event(req, &req->event);
+    return 0;
+}
+
+/**
+ * Wait until events may be read from a request, or until it is woken
+ * by bgpio_wakeup(), for at most the time given by \p timeout.
+ * Events take precedence over a wakeup.
+ *
+ * @param req The ::bgpio_request_t request.
+ *
+ * @param timeout The maximum time to wait, or NULL.
+ *
+ * @result Zero if events may be read, ETIMEDOUT if the timeout
+ * expired, EINTR if we were woken by bgpio_wakeup(), else an errno
+ * value.
+ */
+static int
+poll_request(bgpio_request_t *req, struct timespec *timeout)
+{
+    struct pollfd poll_fds[2] = {{req->req.fd, POLLIN, 0},
+				 {req->wakeup_fd, POLLIN, 0}};
+    uint64_t wakeups;
+    int res = ppoll(poll_fds, req->wakeup_fd? 2: 1, timeout, NULL);
+
+    if (res == 0) {
+	/* We timed-out.  Let the caller know. */
+	return ETIMEDOUT;
+    }
+    if (res < 0) {
+	return errno? errno: EINVAL;
+    }
+    if (!(poll_fds[0].revents & (POLLIN | POLLERR | POLLHUP))) {
+	if (poll_fds[1].revents & POLLIN) {
+	    /* Consume the wakeup, so that it is reported once. */
+	    (void) read(req->wakeup_fd, &wakeups, sizeof(wakeups));
+	    return EINTR;
 	}
-	if (!poll_fd.revents & POLLIN) {
-	    /* No input data available.  This is bad but we cannot
-	     * easily provide more information here.  */
-	    return EINVAL;
+	/* No input data available.  This is bad but we cannot
+	 * easily provide more information here.  */
+	return EINVAL;
+    }
+    return 0;
+}
+
+/**
+ * Wait, as for poll_request(), for events on a request, for at most
+ * \p timeout_msecs.  This is used by the library's functions that read
+ * events themselves, so that they honour the request's wakeup fd, and
+ * do not fail with EAGAIN on a non-blocking request.
+ *
+ * @param req The ::bgpio_request_t request.
+ *
+ * @param timeout_msecs Pointer to a timeout value given in
+ * milliseconds, or NULL to wait indefinitely.
+ *
+ * @result Zero if events may be read, ETIMEDOUT if the timeout
+ * expired, EINTR if we were woken by bgpio_wakeup(), else an errno
+ * value.
+ */
+int
+bgpio_poll_request(bgpio_request_t *req, int *timeout_msecs)
+{
+    struct timespec ts;
+
+    return poll_request(req, msecs_timespec(timeout_msecs, &ts));
+}
+
+/**
+ * Await an event on the gpio lines of a request, for at most the time
+ * given by \p timeout.
+ *
+ * @param req The ::bgpio_request_t request.
+ *
+ * @param timeout The maximum time to wait, or NULL.
+ *
+ * @result Zero if successful, else an errno value, as for
+ * bgpio_await_event().
+ */
+static int
+await_event(bgpio_request_t *req, struct timespec *timeout)
+{
+    int res;
+    if (req->busy.enabled) {
+	return spin_event(req, timeout);
+    }
+    if (timeout || req->nonblocking || req->wakeup_fd) {
+	if ((res = poll_request(req, timeout))) {
+	    return res;
 	}
     }
     
@@ -800,12 +1414,74 @@ bgpio_await_event(bgpio_request_t *req,
     if (res == -1) {
 	return errno;
     }
+    req->read_ns = bgpio_now_ns();
     if (res != sizeof(struct gpio_v2_line_event)) {
 	return EINVAL;
     }
+    bgpio_note_event(req, &req->event);
     return 0;
 }
 
+/**
+ * Await an event on the gpio lines configured in a ::bgpio_request_t
+ * request.
+ *
+ * If the request has been made non-blocking, or has a wakeup fd, we
+ * poll even if there is no timeout.  In busy-poll mode (see
+ * bgpio_request_busy_poll()) we do not sleep at all, but spin.
+ *
+ * @param req The ::bgpio_request_t request identifying the lines and
+ * events on which we are to wait.
+ * 
+ * @param timeout_msecs Pointer to a timeout value given in
+ * milliseconds.  If no timeout is required, the pointer should be
+ * NULL.  The timeout applies afresh to each call; see
+ * bgpio_await_event_until() for a deadline that does not.
+ * 
+ * @result Zero if successful.  ::bgpio_request_t->event will describe
+ * the event that occurred.  EINTR means that we were woken by
+ * bgpio_wakeup().
+ */
+int
+bgpio_await_event(bgpio_request_t *req,
+		  int *timeout_msecs)
+{
+    struct timespec ts;
+
+    return await_event(req, msecs_timespec(timeout_msecs, &ts));
+}
+
+/**
+ * Await an event on the gpio lines of a request until an absolute
+ * deadline.  Unlike a timeout, a deadline does not restart with each
+ * call, so a loop awaiting events until the deadline ends when the
+ * deadline passes, no matter how many events arrive.
+ *
+ * @param req The ::bgpio_request_t request identifying the lines and
+ * events on which we are to wait.
+ *
+ * @param deadline_ns The deadline, as a CLOCK_MONOTONIC time in
+ * nanoseconds (see bgpio_now_ns()), or 0 for no deadline.
+ *
+ * @param remaining_ns Where the time remaining until the deadline, in
+ * nanoseconds, is to be placed on return, or NULL.
+ *
+ * @result Zero if successful, with ::bgpio_request_t->event describing
+ * the event, ETIMEDOUT if the deadline passed, or another errno value
+ * as for bgpio_await_event().
+ */
+int
+bgpio_await_event_until(bgpio_request_t *req, uint64_t deadline_ns,
+			uint64_t *remaining_ns)
+{
+    struct timespec ts;
+    int res;
+
+    res = await_event(req, deadline_timespec(deadline_ns, &ts));
+    set_remaining(deadline_ns, remaining_ns);
+    return res;
+}
+
 /**
  * Register a line to watch for configuration and reservation changes. 
  * 
@@ -829,39 +1505,35 @@ bgpio_watch_line(bgpio_chip_t *chip, int line)
 }
 
 /**
- * Await a gpio line change event from a set of gpio lines.
- * 
- * In the event of an error, errno will be set and the result will be
- * NULL.
+ * Await a gpio line change event from a chip's watched lines, for at
+ * most the time given by \p timeout.
  *
  * @param chip The ::bgpio_chip_t struct returned by bgpio_open_chip().
  *
- * @param timeout_msecs Pointer to a timeout value given in
- * milliseconds.  If no timeout is required, the pointer should be
- * NULL.
- * 
- * @result Pointer to a static ::gpio_v2_line_info_changed struct that
- * describes the event, or NULL in the event of an error.  The caller
- * must not free this result, and should its contents to change on the
- * next call to this function.
+ * @param timeout The maximum time to wait, or NULL.
+ *
+ * @result As for bgpio_await_watched_lines().
  */
-struct gpio_v2_line_info_changed *
-bgpio_await_watched_lines(bgpio_chip_t *chip, int *timeout_msecs)
+static struct gpio_v2_line_info_changed *
+await_watched_lines(bgpio_chip_t *chip, struct timespec *timeout)
 {
     static struct gpio_v2_line_info_changed change_info;
     struct pollfd poll_fd;
     int ret = 1;
     ssize_t rd;
 
-    if (timeout_msecs) {
+    if (timeout || chip->nonblocking) {
 	poll_fd.fd = chip->fd;
 	poll_fd.events = POLLIN | POLLPRI;
-	ret = poll(&poll_fd, 1, *timeout_msecs);
+	ret = ppoll(&poll_fd, 1, timeout, NULL);
 	if (ret < 0) {
 	    return NULL;
 	}
     }
-    if (ret > 1) {
+    if (ret == 0) {
+	errno = ETIMEDOUT;
+    }
+    else {
 	memset(&change_info, 0, sizeof(change_info));
 	rd = read(chip->fd, &change_info, sizeof(change_info));
 	if (rd == sizeof(change_info)) {
@@ -873,3 +1545,62 @@ bgpio_await_watched_lines(bgpio_chip_t *chip, int *timeout_msecs)
     }
     return NULL;
 }
+
+/**
+ * Await a gpio line change event from a set of gpio lines.
+ * 
+ * In the event of an error, errno will be set and the result will be
+ * NULL.
+ *
+ * @param chip The ::bgpio_chip_t struct returned by bgpio_open_chip().
+ *
+ * @param timeout_msecs Pointer to a timeout value given in
+ * milliseconds.  If no timeout is required, the pointer should be
+ * NULL.
+ * 
+ * @result Pointer to a static ::gpio_v2_line_info_changed struct that
+ * describes the event, or NULL in the event of an error, with errno
+ * set to ETIMEDOUT if the timeout expired.  The caller
+ * must not free this result, and should its contents to change on the
+ * next call to this function.
+ */
+struct gpio_v2_line_info_changed *
+bgpio_await_watched_lines(bgpio_chip_t *chip, int *timeout_msecs)
+{
+    struct timespec ts;
+
+    return await_watched_lines(chip, msecs_timespec(timeout_msecs, &ts));
+}
+
+/**
+ * Await a gpio line change event from a set of gpio lines until an
+ * absolute deadline.  See bgpio_await_event_until().
+ *
+ * In the event of an error, errno will be set and the result will be
+ * NULL.
+ *
+ * @param chip The ::bgpio_chip_t struct returned by bgpio_open_chip().
+ *
+ * @param deadline_ns The deadline, as a CLOCK_MONOTONIC time in
+ * nanoseconds (see bgpio_now_ns()), or 0 for no deadline.
+ *
+ * @param remaining_ns Where the time remaining until the deadline, in
+ * nanoseconds, is to be placed on return, or NULL.
+ *
+ * @result As for bgpio_await_watched_lines(), with errno set to
+ * ETIMEDOUT if the deadline passed.
+ */
+struct gpio_v2_line_info_changed *
+bgpio_await_watched_lines_until(bgpio_chip_t *chip, uint64_t deadline_ns,
+				uint64_t *remaining_ns)
+{
+    struct gpio_v2_line_info_changed *change;
+    struct timespec ts;
+    int err;
+
+    change = await_watched_lines(chip, deadline_timespec(deadline_ns, &ts));
+    err = errno;
+    set_remaining(deadline_ns, remaining_ns);
+    errno = err;
+    return change;
+}
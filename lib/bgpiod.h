@@ -18,6 +18,8 @@
 #include <stdbool.h>
 #include <stdarg.h>
 #include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 
 #ifndef BGPIO_H
 /**
@@ -83,8 +85,235 @@ typedef struct bgpio_chip_t {
 				 * operations */
     int   fd;			/**< File descriptor for chardev */
     char *path;                 /**< Path to the gpio device */
+    struct bgpio_lineinfo_cache *cache;  /**< Line-info cache, or NULL
+					  * (see
+					  * bgpio_enable_lineinfo_cache()) */
+    bool  nonblocking;          /**< Whether fd is O_NONBLOCK (see
+				 * bgpio_chip_nonblocking()) */
 } bgpio_chip_t;
 
+/**
+ * A cache of the line information for a chip, as created by
+ * bgpio_enable_lineinfo_cache().  Entries are populated on first use
+ * and kept up to date from the line-info change events that the
+ * kernel sends for watched lines.  These are received on a file
+ * descriptor of our own so that they do not interfere with
+ * bgpio_watch_line().
+ */
+typedef struct bgpio_lineinfo_cache {
+    int       watch_fd;          /**< Fd on which our watches are made */
+    uint32_t  num_lines;         /**< Number of lines on the chip */
+    uint8_t  *cached;            /**< Whether each line's info is cached */
+    uint8_t  *watched;           /**< Whether each line is watched */
+    struct gpio_v2_line_info *infos;  /**< Cached info, by line */
+    uint64_t  hits;              /**< Lookups answered from the cache */
+    uint64_t  misses;            /**< Lookups requiring an ioctl */
+    uint64_t  updates;           /**< Change events applied */
+    uint64_t  overflows;         /**< Times the cache was invalidated
+				  * as change events may have been
+				  * lost */
+} bgpio_lineinfo_cache_t;
+
+/**
+ * The directory in which gpio character devices are found.
+ */
+#define BGPIO_DEV_DIR "/dev"
+
+/**
+ * The sysfs directory listing gpio chips.  This is preferred to
+ * scanning BGPIO_DEV_DIR as it contains nothing else.
+ */
+#define BGPIO_SYS_GPIO_DIR "/sys/bus/gpio/devices"
+
+/**
+ * An entry in a ::bgpio_registry_t, describing a single gpio chip.
+ */
+typedef struct bgpio_chip_entry_t {
+    char     *path;                     /**< Path to the gpio device */
+    char      name[GPIO_MAX_NAME_SIZE]; /**< Kernel name, eg "gpiochip0" */
+    char      label[GPIO_MAX_NAME_SIZE]; /**< Functional label, or
+					  * empty if the chip could not be
+					  * opened */
+    uint32_t  lines;                    /**< Number of lines, or 0 */
+} bgpio_chip_entry_t;
+
+/**
+ * A slot in the hash index of a ::bgpio_registry_t.
+ */
+typedef struct bgpio_registry_slot_t {
+    const char *key;            /**< Path, name, label or path suffix */
+    int         chip;           /**< Index into the registry's chips, or
+				 * -1 if the key is ambiguous */
+} bgpio_registry_slot_t;
+
+/**
+ * A registry of the gpio chips on the system, as created by
+ * bgpio_open_registry().  Chips are enumerated once and indexed by
+ * path, name, label and every suffix of their path, so that a chip id
+ * given by a user can be resolved by bgpio_registry_find() without
+ * rescanning.  An inotify watch on BGPIO_DEV_DIR allows the registry
+ * to be brought up to date incrementally by bgpio_registry_refresh().
+ */
+typedef struct bgpio_registry_t {
+    int                    count;        /**< Number of chips */
+    int                    size;         /**< Allocated size of chips */
+    bgpio_chip_entry_t   **chips;        /**< Chips, sorted by path */
+    bgpio_registry_slot_t *index;        /**< Open-addressed hash index */
+    uint32_t               index_size;   /**< Slots in index (power of 2) */
+    int                    inotify_fd;   /**< Watch on BGPIO_DEV_DIR, or
+					  * -1 if unavailable */
+    uint64_t               generation;   /**< Incremented whenever the set
+					  * of chips changes */
+} bgpio_registry_t;
+
+/**
+ * The default location of the cache file used by
+ * bgpio_open_line_index().  This is on a tmpfs so that it does not
+ * outlive a reboot, which may change the set of chips.
+ */
+#define BGPIO_LINE_CACHE "/run/bgpiod-lines.cache"
+
+/**
+ * An entry in a ::bgpio_line_index_t, describing a single gpio line.
+ */
+typedef struct bgpio_line_entry_t {
+    int      chip;              /**< Index of the line's chip in the
+				 * registry */
+    int      offset;            /**< The line number on its chip */
+    char     name[GPIO_MAX_NAME_SIZE];     /**< The line's name */
+    char     consumer[GPIO_MAX_NAME_SIZE]; /**< The line's consumer when
+					    * the index was built */
+    bool     duplicate;         /**< Whether another line shares the
+				 * name */
+    int      next_by_name;      /**< The next line with the same name,
+				 * or -1 */
+    int      next_by_consumer;  /**< The next line with the same
+				 * consumer, or -1 */
+} bgpio_line_entry_t;
+
+/**
+ * An index of the gpio lines on all chips in a ::bgpio_registry_t, as
+ * created by bgpio_open_line_index(), allowing lines to be found by
+ * name, and by consumer, with a single hash lookup.
+ */
+typedef struct bgpio_line_index_t {
+    bgpio_registry_t   *registry;     /**< The chips being indexed */
+    uint64_t            generation;   /**< registry->generation when the
+				       * index was built */
+    char               *cache_path;   /**< Cache file, or NULL */
+    int                 count;        /**< Number of lines */
+    bgpio_line_entry_t *lines;        /**< The lines, by chip and offset */
+    uint32_t            index_size;   /**< Slots in each hash index */
+    int32_t            *by_name;      /**< Hash index of line names; each
+				       * slot is a line, or -1 */
+    int32_t            *by_consumer;  /**< Hash index of consumers; each
+				       * slot is the first line with that
+				       * consumer, or -1 */
+    bool                consumers_valid; /**< false if the index was
+					  * loaded from the cache file,
+					  * which has no consumers */
+} bgpio_line_index_t;
+
+struct bgpio_request;
+struct bgpio_dispatch;
+
+/**
+ * The type of callback functions registered using bgpio_on_edge().
+ *
+ * @param req The ::bgpio_request_t on which the event occurred.
+ *
+ * @param event The edge event.  This is only valid for the duration of
+ * the call.
+ *
+ * @param ctx The context pointer given to bgpio_on_edge().
+ */
+typedef void (*bgpio_edge_fn)(struct bgpio_request *req,
+			      struct gpio_v2_line_event *event, void *ctx);
+
+/**
+ * The type of callback functions passed to bgpio_drain_watch_events().
+ *
+ * @param chip The ::bgpio_chip_t on which the change was watched.
+ *
+ * @param change The line-info change.  This is only valid for the
+ * duration of the call.
+ *
+ * @param ctx The context pointer given to bgpio_drain_watch_events().
+ */
+typedef void (*bgpio_watch_fn)(struct bgpio_chip_t *chip,
+			       struct gpio_v2_line_info_changed *change,
+			       void *ctx);
+
+/**
+ * The type of callback functions passed to bgpio_enable_rate_guard(),
+ * called whenever a line is throttled or restored.
+ *
+ * @param req The ::bgpio_request_t to which the line belongs.
+ *
+ * @param line The gpio line number.
+ *
+ * @param throttled Whether the line has been throttled, rather than
+ * restored.
+ *
+ * @param count For throttling, the number of events counted in the
+ * measurement period; for restoration, the number of value changes
+ * sampled while the line was throttled.
+ *
+ * @param err Zero, or the errno value with which the throttling or
+ * restoration failed, in which case it will be tried again later.
+ *
+ * @param ctx The context pointer given to bgpio_enable_rate_guard().
+ */
+typedef void (*bgpio_guard_fn)(struct bgpio_request *req, int line,
+			       bool throttled, uint64_t count, int err,
+			       void *ctx);
+
+/**
+ * The library's record of the values last driven onto a request's
+ * output lines, used to avoid redundant and repeated set ioctls.  See
+ * bgpio_set_output_mode().
+ */
+typedef struct bgpio_output_shadow {
+    uint64_t bits;               /**< Last driven values, by line index */
+    uint64_t known;              /**< Lines for which bits is valid */
+    uint64_t pending_mask;       /**< Lines with deferred updates */
+    uint64_t pending_bits;       /**< Deferred values */
+    uint64_t pending_since_ns;   /**< When the oldest deferral was made */
+    uint32_t defer_usecs;        /**< Deferred-flush window, or 0 */
+    bool     elide;              /**< Skip sets that change nothing */
+    uint64_t ioctls;             /**< Number of set ioctls issued */
+    uint64_t elided;             /**< Number of set ioctls avoided */
+} bgpio_output_shadow_t;
+
+/**
+ * The library's mirror of the values of a request's input lines,
+ * maintained from edge events so that bgpio_fetch() can be answered
+ * without an ioctl.  See bgpio_enable_mirror().
+ */
+typedef struct bgpio_input_mirror {
+    uint64_t bits;               /**< Mirrored values, by line index */
+    uint64_t valid;              /**< Lines that can be mirrored */
+    uint64_t synced_ns;          /**< When bits was last fetched */
+    uint32_t resync_msecs;       /**< Resync period, or 0 for never */
+    bool     enabled;            /**< Whether the mirror is in use */
+    uint64_t fetches;            /**< Number of get ioctls issued */
+    uint64_t served;             /**< Fetches answered from the mirror */
+} bgpio_input_mirror_t;
+
+/**
+ * The state of a request's busy-poll mode, in which
+ * bgpio_await_event() spins on a non-blocking read() rather than
+ * sleeping in poll().  See bgpio_request_busy_poll().
+ */
+typedef struct bgpio_busy_poll {
+    bool     enabled;            /**< Whether bgpio_await_event() spins */
+    bool     was_nonblocking;    /**< Whether the request was
+				  * non-blocking before busy-poll mode */
+    uint32_t max_backoff;        /**< Most cpu pauses between reads */
+    uint64_t reads;              /**< Number of read() calls made */
+    uint64_t empty;              /**< Reads that found no event */
+} bgpio_busy_poll_t;
+
 /**
  * This is the primary data structure that we pass around between
  * calls to bgpio functions.  It encapsulates all of the data
@@ -99,8 +328,168 @@ typedef struct bgpio_request {
     struct   gpio_v2_line_event event;
     int      device_fd;
     char    *chardev_path;
+    struct bgpio_dispatch *dispatch;
+    struct bgpio_sigio *sigio;
+    struct bgpio_coalesce *coalesce;
+    struct bgpio_rate_guard *guard;
+    bgpio_output_shadow_t shadow;
+    bgpio_input_mirror_t mirror;
+    bool     nonblocking;
+    int      wakeup_fd;
+    bgpio_busy_poll_t busy;
+    uint64_t read_ns;
 } bgpio_request_t;
 
+/**
+ * The interval, in milliseconds, at which a ::bgpio_supervisor_t
+ * re-enumerates chips while waiting for a chip to reappear, if no
+ * inotify watch is available.
+ */
+#define BGPIO_REACQUIRE_POLL_MSECS 100
+
+/**
+ * A supervisor for a ::bgpio_request_t, as created by
+ * bgpio_supervise_request().  If the request's chip goes away, as
+ * USB gpio expanders may when they re-enumerate, the supervisor waits
+ * for a chip with the same label to appear, possibly at a different
+ * path, and re-requests the same lines with the same configuration.
+ */
+typedef struct bgpio_supervisor_t {
+    bgpio_request_t  *req;        /**< The supervised request */
+    bgpio_registry_t *registry;   /**< For finding the reappeared chip */
+    char      label[GPIO_MAX_NAME_SIZE]; /**< The label of the chip */
+    uint64_t  lost_ns;            /**< When the chip was lost, or 0 */
+    uint64_t  last_gap_ns;        /**< Duration of the last outage */
+    uint32_t  recoveries;         /**< Number of successful re-acquires */
+} bgpio_supervisor_t;
+
+/**
+ * The maximum number of requests in a ::bgpio_group_t.
+ */
+#define BGPIO_GROUP_MAX 16
+
+/**
+ * The timing of one request's part in the last operation on a
+ * ::bgpio_group_t.  Times are CLOCK_MONOTONIC, in nanoseconds, read
+ * immediately before and after the request's ioctl.
+ */
+typedef struct bgpio_group_timing_t {
+    uint64_t start_ns;          /**< Before the ioctl */
+    uint64_t end_ns;            /**< After the ioctl */
+    int      err;               /**< errno from the ioctl, or 0 */
+} bgpio_group_timing_t;
+
+struct bgpio_group_t;
+
+/**
+ * A worker thread of a ::bgpio_group_t, which performs the operations
+ * on a single request.
+ */
+typedef struct bgpio_group_worker_t {
+    struct bgpio_group_t *group; /**< The group */
+    int                   idx;   /**< The index of our request */
+    pthread_t             thread; /**< The worker thread */
+} bgpio_group_worker_t;
+
+/**
+ * A group of requests, usually on different chips, to be operated on
+ * together, as created by bgpio_open_group().  Each request has its
+ * own worker thread, pinned to a cpu.  For each operation, the workers
+ * are woken and gathered at a spin barrier, from which they are
+ * released at once so that their ioctls are issued as nearly
+ * simultaneously as possible.  The timings of the last operation bound
+ * when it took effect on each request, and on the group as a whole.
+ */
+typedef struct bgpio_group_t {
+    int                  count;   /**< Number of requests */
+    bgpio_request_t     *reqs[BGPIO_GROUP_MAX];   /**< The requests */
+    bgpio_group_timing_t timing[BGPIO_GROUP_MAX]; /**< By request, for
+					   * the last operation */
+    uint64_t             start_ns; /**< Earliest start of the last
+				    * operation */
+    uint64_t             end_ns;   /**< Latest end of the last operation */
+    uint64_t             skew_ns;  /**< Spread of start times in the last
+				    * operation */
+    int                  workers;  /**< Number of worker threads running,
+				    * or 0 if operations are performed
+				    * by the caller */
+    bool                 realtime; /**< Whether workers are SCHED_FIFO */
+    int                  spin_limit; /**< Spins at the barrier before
+				      * giving up the cpu */
+    bgpio_group_worker_t worker[BGPIO_GROUP_MAX]; /**< The workers */
+    uint32_t             op;       /**< The operation being performed */
+    uint32_t             wake;     /**< Futex, incremented to wake the
+				    * workers for each operation */
+    uint32_t             arrived;  /**< Workers at the barrier */
+    uint32_t             release;  /**< Set to wake to release them */
+    uint32_t             done;     /**< Futex, workers finished */
+} bgpio_group_t;
+
+/**
+ * The maximum number of requests whose events can be merged by a
+ * ::bgpio_merger_t.
+ */
+#define BGPIO_MERGE_MAX 16
+
+/**
+ * The number of events that a ::bgpio_merger_t holds for each request.
+ * Once this many events from one request are held, no more are read
+ * from it until some have been emitted.  This must be a power of 2.
+ */
+#define BGPIO_MERGE_QUEUE 64
+
+/**
+ * An edge event emitted by bgpio_merge_next().
+ */
+typedef struct bgpio_merged_event_t {
+    struct gpio_v2_line_event event; /**< The event */
+    bgpio_request_t *req;       /**< The request it was read from */
+    int              source;    /**< The index of that request in the
+				 * merger */
+    bool             late;      /**< Whether it arrived after a later
+				 * event had already been emitted */
+} bgpio_merged_event_t;
+
+/**
+ * The events read from one request of a ::bgpio_merger_t, awaiting
+ * emission.  As the kernel delivers each request's events in order,
+ * this is a simple fifo.
+ */
+typedef struct bgpio_merge_source_t {
+    bgpio_request_t *req;       /**< The request */
+    uint32_t         head;      /**< Index of the oldest held event */
+    uint32_t         held;      /**< Number of held events */
+    struct gpio_v2_line_event events[BGPIO_MERGE_QUEUE]; /**< Held
+				 * events */
+} bgpio_merge_source_t;
+
+/**
+ * A merger of the edge events of several requests, usually on
+ * different chips, into a single stream ordered by timestamp, as
+ * created by bgpio_open_merger().
+ *
+ * Each request's own events are already in order, so the merger is a
+ * k-way merge: a min-heap holds the requests that have events, keyed
+ * on the timestamp of their oldest event.  The oldest event of all
+ * can be emitted at once if every request has an event held, as no
+ * request can then produce anything older.  Otherwise it is held until
+ * it is window_ns old, giving events from idle or slow requests time
+ * to arrive.  Events arriving even later than that are emitted, but
+ * flagged as late, and counted.
+ */
+typedef struct bgpio_merger_t {
+    int                   count;      /**< Number of requests */
+    uint64_t              window_ns;  /**< The reorder window */
+    uint64_t              last_ns;    /**< Timestamp of the latest
+				       * event emitted */
+    uint64_t              emitted;    /**< Events emitted */
+    uint64_t              late;       /**< Late events emitted */
+    int                   heap_size;  /**< Sources in heap */
+    int                   heap[BGPIO_MERGE_MAX]; /**< Min-heap of
+				       * source indexes */
+    bgpio_merge_source_t  sources[BGPIO_MERGE_MAX]; /**< By request */
+} bgpio_merger_t;
+
 /** 
  * \var struct gpio_v2_line_request bgpio_request_t::req
  *  The line_request part of our request.  This contains line
@@ -134,6 +523,393 @@ typedef struct bgpio_request {
  *  "/dev/gpiochip0").  This will be in place following
  *  bgpio_open_request() until bgpio_close_request() has been called.
  */
+/** 
+ * \var struct bgpio_dispatch * bgpio_request_t::dispatch
+ *  The table of edge-event callbacks registered using
+ *  bgpio_on_edge(), or NULL if there are none.
+ */
+/** 
+ * \var struct bgpio_sigio * bgpio_request_t::sigio
+ *  The state of signal notification, as set up by
+ *  bgpio_enable_sigio(), or NULL.
+ */
+/** 
+ * \var struct bgpio_coalesce * bgpio_request_t::coalesce
+ *  The settings and statistics for coalescing edge events into
+ *  batches, as set up by bgpio_enable_coalescing(), or NULL.
+ */
+/** 
+ * \var struct bgpio_rate_guard * bgpio_request_t::guard
+ *  The state of the request's edge-storm protection, as set up by
+ *  bgpio_enable_rate_guard(), or NULL.
+ */
+/** 
+ * \var bgpio_output_shadow_t bgpio_request_t::shadow
+ *  The values last driven onto the request's output lines, and any
+ *  deferred updates, maintained by bgpio_set() and bgpio_flush().
+ */
+/** 
+ * \var bgpio_input_mirror_t bgpio_request_t::mirror
+ *  The values of the request's edge-detecting input lines, as
+ *  maintained from edge events once bgpio_enable_mirror() has been
+ *  called.
+ */
+/** 
+ * \var bool bgpio_request_t::nonblocking
+ *  Whether the request's file descriptor, req.fd, has been made
+ *  O_NONBLOCK by bgpio_request_nonblocking().
+ */
+/** 
+ * \var int bgpio_request_t::wakeup_fd
+ *  An eventfd, created by bgpio_enable_wakeup(), through which
+ *  bgpio_wakeup() interrupts bgpio_await_event(), or 0.
+ */
+/** 
+ * \var bgpio_busy_poll_t bgpio_request_t::busy
+ *  The request's busy-poll mode, as set by bgpio_request_busy_poll().
+ */
+/** 
+ * \var uint64_t bgpio_request_t::read_ns
+ *  The CLOCK_MONOTONIC time, in nanoseconds, at which the last event
+ *  was read by bgpio_await_event() or bgpio_drain_events().  For
+ *  requests using the default event clock, read_ns less
+ *  event.timestamp_ns is the event's receive latency.
+ */
+
+/**
+ * The maximum number of edge events read by a single read() call in
+ * bgpio_dispatch().
+ */
+#define BGPIO_DISPATCH_BATCH 16
+
+/**
+ * A registered edge-event callback.
+ */
+typedef struct bgpio_edge_handler {
+    bgpio_edge_fn fn;            /**< The callback, or NULL */
+    void         *ctx;           /**< Passed to fn */
+} bgpio_edge_handler_t;
+
+/**
+ * The dispatch table for the edge-event callbacks of a request, as
+ * built by bgpio_on_edge().  The line offset of an event is mapped to
+ * its index in the request by a direct lookup in line_idx, and the
+ * handler is then found by index and edge, so dispatching an event
+ * requires no searching.
+ */
+typedef struct bgpio_dispatch {
+    uint32_t  num_offsets;       /**< Number of entries in line_idx */
+    uint8_t  *line_idx;          /**< Index, by line offset, or 0xff */
+    bgpio_edge_handler_t handlers[GPIO_V2_LINES_MAX][2];  /**< By index,
+				  * then 0 for rising and 1 for falling */
+    struct gpio_v2_line_event events[BGPIO_DISPATCH_BATCH];  /**< Read
+				  * buffer */
+} bgpio_dispatch_t;
+
+/**
+ * The maximum number of edge events in a batch delivered by
+ * bgpio_read_coalesced().
+ */
+#define BGPIO_COALESCE_MAX 256
+
+/**
+ * The number of buckets in the batch-size histogram of a
+ * ::bgpio_coalesce_t.  Bucket n counts batches of from 2^n to
+ * 2^(n+1) - 1 events, so the last counts batches of
+ * BGPIO_COALESCE_MAX.
+ */
+#define BGPIO_COALESCE_BUCKETS 9
+
+/**
+ * The settings and statistics for coalescing a request's edge events
+ * into batches, as set up by bgpio_enable_coalescing().
+ */
+typedef struct bgpio_coalesce {
+    uint64_t window_ns;          /**< How long to wait for more events */
+    uint32_t max_events;         /**< Deliver once this many are read */
+    uint64_t last_ns;            /**< Timestamp of the last delivered
+				  * event */
+    uint64_t batches;            /**< Number of batches delivered */
+    uint64_t events;             /**< Number of events delivered */
+    uint64_t immediate;          /**< Batches delivered without waiting,
+				  * as traffic was sparse */
+    uint64_t histogram[BGPIO_COALESCE_BUCKETS];  /**< Batches by size */
+    struct gpio_v2_line_event buf[BGPIO_COALESCE_MAX];  /**< The batch */
+} bgpio_coalesce_t;
+
+/**
+ * The rate-guard state of one line of a request.
+ */
+typedef struct bgpio_guard_line {
+    uint64_t window_start_ns;    /**< Start of the measurement period */
+    uint64_t count;              /**< Events in the measurement period */
+    uint64_t edge_flags;         /**< Edge flags removed by throttling */
+    uint64_t since_ns;           /**< Start of the current cool-down */
+    uint64_t sampled;            /**< Changes sampled in the cool-down */
+    uint64_t throttles;          /**< Number of times throttled */
+} bgpio_guard_line_t;
+
+/**
+ * The state of a request's edge-storm protection, as set up by
+ * bgpio_enable_rate_guard().
+ */
+typedef struct bgpio_rate_guard {
+    uint32_t max_rate;           /**< Maximum events per second */
+    uint64_t threshold;          /**< Maximum events per measurement
+				  * period */
+    uint64_t cooldown_ns;        /**< Least time a line stays throttled */
+    uint64_t throttled;          /**< Throttled lines, by index */
+    uint64_t unmirrored;         /**< Throttled lines removed from the
+				  * input mirror, by index */
+    uint64_t sampled_bits;       /**< Last sampled values, by index */
+    uint64_t next_sample_ns;     /**< When throttled lines are next
+				  * sampled, or 0 */
+    bgpio_guard_fn fn;           /**< Reports changes, or NULL */
+    void    *ctx;                /**< Context pointer for fn */
+    bgpio_guard_line_t lines[GPIO_V2_LINES_MAX];  /**< By line index */
+} bgpio_rate_guard_t;
+
+/**
+ * The state of signal notification for a request, as set up by
+ * bgpio_enable_sigio().
+ */
+typedef struct bgpio_sigio {
+    int       signo;             /**< The real-time signal raised */
+    bool      threaded;          /**< Whether a notifier thread runs */
+    bool      stopping;          /**< Tells the notifier to exit */
+    bool      was_nonblocking;   /**< Whether the request was
+				  * non-blocking before signals were
+				  * enabled */
+    bool      lost;              /**< Whether the chip has gone away,
+				  * and the file descriptor has been
+				  * disarmed */
+    int       rearm_fd;          /**< eventfd through which
+				  * bgpio_sigio_drain() re-arms the
+				  * notifier, or -1 */
+    pthread_t thread;            /**< The notifier thread */
+    uint64_t  raised;            /**< Signals raised by the notifier */
+} bgpio_sigio_t;
+
+/**
+ * The io_uring submission and completion rings of a ::bgpio_uring_t.
+ * This is private to the library.
+ */
+struct bgpio_uring_ring;
+
+/**
+ * A request whose events are read by a ::bgpio_uring_t, with the
+ * buffer into which its outstanding read places them.
+ */
+typedef struct bgpio_uring_source_t {
+    bgpio_request_t *req;       /**< The request */
+    bool             posted;    /**< Whether a read is outstanding */
+    int              count;     /**< Number of events in the buffer */
+    int              next;      /**< Index of the next to be returned */
+    struct gpio_v2_line_event events[BGPIO_DISPATCH_BATCH];  /**< Read
+				 * buffer */
+} bgpio_uring_source_t;
+
+/**
+ * Reader of the edge events of many requests, as created by
+ * bgpio_open_uring().  Where the kernel provides io_uring, a read is
+ * kept outstanding on every request, so that events from any of them
+ * are collected by a single io_uring_enter() call, which also
+ * re-posts the reads that completed last time.  Otherwise, events are
+ * awaited using poll() and read() as usual.
+ */
+typedef struct bgpio_uring_t {
+    int                      count;     /**< Number of requests */
+    bgpio_uring_source_t    *sources;   /**< By request */
+    int                      next_src;  /**< Where to look first for
+					 * the next event */
+    bool                     fallback;  /**< Whether io_uring is
+					 * unavailable */
+    struct bgpio_uring_ring *ring;      /**< The rings, unless
+					 * fallback is true */
+} bgpio_uring_t;
+
+
+/**
+ * The default path for the unix socket on which bgpiodaemon listens
+ * for client connections.
+ */
+#define BGPIO_DAEMON_SOCKET "/run/bgpiodaemon.sock"
+
+/**
+ * The number of edge events that a ::bgpio_client_t will hold while
+ * it is waiting for the reply to a request.  Events arriving once
+ * this queue is full are counted in bgpio_client_t::dropped and
+ * discarded.
+ */
+#define BGPIO_CLIENT_QUEUE 32
+
+/**
+ * Operation codes for messages exchanged between bgpiodaemon and its
+ * clients.  Each request sent by a client is answered by a reply
+ * carrying the same operation code, with the exception of
+ * BGPIO_MSG_EVENT which is only ever sent by the daemon.
+ */
+typedef enum bgpio_msg_op {
+    BGPIO_MSG_LOOKUP = 1,    /**< Find the mask bit for a line offset */
+    BGPIO_MSG_GET,           /**< Fetch the values of masked lines */
+    BGPIO_MSG_SET,           /**< Set the values of masked lines */
+    BGPIO_MSG_SUBSCRIBE,     /**< Receive edge events for masked lines */
+    BGPIO_MSG_UNSUBSCRIBE,   /**< Stop receiving edge events */
+    BGPIO_MSG_EVENT,         /**< An edge event, sent by the daemon */
+    BGPIO_MSG_HANDOFF        /**< Pass the chip's line request to the
+			      * client (see bgpio_send_request()) */
+} bgpio_msg_op_t;
+
+/**
+ * The single, fixed-size, message type of the bgpiodaemon protocol.
+ *
+ * Chips are identified by their index in the daemon's configuration
+ * file, the first chip configured being chip 0.  Lines are identified
+ * by bitmaps in the same way as for ::gpio_v2_line_values, ie bit 0
+ * is the first line configured for the chip, bit 1 the second, etc.
+ * The mask bit for a given line offset can be found using a
+ * BGPIO_MSG_LOOKUP request (see bgpio_client_lookup()).
+ */
+typedef struct bgpio_msg {
+    uint16_t op;             /**< A ::bgpio_msg_op value */
+    uint16_t chip;           /**< Chip index from the daemon config */
+    int32_t  status;         /**< Zero, or an errno value in replies;
+			      * the line's event sequence number in
+			      * BGPIO_MSG_EVENT messages */
+    uint64_t mask;           /**< Bitmap of the lines affected */
+    uint64_t bits;           /**< Line values (or line offset for
+			      * BGPIO_MSG_LOOKUP requests) */
+    uint64_t timestamp_ns;   /**< Event timestamp (BGPIO_MSG_EVENT) */
+} bgpio_msg_t;
+
+/**
+ * A connection to bgpiodaemon, as returned by bgpio_client_open().
+ * Edge events that arrive while we are waiting for a reply are
+ * queued here, to be returned by subsequent calls to
+ * bgpio_client_await_event().
+ */
+typedef struct bgpio_client {
+    int         fd;          /**< The connected socket */
+    int         head;        /**< Index of the oldest queued event */
+    int         queued;      /**< Number of queued events */
+    uint64_t    dropped;     /**< Events lost because the queue was full */
+    bgpio_msg_t events[BGPIO_CLIENT_QUEUE];  /**< Queued events */
+} bgpio_client_t;
+
+/**
+ * Magic number identifying a shared-memory segment created by
+ * bgpio_open_publisher().
+ */
+#define BGPIO_SHM_VALUES_MAGIC 0x62677076
+
+/**
+ * The layout of a shared-memory segment into which the current values
+ * of a request's gpio lines are published by bgpio_publish(), and
+ * from which they can be read by any number of processes using
+ * bgpio_read_values().
+ *
+ * The segment is guarded by a sequence lock: the publisher makes seq
+ * odd while an update is in progress and even once it is complete,
+ * so readers never block the publisher and never need a system call.
+ * There must be only one publisher for a segment.
+ */
+typedef struct bgpio_shm_values {
+    uint32_t magic;              /**< BGPIO_SHM_VALUES_MAGIC */
+    uint32_t num_lines;          /**< Number of lines published */
+    uint32_t offsets[GPIO_V2_LINES_MAX];  /**< Line numbers by index */
+    char     chardev_path[64];   /**< The chip device (eg "/dev/gpiochip0") */
+    uint32_t seq;                /**< Sequence lock counter */
+    uint32_t pad;                /**< Unused, for alignment */
+    uint64_t bits;               /**< Line values, as line_values.bits */
+    uint64_t timestamp_ns;       /**< When bits were last known correct */
+    uint64_t updates;            /**< Number of updates published */
+    uint64_t changed_ns[GPIO_V2_LINES_MAX];  /**< When each line last
+					      * changed value */
+} bgpio_shm_values_t;
+
+/**
+ * A consistent snapshot of a ::bgpio_shm_values_t, as returned by
+ * bgpio_read_values().
+ */
+typedef struct bgpio_values_snapshot {
+    uint64_t bits;               /**< Line values, as line_values.bits */
+    uint64_t timestamp_ns;       /**< When bits were last known correct */
+    uint64_t updates;            /**< Number of updates published */
+} bgpio_values_snapshot_t;
+
+/**
+ * A publisher of line values into shared memory, as created by
+ * bgpio_open_publisher().
+ */
+typedef struct bgpio_publisher {
+    bgpio_request_t    *req;     /**< The request whose values we publish */
+    bgpio_shm_values_t *values;  /**< The mapped shared-memory segment */
+    char               *name;    /**< The shared-memory object name */
+} bgpio_publisher_t;
+
+/**
+ * Magic number identifying a shared-memory event ring created by
+ * bgpio_open_fanout().
+ */
+#define BGPIO_SHM_RING_MAGIC 0x62677072
+
+/**
+ * The number of events held in a shared-memory event ring.  This must
+ * be a power of 2.  A reader that falls more than this many events
+ * behind the writer will lose events.
+ */
+#define BGPIO_RING_SLOTS 256
+
+/**
+ * The maximum number of events read from the kernel by a single call
+ * to bgpio_fanout_update().
+ */
+#define BGPIO_FANOUT_BATCH 16
+
+/**
+ * The layout of a shared-memory ring of edge events, written by a
+ * single process using bgpio_fanout_update() and read by any number
+ * of processes using bgpio_ring_await_event().
+ *
+ * Events are read from the kernel directly into the events array.
+ * Each event has a corresponding sequence number in seqs, which is
+ * one more than the event's position in the stream, or zero while the
+ * slot is being written.  Readers use this to detect that a slot has
+ * been overwritten before they could read it, so a slow reader never
+ * blocks the writer.
+ */
+typedef struct bgpio_shm_ring {
+    uint32_t magic;              /**< BGPIO_SHM_RING_MAGIC */
+    uint32_t num_lines;          /**< Number of lines in the request */
+    uint32_t offsets[GPIO_V2_LINES_MAX];  /**< Line numbers by index */
+    char     chardev_path[64];   /**< The chip device (eg "/dev/gpiochip0") */
+    uint32_t wakeup;             /**< Futex word, bumped on each write */
+    uint32_t waiters;            /**< Number of readers asleep on wakeup */
+    uint64_t head;               /**< Position of the next event */
+    uint64_t seqs[BGPIO_RING_SLOTS];  /**< Sequence number for each slot */
+    struct gpio_v2_line_event events[BGPIO_RING_SLOTS];  /**< The events */
+} bgpio_shm_ring_t;
+
+/**
+ * The writer of a shared-memory event ring, as created by
+ * bgpio_open_fanout().
+ */
+typedef struct bgpio_fanout {
+    bgpio_request_t  *req;       /**< The request whose events we share */
+    bgpio_shm_ring_t *ring;      /**< The mapped shared-memory ring */
+    char             *name;      /**< The shared-memory object name */
+} bgpio_fanout_t;
+
+/**
+ * A reader of a shared-memory event ring, as created by
+ * bgpio_attach_ring().  Each reader has its own cursor.
+ */
+typedef struct bgpio_ring_reader {
+    bgpio_shm_ring_t *ring;      /**< The mapped shared-memory ring */
+    uint64_t          cursor;    /**< Position of our next event */
+    uint64_t          lost;      /**< Events overwritten before we read
+				  * them */
+} bgpio_ring_reader_t;
 
 
 
@@ -148,7 +924,18 @@ extern int bgpio_fetched(bgpio_request_t *req, int line);
 extern int bgpio_fetched_by_idx(bgpio_request_t *req, int idx, int *p_line);
 extern int bgpio_set_line(bgpio_request_t *req, int line, int value);
 extern int bgpio_set(bgpio_request_t *req);
+extern void bgpio_set_output_mode(
+    bgpio_request_t *req, bool elide, uint32_t defer_usecs);
+extern int bgpio_toggle_lines(bgpio_request_t *req, uint64_t mask);
+extern int bgpio_flush(bgpio_request_t *req);
+extern int bgpio_enable_mirror(bgpio_request_t *req, uint32_t resync_msecs);
+extern void bgpio_note_event(
+    bgpio_request_t *req, struct gpio_v2_line_event *event);
+extern void bgpio_mirror_event(
+    bgpio_request_t *req, struct gpio_v2_line_event *event);
 extern int bgpio_close_request(bgpio_request_t *req);
+extern int bgpio_idx_for_line(bgpio_request_t *req, int line);
+extern uint64_t bgpio_now_ns(void);
 
 extern uint64_t bgpio_attr_flags(struct gpio_v2_line_info *info);
 extern bool bgpio_attr_output(struct gpio_v2_line_info *info, uint64_t *values);
@@ -158,11 +945,128 @@ extern bgpio_chip_t *bgpio_open_chip(char *path);
 extern void bgpio_close_chip(bgpio_chip_t *chip);
 extern struct gpio_v2_line_info *bgpio_get_lineinfo(
     bgpio_chip_t *chip, int line);
+extern int bgpio_chip_snapshot(bgpio_chip_t *chip, int first, int count,
+			       struct gpio_v2_line_info *infos);
+extern int bgpio_enable_lineinfo_cache(bgpio_chip_t *chip);
+extern int bgpio_refresh_lineinfo_cache(bgpio_chip_t *chip);
+extern struct gpio_v2_line_info *bgpio_cached_lineinfo(
+    bgpio_chip_t *chip, int line);
+extern bgpio_registry_t *bgpio_open_registry(void);
+extern void bgpio_close_registry(bgpio_registry_t *reg);
+extern int bgpio_registry_refresh(bgpio_registry_t *reg);
+extern bgpio_chip_entry_t *bgpio_registry_find(
+    bgpio_registry_t *reg, const char *id);
+extern bgpio_line_index_t *bgpio_open_line_index(
+    bgpio_registry_t *reg, const char *cache_path);
+extern void bgpio_close_line_index(bgpio_line_index_t *index);
+extern int bgpio_rebuild_line_index(bgpio_line_index_t *index);
+extern bgpio_line_entry_t *bgpio_find_line_name(
+    bgpio_line_index_t *index, const char *chip, const char *name);
+extern int bgpio_find_consumer_lines(
+    bgpio_line_index_t *index, const char *consumer,
+    bgpio_line_entry_t **lines, int max);
+extern bgpio_supervisor_t *bgpio_supervise_request(bgpio_request_t *req);
+extern void bgpio_end_supervision(bgpio_supervisor_t *sup);
+extern bool bgpio_request_lost(int err);
+extern int bgpio_reacquire(bgpio_supervisor_t *sup, int *timeout_msecs);
+extern int bgpio_supervised_await_event(
+    bgpio_supervisor_t *sup, int *timeout_msecs);
+extern int bgpio_supervised_fetch(bgpio_supervisor_t *sup);
+extern bgpio_group_t *bgpio_open_group(
+    bgpio_request_t **reqs, int count, int rt_priority);
+extern void bgpio_close_group(bgpio_group_t *group);
+extern int bgpio_group_set(bgpio_group_t *group);
+extern int bgpio_group_fetch(bgpio_group_t *group, bool parallel);
+extern bgpio_merger_t *bgpio_open_merger(
+    bgpio_request_t **reqs, int count, uint64_t window_ns);
+extern void bgpio_close_merger(bgpio_merger_t *merger);
+extern int bgpio_merge_next(bgpio_merger_t *merger,
+			    bgpio_merged_event_t *event, int *timeout_msecs);
+extern bgpio_uring_t *bgpio_open_uring(bgpio_request_t **reqs, int count);
+extern void bgpio_close_uring(bgpio_uring_t *uring);
+extern int bgpio_uring_await_event(
+    bgpio_uring_t *uring, bgpio_request_t **p_req, int *timeout_msecs);
 extern int bgpio_await_event(bgpio_request_t *req,
 			     int *timeout_msecs);
+extern int bgpio_await_event_until(bgpio_request_t *req, uint64_t deadline_ns,
+				   uint64_t *remaining_ns);
 extern int bgpio_watch_line(bgpio_chip_t *chip, int line);
 extern struct gpio_v2_line_info_changed *bgpio_await_watched_lines(
     bgpio_chip_t *chip, int *timeout_msecs);
+extern struct gpio_v2_line_info_changed *bgpio_await_watched_lines_until(
+    bgpio_chip_t *chip, uint64_t deadline_ns, uint64_t *remaining_ns);
+
+extern bgpio_client_t *bgpio_client_open(const char *socket_path);
+extern void bgpio_client_close(bgpio_client_t *client);
+extern int bgpio_client_lookup(
+    bgpio_client_t *client, int chip, int line, uint64_t *mask);
+extern int bgpio_client_get(
+    bgpio_client_t *client, int chip, uint64_t mask, uint64_t *bits);
+extern int bgpio_client_set(
+    bgpio_client_t *client, int chip, uint64_t mask, uint64_t bits);
+extern int bgpio_client_subscribe(
+    bgpio_client_t *client, int chip, uint64_t mask);
+extern int bgpio_client_unsubscribe(
+    bgpio_client_t *client, int chip, uint64_t mask);
+extern int bgpio_client_await_event(
+    bgpio_client_t *client, bgpio_msg_t *event, int *timeout_msecs);
+extern bgpio_request_t *bgpio_client_handoff(
+    bgpio_client_t *client, int chip);
+
+extern int bgpio_on_edge(bgpio_request_t *req, int line, uint64_t edge_mask,
+			 bgpio_edge_fn fn, void *ctx);
+extern int bgpio_request_fd(bgpio_request_t *req);
+extern int bgpio_chip_fd(bgpio_chip_t *chip);
+extern int bgpio_request_nonblocking(bgpio_request_t *req, bool nonblocking);
+extern int bgpio_chip_nonblocking(bgpio_chip_t *chip, bool nonblocking);
+extern int bgpio_request_busy_poll(bgpio_request_t *req, bool busy_poll,
+				   uint32_t max_backoff);
+extern int bgpio_drain_events(bgpio_request_t *req, bgpio_edge_fn fn,
+			      void *ctx, int max);
+extern int bgpio_drain_watch_events(bgpio_chip_t *chip, bgpio_watch_fn fn,
+				    void *ctx, int max);
+extern int bgpio_enable_wakeup(bgpio_request_t *req);
+extern int bgpio_wakeup(bgpio_request_t *req);
+extern int bgpio_enable_sigio(bgpio_request_t *req, int signo, bool notifier);
+extern int bgpio_disable_sigio(bgpio_request_t *req);
+extern int bgpio_rearm_sigio(bgpio_request_t *req);
+extern int bgpio_sigio_fd(const siginfo_t *info);
+extern int bgpio_sigio_drain(bgpio_request_t *req,
+			     struct gpio_v2_line_event *events, int max);
+extern int bgpio_dispatch(bgpio_request_t *req, int *timeout_msecs);
+extern int bgpio_enable_coalescing(bgpio_request_t *req,
+				   uint32_t window_usecs, uint32_t max_events);
+extern int bgpio_read_coalesced(bgpio_request_t *req,
+				struct gpio_v2_line_event **p_events,
+				int *timeout_msecs);
+extern int bgpio_enable_rate_guard(bgpio_request_t *req, uint32_t max_rate,
+				   uint32_t cooldown_msecs, bgpio_guard_fn fn,
+				   void *ctx);
+extern int bgpio_guard_check(bgpio_request_t *req);
+
+extern int bgpio_send_request(int sock, bgpio_request_t *req);
+extern bgpio_request_t *bgpio_receive_request(int sock);
+
+extern bgpio_publisher_t *bgpio_open_publisher(
+    bgpio_request_t *req, const char *name);
+extern void bgpio_publish(bgpio_publisher_t *pub);
+extern void bgpio_publish_event(
+    bgpio_publisher_t *pub, struct gpio_v2_line_event *event);
+extern int bgpio_publish_update(bgpio_publisher_t *pub, int *period_msecs);
+extern void bgpio_close_publisher(bgpio_publisher_t *pub);
+extern bgpio_shm_values_t *bgpio_attach_values(const char *name);
+extern void bgpio_detach_values(bgpio_shm_values_t *values);
+extern void bgpio_read_values(
+    bgpio_shm_values_t *values, bgpio_values_snapshot_t *snapshot);
+extern bgpio_fanout_t *bgpio_open_fanout(
+    bgpio_request_t *req, const char *name);
+extern int bgpio_fanout_update(bgpio_fanout_t *fanout, int *timeout_msecs);
+extern void bgpio_close_fanout(bgpio_fanout_t *fanout);
+extern bgpio_ring_reader_t *bgpio_attach_ring(const char *name);
+extern void bgpio_detach_ring(bgpio_ring_reader_t *reader);
+extern int bgpio_ring_await_event(
+    bgpio_ring_reader_t *reader, struct gpio_v2_line_event *event,
+    int *timeout_msecs);
 
 
 #endif
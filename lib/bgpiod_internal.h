@@ -0,0 +1,61 @@
+/*
+ *     Copyright (c) 2023 Marc Munro
+ *     Fileset:	libbgpiod - basic/bloodnok gpio device library
+ *     Author:  Marc Munro
+ *     License: GPL-3.0
+ *
+ */
+
+/**
+ * @file   bgpiod_internal.h
+ * @brief Private header for libbgpiod, declaring what is shared
+ * between the library's source files but is not part of its public
+ * interface.  This is not installed, and must be included after
+ * bgpiod.h.
+ */
+
+/**
+ * Marks functions that are shared between the library's source files,
+ * so that they are not exported from the shared library.
+ */
+#define BGPIO_INTERNAL __attribute__((visibility("hidden")))
+
+extern int bgpio_poll_request(bgpio_request_t *req, int *timeout_msecs)
+    BGPIO_INTERNAL;
+extern void bgpio_guard_event(
+    bgpio_request_t *req, struct gpio_v2_line_event *event) BGPIO_INTERNAL;
+extern uint64_t bgpio_line_flags_by_idx(bgpio_request_t *req, int idx)
+    BGPIO_INTERNAL;
+extern int bgpio_mirror_sync(bgpio_request_t *req) BGPIO_INTERNAL;
+
+/**
+ * Hint to the cpu that we are spinning, without giving it up.
+ */
+static inline void
+bgpio_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/**
+ * Hash a string using FNV-1a.
+ *
+ * @param key The string to be hashed.
+ *
+ * @result The hash value.
+ */
+static inline uint32_t
+bgpio_hash_key(const char *key)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*key) {
+	hash ^= (uint8_t) *key++;
+	hash *= 16777619u;
+    }
+    return hash;
+}
@@ -0,0 +1,482 @@
+/*
+ *     Copyright (c) 2023 Marc Munro
+ *     Fileset:	libbgpiod - basic/bloodnok gpio device library
+ *     Author:   Marc Munro
+ *     License:  GPL-3.0
+ *
+ */
+
+/**
+ * @file   chips.c
+ * @brief A registry of the gpio chips available on the system.
+ *
+ * Tools and daemons need to turn user-supplied chip ids, such as
+ * "/dev/gpiochip0", "gpiochip0", "chip0", "0" or a chip label, into
+ * device paths.  Rather than scanning BGPIO_DEV_DIR for each id, we
+ * enumerate the chips once, preferring BGPIO_SYS_GPIO_DIR, and index
+ * every name by which a chip may be known in a small hash table.  Ids
+ * that could refer to more than one chip are recorded as ambiguous,
+ * giving the same semantics as the suffix matching that the tools
+ * have always used.
+ *
+ * An inotify watch on BGPIO_DEV_DIR tells us when chips come and go,
+ * so that long-running processes can keep the registry current by
+ * calling bgpio_registry_refresh(), which applies only the changes.
+ */
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "bgpiod.h"
+#include "bgpiod_internal.h"
+
+/**
+ * The prefix of the file names of gpio character devices.
+ */
+#define CHIP_PREFIX "gpiochip"
+
+/**
+ * The size of the buffer used to read inotify events.
+ */
+#define INOTIFY_BUFSIZE 4096
+
+/**
+ * Add a key to the registry's hash index.  If the key is already
+ * present for a different chip, it is marked as ambiguous.
+ *
+ * @param reg The ::bgpio_registry_t.
+ *
+ * @param key The key, which must remain valid for as long as the
+ * index does.
+ *
+ * @param chip The index of the chip in the registry.
+ */
+static void
+index_key(bgpio_registry_t *reg, const char *key, int chip)
+{
+    uint32_t mask = reg->index_size - 1;
+    uint32_t slot = bgpio_hash_key(key) & mask;
+
+    if (!key[0]) {
+	return;
+    }
+    while (reg->index[slot].key) {
+	if (strcmp(reg->index[slot].key, key) == 0) {
+	    if (reg->index[slot].chip != chip) {
+		reg->index[slot].chip = -1;
+	    }
+	    return;
+	}
+	slot = (slot + 1) & mask;
+    }
+    reg->index[slot].key = key;
+    reg->index[slot].chip = chip;
+}
+
+/**
+ * Rebuild the registry's hash index from its chips.  This is cheap
+ * enough, for the handful of chips on any real system, that we simply
+ * do it whenever the set of chips changes.
+ *
+ * @param reg The ::bgpio_registry_t.
+ *
+ * @result Zero if successful, else an errno value.
+ */
+static int
+build_index(bgpio_registry_t *reg)
+{
+    size_t keys = 0;
+    uint32_t size = 16;
+    size_t len;
+    size_t i;
+    int chip;
+
+    for (chip = 0; chip < reg->count; chip++) {
+	keys += strlen(reg->chips[chip]->path) + 2;
+    }
+    while (size < keys * 2) {
+	size *= 2;
+    }
+    free(reg->index);
+    reg->index = calloc(size, sizeof(bgpio_registry_slot_t));
+    if (!reg->index) {
+	reg->index_size = 0;
+	return ENOMEM;
+    }
+    reg->index_size = size;
+    for (chip = 0; chip < reg->count; chip++) {
+	bgpio_chip_entry_t *entry = reg->chips[chip];
+	len = strlen(entry->path);
+	for (i = 0; i < len; i++) {
+	    index_key(reg, entry->path + i, chip);
+	}
+	index_key(reg, entry->name, chip);
+	index_key(reg, entry->label, chip);
+    }
+    return 0;
+}
+
+/**
+ * Fill in the name, label and number of lines for a chip entry from
+ * the chip itself.  If the chip cannot be opened, perhaps because
+ * udev has not yet set its permissions, the entry is left with only
+ * its path and the name derived from it.
+ *
+ * @param entry The ::bgpio_chip_entry_t to be filled in.
+ */
+static void
+describe_entry(bgpio_chip_entry_t *entry)
+{
+    struct gpiochip_info info;
+    int fd = open(entry->path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+	return;
+    }
+    if (ioctl(fd, GPIO_GET_CHIPINFO_IOCTL, &info) == 0) {
+	memcpy(entry->name, info.name, GPIO_MAX_NAME_SIZE);
+	memcpy(entry->label, info.label, GPIO_MAX_NAME_SIZE);
+	entry->name[GPIO_MAX_NAME_SIZE - 1] = '\0';
+	entry->label[GPIO_MAX_NAME_SIZE - 1] = '\0';
+	entry->lines = info.lines;
+    }
+    close(fd);
+}
+
+/**
+ * Find the position of a chip in the registry by device name.
+ *
+ * @param reg The ::bgpio_registry_t.
+ *
+ * @param devname The file name of the device within BGPIO_DEV_DIR.
+ *
+ * @param p_pos Where the position at which a chip of this name is, or
+ * should be inserted, will be placed.
+ *
+ * @result true if the chip is present.
+ */
+static bool
+find_chip(bgpio_registry_t *reg, const char *devname, int *p_pos)
+{
+    const char *path;
+    int pos;
+    int cmp;
+
+    for (pos = 0; pos < reg->count; pos++) {
+	path = reg->chips[pos]->path + strlen(BGPIO_DEV_DIR "/");
+	cmp = strcmp(path, devname);
+	if (cmp >= 0) {
+	    *p_pos = pos;
+	    return cmp == 0;
+	}
+    }
+    *p_pos = pos;
+    return false;
+}
+
+/**
+ * Add a chip to the registry, keeping the chips sorted by path.
+ * Adding a chip that is already present does nothing.
+ *
+ * @param reg The ::bgpio_registry_t.
+ *
+ * @param devname The file name of the device within BGPIO_DEV_DIR.
+ *
+ * @result Zero if successful, else an errno value.
+ */
+static int
+add_chip(bgpio_registry_t *reg, const char *devname)
+{
+    bgpio_chip_entry_t *entry;
+    int pos;
+
+    if (find_chip(reg, devname, &pos)) {
+	return 0;
+    }
+    if (reg->count >= reg->size) {
+	int new_size = reg->size? reg->size * 2: 8;
+	bgpio_chip_entry_t **chips =
+	    realloc(reg->chips, new_size * sizeof(bgpio_chip_entry_t *));
+	if (!chips) {
+	    return ENOMEM;
+	}
+	reg->chips = chips;
+	reg->size = new_size;
+    }
+    entry = calloc(1, sizeof(bgpio_chip_entry_t));
+    if (!entry) {
+	return ENOMEM;
+    }
+    entry->path = malloc(strlen(BGPIO_DEV_DIR "/") + strlen(devname) + 1);
+    if (!entry->path) {
+	free(entry);
+	return ENOMEM;
+    }
+    sprintf(entry->path, BGPIO_DEV_DIR "/%s", devname);
+    strncpy(entry->name, devname, GPIO_MAX_NAME_SIZE - 1);
+    describe_entry(entry);
+
+    memmove(&reg->chips[pos + 1], &reg->chips[pos],
+	    (reg->count - pos) * sizeof(bgpio_chip_entry_t *));
+    reg->chips[pos] = entry;
+    reg->count++;
+    reg->generation++;
+    return 0;
+}
+
+/**
+ * Remove a chip from the registry, if it is present.
+ *
+ * @param reg The ::bgpio_registry_t.
+ *
+ * @param devname The file name of the device within BGPIO_DEV_DIR.
+ */
+static void
+remove_chip(bgpio_registry_t *reg, const char *devname)
+{
+    int pos;
+
+    if (find_chip(reg, devname, &pos)) {
+	free(reg->chips[pos]->path);
+	free(reg->chips[pos]);
+	reg->count--;
+	memmove(&reg->chips[pos], &reg->chips[pos + 1],
+		(reg->count - pos) * sizeof(bgpio_chip_entry_t *));
+	reg->generation++;
+    }
+}
+
+/**
+ * Add all chips listed in a directory to the registry.
+ *
+ * @param reg The ::bgpio_registry_t.
+ *
+ * @param dirname The directory to be scanned.
+ *
+ * @result Zero if successful, else an errno value.  ENOENT indicates
+ * that the directory could not be opened.
+ */
+static int
+scan_dir(bgpio_registry_t *reg, const char *dirname)
+{
+    DIR *dfd = opendir(dirname);
+    struct dirent *dir;
+    int err = 0;
+
+    if (!dfd) {
+	return ENOENT;
+    }
+    while (!err && (dir = readdir(dfd))) {
+	if (strncmp(dir->d_name, CHIP_PREFIX, strlen(CHIP_PREFIX)) == 0) {
+	    err = add_chip(reg, dir->d_name);
+	}
+    }
+    closedir(dfd);
+    return err;
+}
+
+/**
+ * Enumerate the gpio chips on the system and create a registry for
+ * them.  The registry will be kept current, by bgpio_registry_refresh(),
+ * as chips are added and removed.
+ *
+ * In the event of an error, errno will be set.
+ *
+ * @result A dynamically allocated ::bgpio_registry_t struct, which
+ * must be freed using bgpio_close_registry(), or NULL on failure.
+ */
+bgpio_registry_t *
+bgpio_open_registry(void)
+{
+    bgpio_registry_t *reg = calloc(1, sizeof(bgpio_registry_t));
+    int err;
+
+    if (!reg) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    /* Start watching before we scan, so that no change can be
+     * missed.  The registry is still usable, if not self-updating,
+     * without the watch. */
+    reg->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (reg->inotify_fd >= 0) {
+	if (inotify_add_watch(reg->inotify_fd, BGPIO_DEV_DIR,
+			      IN_CREATE | IN_DELETE | IN_ATTRIB |
+			      IN_MOVED_FROM | IN_MOVED_TO) < 0) {
+	    close(reg->inotify_fd);
+	    reg->inotify_fd = -1;
+	}
+    }
+    err = scan_dir(reg, BGPIO_SYS_GPIO_DIR);
+    if ((err == ENOENT) || ((err == 0) && (reg->count == 0))) {
+	err = scan_dir(reg, BGPIO_DEV_DIR);
+	if (err == ENOENT) {
+	    /* No chips is not an error. */
+	    err = 0;
+	}
+    }
+    if (!err) {
+	err = build_index(reg);
+    }
+    if (err) {
+	bgpio_close_registry(reg);
+	errno = err;
+	return NULL;
+    }
+    return reg;
+}
+
+/**
+ * Free a registry created by bgpio_open_registry().  Any
+ * ::bgpio_chip_entry_t pointers obtained from it become invalid.
+ *
+ * @param reg The ::bgpio_registry_t to be freed.
+ */
+void
+bgpio_close_registry(bgpio_registry_t *reg)
+{
+    int i;
+
+    assert(reg);
+    if (reg->inotify_fd >= 0) {
+	close(reg->inotify_fd);
+    }
+    for (i = 0; i < reg->count; i++) {
+	free(reg->chips[i]->path);
+	free(reg->chips[i]);
+    }
+    free(reg->chips);
+    free(reg->index);
+    free(reg);
+}
+
+/**
+ * Apply any changes to the set of gpio chips that have been reported
+ * since the registry was created or last refreshed.  This does not
+ * block.  The inotify file descriptor, \p reg->inotify_fd, may be
+ * polled by callers wishing to know when a refresh is needed.
+ *
+ * Pointers to ::bgpio_chip_entry_t structs for chips that remain
+ * present are unaffected by a refresh.
+ *
+ * @param reg The ::bgpio_registry_t.
+ *
+ * @result The number of chips added, removed or updated, or -1 with
+ * errno set.
+ */
+int
+bgpio_registry_refresh(bgpio_registry_t *reg)
+{
+    char buf[INOTIFY_BUFSIZE]
+	__attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *event;
+    uint64_t generation;
+    ssize_t len;
+    char *ptr;
+    int changes = 0;
+    int pos;
+    int err;
+
+    assert(reg);
+    if (reg->inotify_fd < 0) {
+	return 0;
+    }
+    generation = reg->generation;
+    while ((len = read(reg->inotify_fd, buf, sizeof(buf))) > 0) {
+	for (ptr = buf; ptr < buf + len;
+	     ptr += sizeof(struct inotify_event) + event->len) {
+	    event = (struct inotify_event *) ptr;
+	    if (!event->len ||
+		strncmp(event->name, CHIP_PREFIX, strlen(CHIP_PREFIX))) {
+		continue;
+	    }
+	    if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+		remove_chip(reg, event->name);
+	    }
+	    else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+		if ((err = add_chip(reg, event->name))) {
+		    errno = err;
+		    return -1;
+		}
+	    }
+	    else if ((event->mask & IN_ATTRIB) &&
+		     find_chip(reg, event->name, &pos) &&
+		     !reg->chips[pos]->lines) {
+		/* Permissions may now allow us to describe the chip. */
+		describe_entry(reg->chips[pos]);
+		if (reg->chips[pos]->lines) {
+		    reg->generation++;
+		}
+	    }
+	}
+    }
+    if ((len < 0) && (errno != EAGAIN) && (errno != EINTR)) {
+	return -1;
+    }
+    if (reg->generation != generation) {
+	changes = (int) (reg->generation - generation);
+	if ((err = build_index(reg))) {
+	    errno = err;
+	    return -1;
+	}
+    }
+    return changes;
+}
+
+/**
+ * Find a chip in the registry from a user-supplied id.  The id may be
+ * the full path to the chip device, the chip's name or label, or any
+ * suffix of its path (eg "chip0" or "0") that identifies it uniquely.
+ * Ids beginning with '/' must match the full path.
+ *
+ * In the event of an error, errno will be set.
+ *
+ * @param reg The ::bgpio_registry_t.
+ *
+ * @param id The chip id.
+ *
+ * @result The matching ::bgpio_chip_entry_t, or NULL with errno set
+ * to ENOENT if there is no match, or ENOTUNIQ if \p id could refer to
+ * more than one chip.
+ */
+bgpio_chip_entry_t *
+bgpio_registry_find(bgpio_registry_t *reg, const char *id)
+{
+    uint32_t mask;
+    uint32_t slot;
+    bgpio_chip_entry_t *entry;
+
+    assert(reg);
+    assert(id);
+    if (!reg->index_size) {
+	errno = ENOENT;
+	return NULL;
+    }
+    mask = reg->index_size - 1;
+    slot = bgpio_hash_key(id) & mask;
+    while (reg->index[slot].key) {
+	if (strcmp(reg->index[slot].key, id) == 0) {
+	    if (reg->index[slot].chip < 0) {
+		errno = ENOTUNIQ;
+		return NULL;
+	    }
+	    entry = reg->chips[reg->index[slot].chip];
+	    if ((id[0] == '/') && strcmp(entry->path, id)) {
+		break;
+	    }
+	    return entry;
+	}
+	slot = (slot + 1) & mask;
+    }
+    errno = ENOENT;
+    return NULL;
+}
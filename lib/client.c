@@ -0,0 +1,407 @@
+/*
+ *     Copyright (c) 2023 Marc Munro
+ *     Fileset:	libbgpiod - basic/bloodnok gpio device library
+ *     Author:   Marc Munro
+ *     License:  GPL-3.0
+ *
+ */
+
+/**
+ * @file   client.c
+ * @brief Client side of the bgpiodaemon protocol.
+ *
+ * bgpiodaemon is a long-running process that owns a configured set of
+ * gpio lines and serves get, set and subscribe requests from local
+ * clients over a unix socket.  The functions here allow clients to
+ * make those requests without having to know the details of the
+ * protocol, which are described with ::bgpio_msg_t.
+ *
+ * Replies from the daemon are returned in the order in which their
+ * requests were made, but edge events may arrive at any time.  Any
+ * events that arrive while we are waiting for a reply are queued in
+ * the ::bgpio_client_t struct and returned by
+ * bgpio_client_await_event().
+ */
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "bgpiod.h"
+
+/**
+ * Add an edge event message to the client's queue of events.  If the
+ * queue is full the event is discarded and counted in
+ * ::bgpio_client_t->dropped.
+ *
+ * @param client The ::bgpio_client_t for our connection.
+ *
+ * @param msg The BGPIO_MSG_EVENT message to be queued.
+ */
+static void
+queue_event(bgpio_client_t *client, bgpio_msg_t *msg)
+{
+    if (client->queued >= BGPIO_CLIENT_QUEUE) {
+	client->dropped++;
+	return;
+    }
+    client->events[(client->head + client->queued) % BGPIO_CLIENT_QUEUE] =
+	*msg;
+    client->queued++;
+}
+
+/**
+ * Receive a single message from the daemon.
+ *
+ * @param client The ::bgpio_client_t for our connection.
+ *
+ * @param msg Where the received message will be placed.
+ *
+ * @result Zero if successful, else an errno value.  If the daemon has
+ * closed the connection the result will be ECONNRESET.
+ */
+static int
+receive_msg(bgpio_client_t *client, bgpio_msg_t *msg)
+{
+    ssize_t res;
+
+    do {
+	res = recv(client->fd, msg, sizeof(bgpio_msg_t), 0);
+    } while ((res < 0) && (errno == EINTR));
+
+    if (res < 0) {
+	return errno;
+    }
+    if (res == 0) {
+	return ECONNRESET;
+    }
+    if (res != sizeof(bgpio_msg_t)) {
+	return EPROTO;
+    }
+    return 0;
+}
+
+/**
+ * Send a request to the daemon and wait for its reply.  Any edge
+ * events received while waiting are queued.
+ *
+ * @param client The ::bgpio_client_t for our connection.
+ *
+ * @param msg The request to be sent.  This will be overwritten by the
+ * daemon's reply.
+ *
+ * @result Zero if successful, else an errno value, either from the
+ * socket operations or from the status field of the reply.
+ */
+static int
+transact(bgpio_client_t *client, bgpio_msg_t *msg)
+{
+    uint16_t op = msg->op;
+    int err;
+
+    if (send(client->fd, msg, sizeof(bgpio_msg_t), MSG_NOSIGNAL) !=
+	sizeof(bgpio_msg_t)) {
+	return errno? errno: EIO;
+    }
+    while (true) {
+	if ((err = receive_msg(client, msg))) {
+	    return err;
+	}
+	if (msg->op == op) {
+	    return msg->status;
+	}
+	if (msg->op == BGPIO_MSG_EVENT) {
+	    queue_event(client, msg);
+	}
+	else {
+	    return EPROTO;
+	}
+    }
+}
+
+/**
+ * Connect to bgpiodaemon.
+ *
+ * In the event of an error, errno will be set.
+ *
+ * @param socket_path The path to the daemon's unix socket.  If NULL,
+ * BGPIO_DAEMON_SOCKET will be used.
+ *
+ * @result A dynamically allocated ::bgpio_client_t struct, which must
+ * be closed and freed using bgpio_client_close(), or NULL if the
+ * connection could not be made.
+ */
+bgpio_client_t *
+bgpio_client_open(const char *socket_path)
+{
+    struct sockaddr_un addr;
+    bgpio_client_t *client;
+    int fd;
+
+    if (!socket_path) {
+	socket_path = BGPIO_DAEMON_SOCKET;
+    }
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+	errno = ENAMETOOLONG;
+	return NULL;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+	return NULL;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+	int err = errno;
+	close(fd);
+	errno = err;
+	return NULL;
+    }
+    client = calloc(1, sizeof(bgpio_client_t));
+    if (!client) {
+	close(fd);
+	errno = ENOMEM;
+	return NULL;
+    }
+    client->fd = fd;
+    return client;
+}
+
+/**
+ * Close a connection opened by bgpio_client_open().  Any
+ * subscriptions will be cancelled by the daemon.
+ *
+ * @param client The ::bgpio_client_t to be closed and freed.
+ */
+void
+bgpio_client_close(bgpio_client_t *client)
+{
+    assert(client);
+    if (close(client->fd)) {
+	perror("Failed to close bgpiodaemon connection");
+    }
+    free((void *) client);
+}
+
+/**
+ * Find the mask bit that identifies a given gpio line in requests for
+ * a given chip.
+ *
+ * @param client The ::bgpio_client_t for our connection.
+ *
+ * @param chip The index of the chip in the daemon's configuration.
+ *
+ * @param line The gpio line number.
+ *
+ * @param mask Where the single-bit bitmap for the line will be
+ * placed.
+ *
+ * @result Zero if successful, else an errno value.  ENOENT means that
+ * the line is not owned by the daemon.
+ */
+int
+bgpio_client_lookup(bgpio_client_t *client, int chip, int line,
+		    uint64_t *mask)
+{
+    assert(client);
+    assert(mask);
+    bgpio_msg_t msg = {BGPIO_MSG_LOOKUP, chip, 0, 0, line, 0};
+    int err = transact(client, &msg);
+
+    if (!err) {
+	*mask = msg.mask;
+    }
+    return err;
+}
+
+/**
+ * Fetch the values of a set of lines from the daemon.  The daemon
+ * combines fetches from all clients that are ready at the same time
+ * into a single ioctl call.
+ *
+ * @param client The ::bgpio_client_t for our connection.
+ *
+ * @param chip The index of the chip in the daemon's configuration.
+ *
+ * @param mask Bitmap of the lines to be fetched.
+ *
+ * @param bits Where the bitmap of fetched values will be placed.
+ *
+ * @result Zero if successful, else an errno value.
+ */
+int
+bgpio_client_get(bgpio_client_t *client, int chip, uint64_t mask,
+		 uint64_t *bits)
+{
+    assert(client);
+    assert(bits);
+    bgpio_msg_t msg = {BGPIO_MSG_GET, chip, 0, mask, 0, 0};
+    int err = transact(client, &msg);
+
+    if (!err) {
+	*bits = msg.bits;
+    }
+    return err;
+}
+
+/**
+ * Set the values of a set of output lines owned by the daemon.  The
+ * daemon combines sets from all clients that are ready at the same
+ * time into a single ioctl call.
+ *
+ * @param client The ::bgpio_client_t for our connection.
+ *
+ * @param chip The index of the chip in the daemon's configuration.
+ *
+ * @param mask Bitmap of the lines to be set.
+ *
+ * @param bits Bitmap of the values to be set.
+ *
+ * @result Zero if successful, else an errno value.  EPERM means that
+ * one of the lines in \p mask is not an output.
+ */
+int
+bgpio_client_set(bgpio_client_t *client, int chip, uint64_t mask,
+		 uint64_t bits)
+{
+    assert(client);
+    bgpio_msg_t msg = {BGPIO_MSG_SET, chip, 0, mask, bits, 0};
+
+    return transact(client, &msg);
+}
+
+/**
+ * Ask the daemon to send us edge events for a set of lines.  The
+ * lines must have been configured for edge detection in the daemon's
+ * configuration file.  Events are retrieved using
+ * bgpio_client_await_event().
+ *
+ * @param client The ::bgpio_client_t for our connection.
+ *
+ * @param chip The index of the chip in the daemon's configuration.
+ *
+ * @param mask Bitmap of the lines to be subscribed to.
+ *
+ * @result Zero if successful, else an errno value.
+ */
+int
+bgpio_client_subscribe(bgpio_client_t *client, int chip, uint64_t mask)
+{
+    assert(client);
+    bgpio_msg_t msg = {BGPIO_MSG_SUBSCRIBE, chip, 0, mask, 0, 0};
+
+    return transact(client, &msg);
+}
+
+/**
+ * Cancel a subscription made by bgpio_client_subscribe().
+ *
+ * @param client The ::bgpio_client_t for our connection.
+ *
+ * @param chip The index of the chip in the daemon's configuration.
+ *
+ * @param mask Bitmap of the lines to be unsubscribed from.
+ *
+ * @result Zero if successful, else an errno value.
+ */
+int
+bgpio_client_unsubscribe(bgpio_client_t *client, int chip, uint64_t mask)
+{
+    assert(client);
+    bgpio_msg_t msg = {BGPIO_MSG_UNSUBSCRIBE, chip, 0, mask, 0, 0};
+
+    return transact(client, &msg);
+}
+
+/**
+ * Await an edge event from the daemon, for lines subscribed to using
+ * bgpio_client_subscribe().
+ *
+ * @param client The ::bgpio_client_t for our connection.
+ *
+ * @param event Where the BGPIO_MSG_EVENT message will be placed.
+ * The line is identified by `event->chip` and the single bit set in
+ * `event->mask`.  `event->bits` will contain 1 for a rising edge and
+ * 0 for a falling edge.
+ *
+ * @param timeout_msecs Pointer to a timeout value given in
+ * milliseconds.  If no timeout is required, the pointer should be
+ * NULL.
+ *
+ * @result Zero if successful, ETIMEDOUT if the timeout expired, or an
+ * errno value.
+ */
+int
+bgpio_client_await_event(bgpio_client_t *client, bgpio_msg_t *event,
+			 int *timeout_msecs)
+{
+    assert(client);
+    assert(event);
+    int res;
+
+    if (client->queued) {
+	*event = client->events[client->head];
+	client->head = (client->head + 1) % BGPIO_CLIENT_QUEUE;
+	client->queued--;
+	return 0;
+    }
+
+    if (timeout_msecs) {
+	struct pollfd poll_fd = {client->fd, POLLIN, 0};
+	res = poll(&poll_fd, 1, *timeout_msecs);
+	if (res == 0) {
+	    return ETIMEDOUT;
+	}
+	if (res < 0) {
+	    return errno? errno: EINVAL;
+	}
+    }
+    if ((res = receive_msg(client, event))) {
+	return res;
+    }
+    return (event->op == BGPIO_MSG_EVENT)? 0: EPROTO;
+}
+
+/**
+ * Ask the daemon for direct access to its line request for a chip.
+ * The returned request shares the daemon's lines, so that fetches and
+ * sets made using bgpio_fetch() and bgpio_set() go straight to the
+ * kernel rather than through the daemon.  The daemon continues to
+ * own the lines, so they, and any output values, survive the closing
+ * of the returned request.
+ *
+ * Edge events must still be obtained through
+ * bgpio_client_subscribe(): awaiting events directly on the returned
+ * request would steal them from the daemon.
+ *
+ * In the event of an error, errno will be set.
+ *
+ * @param client The ::bgpio_client_t for our connection.
+ *
+ * @param chip The index of the chip in the daemon's configuration.
+ *
+ * @result A dynamically allocated ::bgpio_request_t, which must be
+ * closed and freed using bgpio_close_request(), or NULL on failure.
+ */
+bgpio_request_t *
+bgpio_client_handoff(bgpio_client_t *client, int chip)
+{
+    assert(client);
+    bgpio_msg_t msg = {BGPIO_MSG_HANDOFF, chip, 0, 0, 0, 0};
+    int err = transact(client, &msg);
+
+    if (err) {
+	errno = err;
+	return NULL;
+    }
+    return bgpio_receive_request(client->fd);
+}
@@ -0,0 +1,235 @@
+/*
+ *     Copyright (c) 2023 Marc Munro
+ *     Fileset:	libbgpiod - basic/bloodnok gpio device library
+ *     Author:   Marc Munro
+ *     License:  GPL-3.0
+ *
+ */
+
+/**
+ * @file   coalesce.c
+ * @brief Coalescing of edge events into batches.
+ *
+ * At high edge rates, waking once per event costs far more cpu than
+ * handling the events.  Once coalescing has been enabled for a
+ * request by bgpio_enable_coalescing(), bgpio_read_coalesced(), and so
+ * bgpio_dispatch(), wait after the first event wakes them for up to a
+ * given window, or until a given number of events has been read,
+ * before delivering the batch.  This bounds the extra latency of any
+ * event to the window.
+ *
+ * When traffic is sparse, which is when an event arrives more than a
+ * window after its predecessor, there is little to gain by waiting, and
+ * the event is delivered at once.
+ *
+ * The distribution of batch sizes is recorded in a histogram, so that
+ * the window may be tuned.
+ */
+
+#define _GNU_SOURCE     // for ppoll()
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "bgpiod.h"
+#include "bgpiod_internal.h"
+
+/**
+ * Read whatever events are queued for a request, up to \p max, into
+ * \p events.
+ *
+ * @param req The ::bgpio_request_t.
+ *
+ * @param events Where the events are to be placed.
+ *
+ * @param max The number of events for which \p events has room.
+ *
+ * @result The number of events read, or -1 with errno set.
+ */
+static int
+read_events(bgpio_request_t *req, struct gpio_v2_line_event *events,
+	    int max)
+{
+    ssize_t res;
+    int count;
+    int i;
+
+    do {
+	res = read(req->req.fd, events,
+		   max * sizeof(struct gpio_v2_line_event));
+    } while ((res < 0) && (errno == EINTR));
+
+    if (res < 0) {
+	return ((errno == EAGAIN) || (errno == EWOULDBLOCK))? 0: -1;
+    }
+    count = res / sizeof(struct gpio_v2_line_event);
+    for (i = 0; i < count; i++) {
+	bgpio_note_event(req, &events[i]);
+    }
+    return count;
+}
+
+/**
+ * Record the delivery of a batch in a request's coalescing statistics.
+ *
+ * @param coalesce The request's ::bgpio_coalesce_t.
+ *
+ * @param count The number of events in the batch.
+ *
+ * @param immediate Whether the batch was delivered without waiting,
+ * because traffic was sparse.
+ */
+static void
+record_batch(bgpio_coalesce_t *coalesce, int count, bool immediate)
+{
+    int bucket = 0;
+
+    while ((count >> (bucket + 1)) && (bucket < BGPIO_COALESCE_BUCKETS - 1)) {
+	bucket++;
+    }
+    coalesce->histogram[bucket]++;
+    coalesce->batches++;
+    coalesce->events += count;
+    if (immediate) {
+	coalesce->immediate++;
+    }
+}
+
+/**
+ * Enable, or disable, the coalescing of a request's edge events into
+ * batches by bgpio_read_coalesced() and bgpio_dispatch().  Calling this
+ * again changes the settings and clears the statistics.
+ *
+ * @param req The completed ::bgpio_request_t.
+ *
+ * @param window_usecs How long, in microseconds, to wait for further
+ * events after the first event of a batch is read.  Zero disables
+ * coalescing.
+ *
+ * @param max_events The number of events after which a batch is
+ * delivered without waiting further, at most BGPIO_COALESCE_MAX.  Zero
+ * means BGPIO_COALESCE_MAX.
+ *
+ * @result Zero if successful, else an errno value.
+ */
+int
+bgpio_enable_coalescing(bgpio_request_t *req, uint32_t window_usecs,
+			uint32_t max_events)
+{
+    assert(req);
+
+    if (max_events > BGPIO_COALESCE_MAX) {
+	return EINVAL;
+    }
+    if (!window_usecs) {
+	free(req->coalesce);
+	req->coalesce = NULL;
+	return 0;
+    }
+    if (!req->coalesce) {
+	req->coalesce = malloc(sizeof(bgpio_coalesce_t));
+	if (!req->coalesce) {
+	    return ENOMEM;
+	}
+    }
+    memset(req->coalesce, 0, sizeof(bgpio_coalesce_t));
+    req->coalesce->window_ns = (uint64_t) window_usecs * 1000;
+    req->coalesce->max_events = max_events? max_events: BGPIO_COALESCE_MAX;
+    return 0;
+}
+
+/**
+ * Await a batch of edge events for a request with coalescing enabled.
+ * Once the first event has been read, we wait for up to the request's
+ * coalescing window for more, unless traffic is sparse or the batch is
+ * already full.  The last event read is left in
+ * ::bgpio_request_t->event.
+ *
+ * In the event of an error, errno will be set.
+ *
+ * @param req The ::bgpio_request_t, for which
+ * bgpio_enable_coalescing() has been called.
+ *
+ * @param p_events Where a pointer to the batch of events will be
+ * placed.  The events remain valid until the next call.
+ *
+ * @param timeout_msecs Pointer to a timeout value, given in
+ * milliseconds, for the first event, or NULL to wait indefinitely.
+ *
+ * @result The number of events in the batch, zero if the timeout
+ * expired, or -1 in the event of an error.  An errno of EINTR means
+ * that we were woken by bgpio_wakeup().
+ */
+int
+bgpio_read_coalesced(bgpio_request_t *req,
+		     struct gpio_v2_line_event **p_events, int *timeout_msecs)
+{
+    assert(req);
+    assert(p_events);
+    bgpio_coalesce_t *coalesce = req->coalesce;
+    struct pollfd poll_fd = {req->req.fd, POLLIN, 0};
+    struct gpio_v2_line_event *events;
+    struct timespec wait;
+    uint64_t deadline;
+    uint64_t now;
+    bool immediate;
+    int count;
+    int more;
+    int res;
+    int err;
+
+    if (!coalesce) {
+	errno = EINVAL;
+	return -1;
+    }
+    events = coalesce->buf;
+    *p_events = events;
+
+    if ((err = bgpio_poll_request(req, timeout_msecs))) {
+	if (err == ETIMEDOUT) {
+	    return 0;
+	}
+	errno = err;
+	return -1;
+    }
+    now = bgpio_now_ns();
+    deadline = now + coalesce->window_ns;
+    if ((count = read_events(req, events, coalesce->max_events)) <= 0) {
+	return count;
+    }
+
+    /* Traffic is sparse if the first event of the batch came more than
+     * a window after the last event delivered. */
+    immediate = (count == 1) &&
+	(events[0].timestamp_ns - coalesce->last_ns > coalesce->window_ns);
+
+    while (!immediate && (count < coalesce->max_events) && (now < deadline)) {
+	wait.tv_sec = (deadline - now) / 1000000000;
+	wait.tv_nsec = (deadline - now) % 1000000000;
+	res = ppoll(&poll_fd, 1, &wait, NULL);
+	if ((res < 0) && (errno != EINTR)) {
+	    break;
+	}
+	if (res > 0) {
+	    more = read_events(req, events + count,
+			       coalesce->max_events - count);
+	    if (more < 0) {
+		/* Deliver what we have; the error will recur. */
+		break;
+	    }
+	    count += more;
+	}
+	now = bgpio_now_ns();
+    }
+
+    coalesce->last_ns = events[count - 1].timestamp_ns;
+    req->event = events[count - 1];
+    record_batch(coalesce, count, immediate);
+    return count;
+}
@@ -0,0 +1,254 @@
+/*
+ *     Copyright (c) 2023 Marc Munro
+ *     Fileset:	libbgpiod - basic/bloodnok gpio device library
+ *     Author:   Marc Munro
+ *     License:  GPL-3.0
+ *
+ */
+
+/**
+ * @file   dispatch.c
+ * @brief Dispatch of edge events to per-line callbacks.
+ *
+ * Rather than awaiting each event with bgpio_await_event() and then
+ * deciding what to do based on its line and edge, the caller may
+ * register a callback for each line and edge using bgpio_on_edge(),
+ * and then repeatedly call bgpio_dispatch().  This reads all pending
+ * events, in as few system calls as possible, and calls the
+ * appropriate callback for each.
+ */
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "bgpiod.h"
+#include "bgpiod_internal.h"
+
+/**
+ * Value in ::bgpio_dispatch_t->line_idx for offsets that are not
+ * part of the request.
+ */
+#define NO_IDX 0xff
+
+/**
+ * Build, or rebuild, the map from line offsets to line indexes for a
+ * request's dispatch table.
+ *
+ * @param req The ::bgpio_request_t whose dispatch table is to be
+ * updated.
+ *
+ * @result Zero if successful, else an errno value.
+ */
+static int
+build_line_idx(bgpio_request_t *req)
+{
+    bgpio_dispatch_t *dispatch = req->dispatch;
+    uint32_t num_offsets = 0;
+    uint8_t *line_idx;
+    int i;
+
+    for (i = 0; i < req->req.num_lines; i++) {
+	if (req->req.offsets[i] >= num_offsets) {
+	    num_offsets = req->req.offsets[i] + 1;
+	}
+    }
+    line_idx = malloc(num_offsets? num_offsets: 1);
+    if (!line_idx) {
+	return ENOMEM;
+    }
+    memset(line_idx, NO_IDX, num_offsets);
+    for (i = 0; i < req->req.num_lines; i++) {
+	line_idx[req->req.offsets[i]] = i;
+    }
+    free(dispatch->line_idx);
+    dispatch->line_idx = line_idx;
+    dispatch->num_offsets = num_offsets;
+    return 0;
+}
+
+/**
+ * Register a callback to be called by bgpio_dispatch() for edge
+ * events on a given line.  A later registration for the same line and
+ * edge replaces the earlier one.
+ *
+ * The line must already have been added to the request, with edge
+ * detection, using bgpio_configure_line().
+ *
+ * @param req The ::bgpio_request_t containing the line.
+ *
+ * @param line The gpio line number.
+ *
+ * @param edge_mask Which edges the callback is for:
+ * GPIO_V2_LINE_FLAG_EDGE_RISING, GPIO_V2_LINE_FLAG_EDGE_FALLING, or
+ * both.
+ *
+ * @param fn The callback, or NULL to remove an existing registration.
+ *
+ * @param ctx A pointer that will be passed to \p fn.
+ *
+ * @result Zero if successful, else an errno value.  EINVAL means that
+ * the line is not part of the request.
+ */
+int
+bgpio_on_edge(bgpio_request_t *req, int line, uint64_t edge_mask,
+	      bgpio_edge_fn fn, void *ctx)
+{
+    assert(req);
+    int idx = bgpio_idx_for_line(req, line);
+    int err;
+
+    if (idx < 0) {
+	return EINVAL;
+    }
+    if (!req->dispatch) {
+	req->dispatch = calloc(1, sizeof(bgpio_dispatch_t));
+	if (!req->dispatch) {
+	    return ENOMEM;
+	}
+    }
+    if ((line >= req->dispatch->num_offsets) ||
+	(req->dispatch->line_idx[line] != idx)) {
+	/* Lines have been added since the map was built. */
+	if ((err = build_line_idx(req))) {
+	    return err;
+	}
+    }
+    if (edge_mask & GPIO_V2_LINE_FLAG_EDGE_RISING) {
+	req->dispatch->handlers[idx][0] = (bgpio_edge_handler_t) {fn, ctx};
+    }
+    if (edge_mask & GPIO_V2_LINE_FLAG_EDGE_FALLING) {
+	req->dispatch->handlers[idx][1] = (bgpio_edge_handler_t) {fn, ctx};
+    }
+    return 0;
+}
+
+/**
+ * Call the registered callback for each of a set of events.  Events
+ * for which no callback is registered are discarded.
+ *
+ * @param req The ::bgpio_request_t from which the events were read.
+ *
+ * @param events The events.
+ *
+ * @param count The number of events.
+ *
+ * @param mirror Whether each event is to be applied to the request's
+ * input mirror before its callback is called.
+ */
+static void
+dispatch_events(bgpio_request_t *req, struct gpio_v2_line_event *events,
+		int count, bool mirror)
+{
+    bgpio_dispatch_t *dispatch = req->dispatch;
+    bgpio_edge_handler_t *handler;
+    int idx;
+    int i;
+
+    for (i = 0; i < count; i++) {
+	if (mirror) {
+	    bgpio_note_event(req, &events[i]);
+	}
+	if (!dispatch || (events[i].offset >= dispatch->num_offsets)) {
+	    continue;
+	}
+	idx = dispatch->line_idx[events[i].offset];
+	if (idx == NO_IDX) {
+	    continue;
+	}
+	handler = &dispatch->handlers[idx][
+	    (events[i].id == GPIO_V2_LINE_EVENT_FALLING_EDGE)? 1: 0];
+	if (handler->fn) {
+	    handler->fn(req, &events[i], handler->ctx);
+	}
+    }
+}
+
+/**
+ * Read all pending edge events for a request, calling the callback
+ * registered by bgpio_on_edge() for each.  Events are read in batches
+ * of up to BGPIO_DISPATCH_BATCH per system call.  Events for which no
+ * callback is registered are discarded.
+ *
+ * If coalescing has been enabled by bgpio_enable_coalescing(), events
+ * are instead read as a single batch by bgpio_read_coalesced().
+ *
+ * In the event of an error, errno will be set.
+ *
+ * @param req The completed ::bgpio_request_t.
+ *
+ * @param timeout_msecs Pointer to a timeout value, given in
+ * milliseconds, for the first event.  If NULL, we wait indefinitely
+ * for the first event.  Once events have been read we do not wait for
+ * more.
+ *
+ * @result The number of events read, zero if the timeout expired, or
+ * -1 in the event of an error.  An errno of EINTR means that we were
+ * woken by bgpio_wakeup().
+ */
+int
+bgpio_dispatch(bgpio_request_t *req, int *timeout_msecs)
+{
+    assert(req);
+    bgpio_dispatch_t *dispatch = req->dispatch;
+    struct gpio_v2_line_event *events;
+    struct gpio_v2_line_event single;
+    struct pollfd poll_fd = {req->req.fd, POLLIN, 0};
+    size_t batch;
+    ssize_t res;
+    int total = 0;
+    int count;
+    int err;
+
+    if (req->coalesce) {
+	count = bgpio_read_coalesced(req, &events, timeout_msecs);
+	if (count > 0) {
+	    /* The events were mirrored as they were read. */
+	    dispatch_events(req, events, count, false);
+	}
+	return count;
+    }
+    if (dispatch) {
+	events = dispatch->events;
+	batch = sizeof(dispatch->events);
+    }
+    else {
+	events = &single;
+	batch = sizeof(single);
+    }
+    if (timeout_msecs || req->nonblocking || req->wakeup_fd) {
+	if ((err = bgpio_poll_request(req, timeout_msecs))) {
+	    if (err == ETIMEDOUT) {
+		return 0;
+	    }
+	    errno = err;
+	    return -1;
+	}
+    }
+    while (true) {
+	do {
+	    res = read(req->req.fd, events, batch);
+	} while ((res < 0) && (errno == EINTR));
+
+	if (res < 0) {
+	    return total? total: -1;
+	}
+	count = res / sizeof(struct gpio_v2_line_event);
+	dispatch_events(req, events, count, true);
+	total += count;
+
+	/* A short read means there are no more events; otherwise
+	 * check, without waiting, whether more have arrived. */
+	if ((res < batch) || (poll(&poll_fd, 1, 0) <= 0)) {
+	    break;
+	}
+    }
+    if (count) {
+	req->event = events[count - 1];
+    }
+    return total;
+}
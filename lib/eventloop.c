@@ -0,0 +1,405 @@
+/*
+ *     Copyright (c) 2023 Marc Munro
+ *     Fileset:	libbgpiod - basic/bloodnok gpio device library
+ *     Author:   Marc Munro
+ *     License:  GPL-3.0
+ *
+ */
+
+/**
+ * @file   eventloop.c
+ * @brief Integration with event loops outside of the library.
+ *
+ * An application with its own event loop, based on epoll or libuv for
+ * instance, should not wait inside the library, as bgpio_await_event()
+ * and bgpio_await_watched_lines() do.  Instead, it registers the file
+ * descriptors of its requests and chips, as returned by
+ * bgpio_request_fd() and bgpio_chip_fd(), with its own loop, and when
+ * one becomes readable calls bgpio_drain_events() or
+ * bgpio_drain_watch_events().  These read whatever is queued, in as
+ * few system calls as possible, and return at once.  The descriptors
+ * may be made O_NONBLOCK, which saves a poll() before each drain.
+ *
+ * Threads that do wait in bgpio_await_event() can be woken by another
+ * thread, using an eventfd created by bgpio_enable_wakeup().
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "bgpiod.h"
+
+/**
+ * The maximum number of line-info changes read by a single read()
+ * call in bgpio_drain_watch_events().
+ */
+#define WATCH_BATCH 8
+
+/**
+ * Set or clear O_NONBLOCK on a file descriptor.
+ *
+ * @param fd The file descriptor.
+ *
+ * @param nonblocking Whether O_NONBLOCK is to be set.
+ *
+ * @result Zero if successful, else an errno value.
+ */
+static int
+set_nonblocking(int fd, bool nonblocking)
+{
+    int flags = fcntl(fd, F_GETFL);
+
+    if (flags < 0) {
+	return errno;
+    }
+    flags = nonblocking? (flags | O_NONBLOCK): (flags & ~O_NONBLOCK);
+    if (fcntl(fd, F_SETFL, flags) < 0) {
+	return errno;
+    }
+    return 0;
+}
+
+/**
+ * Read whatever is queued on a file descriptor, up to \p size bytes,
+ * without waiting.
+ *
+ * @param fd The file descriptor.
+ *
+ * @param nonblocking Whether \p fd is O_NONBLOCK.  If not, we must
+ * poll before reading, as the read would otherwise wait.
+ *
+ * @param buf The buffer into which to read.
+ *
+ * @param size The size of \p buf.
+ *
+ * @result The number of bytes read, zero if nothing was queued, or -1
+ * with errno set.
+ */
+static ssize_t
+read_queued(int fd, bool nonblocking, void *buf, size_t size)
+{
+    struct pollfd poll_fd = {fd, POLLIN, 0};
+    ssize_t res;
+
+    if (!nonblocking) {
+	if ((res = poll(&poll_fd, 1, 0)) <= 0) {
+	    return res;
+	}
+    }
+    do {
+	res = read(fd, buf, size);
+    } while ((res < 0) && (errno == EINTR));
+
+    if ((res < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+	return 0;
+    }
+    return res;
+}
+
+/**
+ * Return the file descriptor on which a request's edge events are
+ * read.  It becomes readable when events are queued, and may be
+ * registered with an external event loop.  The descriptor belongs to
+ * the request and must not be closed by the caller.
+ *
+ * Note that if a supervised request is re-acquired by
+ * bgpio_reacquire() its file descriptor will change.
+ *
+ * @param req The ::bgpio_request_t.
+ *
+ * @result The file descriptor, or -1 if the request has not been
+ * completed.
+ */
+int
+bgpio_request_fd(bgpio_request_t *req)
+{
+    assert(req);
+    return (req->req.fd > 0)? req->req.fd: -1;
+}
+
+/**
+ * Return the file descriptor on which a chip's line-info changes are
+ * read, as watched by bgpio_watch_line().  The descriptor belongs to
+ * the chip and must not be closed by the caller.
+ *
+ * @param chip The ::bgpio_chip_t.
+ *
+ * @result The file descriptor.
+ */
+int
+bgpio_chip_fd(bgpio_chip_t *chip)
+{
+    assert(chip);
+    return chip->fd;
+}
+
+/**
+ * Make a request's file descriptor O_NONBLOCK, or blocking again.
+ * bgpio_await_event() continues to wait for events either way.
+ *
+ * @param req The completed ::bgpio_request_t.
+ *
+ * @param nonblocking Whether the file descriptor is to be
+ * non-blocking.
+ *
+ * @result Zero if successful, else an errno value.
+ */
+int
+bgpio_request_nonblocking(bgpio_request_t *req, bool nonblocking)
+{
+    assert(req);
+    int err;
+
+    if (req->req.fd <= 0) {
+	return EINVAL;
+    }
+    if (!(err = set_nonblocking(req->req.fd, nonblocking))) {
+	req->nonblocking = nonblocking;
+    }
+    return err;
+}
+
+/**
+ * Make a chip's file descriptor O_NONBLOCK, or blocking again.
+ * bgpio_await_watched_lines() continues to wait for changes either
+ * way.
+ *
+ * @param chip The ::bgpio_chip_t.
+ *
+ * @param nonblocking Whether the file descriptor is to be
+ * non-blocking.
+ *
+ * @result Zero if successful, else an errno value.
+ */
+int
+bgpio_chip_nonblocking(bgpio_chip_t *chip, bool nonblocking)
+{
+    assert(chip);
+    int err;
+
+    if (!(err = set_nonblocking(chip->fd, nonblocking))) {
+	chip->nonblocking = nonblocking;
+    }
+    return err;
+}
+
+/**
+ * Put a request into, or take it out of, busy-poll mode.  In busy-poll
+ * mode the request's file descriptor is O_NONBLOCK, and
+ * bgpio_await_event() spins on read() rather than sleeping in poll(),
+ * trading a cpu for the latency of a wakeup.  This is only worthwhile
+ * if the calling thread has a cpu to itself, ideally at real-time
+ * priority; otherwise it will be slower than sleeping.  The counts of
+ * reads made, and of those that found nothing, are kept in
+ * ::bgpio_request_t->busy.  Leaving busy-poll mode makes the file
+ * descriptor blocking again only if it was blocking on entry.
+ *
+ * @param req The completed ::bgpio_request_t.
+ *
+ * @param busy_poll Whether bgpio_await_event() is to spin.
+ *
+ * @param max_backoff The maximum number of cpu pause instructions
+ * between reads.  The pause doubles from 1 to this after each read that
+ * finds nothing.  Zero means spin on read() without pausing.
+ *
+ * @result Zero if successful, else an errno value.
+ */
+int
+bgpio_request_busy_poll(bgpio_request_t *req, bool busy_poll,
+			uint32_t max_backoff)
+{
+    assert(req);
+    bool was_nonblocking = req->nonblocking;
+    int err;
+
+    if (busy_poll && !req->busy.enabled) {
+	if ((err = bgpio_request_nonblocking(req, true))) {
+	    return err;
+	}
+	req->busy.was_nonblocking = was_nonblocking;
+    }
+    else if (!busy_poll && req->busy.enabled) {
+	if ((err = bgpio_request_nonblocking(
+		 req, req->busy.was_nonblocking))) {
+	    return err;
+	}
+    }
+    req->busy.enabled = busy_poll;
+    req->busy.max_backoff = max_backoff;
+    return 0;
+}
+
+/**
+ * Read the edge events queued for a request, without waiting, calling
+ * \p fn for each.  Events are read in batches of up to
+ * BGPIO_DISPATCH_BATCH per system call.  As for bgpio_await_event(),
+ * the last event read is left in ::bgpio_request_t->event.
+ *
+ * In the event of an error, errno will be set.
+ *
+ * @param req The completed ::bgpio_request_t.
+ *
+ * @param fn The function to call for each event, or NULL.
+ *
+ * @param ctx A pointer that will be passed to \p fn.
+ *
+ * @param max The maximum number of events to read, or 0 for all that
+ * are queued.
+ *
+ * @result The number of events read, which may be zero, or -1 if an
+ * error occurred before any were read.
+ */
+int
+bgpio_drain_events(bgpio_request_t *req, bgpio_edge_fn fn, void *ctx,
+		   int max)
+{
+    assert(req);
+    struct gpio_v2_line_event events[BGPIO_DISPATCH_BATCH];
+    int total = 0;
+    int want;
+    int count;
+    ssize_t res;
+    int i;
+
+    while ((max <= 0) || (total < max)) {
+	want = BGPIO_DISPATCH_BATCH;
+	if ((max > 0) && (max - total < want)) {
+	    want = max - total;
+	}
+	res = read_queued(req->req.fd, req->nonblocking, events,
+			  want * sizeof(struct gpio_v2_line_event));
+	if (res < 0) {
+	    return total? total: -1;
+	}
+	count = res / sizeof(struct gpio_v2_line_event);
+	if (count) {
+	    req->read_ns = bgpio_now_ns();
+	}
+	for (i = 0; i < count; i++) {
+	    bgpio_note_event(req, &events[i]);
+	    req->event = events[i];
+	    if (fn) {
+		fn(req, &events[i], ctx);
+	    }
+	}
+	total += count;
+	if (count < want) {
+	    /* A short read means there is nothing more queued. */
+	    break;
+	}
+    }
+    return total;
+}
+
+/**
+ * Read the line-info changes queued for a chip's watched lines,
+ * without waiting, calling \p fn for each.
+ *
+ * In the event of an error, errno will be set.
+ *
+ * @param chip The ::bgpio_chip_t, with lines watched using
+ * bgpio_watch_line().
+ *
+ * @param fn The function to call for each change.
+ *
+ * @param ctx A pointer that will be passed to \p fn.
+ *
+ * @param max The maximum number of changes to read, or 0 for all that
+ * are queued.
+ *
+ * @result The number of changes read, which may be zero, or -1 if an
+ * error occurred before any were read.
+ */
+int
+bgpio_drain_watch_events(bgpio_chip_t *chip, bgpio_watch_fn fn, void *ctx,
+			 int max)
+{
+    assert(chip);
+    assert(fn);
+    struct gpio_v2_line_info_changed changes[WATCH_BATCH];
+    int total = 0;
+    int want;
+    int count;
+    ssize_t res;
+    int i;
+
+    while ((max <= 0) || (total < max)) {
+	want = WATCH_BATCH;
+	if ((max > 0) && (max - total < want)) {
+	    want = max - total;
+	}
+	res = read_queued(chip->fd, chip->nonblocking, changes,
+			  want * sizeof(struct gpio_v2_line_info_changed));
+	if (res < 0) {
+	    return total? total: -1;
+	}
+	count = res / sizeof(struct gpio_v2_line_info_changed);
+	for (i = 0; i < count; i++) {
+	    fn(chip, &changes[i], ctx);
+	}
+	total += count;
+	if (count < want) {
+	    break;
+	}
+    }
+    return total;
+}
+
+/**
+ * Create an eventfd through which other threads may wake a thread
+ * waiting in bgpio_await_event() for the request, using
+ * bgpio_wakeup().  The eventfd is closed by bgpio_close_request().
+ *
+ * @param req The ::bgpio_request_t.
+ *
+ * @result Zero if successful, else an errno value.
+ */
+int
+bgpio_enable_wakeup(bgpio_request_t *req)
+{
+    assert(req);
+    int fd;
+
+    if (req->wakeup_fd) {
+	return 0;
+    }
+    if ((fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+	return errno;
+    }
+    req->wakeup_fd = fd;
+    return 0;
+}
+
+/**
+ * Wake a thread waiting in bgpio_await_event() for a request, which
+ * will return EINTR.  If no thread is waiting, the next call to
+ * bgpio_await_event() will return EINTR unless an event is already
+ * queued.  This may be called from any thread, and from signal
+ * handlers.
+ *
+ * @param req The ::bgpio_request_t, for which bgpio_enable_wakeup()
+ * must have been called.
+ *
+ * @result Zero if successful, else an errno value.
+ */
+int
+bgpio_wakeup(bgpio_request_t *req)
+{
+    assert(req);
+    uint64_t one = 1;
+
+    if (!req->wakeup_fd) {
+	return EINVAL;
+    }
+    if ((write(req->wakeup_fd, &one, sizeof(one)) < 0) && (errno != EAGAIN)) {
+	return errno;
+    }
+    return 0;
+}
@@ -0,0 +1,471 @@
+/*
+ *     Copyright (c) 2023 Marc Munro
+ *     Fileset:	libbgpiod - basic/bloodnok gpio device library
+ *     Author:   Marc Munro
+ *     License:  GPL-3.0
+ *
+ */
+
+/**
+ * @file   groups.c
+ * @brief Operations on groups of requests, spanning several chips,
+ * with minimal skew between chips.
+ *
+ * A single logical update of lines on several chips needs one ioctl
+ * per chip.  Issued one after another from a single thread, the last
+ * ioctl follows the first by the sum of their durations plus any
+ * scheduling noise.  Instead, each request in a ::bgpio_group_t has a
+ * worker thread, pinned to its own cpu and optionally SCHED_FIFO, that
+ * sleeps on a futex between operations.  To perform an operation, the
+ * caller wakes the workers and waits, spinning, until all have arrived
+ * at a barrier.  Only then does it release them, so the time taken to
+ * wake them does not contribute to the skew between their ioctls.
+ *
+ * Each ioctl is bracketed by CLOCK_MONOTONIC reads so that callers can
+ * see how simultaneous the operation really was.
+ */
+
+#define _GNU_SOURCE     // for pthread_attr_setaffinity_np()
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "bgpiod.h"
+#include "bgpiod_internal.h"
+
+/**
+ * The number of times a thread spins at the barrier before giving up
+ * the cpu.  Spinning must be bounded as SCHED_FIFO spinners could
+ * otherwise keep the threads they are waiting for from running.
+ */
+#define SPIN_LIMIT 20000
+
+/**
+ * Operations performed by the workers of a ::bgpio_group_t.
+ */
+enum group_op {
+    GROUP_OP_EXIT,              /**< Terminate the worker */
+    GROUP_OP_SET,               /**< Flush the request's output shadow */
+    GROUP_OP_FETCH              /**< Fetch the request's line values */
+};
+
+/**
+ * Wait on a futex private to this process.
+ *
+ * @param addr The futex word.
+ *
+ * @param val The value that \p addr is expected to contain.
+ */
+static void
+futex_wait(uint32_t *addr, uint32_t val)
+{
+    (void) syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+/**
+ * Wake all threads waiting on a futex private to this process.
+ *
+ * @param addr The futex word.
+ */
+static void
+futex_wake_all(uint32_t *addr)
+{
+    (void) syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX,
+		   NULL, NULL, 0);
+}
+
+/**
+ * Perform an operation on a single request of a group, recording its
+ * timing.
+ *
+ * @param group The ::bgpio_group_t.
+ *
+ * @param idx The index of the request in the group.
+ *
+ * @param op The ::group_op to be performed.
+ */
+static void
+perform_op(bgpio_group_t *group, int idx, uint32_t op)
+{
+    bgpio_group_timing_t *timing = &group->timing[idx];
+    bgpio_request_t *req = group->reqs[idx];
+    int res = 0;
+
+    timing->start_ns = bgpio_now_ns();
+    if (op == GROUP_OP_SET) {
+	res = bgpio_flush(req);
+    }
+    else if (op == GROUP_OP_FETCH) {
+	res = bgpio_fetch(req);
+    }
+    timing->end_ns = bgpio_now_ns();
+    timing->err = res? (errno? errno: EIO): 0;
+}
+
+/**
+ * Wait at the barrier until the caller releases the workers for the
+ * operation identified by \p wake.  We spin for the lowest latency,
+ * but only for a while.
+ *
+ * @param group The ::bgpio_group_t.
+ *
+ * @param wake The value of \p group->wake for this operation.
+ */
+static void
+spin_until_released(bgpio_group_t *group, uint32_t wake)
+{
+    uint32_t release;
+    int spins = 0;
+
+    while ((release = __atomic_load_n(&group->release, __ATOMIC_ACQUIRE)) !=
+	   wake) {
+	if (spins < group->spin_limit) {
+	    spins++;
+	    bgpio_cpu_relax();
+	}
+	else {
+	    futex_wait(&group->release, release);
+	}
+    }
+}
+
+/**
+ * Thread body for the workers of a group.  Each operation is awaited
+ * on the group's wake futex and then, after arriving at the barrier,
+ * performed as soon as the caller releases the workers.
+ *
+ * @param arg The ::bgpio_group_worker_t for this thread.
+ *
+ * @result NULL.
+ */
+static void *
+group_worker(void *arg)
+{
+    bgpio_group_worker_t *worker = (bgpio_group_worker_t *) arg;
+    bgpio_group_t *group = worker->group;
+    uint32_t seen = 0;
+    uint32_t wake;
+    uint32_t op;
+
+    while (true) {
+	while ((wake = __atomic_load_n(&group->wake, __ATOMIC_ACQUIRE)) ==
+	       seen) {
+	    futex_wait(&group->wake, seen);
+	}
+	seen = wake;
+	op = group->op;
+	if (op == GROUP_OP_EXIT) {
+	    return NULL;
+	}
+	__atomic_add_fetch(&group->arrived, 1, __ATOMIC_ACQ_REL);
+	spin_until_released(group, seen);
+	perform_op(group, worker->idx, op);
+	if (__atomic_add_fetch(&group->done, 1, __ATOMIC_ACQ_REL) ==
+	    (uint32_t) group->workers) {
+	    futex_wake_all(&group->done);
+	}
+    }
+}
+
+/**
+ * Perform an operation on every request of a group, using the workers
+ * if there are any and \p parallel is true, and record the group's
+ * overall timing.
+ *
+ * @param group The ::bgpio_group_t.
+ *
+ * @param op The ::group_op to be performed.
+ *
+ * @param parallel Whether the operation may be performed by the
+ * workers.  If not, the caller performs it on each request in turn.
+ *
+ * @result Zero if successful, else the first errno value reported for
+ * any request.
+ */
+static int
+run_group(bgpio_group_t *group, uint32_t op, bool parallel)
+{
+    uint32_t wake;
+    uint32_t done;
+    int spins = 0;
+    int i;
+
+    if (group->workers && parallel) {
+	group->op = op;
+	__atomic_store_n(&group->arrived, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&group->done, 0, __ATOMIC_RELAXED);
+	wake = __atomic_add_fetch(&group->wake, 1, __ATOMIC_RELEASE);
+	futex_wake_all(&group->wake);
+	while (__atomic_load_n(&group->arrived, __ATOMIC_ACQUIRE) <
+	       (uint32_t) group->workers) {
+	    if (spins < group->spin_limit) {
+		spins++;
+		bgpio_cpu_relax();
+	    }
+	    else {
+		sched_yield();
+	    }
+	}
+	__atomic_store_n(&group->release, wake, __ATOMIC_RELEASE);
+	futex_wake_all(&group->release);
+	while ((done = __atomic_load_n(&group->done, __ATOMIC_ACQUIRE)) <
+	       (uint32_t) group->workers) {
+	    futex_wait(&group->done, done);
+	}
+    }
+    else {
+	for (i = 0; i < group->count; i++) {
+	    perform_op(group, i, op);
+	}
+    }
+
+    group->start_ns = group->timing[0].start_ns;
+    group->end_ns = group->timing[0].end_ns;
+    for (i = 1; i < group->count; i++) {
+	if (group->timing[i].start_ns < group->start_ns) {
+	    group->start_ns = group->timing[i].start_ns;
+	}
+	if (group->timing[i].end_ns > group->end_ns) {
+	    group->end_ns = group->timing[i].end_ns;
+	}
+    }
+    group->skew_ns = 0;
+    for (i = 0; i < group->count; i++) {
+	if (group->timing[i].start_ns - group->start_ns > group->skew_ns) {
+	    group->skew_ns = group->timing[i].start_ns - group->start_ns;
+	}
+    }
+    for (i = 0; i < group->count; i++) {
+	if (group->timing[i].err) {
+	    return group->timing[i].err;
+	}
+    }
+    return 0;
+}
+
+/**
+ * Start a worker thread, pinned to a cpu and, if \p rt_priority is
+ * non-zero, scheduled SCHED_FIFO.
+ *
+ * @param group The ::bgpio_group_t.
+ *
+ * @param idx The index of the worker's request.
+ *
+ * @param cpu The cpu to which the worker is to be pinned, or -1.
+ *
+ * @param rt_priority The SCHED_FIFO priority, or 0.
+ *
+ * @result Zero if successful, else an errno value.
+ */
+static int
+start_worker(bgpio_group_t *group, int idx, int cpu, int rt_priority)
+{
+    bgpio_group_worker_t *worker = &group->worker[idx];
+    struct sched_param param = {rt_priority};
+    pthread_attr_t attr;
+    cpu_set_t cpus;
+    int err;
+
+    worker->group = group;
+    worker->idx = idx;
+    pthread_attr_init(&attr);
+    if (cpu >= 0) {
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	(void) pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+    if (rt_priority) {
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+	pthread_attr_setschedparam(&attr, &param);
+    }
+    err = pthread_create(&worker->thread, &attr, group_worker, worker);
+    pthread_attr_destroy(&attr);
+    return err;
+}
+
+/**
+ * Stop the group's worker threads.  The group's wake and release
+ * counters are reset so that workers started later, which begin by
+ * waiting for wake to move from zero, do not see the exit operation.
+ *
+ * @param group The ::bgpio_group_t.
+ */
+static void
+stop_workers(bgpio_group_t *group)
+{
+    int i;
+
+    if (group->workers) {
+	group->op = GROUP_OP_EXIT;
+	__atomic_add_fetch(&group->wake, 1, __ATOMIC_RELEASE);
+	futex_wake_all(&group->wake);
+	for (i = 0; i < group->workers; i++) {
+	    pthread_join(group->worker[i].thread, NULL);
+	}
+	group->workers = 0;
+	__atomic_store_n(&group->wake, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&group->release, 0, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Create a group of requests, usually on different chips, so that
+ * operations on them can be performed with minimal skew.  A worker
+ * thread is started for each request, and pinned to its own cpu if
+ * there are enough to go round.  If SCHED_FIFO is requested but not permitted, the
+ * workers are scheduled normally and \p group->realtime is false.  If
+ * there is only one request, or threads cannot be started, operations
+ * are performed by the caller, one request after another.
+ *
+ * In the event of an error, errno will be set.
+ *
+ * @param reqs Array of completed ::bgpio_request_t requests.  These
+ * must not be closed while the group exists.
+ *
+ * @param count The number of requests, at most BGPIO_GROUP_MAX.
+ *
+ * @param rt_priority The SCHED_FIFO priority for the workers, or 0
+ * for normal scheduling.
+ *
+ * @result A dynamically allocated ::bgpio_group_t struct, which must
+ * be freed using bgpio_close_group(), or NULL on failure.
+ */
+bgpio_group_t *
+bgpio_open_group(bgpio_request_t **reqs, int count, int rt_priority)
+{
+    bgpio_group_t *group;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int cpu;
+    int err;
+    int i;
+
+    assert(reqs);
+    if ((count < 1) || (count > BGPIO_GROUP_MAX)) {
+	errno = EINVAL;
+	return NULL;
+    }
+    group = calloc(1, sizeof(bgpio_group_t));
+    if (!group) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    group->count = count;
+    memcpy(group->reqs, reqs, count * sizeof(bgpio_request_t *));
+    if (count == 1) {
+	return group;
+    }
+
+    /* Spinning is pointless if there is only one cpu. */
+    group->spin_limit = (cpus > 1)? SPIN_LIMIT: 0;
+    group->realtime = rt_priority != 0;
+    for (i = 0; i < count; i++) {
+	/* Pin workers only if each can have a cpu of its own, leaving
+	 * cpu 0 to the caller. */
+	cpu = (cpus > count)? i + 1: -1;
+	err = start_worker(group, i, cpu, group->realtime? rt_priority: 0);
+	if (err == EPERM && group->realtime) {
+	    /* We may not use SCHED_FIFO; start again without it. */
+	    stop_workers(group);
+	    group->realtime = false;
+	    i = -1;
+	    continue;
+	}
+	if (err) {
+	    /* Fall back to performing operations ourselves. */
+	    stop_workers(group);
+	    group->realtime = false;
+	    break;
+	}
+	group->workers++;
+    }
+    return group;
+}
+
+/**
+ * Free a group created by bgpio_open_group(), stopping its workers.
+ * The requests are not affected.
+ *
+ * @param group The ::bgpio_group_t to be freed.
+ */
+void
+bgpio_close_group(bgpio_group_t *group)
+{
+    assert(group);
+    stop_workers(group);
+    free(group);
+}
+
+/**
+ * Set the output values of every request in a group, as prepared for
+ * each request by bgpio_set_line(), with all of the set ioctls issued
+ * together.  Any values deferred by bgpio_set_output_mode() are sent
+ * too, and unchanged values are elided if the request asks for that.
+ * The timing of each request's ioctl is recorded in \p group->timing,
+ * and the spread of their start times in \p group->skew_ns.
+ *
+ * @param group The ::bgpio_group_t.
+ *
+ * @result Zero if successful, else an errno value reported for one of
+ * the requests.
+ */
+int
+bgpio_group_set(bgpio_group_t *group)
+{
+    assert(group);
+    bgpio_output_shadow_t *shadow;
+    bgpio_request_t *req;
+    uint64_t mask;
+    int i;
+
+    /* Do all of the preparation before the barrier, so that the workers
+     * have nothing left to do but their ioctls. */
+    for (i = 0; i < group->count; i++) {
+	req = group->reqs[i];
+	shadow = &req->shadow;
+	mask = req->line_values.mask;
+	shadow->pending_bits = (shadow->pending_bits & ~mask) |
+	    (req->line_values.bits & mask);
+	shadow->pending_mask |= mask;
+    }
+    return run_group(group, GROUP_OP_SET, true);
+}
+
+/**
+ * Fetch the values of the lines of every request in a group, as
+ * bgpio_fetch() does for a single request, so that together they form
+ * a single sample.  Each request's ioctl is bracketed by
+ * CLOCK_MONOTONIC reads, recorded in \p group->timing, so every value
+ * is known to have been read between that request's start_ns and
+ * end_ns.  The whole sample was taken between \p group->start_ns and
+ * \p group->end_ns.
+ *
+ * Fetching in parallel, using the group's workers, gives the narrowest
+ * window when there are enough cpus.  Fetching back-to-back, from the
+ * calling thread, avoids waking the workers and may be the better
+ * choice on a single cpu, or for requests whose values are answered
+ * from a mirror without an ioctl.
+ *
+ * @param group The ::bgpio_group_t.
+ *
+ * @param parallel Whether to fetch from all requests at once, using
+ * the group's workers, rather than one after another.
+ *
+ * @result Zero if successful, else an errno value reported for one of
+ * the requests.
+ */
+int
+bgpio_group_fetch(bgpio_group_t *group, bool parallel)
+{
+    assert(group);
+    return run_group(group, GROUP_OP_FETCH, parallel);
+}
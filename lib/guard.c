@@ -0,0 +1,471 @@
+/*
+ *     Copyright (c) 2023 Marc Munro
+ *     Fileset:	libbgpiod - basic/bloodnok gpio device library
+ *     Author:   Marc Munro
+ *     License:  GPL-3.0
+ *
+ */
+
+/**
+ * @file   guard.c
+ * @brief Protection against edge storms from chattering lines.
+ *
+ * A faulty input that chatters at a high rate delivers every edge to
+ * userspace, which can consume a whole cpu and starve the handling of
+ * other lines.  Once a rate guard has been enabled for a request by
+ * bgpio_enable_rate_guard(), each event is counted, through
+ * bgpio_note_event(), against its line.  A line whose events exceed
+ * the maximum rate is throttled: its edge-detection flags are removed
+ * with bgpio_reconfigure(), so that the kernel stops generating
+ * events for it.  As its events no longer keep any input mirror (see
+ * bgpio_enable_mirror()) up to date, the line is also removed from the
+ * mirror until it is restored.
+ *
+ * While a line is throttled its value is sampled periodically, and
+ * changes counted, by bgpio_guard_check(), which the caller must call
+ * regularly.  Once a cool-down period has passed in which the sampled
+ * rate of change is within the maximum, the line's edge detection is
+ * restored.  Note that sampling cannot see more than one change per
+ * sample, so for maximum rates above the sampling rate a throttled line
+ * is restored after each cool-down, and throttled again if it is still
+ * chattering.
+ *
+ * Each throttling and restoration is reported through a callback, or
+ * to stderr.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "bgpiod.h"
+#include "bgpiod_internal.h"
+
+/**
+ * The period, in nanoseconds, over which event rates are measured.
+ */
+#define GUARD_WINDOW_NS 100000000
+
+/**
+ * The period, in milliseconds, at which throttled lines are sampled.
+ */
+#define GUARD_SAMPLE_MSECS 10
+
+/**
+ * Mask of all edge-detection flags.
+ */
+#define GUARD_EDGE_FLAGS \
+    (GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING)
+
+/**
+ * Move a line of a request to the flags attribute for \p flags,
+ * reclaiming any flags attribute that it leaves empty.  Unlike
+ * bgpio_configure_line(), this leaves the line's other attributes,
+ * such as its debounce period, alone.
+ *
+ * @param config The request's line configuration.
+ *
+ * @param idx The index of the line in the request.
+ *
+ * @param flags The line's new flags.
+ *
+ * @result Zero if successful, or ENOSPC if there is no attribute slot
+ * available for the flags.
+ */
+static int
+move_flags(struct gpio_v2_line_config *config, int idx, uint64_t flags)
+{
+    struct gpio_v2_line_config_attribute *attr;
+    int slot = -1;
+    int i;
+
+    for (i = 0; i < config->num_attrs; i++) {
+	attr = &config->attrs[i];
+	if ((attr->attr.id == GPIO_V2_LINE_ATTR_ID_FLAGS) &&
+	    (attr->attr.flags == flags)) {
+	    slot = i;
+	}
+    }
+    if ((slot < 0) && (flags != config->flags)) {
+	if (config->num_attrs >= GPIO_V2_LINE_NUM_ATTRS_MAX) {
+	    return ENOSPC;
+	}
+	slot = config->num_attrs++;
+	config->attrs[slot].attr.id = GPIO_V2_LINE_ATTR_ID_FLAGS;
+	config->attrs[slot].attr.flags = flags;
+	config->attrs[slot].mask = 0;
+    }
+    for (i = config->num_attrs - 1; i >= 0; i--) {
+	attr = &config->attrs[i];
+	if ((attr->attr.id != GPIO_V2_LINE_ATTR_ID_FLAGS) || (i == slot)) {
+	    continue;
+	}
+	BGPIO_CLEARBIT(attr->mask, idx);
+	if (!attr->mask) {
+	    memmove(attr, attr + 1,
+		    (config->num_attrs - i - 1) * sizeof(*attr));
+	    config->num_attrs--;
+	    if (slot > i) {
+		slot--;
+	    }
+	}
+    }
+    if (slot >= 0) {
+	BGPIO_SETBIT(config->attrs[slot].mask, idx);
+    }
+    return 0;
+}
+
+/**
+ * Change the flags of a line of a request, and apply the change.  If
+ * the change cannot be applied, the request's configuration is left as
+ * it was.
+ *
+ * @param req The ::bgpio_request_t.
+ *
+ * @param idx The index of the line in the request.
+ *
+ * @param flags The line's new flags.
+ *
+ * @result Zero if successful, else an errno value.
+ */
+static int
+set_flags(bgpio_request_t *req, int idx, uint64_t flags)
+{
+    struct gpio_v2_line_config saved = req->req.config;
+    int err;
+
+    if ((err = move_flags(&req->req.config, idx, flags))) {
+	return err;
+    }
+    if (bgpio_reconfigure(req)) {
+	err = errno;
+	req->req.config = saved;
+	return err;
+    }
+    return 0;
+}
+
+/**
+ * Report a change to the state of a line.
+ *
+ * @param req The ::bgpio_request_t.
+ *
+ * @param idx The index of the line in the request.
+ *
+ * @param throttled Whether the line has been throttled, rather than
+ * restored.
+ *
+ * @param count For throttling, the number of events counted in the
+ * last measurement period; for restoration, the number of changes
+ * sampled while the line was throttled.
+ *
+ * @param err Zero, or the errno value with which the change failed.
+ */
+static void
+report(bgpio_request_t *req, int idx, bool throttled, uint64_t count,
+       int err)
+{
+    bgpio_rate_guard_t *guard = req->guard;
+    int line = req->req.offsets[idx];
+
+    if (guard->fn) {
+	guard->fn(req, line, throttled, count, err, guard->ctx);
+    }
+    else if (err) {
+	fprintf(stderr, "bgpio: unable to %s line %d of %s: %s\n",
+		throttled? "throttle": "restore", line, req->chardev_path,
+		strerror(err));
+    }
+    else if (throttled) {
+	fprintf(stderr, "bgpio: line %d of %s throttled after %" PRIu64
+		" events in %d ms\n", line, req->chardev_path, count,
+		GUARD_WINDOW_NS / 1000000);
+    }
+    else {
+	fprintf(stderr, "bgpio: line %d of %s restored (%" PRIu64
+		" changes sampled while throttled)\n",
+		line, req->chardev_path, count);
+    }
+}
+
+/**
+ * Sample the values of a request's throttled lines, counting changes.
+ *
+ * @param req The ::bgpio_request_t.
+ *
+ * @param mask The lines to be sampled, by index.
+ *
+ * @param count Whether changes are to be counted, rather than the
+ * values simply being recorded.
+ */
+static void
+sample(bgpio_request_t *req, uint64_t mask, bool count)
+{
+    bgpio_rate_guard_t *guard = req->guard;
+    struct gpio_v2_line_values values = {0, mask};
+    uint64_t changed;
+    int idx;
+
+    if (ioctl(req->req.fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values)) {
+	return;
+    }
+    if (count) {
+	changed = (values.bits ^ guard->sampled_bits) & mask;
+	for (idx = 0; changed; idx++) {
+	    if (BGPIO_BITVALUE(changed, idx)) {
+		guard->lines[idx].sampled++;
+		BGPIO_CLEARBIT(changed, idx);
+	    }
+	}
+    }
+    guard->sampled_bits = (guard->sampled_bits & ~mask) | (values.bits & mask);
+}
+
+/**
+ * Throttle a line, removing its edge-detection flags.
+ *
+ * @param req The ::bgpio_request_t.
+ *
+ * @param idx The index of the line in the request.
+ *
+ * @param now The current CLOCK_MONOTONIC time in nanoseconds.
+ */
+static void
+throttle(bgpio_request_t *req, int idx, uint64_t now)
+{
+    bgpio_rate_guard_t *guard = req->guard;
+    bgpio_guard_line_t *gline = &guard->lines[idx];
+    uint64_t flags = bgpio_line_flags_by_idx(req, idx);
+    int err;
+
+    err = set_flags(req, idx, flags & ~GUARD_EDGE_FLAGS);
+    report(req, idx, true, gline->count, err);
+    if (err) {
+	/* Try again after another measurement period. */
+	gline->window_start_ns = now;
+	gline->count = 0;
+	return;
+    }
+    gline->edge_flags = flags & GUARD_EDGE_FLAGS;
+    gline->since_ns = now;
+    gline->sampled = 0;
+    gline->throttles++;
+    BGPIO_SETBIT(guard->throttled, idx);
+    if (req->mirror.enabled && BGPIO_BITVALUE(req->mirror.valid, idx)) {
+	/* Fetches of the line must go to the kernel until restored. */
+	BGPIO_CLEARBIT(req->mirror.valid, idx);
+	BGPIO_SETBIT(guard->unmirrored, idx);
+    }
+    sample(req, BGPIO_BITMASK(idx), false);
+    if (!guard->next_sample_ns) {
+	guard->next_sample_ns = now + (GUARD_SAMPLE_MSECS * 1000000);
+    }
+}
+
+/**
+ * Restore a throttled line's edge-detection flags.
+ *
+ * @param req The ::bgpio_request_t.
+ *
+ * @param idx The index of the line in the request.
+ *
+ * @param now The current CLOCK_MONOTONIC time in nanoseconds.
+ *
+ * @result Zero if successful, else an errno value, in which case the
+ * line remains throttled.
+ */
+static int
+restore(bgpio_request_t *req, int idx, uint64_t now)
+{
+    bgpio_rate_guard_t *guard = req->guard;
+    bgpio_guard_line_t *gline = &guard->lines[idx];
+    int err;
+
+    err = set_flags(req, idx, bgpio_line_flags_by_idx(req, idx) | gline->edge_flags);
+    report(req, idx, false, gline->sampled, err);
+    if (err) {
+	/* Stay throttled, and try again after another cool-down. */
+	gline->since_ns = now;
+	return err;
+    }
+    BGPIO_CLEARBIT(guard->throttled, idx);
+    gline->window_start_ns = now;
+    gline->count = 0;
+    if (BGPIO_BITVALUE(guard->unmirrored, idx)) {
+	BGPIO_CLEARBIT(guard->unmirrored, idx);
+	BGPIO_SETBIT(req->mirror.valid, idx);
+	/* The mirror's value for the line is stale.  If this fails, the
+	 * next resync will correct it. */
+	(void) bgpio_mirror_sync(req);
+    }
+    return 0;
+}
+
+/**
+ * Guard a request's lines against edge storms.  Events are counted
+ * for each line as they pass through bgpio_note_event(), which is
+ * called by all of the library's functions that read events, and a
+ * line whose events exceed \p max_rate is throttled, as described
+ * above.  bgpio_guard_check() must then be called regularly, at least
+ * as often as it asks, to sample and restore throttled lines.
+ *
+ * Note that events read by bgpio_sigio_drain() are not counted.
+ *
+ * @param req The completed ::bgpio_request_t.
+ *
+ * @param max_rate The maximum number of events per second allowed for
+ * any line, or 0 to remove the guard, restoring any throttled lines.
+ * If any line cannot be restored, the guard remains in place, with
+ * that line throttled, and the error is returned.
+ *
+ * @param cooldown_msecs How long, in milliseconds, a line remains
+ * throttled, at the least.
+ *
+ * @param fn A function to be called whenever a line is throttled or
+ * restored, or NULL to report these events on stderr.
+ *
+ * @param ctx A pointer that will be passed to \p fn.
+ *
+ * @result Zero if successful, else an errno value.
+ */
+int
+bgpio_enable_rate_guard(bgpio_request_t *req, uint32_t max_rate,
+			uint32_t cooldown_msecs, bgpio_guard_fn fn,
+			void *ctx)
+{
+    assert(req);
+    bgpio_rate_guard_t *guard = req->guard;
+    uint64_t now = bgpio_now_ns();
+    int result = 0;
+    int err;
+    int idx;
+
+    if (!max_rate) {
+	if (guard) {
+	    for (idx = 0; idx < req->req.num_lines; idx++) {
+		if (BGPIO_BITVALUE(guard->throttled, idx)) {
+		    if ((err = restore(req, idx, now)) && !result) {
+			result = err;
+		    }
+		}
+	    }
+	    if (result) {
+		return result;
+	    }
+	    free(guard);
+	    req->guard = NULL;
+	}
+	return 0;
+    }
+    if (!guard) {
+	if (!(guard = calloc(1, sizeof(bgpio_rate_guard_t)))) {
+	    return ENOMEM;
+	}
+	req->guard = guard;
+	for (idx = 0; idx < GPIO_V2_LINES_MAX; idx++) {
+	    guard->lines[idx].window_start_ns = now;
+	}
+    }
+    guard->max_rate = max_rate;
+    guard->threshold = (((uint64_t) max_rate * GUARD_WINDOW_NS) +
+			999999999) / 1000000000;
+    guard->cooldown_ns = (uint64_t) cooldown_msecs * 1000000;
+    guard->fn = fn;
+    guard->ctx = ctx;
+    return 0;
+}
+
+/**
+ * Count an event against its line, throttling the line if it has
+ * exceeded the maximum rate.  This is called by bgpio_note_event()
+ * for requests with a rate guard.  Events are counted by the time at
+ * which they are handled, rather than by their timestamps, as these
+ * may come from a clock other than CLOCK_MONOTONIC.
+ *
+ * @param req The ::bgpio_request_t, with a rate guard.
+ *
+ * @param event The edge event.
+ */
+void
+bgpio_guard_event(bgpio_request_t *req, struct gpio_v2_line_event *event)
+{
+    bgpio_rate_guard_t *guard = req->guard;
+    bgpio_guard_line_t *gline;
+    int idx = bgpio_idx_for_line(req, event->offset);
+    uint64_t now;
+
+    if ((idx < 0) || BGPIO_BITVALUE(guard->throttled, idx)) {
+	/* Events queued before throttling are not counted. */
+	return;
+    }
+    gline = &guard->lines[idx];
+    now = bgpio_now_ns();
+    if (now - gline->window_start_ns >= GUARD_WINDOW_NS) {
+	gline->window_start_ns = now;
+	gline->count = 0;
+    }
+    if (++gline->count > guard->threshold) {
+	throttle(req, idx, now);
+    }
+}
+
+/**
+ * Sample a request's throttled lines if a sample is due, and restore
+ * those whose cool-down has passed with a sampled rate of change within
+ * the maximum.
+ *
+ * @param req The ::bgpio_request_t.
+ *
+ * @result The time, in milliseconds, before this should be called
+ * again, or -1 if no lines are throttled, in which case it need not be
+ * called until one is.
+ */
+int
+bgpio_guard_check(bgpio_request_t *req)
+{
+    assert(req);
+    bgpio_rate_guard_t *guard = req->guard;
+    bgpio_guard_line_t *gline;
+    uint64_t now;
+    uint64_t limit;
+    int idx;
+
+    if (!guard || !guard->throttled) {
+	return -1;
+    }
+    now = bgpio_now_ns();
+    if (now < guard->next_sample_ns) {
+	return (int) ((guard->next_sample_ns - now + 999999) / 1000000);
+    }
+    sample(req, guard->throttled, true);
+    for (idx = 0; idx < req->req.num_lines; idx++) {
+	if (!BGPIO_BITVALUE(guard->throttled, idx)) {
+	    continue;
+	}
+	gline = &guard->lines[idx];
+	if (now - gline->since_ns < guard->cooldown_ns) {
+	    continue;
+	}
+	limit = ((uint64_t) guard->max_rate * (now - gline->since_ns)) /
+	    1000000000;
+	if (gline->sampled <= limit) {
+	    (void) restore(req, idx, now);
+	}
+	else {
+	    /* Still chattering; start another cool-down. */
+	    gline->since_ns = now;
+	    gline->sampled = 0;
+	}
+    }
+    if (!guard->throttled) {
+	guard->next_sample_ns = 0;
+	return -1;
+    }
+    guard->next_sample_ns = now + (GUARD_SAMPLE_MSECS * 1000000);
+    return GUARD_SAMPLE_MSECS;
+}
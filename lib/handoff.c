@@ -0,0 +1,200 @@
+/*
+ *     Copyright (c) 2023 Marc Munro
+ *     Fileset:	libbgpiod - basic/bloodnok gpio device library
+ *     Author:   Marc Munro
+ *     License:  GPL-3.0
+ *
+ */
+
+/**
+ * @file   handoff.c
+ * @brief Passing completed line requests between processes.
+ *
+ * A completed ::bgpio_request_t is little more than a file descriptor
+ * for the line request, along with the metadata describing its lines.
+ * The functions here send that file descriptor, using SCM_RIGHTS, and
+ * the metadata over a unix socket, allowing the receiving process to
+ * rebuild a fully functional request without re-requesting its lines.
+ *
+ * This allows a broker process to own gpio lines and decide who may
+ * use them, while its clients perform their ioctls directly on the
+ * line request.  Since the broker retains its own copy of the file
+ * descriptor, the lines, and the values of any outputs, survive the
+ * restart of a client.
+ */
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/socket.h>
+
+#include "bgpiod.h"
+
+/**
+ * Magic number identifying a handoff message.
+ */
+#define HANDOFF_MAGIC 0x62677068
+
+/**
+ * The data part of a handoff message.  The line request's file
+ * descriptor travels separately, as ancillary data.
+ */
+typedef struct handoff_msg {
+    uint32_t magic;                     /**< HANDOFF_MAGIC */
+    uint32_t path_len;                  /**< Length of chardev_path */
+    struct gpio_v2_line_request req;    /**< Lines and configuration */
+    struct gpio_v2_line_values line_values;  /**< Last values */
+    char chardev_path[256];             /**< The chip device path */
+} handoff_msg;
+
+/**
+ * Send a completed request to another process over a connected unix
+ * socket.  The receiving process should call bgpio_receive_request().
+ *
+ * The request remains usable by the sender, and the lines remain
+ * reserved until both the sender and the receiver have closed their
+ * requests.  Note that edge events are delivered to whichever process
+ * reads them first, so only one process should await events on a
+ * shared request.
+ *
+ * @param sock A connected unix domain socket.
+ *
+ * @param req The completed ::bgpio_request_t to be sent.
+ *
+ * @result Zero if successful, else an errno value.
+ */
+int
+bgpio_send_request(int sock, bgpio_request_t *req)
+{
+    assert(req);
+    handoff_msg msg;
+    struct iovec iov = {&msg, sizeof(msg)};
+    union {
+	char buf[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr align;
+    } control;
+    struct msghdr hdr;
+    struct cmsghdr *cmsg;
+    ssize_t res;
+
+    if (req->req.fd <= 0) {
+	/* The request has not been completed. */
+	return EINVAL;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.magic = HANDOFF_MAGIC;
+    msg.req = req->req;
+    msg.line_values = req->line_values;
+    if (req->chardev_path) {
+	msg.path_len = strlen(req->chardev_path);
+	if (msg.path_len >= sizeof(msg.chardev_path)) {
+	    return ENAMETOOLONG;
+	}
+	strcpy(msg.chardev_path, req->chardev_path);
+    }
+
+    memset(&control, 0, sizeof(control));
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control.buf;
+    hdr.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &req->req.fd, sizeof(int));
+
+    do {
+	res = sendmsg(sock, &hdr, MSG_NOSIGNAL);
+    } while ((res < 0) && (errno == EINTR));
+
+    if (res < 0) {
+	return errno;
+    }
+    return (res == sizeof(msg))? 0: EPROTO;
+}
+
+/**
+ * Receive a request sent by bgpio_send_request(), rebuilding it as a
+ * completed ::bgpio_request_t.  No lines are requested from the
+ * kernel: the request shares the sender's line request.
+ *
+ * In the event of an error, errno will be set.
+ *
+ * @param sock A connected unix domain socket.
+ *
+ * @result A dynamically allocated ::bgpio_request_t, which must be
+ * closed and freed using bgpio_close_request(), or NULL on failure.
+ * If the sender closed the connection, errno will be ECONNRESET.
+ */
+bgpio_request_t *
+bgpio_receive_request(int sock)
+{
+    handoff_msg msg;
+    struct iovec iov = {&msg, sizeof(msg)};
+    union {
+	char buf[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr align;
+    } control;
+    struct msghdr hdr;
+    struct cmsghdr *cmsg;
+    bgpio_request_t *req;
+    ssize_t res;
+    int fd = -1;
+    int err;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control.buf;
+    hdr.msg_controllen = sizeof(control.buf);
+
+    do {
+	res = recvmsg(sock, &hdr, MSG_CMSG_CLOEXEC);
+    } while ((res < 0) && (errno == EINTR));
+
+    if (res < 0) {
+	return NULL;
+    }
+    for (cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+	if ((cmsg->cmsg_level == SOL_SOCKET) &&
+	    (cmsg->cmsg_type == SCM_RIGHTS)) {
+	    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+    }
+    if (res == 0) {
+	err = ECONNRESET;
+	goto fail;
+    }
+    if ((res != sizeof(msg)) || (msg.magic != HANDOFF_MAGIC) ||
+	(hdr.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || (fd < 0) ||
+	(msg.path_len >= sizeof(msg.chardev_path))) {
+	err = EPROTO;
+	goto fail;
+    }
+
+    req = calloc(1, sizeof(bgpio_request_t));
+    if (!req || !(req->chardev_path = malloc(msg.path_len + 1))) {
+	free(req);
+	err = ENOMEM;
+	goto fail;
+    }
+    req->req = msg.req;
+    req->req.fd = fd;
+    req->line_values = msg.line_values;
+    memcpy(req->chardev_path, msg.chardev_path, msg.path_len);
+    req->chardev_path[msg.path_len] = '\0';
+    return req;
+
+fail:
+    if (fd >= 0) {
+	close(fd);
+    }
+    errno = err;
+    return NULL;
+}
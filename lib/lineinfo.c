@@ -0,0 +1,210 @@
+/*
+ *     Copyright (c) 2023 Marc Munro
+ *     Fileset:	libbgpiod - basic/bloodnok gpio device library
+ *     Author:   Marc Munro
+ *     License:  GPL-3.0
+ *
+ */
+
+/**
+ * @file   lineinfo.c
+ * @brief A per-chip cache of gpio line information.
+ *
+ * Line information changes only when a line is requested, released
+ * or reconfigured.  Rather than asking the kernel for it on every
+ * query, we fetch each line's information once, using
+ * GPIO_V2_GET_LINEINFO_WATCH_IOCTL, which also asks the kernel to
+ * tell us of any subsequent changes.  Those change notifications
+ * carry the line's new information, so we simply apply them to the
+ * cache when they are read by bgpio_refresh_lineinfo_cache().
+ *
+ * The kernel queues at most LINEINFO_FIFO_SIZE change events for each
+ * file descriptor, and silently drops any more.  If a refresh finds
+ * that many queued, some may have been lost, so every cache entry is
+ * invalidated, and re-read on its next use.
+ */
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "bgpiod.h"
+
+/**
+ * The number of change events read by a single read() call in
+ * bgpio_refresh_lineinfo_cache().
+ */
+#define CHANGE_BATCH 16
+
+/**
+ * The number of line-info change events that the kernel will queue
+ * for a file descriptor before it starts dropping them.
+ */
+#define LINEINFO_FIFO_SIZE 32
+
+/**
+ * Create a line-info cache for a chip.  Once this has been done,
+ * bgpio_cached_lineinfo() may be used to obtain line information
+ * without system calls, and bgpio_get_lineinfo() will use the cache.
+ * The cache is freed by bgpio_close_chip().
+ *
+ * @param chip The ::bgpio_chip_t returned by bgpio_open_chip().
+ *
+ * @result Zero if successful, else -1 with errno set.
+ */
+int
+bgpio_enable_lineinfo_cache(bgpio_chip_t *chip)
+{
+    assert(chip);
+    bgpio_lineinfo_cache_t *cache;
+    int err;
+
+    if (chip->cache) {
+	return 0;
+    }
+    cache = calloc(1, sizeof(bgpio_lineinfo_cache_t));
+    if (!cache) {
+	errno = ENOMEM;
+	return -1;
+    }
+    cache->num_lines = chip->info.lines;
+    cache->cached = calloc(cache->num_lines? cache->num_lines: 1,
+			   sizeof(uint8_t));
+    cache->watched = calloc(cache->num_lines? cache->num_lines: 1,
+			    sizeof(uint8_t));
+    cache->infos = calloc(cache->num_lines? cache->num_lines: 1,
+			  sizeof(struct gpio_v2_line_info));
+    if (!cache->cached || !cache->watched || !cache->infos) {
+	err = ENOMEM;
+	goto fail;
+    }
+    cache->watch_fd = open(chip->path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (cache->watch_fd < 0) {
+	err = errno;
+	goto fail;
+    }
+    chip->cache = cache;
+    return 0;
+
+fail:
+    free(cache->cached);
+    free(cache->watched);
+    free(cache->infos);
+    free(cache);
+    errno = err;
+    return -1;
+}
+
+/**
+ * Apply any pending line-info change events to a chip's cache.  This
+ * never blocks.  It should be called before a set of queries if
+ * changes made by other processes are to be seen, or whenever
+ * `chip->cache->watch_fd` becomes readable.  If so many changes are
+ * found that the kernel may have dropped some, the whole cache is
+ * invalidated.
+ *
+ * @param chip The ::bgpio_chip_t whose cache is to be refreshed.
+ *
+ * @result The number of changes applied, or -1 with errno set.
+ */
+int
+bgpio_refresh_lineinfo_cache(bgpio_chip_t *chip)
+{
+    assert(chip);
+    assert(chip->cache);
+    bgpio_lineinfo_cache_t *cache = chip->cache;
+    struct gpio_v2_line_info_changed changes[CHANGE_BATCH];
+    uint32_t line;
+    ssize_t res;
+    int total = 0;
+    int count;
+    int i;
+
+    while (true) {
+	res = read(cache->watch_fd, changes, sizeof(changes));
+	if (res < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    if (errno == EAGAIN) {
+		break;
+	    }
+	    return -1;
+	}
+	count = res / sizeof(struct gpio_v2_line_info_changed);
+	for (i = 0; i < count; i++) {
+	    line = changes[i].info.offset;
+	    if (line < cache->num_lines) {
+		cache->infos[line] = changes[i].info;
+		cache->cached[line] = true;
+	    }
+	}
+	cache->updates += count;
+	total += count;
+	if (res < (ssize_t) sizeof(changes)) {
+	    break;
+	}
+    }
+    if (total >= LINEINFO_FIFO_SIZE) {
+	/* The kernel's queue may have overflowed. */
+	memset(cache->cached, 0, cache->num_lines * sizeof(uint8_t));
+	cache->overflows++;
+    }
+    return total;
+}
+
+/**
+ * Return the cached information for a gpio line.  If the line is not
+ * yet cached, its information is fetched, and changes to it watched
+ * for.  Subsequent calls for the same line are answered from memory.
+ *
+ * Changes made since the last call to bgpio_refresh_lineinfo_cache()
+ * will not be reflected in the result.
+ *
+ * In the event of an error, errno will be set.
+ *
+ * @param chip The ::bgpio_chip_t, with a cache created by
+ * bgpio_enable_lineinfo_cache().
+ *
+ * @param line The gpio line number.
+ *
+ * @result Pointer to the cached ::gpio_v2_line_info struct, which
+ * must not be freed or modified by the caller, or NULL on failure.
+ */
+struct gpio_v2_line_info *
+bgpio_cached_lineinfo(bgpio_chip_t *chip, int line)
+{
+    assert(chip);
+    assert(chip->cache);
+    bgpio_lineinfo_cache_t *cache = chip->cache;
+    struct gpio_v2_line_info *info;
+
+    if ((line < 0) || (line >= cache->num_lines)) {
+	errno = EINVAL;
+	return NULL;
+    }
+    info = &cache->infos[line];
+    if (cache->cached[line]) {
+	cache->hits++;
+	return info;
+    }
+    memset(info, 0, sizeof(struct gpio_v2_line_info));
+    info->offset = line;
+    /* A line may only be watched once, so lines whose entries have
+     * been invalidated are simply re-read. */
+    if (ioctl(cache->watch_fd,
+	      cache->watched[line]? GPIO_V2_GET_LINEINFO_IOCTL:
+	      GPIO_V2_GET_LINEINFO_WATCH_IOCTL, info)) {
+	return NULL;
+    }
+    cache->misses++;
+    cache->watched[line] = true;
+    cache->cached[line] = true;
+    return info;
+}
@@ -0,0 +1,393 @@
+/*
+ *     Copyright (c) 2023 Marc Munro
+ *     Fileset:	libbgpiod - basic/bloodnok gpio device library
+ *     Author:   Marc Munro
+ *     License:  GPL-3.0
+ *
+ */
+
+/**
+ * @file   merge.c
+ * @brief Merging of the edge events of several requests into a single
+ * stream, ordered by timestamp.
+ *
+ * The kernel delivers the events of each request in timestamp order,
+ * but events from different requests, and particularly from different
+ * chips, are read from different file descriptors and may be read in
+ * any order.  A ::bgpio_merger_t reads from all of its requests, holds
+ * what it has read in a fifo for each, and emits the oldest event
+ * held, found from a min-heap of the fifos, once it is sure, or has
+ * waited long enough to be reasonably sure, that nothing older is
+ * still to come.
+ *
+ * Ordering is by the events' timestamp_ns fields, which are compared
+ * with CLOCK_MONOTONIC to determine their age.  Requests using
+ * GPIO_V2_LINE_FLAG_EVENT_CLOCK_REALTIME, or a hardware timestamp
+ * engine, should not be merged with requests using the default clock.
+ */
+
+#define _GNU_SOURCE     // for ppoll()
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "bgpiod.h"
+
+/**
+ * The timestamp of the oldest event held for a source.  The source
+ * must have events held.
+ *
+ * @param merger The ::bgpio_merger_t.
+ *
+ * @param src The index of the source.
+ *
+ * @result The timestamp in nanoseconds.
+ */
+static uint64_t
+head_ns(bgpio_merger_t *merger, int src)
+{
+    bgpio_merge_source_t *source = &merger->sources[src];
+
+    return source->events[source->head].timestamp_ns;
+}
+
+/**
+ * Heap ordering predicate.  Sources are ordered by the timestamps of
+ * their oldest events and then, so that ties are resolved the same way
+ * every time, by index.
+ *
+ * @param merger The ::bgpio_merger_t.
+ *
+ * @param a The index of a source.
+ *
+ * @param b The index of another source.
+ *
+ * @result true if \p a should be emitted from before \p b.
+ */
+static bool
+precedes(bgpio_merger_t *merger, int a, int b)
+{
+    uint64_t a_ns = head_ns(merger, a);
+    uint64_t b_ns = head_ns(merger, b);
+
+    return (a_ns < b_ns) || ((a_ns == b_ns) && (a < b));
+}
+
+/**
+ * Restore the heap property by moving the source at \p pos towards the
+ * root.
+ *
+ * @param merger The ::bgpio_merger_t.
+ *
+ * @param pos The position in the heap of a source whose key may be
+ * less than its parent's.
+ */
+static void
+sift_up(bgpio_merger_t *merger, int pos)
+{
+    int *heap = merger->heap;
+    int src = heap[pos];
+    int parent;
+
+    while (pos > 0) {
+	parent = (pos - 1) / 2;
+	if (!precedes(merger, src, heap[parent])) {
+	    break;
+	}
+	heap[pos] = heap[parent];
+	pos = parent;
+    }
+    heap[pos] = src;
+}
+
+/**
+ * Restore the heap property by moving the source at \p pos away from
+ * the root.
+ *
+ * @param merger The ::bgpio_merger_t.
+ *
+ * @param pos The position in the heap of a source whose key may be
+ * greater than its children's.
+ */
+static void
+sift_down(bgpio_merger_t *merger, int pos)
+{
+    int *heap = merger->heap;
+    int src = heap[pos];
+    int child;
+
+    while ((child = (2 * pos) + 1) < merger->heap_size) {
+	if ((child + 1 < merger->heap_size) &&
+	    precedes(merger, heap[child + 1], heap[child])) {
+	    child++;
+	}
+	if (!precedes(merger, heap[child], src)) {
+	    break;
+	}
+	heap[pos] = heap[child];
+	pos = child;
+    }
+    heap[pos] = src;
+}
+
+/**
+ * Read the pending events of a source whose file descriptor is known
+ * to be readable, adding them to its fifo.  If the fifo was empty,
+ * the source is added to the heap.
+ *
+ * @param merger The ::bgpio_merger_t.
+ *
+ * @param src The index of the source.
+ *
+ * @result Zero if successful, else an errno value.
+ */
+static int
+read_source(bgpio_merger_t *merger, int src)
+{
+    bgpio_merge_source_t *source = &merger->sources[src];
+    struct gpio_v2_line_event events[BGPIO_DISPATCH_BATCH];
+    uint32_t space = BGPIO_MERGE_QUEUE - source->held;
+    bool was_empty = source->held == 0;
+    size_t batch;
+    ssize_t res;
+    int count;
+    int i;
+
+    batch = ((space < BGPIO_DISPATCH_BATCH)? space: BGPIO_DISPATCH_BATCH) *
+	sizeof(struct gpio_v2_line_event);
+    do {
+	res = read(source->req->req.fd, events, batch);
+    } while ((res < 0) && (errno == EINTR));
+
+    if (res < 0) {
+	return errno;
+    }
+    count = res / sizeof(struct gpio_v2_line_event);
+    for (i = 0; i < count; i++) {
+	bgpio_note_event(source->req, &events[i]);
+	source->events[(source->head + source->held) &
+		       (BGPIO_MERGE_QUEUE - 1)] = events[i];
+	source->held++;
+    }
+    if (was_empty && source->held) {
+	merger->heap[merger->heap_size] = src;
+	sift_up(merger, merger->heap_size++);
+    }
+    return 0;
+}
+
+/**
+ * Wait for events from any source that has room for them, and read
+ * them.
+ *
+ * @param merger The ::bgpio_merger_t.
+ *
+ * @param wait_ns How long to wait, in nanoseconds.  Zero means do not
+ * wait, and a negative value means wait indefinitely.
+ *
+ * @result Zero if successful, including if nothing was read, else an
+ * errno value.
+ */
+static int
+fill(bgpio_merger_t *merger, int64_t wait_ns)
+{
+    struct pollfd poll_fds[BGPIO_MERGE_MAX];
+    int srcs[BGPIO_MERGE_MAX];
+    struct timespec timeout;
+    int nfds = 0;
+    int res;
+    int err;
+    int i;
+
+    for (i = 0; i < merger->count; i++) {
+	if (merger->sources[i].held < BGPIO_MERGE_QUEUE) {
+	    poll_fds[nfds] = (struct pollfd) {
+		merger->sources[i].req->req.fd, POLLIN, 0};
+	    srcs[nfds++] = i;
+	}
+    }
+    if (!nfds) {
+	return 0;
+    }
+    timeout.tv_sec = wait_ns / 1000000000;
+    timeout.tv_nsec = wait_ns % 1000000000;
+    res = ppoll(poll_fds, nfds, (wait_ns < 0)? NULL: &timeout, NULL);
+    if (res < 0) {
+	return errno;
+    }
+    for (i = 0; (i < nfds) && res; i++) {
+	if (poll_fds[i].revents) {
+	    res--;
+	    if ((err = read_source(merger, srcs[i]))) {
+		return err;
+	    }
+	}
+    }
+    return 0;
+}
+
+/**
+ * Remove the oldest held event, from the source at the root of the
+ * heap, into \p event.
+ *
+ * @param merger The ::bgpio_merger_t.
+ *
+ * @param event The ::bgpio_merged_event_t to be filled in.
+ */
+static void
+emit(bgpio_merger_t *merger, bgpio_merged_event_t *event)
+{
+    int src = merger->heap[0];
+    bgpio_merge_source_t *source = &merger->sources[src];
+
+    event->event = source->events[source->head];
+    event->req = source->req;
+    event->source = src;
+    source->head = (source->head + 1) & (BGPIO_MERGE_QUEUE - 1);
+    source->held--;
+    if (!source->held) {
+	merger->heap[0] = merger->heap[--merger->heap_size];
+    }
+    if (merger->heap_size) {
+	sift_down(merger, 0);
+    }
+
+    event->late = event->event.timestamp_ns < merger->last_ns;
+    if (event->late) {
+	merger->late++;
+    }
+    else {
+	merger->last_ns = event->event.timestamp_ns;
+    }
+    merger->emitted++;
+}
+
+/**
+ * Create a merger for the edge events of a set of requests, usually
+ * on different chips.  Events should then be read only using
+ * bgpio_merge_next().
+ *
+ * In the event of an error, errno will be set.
+ *
+ * @param reqs Array of completed ::bgpio_request_t requests, with edge
+ * detection configured.  These must not be closed while the merger
+ * exists.
+ *
+ * @param count The number of requests, at most BGPIO_MERGE_MAX.
+ *
+ * @param window_ns The reorder window, in nanoseconds.  An event is
+ * held for up to this long in case an older event from another request
+ * is yet to be read.  A larger window makes late events less likely,
+ * at the cost of latency.  This may be changed later through \p
+ * merger->window_ns.
+ *
+ * @result A dynamically allocated ::bgpio_merger_t struct, which must
+ * be freed using bgpio_close_merger(), or NULL on failure.
+ */
+bgpio_merger_t *
+bgpio_open_merger(bgpio_request_t **reqs, int count, uint64_t window_ns)
+{
+    bgpio_merger_t *merger;
+    int i;
+
+    assert(reqs);
+    if ((count < 1) || (count > BGPIO_MERGE_MAX)) {
+	errno = EINVAL;
+	return NULL;
+    }
+    merger = calloc(1, sizeof(bgpio_merger_t));
+    if (!merger) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    merger->count = count;
+    merger->window_ns = window_ns;
+    for (i = 0; i < count; i++) {
+	merger->sources[i].req = reqs[i];
+    }
+    return merger;
+}
+
+/**
+ * Free a merger created by bgpio_open_merger().  Any events still held
+ * are discarded.  The requests are not affected.
+ *
+ * @param merger The ::bgpio_merger_t to be freed.
+ */
+void
+bgpio_close_merger(bgpio_merger_t *merger)
+{
+    assert(merger);
+    free(merger);
+}
+
+/**
+ * Await the next event, in timestamp order, from the requests of a
+ * merger.  An event is returned as soon as it is known to be the
+ * oldest, which is when every request has events held, or when it is
+ * \p merger->window_ns old.  An event older than one already returned
+ * is returned with its late flag set, and counted in \p merger->late.
+ *
+ * @param merger The ::bgpio_merger_t.
+ *
+ * @param event The ::bgpio_merged_event_t to be filled in.
+ *
+ * @param timeout_msecs Pointer to a timeout value given in
+ * milliseconds.  If no timeout is required, the pointer should be
+ * NULL.
+ *
+ * @result Zero if successful, with \p event describing the event,
+ * ETIMEDOUT if no event could be returned in time, or another errno
+ * value.  ENODEV means that one of the requests' chips has gone away.
+ */
+int
+bgpio_merge_next(bgpio_merger_t *merger, bgpio_merged_event_t *event,
+		 int *timeout_msecs)
+{
+    assert(merger);
+    assert(event);
+    uint64_t deadline = 0;
+    uint64_t now;
+    uint64_t oldest;
+    int64_t wait_ns;
+    int err;
+
+    if (timeout_msecs) {
+	deadline = bgpio_now_ns() + ((uint64_t) *timeout_msecs * 1000000);
+    }
+
+    /* Take whatever has already arrived before deciding anything. */
+    if ((err = fill(merger, 0))) {
+	return err;
+    }
+    while (true) {
+	now = bgpio_now_ns();
+	wait_ns = -1;
+	if (merger->heap_size) {
+	    oldest = head_ns(merger, merger->heap[0]);
+	    if ((merger->heap_size == merger->count) ||
+		(oldest + merger->window_ns <= now)) {
+		emit(merger, event);
+		return 0;
+	    }
+	    wait_ns = (int64_t) (oldest + merger->window_ns - now);
+	}
+	if (timeout_msecs) {
+	    if (now >= deadline) {
+		return ETIMEDOUT;
+	    }
+	    if ((wait_ns < 0) || (deadline - now < (uint64_t) wait_ns)) {
+		wait_ns = (int64_t) (deadline - now);
+	    }
+	}
+	if ((err = fill(merger, wait_ns))) {
+	    return err;
+	}
+    }
+}
@@ -0,0 +1,593 @@
+/*
+ *     Copyright (c) 2023 Marc Munro
+ *     Fileset:	libbgpiod - basic/bloodnok gpio device library
+ *     Author:   Marc Munro
+ *     License:  GPL-3.0
+ *
+ */
+
+/**
+ * @file   names.c
+ * @brief An index of gpio lines, across all chips, by name and
+ * consumer.
+ *
+ * Lines are usually known by the names given to them in the device
+ * tree (eg "RELAY_3") rather than by chip and offset.  Finding a line
+ * by name would otherwise mean asking the kernel for the information
+ * of every line on every chip, so we do that once, using
+ * bgpio_chip_snapshot(), and index the results in hash tables.
+ *
+ * Line names are fixed for as long as a chip exists, so the names
+ * may be saved to a cache file from which later processes can load
+ * the index without scanning any lines.  The cache file records the
+ * chips from which it was built and is ignored if they do not match
+ * the current registry.  Consumers change as lines are requested and
+ * released, so they are not cached: they reflect the state of the
+ * lines when the index was last built by scanning.
+ *
+ * The index is rebuilt whenever the registry's generation shows that
+ * the set of chips has changed.
+ */
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "bgpiod.h"
+#include "bgpiod_internal.h"
+
+/**
+ * The first line of a cache file, identifying its format.
+ */
+#define CACHE_MAGIC "bgpiod-lines 1"
+
+/**
+ * Add a line to one of the index's hash tables.
+ *
+ * @param index The ::bgpio_line_index_t.
+ *
+ * @param table The hash table, index->by_name or index->by_consumer.
+ *
+ * @param line The index of the line in index->lines.
+ *
+ * @param by_name Whether the table is keyed by name, rather than by
+ * consumer.
+ */
+static void
+index_line(bgpio_line_index_t *index, int32_t *table, int line,
+	   bool by_name)
+{
+    bgpio_line_entry_t *entry = &index->lines[line];
+    const char *key = by_name? entry->name: entry->consumer;
+    uint32_t mask = index->index_size - 1;
+    uint32_t slot = bgpio_hash_key(key) & mask;
+    bgpio_line_entry_t *other;
+
+    if (!key[0]) {
+	return;
+    }
+    while (table[slot] >= 0) {
+	other = &index->lines[table[slot]];
+	if (strcmp(by_name? other->name: other->consumer, key) == 0) {
+	    /* Append, so that lines are listed in chip order. */
+	    if (by_name) {
+		other->duplicate = entry->duplicate = true;
+		while (other->next_by_name >= 0) {
+		    other = &index->lines[other->next_by_name];
+		}
+		other->next_by_name = line;
+	    }
+	    else {
+		while (other->next_by_consumer >= 0) {
+		    other = &index->lines[other->next_by_consumer];
+		}
+		other->next_by_consumer = line;
+	    }
+	    return;
+	}
+	slot = (slot + 1) & mask;
+    }
+    table[slot] = line;
+}
+
+/**
+ * Find the slot for a key in one of the index's hash tables.
+ *
+ * @param index The ::bgpio_line_index_t.
+ *
+ * @param table The hash table, index->by_name or index->by_consumer.
+ *
+ * @param key The name or consumer being sought.
+ *
+ * @param by_name Whether the table is keyed by name.
+ *
+ * @result The index of the line in index->lines, or -1.
+ */
+static int
+lookup_line(bgpio_line_index_t *index, int32_t *table, const char *key,
+	    bool by_name)
+{
+    uint32_t mask = index->index_size - 1;
+    uint32_t slot = bgpio_hash_key(key) & mask;
+    bgpio_line_entry_t *entry;
+
+    if (!index->index_size) {
+	return -1;
+    }
+    while (table[slot] >= 0) {
+	entry = &index->lines[table[slot]];
+	if (strcmp(by_name? entry->name: entry->consumer, key) == 0) {
+	    return table[slot];
+	}
+	slot = (slot + 1) & mask;
+    }
+    return -1;
+}
+
+/**
+ * Build the hash tables for the lines in the index.
+ *
+ * @param index The ::bgpio_line_index_t, with its lines filled in.
+ *
+ * @result Zero if successful, else an errno value.
+ */
+static int
+build_tables(bgpio_line_index_t *index)
+{
+    uint32_t size = 16;
+    int i;
+
+    while (size < (uint32_t) index->count * 2) {
+	size *= 2;
+    }
+    free(index->by_name);
+    free(index->by_consumer);
+    index->by_name = malloc(size * sizeof(int32_t));
+    index->by_consumer = malloc(size * sizeof(int32_t));
+    if (!index->by_name || !index->by_consumer) {
+	index->index_size = 0;
+	return ENOMEM;
+    }
+    memset(index->by_name, 0xff, size * sizeof(int32_t));
+    memset(index->by_consumer, 0xff, size * sizeof(int32_t));
+    index->index_size = size;
+    for (i = 0; i < index->count; i++) {
+	index->lines[i].duplicate = false;
+	index->lines[i].next_by_name = -1;
+	index->lines[i].next_by_consumer = -1;
+    }
+    for (i = 0; i < index->count; i++) {
+	index_line(index, index->by_name, i, true);
+	if (index->consumers_valid) {
+	    index_line(index, index->by_consumer, i, false);
+	}
+    }
+    return 0;
+}
+
+/**
+ * Allocate the array of lines for the chips in the registry.
+ *
+ * @param index The ::bgpio_line_index_t.
+ *
+ * @result Zero if successful, else an errno value.
+ */
+static int
+allocate_lines(bgpio_line_index_t *index)
+{
+    bgpio_registry_t *reg = index->registry;
+    int count = 0;
+    int chip;
+    int i;
+
+    for (chip = 0; chip < reg->count; chip++) {
+	count += reg->chips[chip]->lines;
+    }
+    free(index->lines);
+    index->lines = calloc(count? count: 1, sizeof(bgpio_line_entry_t));
+    if (!index->lines) {
+	index->count = 0;
+	return ENOMEM;
+    }
+    index->count = count;
+    i = 0;
+    for (chip = 0; chip < reg->count; chip++) {
+	uint32_t offset;
+	for (offset = 0; offset < reg->chips[chip]->lines; offset++) {
+	    index->lines[i].chip = chip;
+	    index->lines[i].offset = offset;
+	    i++;
+	}
+    }
+    return 0;
+}
+
+/**
+ * Write the line names in the index to its cache file.  Failure is
+ * not an error: it just means that the next process must scan the
+ * lines for itself.  The file is written under a unique temporary name,
+ * created by mkstemp() so that concurrent writers cannot interfere and
+ * no existing file or symlink is followed, and is synced and then
+ * renamed so that readers never see a partial file.
+ *
+ * @param index The ::bgpio_line_index_t.
+ */
+static void
+write_cache(bgpio_line_index_t *index)
+{
+    bgpio_registry_t *reg = index->registry;
+    char *tmp_path;
+    FILE *file;
+    int fd;
+    int chip;
+    int i;
+    bool ok;
+
+    if (!index->cache_path) {
+	return;
+    }
+    tmp_path = malloc(strlen(index->cache_path) + 8);
+    if (!tmp_path) {
+	return;
+    }
+    sprintf(tmp_path, "%s.XXXXXX", index->cache_path);
+    if ((fd = mkstemp(tmp_path)) < 0) {
+	free(tmp_path);
+	return;
+    }
+    /* mkstemp() creates the file readable only by us, but the cache
+     * is shared by all users of the library. */
+    if (fchmod(fd, 0644) || !(file = fdopen(fd, "w"))) {
+	close(fd);
+	(void) unlink(tmp_path);
+	free(tmp_path);
+	return;
+    }
+    fprintf(file, "%s\n", CACHE_MAGIC);
+    for (chip = 0; chip < reg->count; chip++) {
+	bgpio_chip_entry_t *entry = reg->chips[chip];
+	fprintf(file, "chip\t%s\t%s\t%s\t%u\n",
+		entry->path, entry->name, entry->label, entry->lines);
+    }
+    for (i = 0; i < index->count; i++) {
+	if (index->lines[i].name[0]) {
+	    fprintf(file, "line\t%d\t%d\t%s\n", index->lines[i].chip,
+		    index->lines[i].offset, index->lines[i].name);
+	}
+    }
+    ok = (fflush(file) == 0) && !ferror(file) && (fsync(fd) == 0);
+    ok = (fclose(file) == 0) && ok;
+    if (!(ok && (rename(tmp_path, index->cache_path) == 0))) {
+	(void) unlink(tmp_path);
+    }
+    free(tmp_path);
+}
+
+/**
+ * Load the line names from the index's cache file, provided that it
+ * was built from the same chips as are now in the registry.
+ *
+ * @param index The ::bgpio_line_index_t.
+ *
+ * @result true if the index was loaded.
+ */
+static bool
+read_cache(bgpio_line_index_t *index)
+{
+    bgpio_registry_t *reg = index->registry;
+    char buf[4 * GPIO_MAX_NAME_SIZE + 256];
+    char *fields[5];
+    int chips = 0;
+    bool seen_lines = false;
+    bool ok = true;
+    int nfields;
+    char *saveptr;
+    FILE *file;
+    int chip;
+    int offset;
+    int i;
+
+    if (!index->cache_path || !(file = fopen(index->cache_path, "r"))) {
+	return false;
+    }
+    if (!fgets(buf, sizeof(buf), file) ||
+	strcmp(buf, CACHE_MAGIC "\n")) {
+	fclose(file);
+	return false;
+    }
+    if (allocate_lines(index)) {
+	fclose(file);
+	return false;
+    }
+    while (ok && fgets(buf, sizeof(buf), file)) {
+	buf[strcspn(buf, "\n")] = '\0';
+	/* Labels may be empty, so we cannot use strtok(). */
+	fields[0] = buf;
+	for (nfields = 1; nfields < 5; nfields++) {
+	    if (!(saveptr = strchr(fields[nfields - 1], '\t'))) {
+		break;
+	    }
+	    *saveptr = '\0';
+	    fields[nfields] = saveptr + 1;
+	}
+	if ((nfields == 5) && (strcmp(fields[0], "chip") == 0)) {
+	    bgpio_chip_entry_t *entry;
+	    ok = (chips < reg->count) && !seen_lines;
+	    if (ok) {
+		entry = reg->chips[chips];
+		ok = (strcmp(entry->path, fields[1]) == 0) &&
+		    (strcmp(entry->name, fields[2]) == 0) &&
+		    (strcmp(entry->label, fields[3]) == 0) &&
+		    (strtoul(fields[4], NULL, 10) == entry->lines);
+	    }
+	    chips++;
+	}
+	else if ((nfields == 4) && (strcmp(fields[0], "line") == 0)) {
+	    chip = atoi(fields[1]);
+	    offset = atoi(fields[2]);
+	    seen_lines = true;
+	    ok = (chips == reg->count) && (chip >= 0) && (chip < chips) &&
+		(offset >= 0) && ((uint32_t) offset < reg->chips[chip]->lines);
+	    if (ok) {
+		/* Lines are stored by chip and then offset. */
+		for (i = 0; i < chip; i++) {
+		    offset += reg->chips[i]->lines;
+		}
+		strncpy(index->lines[offset].name, fields[3],
+			GPIO_MAX_NAME_SIZE - 1);
+	    }
+	}
+	else {
+	    ok = false;
+	}
+    }
+    fclose(file);
+    return ok && (chips == reg->count);
+}
+
+/**
+ * Create an index of the lines of all chips in a registry.  If \p
+ * cache_path is given and the file it names matches the registry, the
+ * line names are loaded from it, otherwise every chip's lines are read
+ * and the cache file is (re-)written.
+ *
+ * In the event of an error, errno will be set.
+ *
+ * @param reg The ::bgpio_registry_t whose chips are to be indexed.
+ * This must not be closed while the index is in use.
+ *
+ * @param cache_path The path of the cache file, usually
+ * BGPIO_LINE_CACHE, or NULL if no cache file is to be used.
+ *
+ * @result A dynamically allocated ::bgpio_line_index_t struct, which
+ * must be freed using bgpio_close_line_index(), or NULL on failure.
+ */
+bgpio_line_index_t *
+bgpio_open_line_index(bgpio_registry_t *reg, const char *cache_path)
+{
+    bgpio_line_index_t *index;
+    int err;
+
+    assert(reg);
+    index = calloc(1, sizeof(bgpio_line_index_t));
+    if (!index) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    index->registry = reg;
+    index->generation = reg->generation;
+    if (cache_path && !(index->cache_path = strdup(cache_path))) {
+	free(index);
+	errno = ENOMEM;
+	return NULL;
+    }
+    if (read_cache(index)) {
+	if ((err = build_tables(index))) {
+	    bgpio_close_line_index(index);
+	    errno = err;
+	    return NULL;
+	}
+    }
+    else if (bgpio_rebuild_line_index(index)) {
+	err = errno;
+	bgpio_close_line_index(index);
+	errno = err;
+	return NULL;
+    }
+    return index;
+}
+
+/**
+ * Free an index created by bgpio_open_line_index().  The registry is
+ * not affected.
+ *
+ * @param index The ::bgpio_line_index_t to be freed.
+ */
+void
+bgpio_close_line_index(bgpio_line_index_t *index)
+{
+    assert(index);
+    free(index->lines);
+    free(index->by_name);
+    free(index->by_consumer);
+    free(index->cache_path);
+    free(index);
+}
+
+/**
+ * Rebuild an index by reading the line information of every chip in
+ * its registry, and rewrite its cache file.  This brings the consumers
+ * of lines up to date, and is done automatically when the registry
+ * shows that the set of chips has changed.
+ *
+ * @param index The ::bgpio_line_index_t.
+ *
+ * @result Zero if successful, else -1 with errno set.
+ */
+int
+bgpio_rebuild_line_index(bgpio_line_index_t *index)
+{
+    bgpio_registry_t *reg;
+    struct gpio_v2_line_info *infos;
+    bgpio_chip_entry_t *entry;
+    bgpio_chip_t *chip;
+    int first = 0;
+    int err;
+    int c;
+    int i;
+
+    assert(index);
+    reg = index->registry;
+    index->generation = reg->generation;
+    if ((err = allocate_lines(index))) {
+	errno = err;
+	return -1;
+    }
+    infos = malloc((index->count? index->count: 1) *
+		   sizeof(struct gpio_v2_line_info));
+    if (!infos) {
+	errno = ENOMEM;
+	return -1;
+    }
+    for (c = 0; c < reg->count; c++) {
+	entry = reg->chips[c];
+	/* Chips that could not be described have no lines. */
+	if (entry->lines && (chip = bgpio_open_chip(entry->path))) {
+	    if (bgpio_chip_snapshot(chip, 0, entry->lines,
+				    &infos[first]) >= 0) {
+		for (i = 0; i < (int) entry->lines; i++) {
+		    strncpy(index->lines[first + i].name,
+			    infos[first + i].name, GPIO_MAX_NAME_SIZE - 1);
+		    strncpy(index->lines[first + i].consumer,
+			    infos[first + i].consumer,
+			    GPIO_MAX_NAME_SIZE - 1);
+		}
+	    }
+	    bgpio_close_chip(chip);
+	}
+	first += entry->lines;
+    }
+    free(infos);
+    index->consumers_valid = true;
+    if ((err = build_tables(index))) {
+	errno = err;
+	return -1;
+    }
+    write_cache(index);
+    return 0;
+}
+
+/**
+ * Rebuild the index if the set of chips in its registry has changed.
+ *
+ * @param index The ::bgpio_line_index_t.
+ *
+ * @result Zero if successful, else -1 with errno set.
+ */
+static int
+check_generation(bgpio_line_index_t *index)
+{
+    if (index->generation != index->registry->generation) {
+	return bgpio_rebuild_line_index(index);
+    }
+    return 0;
+}
+
+/**
+ * Find a gpio line by name, on a given chip or on any chip.  The chip
+ * on which the line is found is given by
+ * `index->registry->chips[entry->chip]`.
+ *
+ * In the event of an error, errno will be set.
+ *
+ * @param index The ::bgpio_line_index_t.
+ *
+ * @param chip The path of the chip on which the line must be, or NULL
+ * if the line may be on any chip.
+ *
+ * @param name The name of the line.
+ *
+ * @result The ::bgpio_line_entry_t for the line, or NULL with errno
+ * set to ENOENT if there is no such line, or ENOTUNIQ if more than
+ * one line, on \p chip if given, has the name.
+ */
+bgpio_line_entry_t *
+bgpio_find_line_name(bgpio_line_index_t *index, const char *chip,
+		     const char *name)
+{
+    bgpio_line_entry_t *found = NULL;
+    bgpio_line_entry_t *entry;
+    int line;
+
+    assert(index);
+    assert(name);
+    if (check_generation(index)) {
+	return NULL;
+    }
+    line = lookup_line(index, index->by_name, name, true);
+    while (line >= 0) {
+	entry = &index->lines[line];
+	if (!chip ||
+	    (strcmp(chip, index->registry->chips[entry->chip]->path) == 0)) {
+	    if (found) {
+		errno = ENOTUNIQ;
+		return NULL;
+	    }
+	    found = entry;
+	}
+	line = entry->next_by_name;
+    }
+    if (!found) {
+	errno = ENOENT;
+    }
+    return found;
+}
+
+/**
+ * Find the gpio lines that were held by a given consumer when the
+ * index was last built.  If the index was loaded from its cache file,
+ * it is first rebuilt, as consumers are not cached.
+ *
+ * @param index The ::bgpio_line_index_t.
+ *
+ * @param consumer The consumer name.
+ *
+ * @param lines Array into which pointers to the ::bgpio_line_entry_t
+ * of each matching line are placed, in chip and offset order.
+ *
+ * @param max The size of \p lines.  Lines beyond this are counted but
+ * not returned.
+ *
+ * @result The number of lines held by \p consumer, or -1 with errno
+ * set.
+ */
+int
+bgpio_find_consumer_lines(bgpio_line_index_t *index, const char *consumer,
+			  bgpio_line_entry_t **lines, int max)
+{
+    int line;
+    int found = 0;
+
+    assert(index);
+    assert(consumer);
+    if (check_generation(index)) {
+	return -1;
+    }
+    if (!index->consumers_valid && bgpio_rebuild_line_index(index)) {
+	return -1;
+    }
+    line = lookup_line(index, index->by_consumer, consumer, false);
+    while (line >= 0) {
+	if (found < max) {
+	    lines[found] = &index->lines[line];
+	}
+	found++;
+	line = index->lines[line].next_by_consumer;
+    }
+    return found;
+}
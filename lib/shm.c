@@ -0,0 +1,758 @@
+/*
+ *     Copyright (c) 2023 Marc Munro
+ *     Fileset:	libbgpiod - basic/bloodnok gpio device library
+ *     Author:   Marc Munro
+ *     License:  GPL-3.0
+ *
+ */
+
+/**
+ * @file   shm.c
+ * @brief Publication of gpio line state and events through POSIX
+ * shared memory.
+ *
+ * Only one process may hold a gpio line, but many processes may want
+ * to know its state.  The functions here allow the holder of a
+ * ::bgpio_request_t to publish the values of its lines into a
+ * shared-memory segment from which any number of readers can take
+ * consistent snapshots, without system calls and without ever
+ * blocking the publisher.
+ *
+ * Similarly, only one process may receive the edge events for a gpio
+ * line.  A fan-out writer places those events into a shared-memory
+ * ring from which any number of processes can read them, each at its
+ * own pace.
+ */
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <limits.h>
+#include <time.h>
+
+#include "bgpiod.h"
+#include "bgpiod_internal.h"
+
+/**
+ * Return a copy of a shared-memory object name, with a leading slash
+ * added if the caller did not supply one.
+ *
+ * @param name The shared-memory object name, eg "gpio-inputs".
+ *
+ * @result Dynamically allocated name suitable for shm_open(), which
+ * the caller must free.
+ */
+static char *
+shm_name(const char *name)
+{
+    char *result = malloc(strlen(name) + 2);
+
+    if (result) {
+	sprintf(result, "%s%s", (name[0] == '/')? "": "/", name);
+    }
+    return result;
+}
+
+/**
+ * Open and map a shared-memory segment.
+ *
+ * @param name The shared-memory object name, with its leading slash.
+ *
+ * @param size The size of the segment.  Unless we are creating it,
+ * this is the minimum acceptable size of an existing segment.
+ *
+ * @param oflag Flags for shm_open().  If O_CREAT is given, the
+ * segment is created (or re-used) and sized.  Unless the access mode
+ * is O_RDONLY, the segment is mapped with write access.
+ *
+ * @param mode The permissions for a newly created segment.
+ *
+ * @result The mapped address, or NULL in the event of an error, in
+ * which case errno will have been set.
+ */
+static void *
+map_shm(const char *name, size_t size, int oflag, mode_t mode)
+{
+    bool create = (oflag & O_CREAT) != 0;
+    bool writable = (oflag & O_ACCMODE) != O_RDONLY;
+    int fd;
+    void *addr;
+    struct stat st;
+    int err;
+
+    fd = shm_open(name, oflag | O_CLOEXEC, mode);
+    if (fd < 0) {
+	return NULL;
+    }
+    if (create) {
+	if (ftruncate(fd, size)) {
+	    goto fail;
+	}
+    }
+    else {
+	if (fstat(fd, &st)) {
+	    goto fail;
+	}
+	if (st.st_size < size) {
+	    errno = EINVAL;
+	    goto fail;
+	}
+    }
+    addr = mmap(NULL, size, writable? PROT_READ | PROT_WRITE: PROT_READ,
+		MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+	goto fail;
+    }
+    close(fd);
+    return addr;
+
+fail:
+    err = errno;
+    close(fd);
+    errno = err;
+    return NULL;
+}
+
+/**
+ * Begin an update of a sequence-locked segment.  The sequence number
+ * becomes odd, telling readers that they must retry.
+ *
+ * @param seq Pointer to the sequence counter.
+ */
+static void
+seq_write_begin(uint32_t *seq)
+{
+    uint32_t s = __atomic_load_n(seq, __ATOMIC_RELAXED);
+
+    __atomic_store_n(seq, s + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * Complete an update of a sequence-locked segment.  The sequence
+ * number becomes even again, and larger than before.
+ *
+ * @param seq Pointer to the sequence counter.
+ */
+static void
+seq_write_end(uint32_t *seq)
+{
+    uint32_t s = __atomic_load_n(seq, __ATOMIC_RELAXED);
+
+    __atomic_store_n(seq, s + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Create a shared-memory segment into which the values of the lines
+ * of \p req will be published.  The current values are fetched and
+ * published immediately.
+ *
+ * The request must have been completed by bgpio_complete_request().
+ * Readers attach to the segment using bgpio_attach_values().
+ *
+ * In the event of an error, errno will be set.
+ *
+ * @param req The ::bgpio_request_t whose values are to be published.
+ *
+ * @param name The name of the shared-memory object, eg
+ * "gpio-inputs".  This is the name readers will use.
+ *
+ * @result A dynamically allocated ::bgpio_publisher_t, which should be
+ * closed using bgpio_close_publisher(), or NULL on failure.
+ */
+bgpio_publisher_t *
+bgpio_open_publisher(bgpio_request_t *req, const char *name)
+{
+    assert(req);
+    assert(name);
+    bgpio_publisher_t *pub = calloc(1, sizeof(bgpio_publisher_t));
+    bgpio_shm_values_t *values;
+    int i;
+
+    if (!pub || !(pub->name = shm_name(name))) {
+	free(pub);
+	errno = ENOMEM;
+	return NULL;
+    }
+    values = map_shm(pub->name, sizeof(bgpio_shm_values_t),
+		     O_CREAT | O_RDWR, 0644);
+    if (!values) {
+	int err = errno;
+	free(pub->name);
+	free(pub);
+	errno = err;
+	return NULL;
+    }
+    pub->req = req;
+    pub->values = values;
+
+    seq_write_begin(&values->seq);
+    values->num_lines = req->req.num_lines;
+    for (i = 0; i < req->req.num_lines; i++) {
+	values->offsets[i] = req->req.offsets[i];
+    }
+    strncpy(values->chardev_path, req->chardev_path? req->chardev_path: "",
+	    sizeof(values->chardev_path) - 1);
+    values->magic = BGPIO_SHM_VALUES_MAGIC;
+    seq_write_end(&values->seq);
+
+    if (bgpio_fetch(req) == 0) {
+	bgpio_publish(pub);
+    }
+    return pub;
+}
+
+/**
+ * Publish the values most recently fetched into the request, ie those
+ * in ::bgpio_request_t->line_values.bits following a call to
+ * bgpio_fetch().  Only the lines in line_values.mask are updated.
+ *
+ * @param pub The ::bgpio_publisher_t returned by
+ * bgpio_open_publisher().
+ */
+void
+bgpio_publish(bgpio_publisher_t *pub)
+{
+    assert(pub);
+    bgpio_shm_values_t *values = pub->values;
+    uint64_t mask = pub->req->line_values.mask;
+    uint64_t bits = pub->req->line_values.bits & mask;
+    uint64_t now = bgpio_now_ns();
+    uint64_t old = __atomic_load_n(&values->bits, __ATOMIC_RELAXED);
+    uint64_t changed = (old ^ bits) & mask;
+    int i;
+
+    seq_write_begin(&values->seq);
+    __atomic_store_n(&values->bits, (old & ~mask) | bits, __ATOMIC_RELAXED);
+    __atomic_store_n(&values->timestamp_ns, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&values->updates, values->updates + 1,
+		     __ATOMIC_RELAXED);
+    for (i = 0; changed; i++, changed >>= 1) {
+	if (changed & 1) {
+	    __atomic_store_n(&values->changed_ns[i], now, __ATOMIC_RELAXED);
+	}
+    }
+    seq_write_end(&values->seq);
+}
+
+/**
+ * Publish the change in a line's value described by an edge event,
+ * as returned from bgpio_await_event().  The event's timestamp
+ * becomes the published timestamp.
+ *
+ * @param pub The ::bgpio_publisher_t returned by
+ * bgpio_open_publisher().
+ *
+ * @param event The ::gpio_v2_line_event describing the edge.
+ */
+void
+bgpio_publish_event(bgpio_publisher_t *pub, struct gpio_v2_line_event *event)
+{
+    assert(pub);
+    assert(event);
+    bgpio_shm_values_t *values = pub->values;
+    int idx = bgpio_idx_for_line(pub->req, event->offset);
+    uint64_t bits = __atomic_load_n(&values->bits, __ATOMIC_RELAXED);
+
+    if (idx < 0) {
+	return;
+    }
+    if (event->id == GPIO_V2_LINE_EVENT_RISING_EDGE) {
+	BGPIO_SETBIT(bits, idx);
+    }
+    else {
+	BGPIO_CLEARBIT(bits, idx);
+    }
+    seq_write_begin(&values->seq);
+    __atomic_store_n(&values->bits, bits, __ATOMIC_RELAXED);
+    __atomic_store_n(&values->timestamp_ns, event->timestamp_ns,
+		     __ATOMIC_RELAXED);
+    __atomic_store_n(&values->updates, values->updates + 1,
+		     __ATOMIC_RELAXED);
+    __atomic_store_n(&values->changed_ns[idx], event->timestamp_ns,
+		     __ATOMIC_RELAXED);
+    seq_write_end(&values->seq);
+}
+
+/**
+ * Keep the published values current.  This waits for up to \p
+ * period_msecs for an edge event on the request's lines, publishing
+ * it if one arrives.  If none arrives within the period, the values
+ * are fetched and published instead.  Call this in a loop.
+ *
+ * Requests with no edge-detecting lines are simply fetched and
+ * published once per period.
+ *
+ * @param pub The ::bgpio_publisher_t returned by
+ * bgpio_open_publisher().
+ *
+ * @param period_msecs Pointer to the maximum period, in
+ * milliseconds, between updates.  If NULL, we wait indefinitely for
+ * an edge event.
+ *
+ * @result Zero if successful, else an errno value.
+ */
+int
+bgpio_publish_update(bgpio_publisher_t *pub, int *period_msecs)
+{
+    assert(pub);
+    int res = bgpio_await_event(pub->req, period_msecs);
+
+    if (res == 0) {
+	bgpio_publish_event(pub, &pub->req->event);
+	return 0;
+    }
+    if (res == ETIMEDOUT) {
+	if (bgpio_fetch(pub->req)) {
+	    return errno? errno: EIO;
+	}
+	bgpio_publish(pub);
+	return 0;
+    }
+    return res;
+}
+
+/**
+ * Stop publishing, removing the shared-memory object and freeing the
+ * ::bgpio_publisher_t.  Readers that are still attached will continue
+ * to see the final published values.  The request is not closed.
+ *
+ * @param pub The ::bgpio_publisher_t returned by
+ * bgpio_open_publisher().
+ */
+void
+bgpio_close_publisher(bgpio_publisher_t *pub)
+{
+    assert(pub);
+    (void) munmap(pub->values, sizeof(bgpio_shm_values_t));
+    (void) shm_unlink(pub->name);
+    free(pub->name);
+    free((void *) pub);
+}
+
+/**
+ * Attach, read-only, to a segment created by bgpio_open_publisher().
+ *
+ * In the event of an error, errno will be set.
+ *
+ * @param name The name of the shared-memory object, as given to
+ * bgpio_open_publisher().
+ *
+ * @result Pointer to the mapped ::bgpio_shm_values_t, which should be
+ * read using bgpio_read_values() and released using
+ * bgpio_detach_values(), or NULL on failure.
+ */
+bgpio_shm_values_t *
+bgpio_attach_values(const char *name)
+{
+    assert(name);
+    char *full_name = shm_name(name);
+    bgpio_shm_values_t *values;
+
+    if (!full_name) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    values = map_shm(full_name, sizeof(bgpio_shm_values_t), O_RDONLY, 0);
+    free(full_name);
+    if (values && (values->magic != BGPIO_SHM_VALUES_MAGIC)) {
+	(void) munmap(values, sizeof(bgpio_shm_values_t));
+	errno = EINVAL;
+	return NULL;
+    }
+    return values;
+}
+
+/**
+ * Release a segment attached by bgpio_attach_values().
+ *
+ * @param values The mapped ::bgpio_shm_values_t.
+ */
+void
+bgpio_detach_values(bgpio_shm_values_t *values)
+{
+    assert(values);
+    (void) munmap(values, sizeof(bgpio_shm_values_t));
+}
+
+/**
+ * Take a consistent snapshot of published line values.  This never
+ * makes a system call and never blocks the publisher: if an update
+ * is in progress, or completes while we are reading, we simply read
+ * again.
+ *
+ * @param values The segment returned by bgpio_attach_values().
+ *
+ * @param snapshot Where the snapshot will be placed.
+ */
+void
+bgpio_read_values(bgpio_shm_values_t *values,
+		  bgpio_values_snapshot_t *snapshot)
+{
+    assert(values);
+    assert(snapshot);
+    uint32_t seq1;
+    uint32_t seq2;
+
+    do {
+	seq1 = __atomic_load_n(&values->seq, __ATOMIC_ACQUIRE);
+	snapshot->bits = __atomic_load_n(&values->bits, __ATOMIC_RELAXED);
+	snapshot->timestamp_ns = __atomic_load_n(&values->timestamp_ns,
+						 __ATOMIC_RELAXED);
+	snapshot->updates = __atomic_load_n(&values->updates,
+					    __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	seq2 = __atomic_load_n(&values->seq, __ATOMIC_RELAXED);
+    } while ((seq1 != seq2) || (seq1 & 1));
+}
+
+/**
+ * Wait on a futex shared between processes.
+ *
+ * @param addr The futex word.
+ *
+ * @param val The value we expect \p addr to contain.  If it contains
+ * anything else we return immediately.
+ *
+ * @param timeout The maximum time to wait, or NULL to wait
+ * indefinitely.
+ *
+ * @result Zero if we were woken, or the value changed, else an errno
+ * value.  ETIMEDOUT means that the timeout expired.
+ */
+static int
+futex_wait(uint32_t *addr, uint32_t val, struct timespec *timeout)
+{
+    if (syscall(SYS_futex, addr, FUTEX_WAIT, val, timeout, NULL, 0)) {
+	return (errno == EAGAIN || errno == EINTR)? 0: errno;
+    }
+    return 0;
+}
+
+/**
+ * Wake all processes waiting on a shared futex.
+ *
+ * @param addr The futex word.
+ */
+static void
+futex_wake_all(uint32_t *addr)
+{
+    (void) syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * Create a shared-memory ring into which the edge events for the
+ * lines of \p req will be written by bgpio_fanout_update().  Readers
+ * attach to the ring using bgpio_attach_ring().
+ *
+ * The request must have been completed by bgpio_complete_request(),
+ * and its lines configured for edge detection.  As readers need to
+ * register themselves as waiters, the ring is created writable by
+ * all, subject to the process umask.
+ *
+ * In the event of an error, errno will be set.
+ *
+ * @param req The ::bgpio_request_t whose events are to be shared.
+ *
+ * @param name The name of the shared-memory object, eg "gpio-edges".
+ * This is the name readers will use.
+ *
+ * @result A dynamically allocated ::bgpio_fanout_t, which should be
+ * closed using bgpio_close_fanout(), or NULL on failure.
+ */
+bgpio_fanout_t *
+bgpio_open_fanout(bgpio_request_t *req, const char *name)
+{
+    assert(req);
+    assert(name);
+    bgpio_fanout_t *fanout = calloc(1, sizeof(bgpio_fanout_t));
+    bgpio_shm_ring_t *ring;
+    int i;
+
+    if (!fanout || !(fanout->name = shm_name(name))) {
+	free(fanout);
+	errno = ENOMEM;
+	return NULL;
+    }
+    ring = map_shm(fanout->name, sizeof(bgpio_shm_ring_t),
+		   O_CREAT | O_RDWR, 0666);
+    if (!ring) {
+	int err = errno;
+	free(fanout->name);
+	free(fanout);
+	errno = err;
+	return NULL;
+    }
+    fanout->req = req;
+    fanout->ring = ring;
+
+    /* If the segment already existed, readers may be attached to it,
+     * so we continue from its current head rather than resetting. */
+    ring->num_lines = req->req.num_lines;
+    for (i = 0; i < req->req.num_lines; i++) {
+	ring->offsets[i] = req->req.offsets[i];
+    }
+    strncpy(ring->chardev_path, req->chardev_path? req->chardev_path: "",
+	    sizeof(ring->chardev_path) - 1);
+    __atomic_store_n(&ring->magic, BGPIO_SHM_RING_MAGIC, __ATOMIC_RELEASE);
+    return fanout;
+}
+
+/**
+ * Wait for edge events on the fan-out's request and write them into
+ * the ring, waking any readers that are waiting.  Up to
+ * BGPIO_FANOUT_BATCH events that are already available are read in a
+ * single system call, directly from the kernel into the shared
+ * ring, so there is no intermediate copy.  Call this in a loop.
+ *
+ * The last event written is also copied into
+ * ::bgpio_request_t->event.
+ *
+ * @param fanout The ::bgpio_fanout_t returned by bgpio_open_fanout().
+ *
+ * @param timeout_msecs Pointer to a timeout value given in
+ * milliseconds.  If no timeout is required, the pointer should be
+ * NULL.
+ *
+ * @result Zero if successful, ETIMEDOUT if the timeout expired, EINTR
+ * if we were woken by bgpio_wakeup(), or an errno value.
+ */
+int
+bgpio_fanout_update(bgpio_fanout_t *fanout, int *timeout_msecs)
+{
+    assert(fanout);
+    bgpio_shm_ring_t *ring = fanout->ring;
+    uint64_t head = ring->head;
+    int slot = head & (BGPIO_RING_SLOTS - 1);
+    int batch = BGPIO_RING_SLOTS - slot;
+    uint64_t saved[BGPIO_FANOUT_BATCH];
+    ssize_t res;
+    int count;
+    int err;
+    int i;
+
+    /* Wait for events before marking any slots, even with no timeout,
+     * so that lagging readers never see marked slots for longer than a
+     * single read. */
+    if ((err = bgpio_poll_request(fanout->req, timeout_msecs))) {
+	return err;
+    }
+    if (batch > BGPIO_FANOUT_BATCH) {
+	batch = BGPIO_FANOUT_BATCH;
+    }
+
+    /* Mark the slots we may overwrite as being in progress, so that
+     * lagging readers cannot mistake a partly-written event for the
+     * one they expected. */
+    for (i = 0; i < batch; i++) {
+	saved[i] = ring->seqs[slot + i];
+	__atomic_store_n(&ring->seqs[slot + i], 0, __ATOMIC_RELAXED);
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    do {
+	res = read(fanout->req->req.fd, &ring->events[slot],
+		   batch * sizeof(struct gpio_v2_line_event));
+    } while ((res < 0) && (errno == EINTR));
+    count = (res > 0)? res / sizeof(struct gpio_v2_line_event): 0;
+
+    for (i = 0; i < batch; i++) {
+	__atomic_store_n(&ring->seqs[slot + i],
+			 (i < count)? head + i + 1: saved[i],
+			 __ATOMIC_RELEASE);
+    }
+    if (res < 0) {
+	return errno;
+    }
+    if (count == 0) {
+	return EIO;
+    }
+
+    for (i = 0; i < count; i++) {
+	bgpio_note_event(fanout->req, &ring->events[slot + i]);
+    }
+    fanout->req->event = ring->events[slot + count - 1];
+    __atomic_store_n(&ring->head, head + count, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&ring->wakeup, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->waiters, __ATOMIC_SEQ_CST)) {
+	futex_wake_all(&ring->wakeup);
+    }
+    return 0;
+}
+
+/**
+ * Close a fan-out writer, removing the shared-memory object and
+ * freeing the ::bgpio_fanout_t.  Readers that are still attached can
+ * read any events remaining in the ring, but will receive no more.
+ * The request is not closed.
+ *
+ * @param fanout The ::bgpio_fanout_t returned by bgpio_open_fanout().
+ */
+void
+bgpio_close_fanout(bgpio_fanout_t *fanout)
+{
+    assert(fanout);
+    (void) munmap(fanout->ring, sizeof(bgpio_shm_ring_t));
+    (void) shm_unlink(fanout->name);
+    free(fanout->name);
+    free((void *) fanout);
+}
+
+/**
+ * Attach to a ring created by bgpio_open_fanout().  The new reader
+ * will receive only events written after it attached.
+ *
+ * In the event of an error, errno will be set.
+ *
+ * @param name The name of the shared-memory object, as given to
+ * bgpio_open_fanout().
+ *
+ * @result A dynamically allocated ::bgpio_ring_reader_t, which should
+ * be released using bgpio_detach_ring(), or NULL on failure.
+ */
+bgpio_ring_reader_t *
+bgpio_attach_ring(const char *name)
+{
+    assert(name);
+    char *full_name = shm_name(name);
+    bgpio_ring_reader_t *reader;
+    bgpio_shm_ring_t *ring;
+
+    if (!full_name) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    ring = map_shm(full_name, sizeof(bgpio_shm_ring_t), O_RDWR, 0);
+    free(full_name);
+    if (!ring) {
+	return NULL;
+    }
+    if (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) !=
+	BGPIO_SHM_RING_MAGIC) {
+	(void) munmap(ring, sizeof(bgpio_shm_ring_t));
+	errno = EINVAL;
+	return NULL;
+    }
+    reader = calloc(1, sizeof(bgpio_ring_reader_t));
+    if (!reader) {
+	(void) munmap(ring, sizeof(bgpio_shm_ring_t));
+	errno = ENOMEM;
+	return NULL;
+    }
+    reader->ring = ring;
+    reader->cursor = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    return reader;
+}
+
+/**
+ * Release a reader created by bgpio_attach_ring().
+ *
+ * @param reader The ::bgpio_ring_reader_t to be released and freed.
+ */
+void
+bgpio_detach_ring(bgpio_ring_reader_t *reader)
+{
+    assert(reader);
+    (void) munmap(reader->ring, sizeof(bgpio_shm_ring_t));
+    free((void *) reader);
+}
+
+/**
+ * Return the next event from a shared-memory ring, waiting for one to
+ * be written if necessary.
+ *
+ * If the writer has overwritten events that we had not yet read, our
+ * cursor is moved forward to the oldest event still available, the
+ * number of events skipped is added to
+ * ::bgpio_ring_reader_t->lost, and EOVERFLOW is returned.  The next
+ * call will return the oldest available event.
+ *
+ * @param reader The ::bgpio_ring_reader_t returned by
+ * bgpio_attach_ring().
+ *
+ * @param event Where the event will be placed.
+ *
+ * @param timeout_msecs Pointer to a timeout value given in
+ * milliseconds.  If no timeout is required, the pointer should be
+ * NULL.
+ *
+ * @result Zero if successful, ETIMEDOUT if the timeout expired,
+ * EOVERFLOW if events were lost, or an errno value.
+ */
+int
+bgpio_ring_await_event(bgpio_ring_reader_t *reader,
+		       struct gpio_v2_line_event *event,
+		       int *timeout_msecs)
+{
+    assert(reader);
+    assert(event);
+    bgpio_shm_ring_t *ring = reader->ring;
+    uint64_t deadline = 0;
+    uint64_t head;
+    uint64_t seq;
+    uint32_t wakeup;
+    int slot;
+    int res;
+
+    if (timeout_msecs) {
+	deadline = bgpio_now_ns() + (uint64_t) *timeout_msecs * 1000000;
+    }
+    while (true) {
+	wakeup = __atomic_load_n(&ring->wakeup, __ATOMIC_SEQ_CST);
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	if (head - reader->cursor >= BGPIO_RING_SLOTS) {
+	    /* The slot at our cursor has been, or is about to be,
+	     * overwritten. */
+	    uint64_t oldest = head - BGPIO_RING_SLOTS + 1;
+	    reader->lost += oldest - reader->cursor;
+	    reader->cursor = oldest;
+	    return EOVERFLOW;
+	}
+	if (reader->cursor < head) {
+	    slot = reader->cursor & (BGPIO_RING_SLOTS - 1);
+	    seq = __atomic_load_n(&ring->seqs[slot], __ATOMIC_ACQUIRE);
+	    *event = ring->events[slot];
+	    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+	    if ((seq == reader->cursor + 1) &&
+		(__atomic_load_n(&ring->seqs[slot], __ATOMIC_RELAXED) == seq)) {
+		reader->cursor++;
+		return 0;
+	    }
+	    /* The writer overtook us while we were reading.  Go round
+	     * again, which will report the overflow. */
+	    continue;
+	}
+
+	/* Nothing to read, so sleep until the writer bumps wakeup. */
+	if (timeout_msecs) {
+	    uint64_t now = bgpio_now_ns();
+	    struct timespec remaining;
+
+	    if (now >= deadline) {
+		return ETIMEDOUT;
+	    }
+	    remaining.tv_sec = (deadline - now) / 1000000000;
+	    remaining.tv_nsec = (deadline - now) % 1000000000;
+	    __atomic_add_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+	    res = futex_wait(&ring->wakeup, wakeup, &remaining);
+	}
+	else {
+	    __atomic_add_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+	    res = futex_wait(&ring->wakeup, wakeup, NULL);
+	}
+	__atomic_sub_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+	if (res && (res != ETIMEDOUT)) {
+	    return res;
+	}
+    }
+}
@@ -0,0 +1,405 @@
+/*
+ *     Copyright (c) 2023 Marc Munro
+ *     Fileset:	libbgpiod - basic/bloodnok gpio device library
+ *     Author:   Marc Munro
+ *     License:  GPL-3.0
+ *
+ */
+
+/**
+ * @file   sigio.c
+ * @brief Notification of edge events by real-time signals.
+ *
+ * Code that is driven by signals, and has no event loop in which to
+ * wait for events, may instead ask for a real-time signal to be raised
+ * whenever a request has events queued, using bgpio_enable_sigio().
+ * The signal's handler finds the request's file descriptor using
+ * bgpio_sigio_fd(), and reads the events with bgpio_sigio_drain(),
+ * which is async-signal-safe.
+ *
+ * The request's file descriptor is armed with F_SETOWN, F_SETSIG and
+ * O_ASYNC, so that the kernel raises the signal itself.  At the time
+ * of writing, however, the gpio character device does not implement
+ * O_ASYNC for line requests, so a notifier thread may also be started,
+ * which polls the file descriptor and raises the signal with
+ * sigqueue().  To avoid a storm of signals, the notifier raises one
+ * signal and then waits for bgpio_sigio_drain() to be called before
+ * polling again.
+ */
+
+#define _GNU_SOURCE     // for F_SETSIG
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "bgpiod.h"
+
+/**
+ * Arm, or disarm, a file descriptor for the kernel to raise a signal
+ * when it becomes readable.  Arming makes it O_NONBLOCK.  This is
+ * async-signal-safe.
+ *
+ * @param fd The file descriptor.
+ *
+ * @param signo The signal, or 0 to disarm.
+ *
+ * @param nonblocking When disarming, whether the file descriptor is to
+ * be left O_NONBLOCK.
+ *
+ * @result Zero if successful, else an errno value.
+ */
+static int
+arm_fd(int fd, int signo, bool nonblocking)
+{
+    int flags = fcntl(fd, F_GETFL);
+
+    if (flags < 0) {
+	return errno;
+    }
+    if (signo) {
+	if (fcntl(fd, F_SETOWN, getpid()) || fcntl(fd, F_SETSIG, signo)) {
+	    return errno;
+	}
+	flags |= O_ASYNC | O_NONBLOCK;
+    }
+    else {
+	if (fcntl(fd, F_SETSIG, 0)) {
+	    return errno;
+	}
+	flags &= ~O_ASYNC;
+	if (!nonblocking) {
+	    flags &= ~O_NONBLOCK;
+	}
+    }
+    if (fcntl(fd, F_SETFL, flags)) {
+	return errno;
+    }
+    return 0;
+}
+
+/**
+ * Stop raising signals for a request whose chip has gone away.  Its
+ * file descriptor will report POLLERR and POLLHUP from now on, so
+ * leaving it armed would raise signals without end.  It is armed again
+ * by bgpio_rearm_sigio().  This is async-signal-safe.
+ *
+ * @param req The ::bgpio_request_t.
+ */
+static void
+disarm_lost(bgpio_request_t *req)
+{
+    if (!__atomic_exchange_n(&req->sigio->lost, true, __ATOMIC_ACQ_REL)) {
+	(void) arm_fd(req->req.fd, 0, true);
+    }
+}
+
+/**
+ * Thread body for the notifier started by bgpio_enable_sigio().  While
+ * armed, it polls the request's file descriptor and, when events are
+ * queued, raises the signal and disarms itself.  It is re-armed by
+ * bgpio_sigio_drain() through the rearm eventfd.  The request's file
+ * descriptor is read afresh each time, as it will change if the
+ * request is re-acquired by a ::bgpio_supervisor_t.  If the chip goes
+ * away, one last signal is raised, so that the handler sees the error,
+ * and the notifier then stays disarmed until bgpio_rearm_sigio().
+ *
+ * @param arg The ::bgpio_request_t.
+ *
+ * @result NULL.
+ */
+static void *
+notifier(void *arg)
+{
+    bgpio_request_t *req = (bgpio_request_t *) arg;
+    bgpio_sigio_t *sigio = req->sigio;
+    struct pollfd poll_fds[2];
+    union sigval value;
+    uint64_t rearms;
+    bool armed = true;
+    int res;
+
+    while (!__atomic_load_n(&sigio->stopping, __ATOMIC_ACQUIRE)) {
+	poll_fds[0] = (struct pollfd) {sigio->rearm_fd, POLLIN, 0};
+	poll_fds[1] = (struct pollfd) {req->req.fd, POLLIN, 0};
+	res = poll(poll_fds, armed? 2: 1, -1);
+	if (res < 0) {
+	    continue;
+	}
+	if (poll_fds[0].revents & POLLIN) {
+	    (void) read(sigio->rearm_fd, &rearms, sizeof(rearms));
+	    armed = !__atomic_load_n(&sigio->lost, __ATOMIC_ACQUIRE);
+	    continue;
+	}
+	if (armed && poll_fds[1].revents) {
+	    armed = false;
+	    if (poll_fds[1].revents & (POLLERR | POLLHUP)) {
+		disarm_lost(req);
+	    }
+	    if (!(poll_fds[1].revents & POLLNVAL)) {
+		/* On POLLERR too, so that the handler sees the error. */
+		value.sival_int = req->req.fd;
+		if (!sigqueue(getpid(), sigio->signo, value)) {
+		    __atomic_add_fetch(&sigio->raised, 1, __ATOMIC_RELAXED);
+		}
+	    }
+	}
+    }
+    return NULL;
+}
+
+/**
+ * Start the notifier thread for a request, with all signals blocked so
+ * that the signals it raises are not delivered to it.
+ *
+ * @param req The ::bgpio_request_t, with req->sigio set up.
+ *
+ * @result Zero if successful, else an errno value.
+ */
+static int
+start_notifier(bgpio_request_t *req)
+{
+    sigset_t all;
+    sigset_t old;
+    int err;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    err = pthread_create(&req->sigio->thread, NULL, notifier, req);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return err;
+}
+
+/**
+ * Have a real-time signal raised whenever edge events are queued for
+ * a request.  The request's file descriptor is made O_NONBLOCK until
+ * bgpio_disable_sigio() is called.  The
+ * caller must install a handler for the signal, using sigaction() with
+ * SA_SIGINFO, before calling this, and should then read events only
+ * using bgpio_sigio_drain().  Signals may be raised when no events
+ * remain, and several events may be reported by one signal.
+ *
+ * If the request is re-acquired by a ::bgpio_supervisor_t, its new file
+ * descriptor is armed in the same way.
+ *
+ * @param req The completed ::bgpio_request_t.
+ *
+ * @param signo The signal to be raised, from SIGRTMIN to SIGRTMAX.
+ * Real-time signals are queued, and carry the file descriptor, so that
+ * one handler may serve several requests.
+ *
+ * @param notifier Whether to start a notifier thread to raise the
+ * signal.  This is needed unless the kernel's gpio character device
+ * supports O_ASYNC, which at the time of writing it does not.
+ *
+ * @result Zero if successful, else an errno value.
+ */
+int
+bgpio_enable_sigio(bgpio_request_t *req, int signo, bool notifier)
+{
+    assert(req);
+    bgpio_sigio_t *sigio;
+    int err;
+
+    if ((req->req.fd <= 0) || req->sigio ||
+	(signo < SIGRTMIN) || (signo > SIGRTMAX)) {
+	return EINVAL;
+    }
+    if (!(sigio = calloc(1, sizeof(bgpio_sigio_t)))) {
+	return ENOMEM;
+    }
+    sigio->signo = signo;
+    sigio->rearm_fd = -1;
+    sigio->was_nonblocking = req->nonblocking;
+    req->sigio = sigio;
+    if ((err = arm_fd(req->req.fd, signo, true))) {
+	goto fail;
+    }
+    req->nonblocking = true;
+    if (notifier) {
+	sigio->rearm_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (sigio->rearm_fd < 0) {
+	    err = errno;
+	    goto fail;
+	}
+	if ((err = start_notifier(req))) {
+	    goto fail;
+	}
+	sigio->threaded = true;
+    }
+    return 0;
+
+fail:
+    (void) arm_fd(req->req.fd, 0, sigio->was_nonblocking);
+    req->nonblocking = sigio->was_nonblocking;
+    if (sigio->rearm_fd >= 0) {
+	close(sigio->rearm_fd);
+    }
+    free(sigio);
+    req->sigio = NULL;
+    return err;
+}
+
+/**
+ * Stop raising signals for a request's events, stopping any notifier
+ * thread, and return the request's file descriptor to the blocking
+ * mode it had before bgpio_enable_sigio().  This is called by
+ * bgpio_close_request().  Signals already queued may still be
+ * delivered.
+ *
+ * @param req The ::bgpio_request_t.
+ *
+ * @result Zero if successful, else an errno value.
+ */
+int
+bgpio_disable_sigio(bgpio_request_t *req)
+{
+    assert(req);
+    bgpio_sigio_t *sigio = req->sigio;
+    uint64_t one = 1;
+    int err = 0;
+
+    if (!sigio) {
+	return 0;
+    }
+    if (sigio->threaded) {
+	__atomic_store_n(&sigio->stopping, true, __ATOMIC_RELEASE);
+	(void) write(sigio->rearm_fd, &one, sizeof(one));
+	pthread_join(sigio->thread, NULL);
+    }
+    if (sigio->rearm_fd >= 0) {
+	close(sigio->rearm_fd);
+    }
+    if (req->req.fd > 0) {
+	err = arm_fd(req->req.fd, 0, sigio->was_nonblocking);
+    }
+    if (!err) {
+	req->nonblocking = sigio->was_nonblocking;
+    }
+    free(sigio);
+    req->sigio = NULL;
+    return err;
+}
+
+/**
+ * Re-arm signal notification after a request's file descriptor has
+ * changed, as when it is re-acquired by a ::bgpio_supervisor_t.
+ *
+ * @param req The ::bgpio_request_t, for which bgpio_enable_sigio() has
+ * been called.
+ *
+ * @result Zero if successful, else an errno value.
+ */
+int
+bgpio_rearm_sigio(bgpio_request_t *req)
+{
+    assert(req);
+    uint64_t one = 1;
+    int err;
+
+    if (!req->sigio) {
+	return 0;
+    }
+    if ((err = arm_fd(req->req.fd, req->sigio->signo, true))) {
+	return err;
+    }
+    __atomic_store_n(&req->sigio->lost, false, __ATOMIC_RELEASE);
+    if (req->sigio->threaded) {
+	(void) write(req->sigio->rearm_fd, &one, sizeof(one));
+    }
+    return 0;
+}
+
+/**
+ * Return the file descriptor for which a signal raised by
+ * bgpio_enable_sigio() was sent, whether it was raised by the kernel
+ * or by a notifier thread.  This is async-signal-safe.
+ *
+ * @param info The siginfo_t passed to an SA_SIGINFO signal handler.
+ *
+ * @result The file descriptor, to be compared with those returned by
+ * bgpio_request_fd(), or -1 if the signal did not come from the
+ * library or the kernel's O_ASYNC support.
+ */
+int
+bgpio_sigio_fd(const siginfo_t *info)
+{
+    assert(info);
+    if (info->si_code == SI_QUEUE) {
+	return info->si_value.sival_int;
+    }
+    if (info->si_code > 0) {
+	/* POLL_IN, POLL_ERR and so on, from the kernel. */
+	return info->si_fd;
+    }
+    return -1;
+}
+
+/**
+ * Read the edge events queued for a request into a buffer, without
+ * waiting, and re-arm its notifier thread.  This is async-signal-safe,
+ * and is intended to be called from the handler of the signal raised
+ * by bgpio_enable_sigio().  Unlike bgpio_drain_events(), it does not
+ * update the request's input mirror, dispatch callbacks or last event,
+ * as the interrupted code may be using them.
+ *
+ * If the request's chip has gone away, its file descriptor is
+ * disarmed, so that no more signals are raised for it, until
+ * bgpio_rearm_sigio() is called.
+ *
+ * The handler should save and restore errno around this call.
+ *
+ * @param req The ::bgpio_request_t, for which bgpio_enable_sigio() has
+ * been called.
+ *
+ * @param events The buffer into which events are to be read.
+ *
+ * @param max The number of events for which \p events has room.
+ *
+ * @result The number of events read, which may be zero, or -1 with
+ * errno set.  ENODEV means that the request's chip has gone away.
+ */
+int
+bgpio_sigio_drain(bgpio_request_t *req, struct gpio_v2_line_event *events,
+		  int max)
+{
+    struct pollfd poll_fd;
+    uint64_t one = 1;
+    ssize_t res;
+    int err;
+
+    if (!req || !req->sigio || (max < 1)) {
+	errno = EINVAL;
+	return -1;
+    }
+    do {
+	res = read(req->req.fd, events,
+		   max * sizeof(struct gpio_v2_line_event));
+    } while ((res < 0) && (errno == EINTR));
+
+    if ((res < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+	err = errno;
+	poll_fd = (struct pollfd) {req->req.fd, POLLIN, 0};
+	if ((poll(&poll_fd, 1, 0) > 0) &&
+	    (poll_fd.revents & (POLLERR | POLLHUP))) {
+	    disarm_lost(req);
+	}
+	errno = err;
+    }
+    if (req->sigio->threaded) {
+	/* Re-arm even after an error; the notifier cannot do better,
+	 * and will not re-arm for a lost chip. */
+	(void) write(req->sigio->rearm_fd, &one, sizeof(one));
+    }
+    if (res < 0) {
+	return ((errno == EAGAIN) || (errno == EWOULDBLOCK))? 0: -1;
+    }
+    return res / sizeof(struct gpio_v2_line_event);
+}
@@ -0,0 +1,345 @@
+/*
+ *     Copyright (c) 2023 Marc Munro
+ *     Fileset:	libbgpiod - basic/bloodnok gpio device library
+ *     Author:   Marc Munro
+ *     License:  GPL-3.0
+ *
+ */
+
+/**
+ * @file   supervise.c
+ * @brief Re-acquisition of gpio lines when their chip reappears.
+ *
+ * When a gpio chip goes away, as a USB gpio expander does when it
+ * re-enumerates, the kernel fails any further operations on line
+ * requests for that chip with ENODEV.  A supervised request responds
+ * to this by waiting, using the inotify watch of a
+ * ::bgpio_registry_t, for a chip with the same label to appear, and
+ * then requesting the same lines again using the request's stored
+ * configuration.  Outputs are restored to the values last driven, as
+ * recorded in the request's output shadow, so they suffer only the
+ * glitch caused by the chip itself going away.
+ *
+ * The chip may reappear under a different path, in which case the
+ * request's chardev_path is updated.
+ */
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "bgpiod.h"
+
+/**
+ * Begin supervising a completed request so that its lines can be
+ * re-acquired by bgpio_reacquire() if its chip goes away and comes
+ * back.  The chip's label is recorded now, while it is present.
+ *
+ * In the event of an error, errno will be set.
+ *
+ * @param req The ::bgpio_request_t, which must have been completed by
+ * bgpio_complete_request().
+ *
+ * @result A dynamically allocated ::bgpio_supervisor_t struct, which
+ * must be freed using bgpio_end_supervision(), or NULL on failure.
+ */
+bgpio_supervisor_t *
+bgpio_supervise_request(bgpio_request_t *req)
+{
+    bgpio_supervisor_t *sup;
+    struct gpiochip_info info;
+    int fd;
+    int err;
+
+    assert(req);
+    fd = open(req->chardev_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+	return NULL;
+    }
+    if (ioctl(fd, GPIO_GET_CHIPINFO_IOCTL, &info)) {
+	err = errno;
+	close(fd);
+	errno = err;
+	return NULL;
+    }
+    close(fd);
+
+    sup = calloc(1, sizeof(bgpio_supervisor_t));
+    if (!sup) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    if (!(sup->registry = bgpio_open_registry())) {
+	err = errno;
+	free(sup);
+	errno = err;
+	return NULL;
+    }
+    sup->req = req;
+    memcpy(sup->label, info.label, GPIO_MAX_NAME_SIZE);
+    sup->label[GPIO_MAX_NAME_SIZE - 1] = '\0';
+    return sup;
+}
+
+/**
+ * Stop supervising a request.  The request itself is not affected,
+ * and must still be closed by bgpio_close_request().
+ *
+ * @param sup The ::bgpio_supervisor_t to be freed.
+ */
+void
+bgpio_end_supervision(bgpio_supervisor_t *sup)
+{
+    assert(sup);
+    bgpio_close_registry(sup->registry);
+    free(sup);
+}
+
+/**
+ * Predicate identifying whether an error from an operation on a
+ * request means that the request's chip has gone away.
+ *
+ * @param err The errno value from the failed operation.
+ *
+ * @result true if the lines must be re-acquired before they can be
+ * used again.
+ */
+bool
+bgpio_request_lost(int err)
+{
+    return (err == ENODEV) || (err == ENXIO);
+}
+
+/**
+ * Find the path at which the supervised request's chip is now
+ * present.  The chip is sought by label, or by its original path if
+ * its label does not identify it uniquely.
+ *
+ * @param sup The ::bgpio_supervisor_t.
+ *
+ * @result The path of the chip, or NULL if it is not present.
+ */
+static const char *
+find_chip(bgpio_supervisor_t *sup)
+{
+    bgpio_chip_entry_t *entry = NULL;
+
+    (void) bgpio_registry_refresh(sup->registry);
+    if (sup->label[0]) {
+	entry = bgpio_registry_find(sup->registry, sup->label);
+	if (entry && strcmp(entry->label, sup->label)) {
+	    /* The label matched some other chip's path suffix. */
+	    entry = NULL;
+	}
+    }
+    if (!entry) {
+	entry = bgpio_registry_find(sup->registry, sup->req->chardev_path);
+    }
+    return entry? entry->path: NULL;
+}
+
+/**
+ * Request the supervised lines from the chip at \p path, restoring
+ * outputs to the values last driven.
+ *
+ * @param sup The ::bgpio_supervisor_t.
+ *
+ * @param path The path of the chip.
+ *
+ * @result Zero if successful, else an errno value.
+ */
+static int
+request_lines(bgpio_supervisor_t *sup, const char *path)
+{
+    bgpio_request_t *req = sup->req;
+    struct gpio_v2_line_config *config = &req->req.config;
+    char *new_path;
+    int fd;
+    int i;
+
+    for (i = 0; i < config->num_attrs; i++) {
+	if (config->attrs[i].attr.id == GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES) {
+	    uint64_t known = config->attrs[i].mask & req->shadow.known;
+	    config->attrs[i].attr.values =
+		(config->attrs[i].attr.values & ~known) |
+		(req->shadow.bits & known);
+	}
+    }
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+	return errno;
+    }
+    if (ioctl(fd, GPIO_V2_GET_LINE_IOCTL, &req->req)) {
+	int err = errno;
+	close(fd);
+	return err;
+    }
+    close(fd);
+
+    if (strcmp(path, req->chardev_path)) {
+	if ((new_path = malloc(strlen(path) + 1))) {
+	    strcpy(new_path, path);
+	    free(req->chardev_path);
+	    req->chardev_path = new_path;
+	}
+    }
+    if (req->nonblocking) {
+	/* The new file descriptor must behave as the old one did. */
+	(void) bgpio_request_nonblocking(req, true);
+    }
+    if (req->sigio) {
+	(void) bgpio_rearm_sigio(req);
+    }
+    if (req->mirror.enabled) {
+	/* Edges may have been missed, so the mirror must be synced. */
+	if (bgpio_enable_mirror(req, req->mirror.resync_msecs)) {
+	    return errno;
+	}
+    }
+    return 0;
+}
+
+/**
+ * Re-acquire the lines of a supervised request after its chip has
+ * gone away, waiting for the chip to reappear.  The duration of the
+ * outage, measured from the first failed attempt to use the lines, is
+ * recorded in \p sup->last_gap_ns.
+ *
+ * @param sup The ::bgpio_supervisor_t.
+ *
+ * @param timeout_msecs Pointer to a timeout value given in
+ * milliseconds.  If no timeout is required, the pointer should be
+ * NULL.
+ *
+ * @result Zero if successful, ETIMEDOUT if the chip did not reappear
+ * in time, or another errno value if the lines could not be
+ * re-acquired.
+ */
+int
+bgpio_reacquire(bgpio_supervisor_t *sup, int *timeout_msecs)
+{
+    assert(sup);
+    bgpio_request_t *req = sup->req;
+    uint64_t start = bgpio_now_ns();
+    const char *path;
+    int wait_msecs;
+    int64_t remaining;
+    int err;
+
+    if (!sup->lost_ns) {
+	sup->lost_ns = start;
+    }
+    if (req->req.fd > 0) {
+	(void) close(req->req.fd);
+	req->req.fd = 0;
+    }
+    while (true) {
+	if ((path = find_chip(sup))) {
+	    err = request_lines(sup, path);
+	    if (!err) {
+		break;
+	    }
+	    if ((err != ENOENT) && (err != EACCES) && !bgpio_request_lost(err)) {
+		/* The chip is back, but we cannot have our lines. */
+		return err;
+	    }
+	}
+	wait_msecs = BGPIO_REACQUIRE_POLL_MSECS;
+	if (timeout_msecs) {
+	    remaining = *timeout_msecs -
+		(int64_t) ((bgpio_now_ns() - start) / 1000000);
+	    if (remaining <= 0) {
+		return ETIMEDOUT;
+	    }
+	    if (remaining < wait_msecs) {
+		wait_msecs = (int) remaining;
+	    }
+	}
+	if (sup->registry->inotify_fd >= 0) {
+	    /* We also time out here as the chip may become usable
+	     * without any change to its device file. */
+	    struct pollfd poll_fd = {sup->registry->inotify_fd, POLLIN, 0};
+	    (void) poll(&poll_fd, 1, wait_msecs);
+	}
+	else {
+	    bgpio_registry_t *registry;
+	    (void) poll(NULL, 0, wait_msecs);
+	    if ((registry = bgpio_open_registry())) {
+		bgpio_close_registry(sup->registry);
+		sup->registry = registry;
+	    }
+	}
+    }
+    sup->last_gap_ns = bgpio_now_ns() - sup->lost_ns;
+    sup->lost_ns = 0;
+    sup->recoveries++;
+    return 0;
+}
+
+/**
+ * Await an event on the lines of a supervised request, as
+ * bgpio_await_event() does, re-acquiring the lines if their chip goes
+ * away.  Callers can tell that a re-acquire has happened from a change
+ * to \p sup->recoveries.
+ *
+ * @param sup The ::bgpio_supervisor_t.
+ *
+ * @param timeout_msecs Pointer to a timeout value given in
+ * milliseconds, applied separately to awaiting the event and to
+ * awaiting the chip's reappearance.  If no timeout is required, the
+ * pointer should be NULL.
+ *
+ * @result Zero if successful, with ::bgpio_request_t->event
+ * describing the event, or an errno value as for bgpio_await_event()
+ * or bgpio_reacquire().
+ */
+int
+bgpio_supervised_await_event(bgpio_supervisor_t *sup, int *timeout_msecs)
+{
+    assert(sup);
+    int err;
+
+    while (bgpio_request_lost(err = bgpio_await_event(sup->req,
+							timeout_msecs))) {
+	if ((err = bgpio_reacquire(sup, timeout_msecs))) {
+	    return err;
+	}
+    }
+    return err;
+}
+
+/**
+ * Fetch the values of the lines of a supervised request, as
+ * bgpio_fetch() does, re-acquiring the lines, and waiting for as long
+ * as it takes, if their chip goes away.
+ *
+ * @param sup The ::bgpio_supervisor_t.
+ *
+ * @result Zero if successful, else -1 with errno set.
+ */
+int
+bgpio_supervised_fetch(bgpio_supervisor_t *sup)
+{
+    assert(sup);
+    int err;
+
+    if (bgpio_fetch(sup->req) == 0) {
+	return 0;
+    }
+    if (!bgpio_request_lost(errno)) {
+	return -1;
+    }
+    if ((err = bgpio_reacquire(sup, NULL))) {
+	errno = err;
+	return -1;
+    }
+    return bgpio_fetch(sup->req);
+}
@@ -0,0 +1,621 @@
+/*
+ *     Copyright (c) 2023 Marc Munro
+ *     Fileset:	libbgpiod - basic/bloodnok gpio device library
+ *     Author:   Marc Munro
+ *     License:  GPL-3.0
+ *
+ */
+
+/**
+ * @file   uring.c
+ * @brief Reading the edge events of many requests through io_uring.
+ *
+ * Awaiting events on many requests with poll() and read() costs at
+ * least two system calls per wakeup, plus one read() for each request
+ * that is ready.  A ::bgpio_uring_t instead keeps an io_uring read
+ * outstanding on every request.  A single io_uring_enter() call then
+ * both re-posts the reads whose events have been consumed and waits
+ * for the next completions, which deliver the events directly into
+ * each request's buffer.
+ *
+ * The rings are set up with raw system calls so that there is no
+ * dependency on liburing.  If the kernel, or the headers we were built
+ * with, do not provide io_uring, or it has been disabled, the same
+ * interface is provided using poll() and read().
+ *
+ * Only event reads are made through io_uring.  The gpio line ioctls
+ * used by bgpio_fetch() and bgpio_set() cannot be: the gpio driver
+ * does not implement io_uring command passthrough, so these remain
+ * synchronous.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <assert.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+#endif
+
+#include "bgpiod.h"
+
+#ifdef HAVE_IO_URING
+
+/**
+ * The user_data of the entries that cancel outstanding reads.  Reads
+ * have the index of their source.
+ */
+#define CANCEL_DATA ((uint64_t) -1)
+
+/**
+ * The mapped io_uring submission and completion rings.
+ */
+struct bgpio_uring_ring {
+    int                  fd;        /**< The io_uring file descriptor */
+    void                *sq_ptr;    /**< Mapped submission ring */
+    size_t               sq_size;   /**< Its size */
+    void                *cq_ptr;    /**< Mapped completion ring, which
+				     * may be sq_ptr */
+    size_t               cq_size;   /**< Its size */
+    struct io_uring_sqe *sqes;      /**< Mapped submission entries */
+    size_t               sqes_size; /**< Their size */
+    unsigned            *sq_tail;   /**< Submission ring tail */
+    unsigned            *sq_mask;   /**< Submission ring mask */
+    unsigned            *sq_array;  /**< Submission ring indexes */
+    unsigned            *cq_head;   /**< Completion ring head */
+    unsigned            *cq_tail;   /**< Completion ring tail */
+    unsigned            *cq_mask;   /**< Completion ring mask */
+    struct io_uring_cqe *cqes;      /**< Completion entries */
+    unsigned             to_submit; /**< Entries queued but not yet
+				     * submitted */
+    bool                 ext_arg;   /**< Whether io_uring_enter() can
+				     * take a timeout */
+    bool                 closing;   /**< Whether reads are being
+				     * cancelled */
+};
+
+/**
+ * Unmap and close a ring.
+ *
+ * @param ring The ring, which is also freed.
+ */
+static void
+close_ring(struct bgpio_uring_ring *ring)
+{
+    if (ring->sqes) {
+	munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ptr && (ring->cq_ptr != ring->sq_ptr)) {
+	munmap(ring->cq_ptr, ring->cq_size);
+    }
+    if (ring->sq_ptr) {
+	munmap(ring->sq_ptr, ring->sq_size);
+    }
+    if (ring->fd >= 0) {
+	close(ring->fd);
+    }
+    free(ring);
+}
+
+/**
+ * Map one of the regions of an io_uring.
+ *
+ * @param fd The io_uring file descriptor.
+ *
+ * @param size The size of the region.
+ *
+ * @param offset The offset identifying the region.
+ *
+ * @result The mapping, or NULL on failure.
+ */
+static void *
+map_region(int fd, size_t size, off_t offset)
+{
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_POPULATE, fd, offset);
+
+    return (ptr == MAP_FAILED)? NULL: ptr;
+}
+
+/**
+ * Create an io_uring with room for at least \p entries submissions.
+ *
+ * @param entries The number of submission entries required.
+ *
+ * @result The ring, or NULL, with errno set, if io_uring is
+ * unavailable.
+ */
+static struct bgpio_uring_ring *
+open_ring(unsigned entries)
+{
+    struct bgpio_uring_ring *ring;
+    struct io_uring_params params;
+    int err;
+
+    if (!(ring = calloc(1, sizeof(struct bgpio_uring_ring)))) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+	err = errno;
+	free(ring);
+	errno = err;
+	return NULL;
+    }
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes +
+	params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+	if (ring->cq_size > ring->sq_size) {
+	    ring->sq_size = ring->cq_size;
+	}
+	ring->cq_size = ring->sq_size;
+    }
+    ring->sq_ptr = map_region(ring->fd, ring->sq_size, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr) {
+	ring->cq_ptr = (params.features & IORING_FEAT_SINGLE_MMAP)?
+	    ring->sq_ptr:
+	    map_region(ring->fd, ring->cq_size, IORING_OFF_CQ_RING);
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    if (ring->cq_ptr) {
+	ring->sqes = map_region(ring->fd, ring->sqes_size, IORING_OFF_SQES);
+    }
+    if (!ring->sqes) {
+	err = errno;
+	close_ring(ring);
+	errno = err;
+	return NULL;
+    }
+    ring->sq_tail = ring->sq_ptr + params.sq_off.tail;
+    ring->sq_mask = ring->sq_ptr + params.sq_off.ring_mask;
+    ring->sq_array = ring->sq_ptr + params.sq_off.array;
+    ring->cq_head = ring->cq_ptr + params.cq_off.head;
+    ring->cq_tail = ring->cq_ptr + params.cq_off.tail;
+    ring->cq_mask = ring->cq_ptr + params.cq_off.ring_mask;
+    ring->cqes = ring->cq_ptr + params.cq_off.cqes;
+#ifdef IORING_FEAT_EXT_ARG
+    ring->ext_arg = (params.features & IORING_FEAT_EXT_ARG) != 0;
+#endif
+    return ring;
+}
+
+/**
+ * Queue a read of a source's events.  It will be submitted by the
+ * next call to io_uring_enter().
+ *
+ * @param uring The ::bgpio_uring_t.
+ *
+ * @param src The index of the source.
+ */
+static void
+post_read(bgpio_uring_t *uring, int src)
+{
+    struct bgpio_uring_ring *ring = uring->ring;
+    bgpio_uring_source_t *source = &uring->sources[src];
+    unsigned tail = *ring->sq_tail;
+    unsigned idx = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = source->req->req.fd;
+    sqe->addr = (uint64_t) (uintptr_t) source->events;
+    sqe->len = sizeof(source->events);
+    sqe->off = (uint64_t) -1;    /* Use, and update, the file position */
+    sqe->user_data = (uint64_t) src;
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    source->posted = true;
+}
+
+/**
+ * Collect all available completions, placing the events read into
+ * their sources' buffers.
+ *
+ * @param uring The ::bgpio_uring_t.
+ *
+ * @result Zero if successful, else the errno value of a failed read.
+ */
+static int
+reap(bgpio_uring_t *uring)
+{
+    struct bgpio_uring_ring *ring = uring->ring;
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    struct io_uring_cqe *cqe;
+    bgpio_uring_source_t *source;
+    int err = 0;
+
+    while (head != tail) {
+	cqe = &ring->cqes[head & *ring->cq_mask];
+	head++;
+	if (cqe->user_data == CANCEL_DATA) {
+	    continue;
+	}
+	source = &uring->sources[cqe->user_data];
+	source->posted = false;
+	if (ring->closing) {
+	    continue;
+	}
+	if (cqe->res < 0) {
+	    if ((cqe->res == -EINTR) || (cqe->res == -EAGAIN)) {
+		post_read(uring, (int) cqe->user_data);
+	    }
+	    else if (!err) {
+		err = -cqe->res;
+	    }
+	}
+	else {
+	    source->count = cqe->res / sizeof(struct gpio_v2_line_event);
+	    source->next = 0;
+	    if (!source->count) {
+		post_read(uring, (int) cqe->user_data);
+	    }
+	}
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return err;
+}
+
+/**
+ * Submit any queued reads and wait for at least one completion.
+ *
+ * @param uring The ::bgpio_uring_t.
+ *
+ * @param timeout_msecs Pointer to a timeout value given in
+ * milliseconds, or NULL.
+ *
+ * @result Zero if successful, ETIMEDOUT, or another errno value.
+ */
+static int
+ring_wait(bgpio_uring_t *uring, int *timeout_msecs)
+{
+    struct bgpio_uring_ring *ring = uring->ring;
+    int res;
+
+#ifdef IORING_FEAT_EXT_ARG
+    if (ring->ext_arg) {
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.sigmask_sz = _NSIG / 8;
+	if (timeout_msecs) {
+	    ts.tv_sec = *timeout_msecs / 1000;
+	    ts.tv_nsec = (*timeout_msecs % 1000) * 1000000;
+	    arg.ts = (uint64_t) (uintptr_t) &ts;
+	}
+	res = (int) syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1,
+			    IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+			    &arg, sizeof(arg));
+	if (res < 0) {
+	    return (errno == ETIME)? ETIMEDOUT: errno;
+	}
+	ring->to_submit -= res;
+	return reap(uring);
+    }
+#endif
+    if (ring->to_submit) {
+	res = (int) syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 0,
+			    0, NULL, 0);
+	if (res < 0) {
+	    return errno;
+	}
+	ring->to_submit -= res;
+    }
+    if (*ring->cq_head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+	/* The ring's fd is readable once completions are available. */
+	struct pollfd poll_fd = {ring->fd, POLLIN, 0};
+	res = poll(&poll_fd, 1, timeout_msecs? *timeout_msecs: -1);
+	if (res == 0) {
+	    return ETIMEDOUT;
+	}
+	if (res < 0) {
+	    return errno;
+	}
+    }
+    return reap(uring);
+}
+
+/**
+ * Cancel all outstanding reads, and wait for them to complete, so
+ * that the kernel cannot write to their buffers once they have been
+ * freed.
+ *
+ * @param uring The ::bgpio_uring_t.
+ */
+static void
+cancel_reads(bgpio_uring_t *uring)
+{
+    struct bgpio_uring_ring *ring = uring->ring;
+    struct io_uring_sqe *sqe;
+    unsigned tail;
+    bool posted;
+    int i;
+
+    ring->closing = true;
+    if (ring->to_submit) {
+	if (syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 0,
+		    0, NULL, 0) < 0) {
+	    return;
+	}
+	ring->to_submit = 0;
+    }
+    for (i = 0; i < uring->count; i++) {
+	if (uring->sources[i].posted) {
+	    tail = *ring->sq_tail;
+	    sqe = &ring->sqes[tail & *ring->sq_mask];
+	    memset(sqe, 0, sizeof(*sqe));
+	    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	    sqe->fd = -1;
+	    sqe->addr = (uint64_t) i;
+	    sqe->user_data = CANCEL_DATA;
+	    ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+	    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	    ring->to_submit++;
+	}
+    }
+    do {
+	if (syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1,
+		    IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    return;
+	}
+	ring->to_submit = 0;
+	(void) reap(uring);
+	posted = false;
+	for (i = 0; i < uring->count; i++) {
+	    posted |= uring->sources[i].posted;
+	}
+    } while (posted);
+}
+
+#endif
+
+/**
+ * Wait, using poll(), until some requests are readable, and read their
+ * events into their sources' buffers.
+ *
+ * @param uring The ::bgpio_uring_t.
+ *
+ * @param timeout_msecs Pointer to a timeout value given in
+ * milliseconds, or NULL.
+ *
+ * @result Zero if successful, ETIMEDOUT, or another errno value.
+ */
+static int
+poll_wait(bgpio_uring_t *uring, int *timeout_msecs)
+{
+    struct pollfd *poll_fds;
+    bgpio_uring_source_t *source;
+    ssize_t res;
+    int ready;
+    int err = 0;
+    int i;
+
+    if (!(poll_fds = malloc(uring->count * sizeof(struct pollfd)))) {
+	return ENOMEM;
+    }
+    for (i = 0; i < uring->count; i++) {
+	poll_fds[i] = (struct pollfd) {
+	    uring->sources[i].req->req.fd, POLLIN, 0};
+    }
+    ready = poll(poll_fds, uring->count, timeout_msecs? *timeout_msecs: -1);
+    if (ready == 0) {
+	err = ETIMEDOUT;
+    }
+    else if (ready < 0) {
+	err = errno;
+    }
+    for (i = 0; (i < uring->count) && (ready > 0); i++) {
+	if (poll_fds[i].revents) {
+	    ready--;
+	    source = &uring->sources[i];
+	    res = read(source->req->req.fd, source->events,
+		       sizeof(source->events));
+	    if (res < 0) {
+		if (errno != EINTR) {
+		    err = errno;
+		}
+		break;
+	    }
+	    source->count = res / sizeof(struct gpio_v2_line_event);
+	    source->next = 0;
+	}
+    }
+    free(poll_fds);
+    return err;
+}
+
+/**
+ * Return the next buffered event, taking one from each source in turn
+ * so that a busy request cannot starve the others.  A source whose
+ * buffer has been emptied has its read posted again.
+ *
+ * @param uring The ::bgpio_uring_t.
+ *
+ * @param p_req Where the request of the event will be placed.
+ *
+ * @result true if an event was found, in (*p_req)->event.
+ */
+static bool
+take_event(bgpio_uring_t *uring, bgpio_request_t **p_req)
+{
+    bgpio_uring_source_t *source;
+    int src;
+    int n;
+
+    for (n = 0; n < uring->count; n++) {
+	src = (uring->next_src + n) % uring->count;
+	source = &uring->sources[src];
+	if (source->next < source->count) {
+	    source->req->event = source->events[source->next++];
+	    bgpio_note_event(source->req, &source->req->event);
+	    if (source->next == source->count) {
+		source->next = source->count = 0;
+#ifdef HAVE_IO_URING
+		if (!uring->fallback) {
+		    post_read(uring, src);
+		}
+#endif
+	    }
+	    uring->next_src = (src + 1) % uring->count;
+	    *p_req = source->req;
+	    return true;
+	}
+    }
+    return false;
+}
+
+/**
+ * Create a reader for the edge events of a set of requests, using
+ * io_uring if the kernel provides it.  Events for these requests
+ * should then be read only using bgpio_uring_await_event().
+ *
+ * In the event of an error, errno will be set.
+ *
+ * @param reqs Array of completed ::bgpio_request_t requests, with edge
+ * detection configured.  These must not be closed while the reader
+ * exists.
+ *
+ * @param count The number of requests.
+ *
+ * @result A dynamically allocated ::bgpio_uring_t struct, which must
+ * be freed using bgpio_close_uring(), or NULL on failure.
+ * \p uring->fallback is true if io_uring is not being used.
+ */
+bgpio_uring_t *
+bgpio_open_uring(bgpio_request_t **reqs, int count)
+{
+    bgpio_uring_t *uring;
+    int i;
+
+    assert(reqs);
+    if (count < 1) {
+	errno = EINVAL;
+	return NULL;
+    }
+    if (!(uring = calloc(1, sizeof(bgpio_uring_t))) ||
+	!(uring->sources = calloc(count, sizeof(bgpio_uring_source_t)))) {
+	free(uring);
+	errno = ENOMEM;
+	return NULL;
+    }
+    uring->count = count;
+    for (i = 0; i < count; i++) {
+	uring->sources[i].req = reqs[i];
+    }
+    uring->fallback = true;
+#ifdef HAVE_IO_URING
+    if ((uring->ring = open_ring(count))) {
+	uring->fallback = false;
+	for (i = 0; i < count; i++) {
+	    post_read(uring, i);
+	}
+    }
+#endif
+    return uring;
+}
+
+/**
+ * Free a reader created by bgpio_open_uring().  Any outstanding reads
+ * are cancelled, and any events not yet returned are lost.  The
+ * requests are not affected.
+ *
+ * @param uring The ::bgpio_uring_t to be freed.
+ */
+void
+bgpio_close_uring(bgpio_uring_t *uring)
+{
+    assert(uring);
+#ifdef HAVE_IO_URING
+    if (uring->ring) {
+	cancel_reads(uring);
+	close_ring(uring->ring);
+	uring->ring = NULL;
+    }
+#endif
+    free(uring->sources);
+    free(uring);
+}
+
+/**
+ * Await an event on any of the requests of a reader, as
+ * bgpio_await_event() does for a single request.  Events from each
+ * request are returned in the order they occurred, and each request
+ * with events pending gets a turn before any has a second.
+ *
+ * @param uring The ::bgpio_uring_t.
+ *
+ * @param p_req Where the request on which the event occurred will be
+ * placed.  Its ::bgpio_request_t->event will describe the event.
+ *
+ * @param timeout_msecs Pointer to a timeout value given in
+ * milliseconds.  If no timeout is required, the pointer should be
+ * NULL.
+ *
+ * @result Zero if successful, ETIMEDOUT if no event arrived in time,
+ * or another errno value.  ENODEV means that a request's chip has
+ * gone away.
+ */
+int
+bgpio_uring_await_event(bgpio_uring_t *uring, bgpio_request_t **p_req,
+			int *timeout_msecs)
+{
+    assert(uring);
+    assert(p_req);
+    uint64_t deadline = 0;
+    uint64_t now;
+    bool waited = false;
+    int remaining = 0;
+    int err;
+
+    if (timeout_msecs) {
+	deadline = bgpio_now_ns() + ((uint64_t) *timeout_msecs * 1000000);
+    }
+    while (!take_event(uring, p_req)) {
+	/* A wait may end without an event, eg for a read that was
+	 * interrupted, so each wait gets only what is left of the
+	 * timeout. */
+	if (timeout_msecs) {
+	    now = bgpio_now_ns();
+	    if (waited && (now >= deadline)) {
+		return ETIMEDOUT;
+	    }
+	    remaining = (now >= deadline)? 0:
+		(int) ((deadline - now + 999999) / 1000000);
+	}
+#ifdef HAVE_IO_URING
+	if (!uring->fallback) {
+	    err = ring_wait(uring, timeout_msecs? &remaining: NULL);
+	}
+	else
+#endif
+	{
+	    err = poll_wait(uring, timeout_msecs? &remaining: NULL);
+	}
+	if (err) {
+	    return err;
+	}
+	waited = true;
+    }
+    return 0;
+}
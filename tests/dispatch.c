@@ -0,0 +1,205 @@
+/*
+ *     Copyright (c) 2023 Marc Munro
+ *     Fileset:	libbgpiod - basic/bloodnok gpio device library
+ *     Author:   Marc Munro
+ *     License:  GPL-3.0
+ *
+ */
+
+/**
+ * @file   dispatch.c
+ * @brief Test helper for per-line edge callbacks.
+ *
+ * Usage: dispatch
+ *
+ * Registers callbacks, with bgpio_on_edge(), for different lines and
+ * edges of a request whose file descriptor is the read end of a pipe.
+ * Edge events, in the kernel's format, are written to the pipe, and
+ * bgpio_dispatch() must pass each to the callback for its line and
+ * edge, discarding those with no callback.  A callback is then
+ * replaced, and another removed, and a second round of events must
+ * follow the new registrations.  No gpio hardware is needed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "../lib/bgpiod.h"
+
+/**
+ * The lines of the request.
+ */
+static int lines[] = {3, 7, 12};
+
+/**
+ * The number of lines in the request.
+ */
+#define NUM_LINES (sizeof(lines) / sizeof(lines[0]))
+
+/**
+ * The number of times each line and edge is written in each round,
+ * which is more than are read in a single batch.
+ */
+#define REPEATS BGPIO_DISPATCH_BATCH
+
+/**
+ * Calls to a callback, counted by line index and edge (0 for rising,
+ * 1 for falling).
+ */
+typedef struct calls_t {
+    int counts[NUM_LINES][2];
+} calls_t;
+
+/**
+ * The ::bgpio_edge_fn that counts its calls.
+ */
+static void
+count_call(bgpio_request_t *req, struct gpio_v2_line_event *event,
+	   void *ctx)
+{
+    calls_t *calls = (calls_t *) ctx;
+    int idx = bgpio_idx_for_line(req, event->offset);
+
+    if (idx < 0) {
+	fprintf(stderr, "dispatch: event for unknown line %d\n",
+		event->offset);
+	exit(1);
+    }
+    calls->counts[idx][
+	(event->id == GPIO_V2_LINE_EVENT_FALLING_EDGE)? 1: 0]++;
+}
+
+/**
+ * Register a callback, exiting on failure.
+ */
+static void
+on_edge(bgpio_request_t *req, int line, uint64_t edge_mask, calls_t *calls)
+{
+    int err = bgpio_on_edge(req, line, edge_mask, calls? count_call: NULL,
+			    calls);
+
+    if (err) {
+	fprintf(stderr, "dispatch: unable to register line %d: %s\n",
+		line, strerror(err));
+	exit(err);
+    }
+}
+
+/**
+ * Write #REPEATS rising and falling edges for every line to the pipe,
+ * and dispatch them.
+ */
+static void
+dispatch_round(bgpio_request_t *req, int write_fd)
+{
+    struct gpio_v2_line_event event;
+    int expected = REPEATS * NUM_LINES * 2;
+    int timeout = 100;
+    int total = 0;
+    int count;
+    int i;
+    int l;
+
+    for (i = 0; i < REPEATS * 2; i++) {
+	for (l = 0; l < NUM_LINES; l++) {
+	    memset(&event, 0, sizeof(event));
+	    event.id = (i & 1)? GPIO_V2_LINE_EVENT_FALLING_EDGE:
+		GPIO_V2_LINE_EVENT_RISING_EDGE;
+	    event.offset = lines[l];
+	    if (write(write_fd, &event, sizeof(event)) != sizeof(event)) {
+		fprintf(stderr, "dispatch: unable to write event: %s\n",
+			strerror(errno));
+		exit(errno);
+	    }
+	}
+    }
+    while (total < expected) {
+	if ((count = bgpio_dispatch(req, &timeout)) <= 0) {
+	    fprintf(stderr, "dispatch: %d of %d events dispatched\n",
+		    total, expected);
+	    exit(1);
+	}
+	total += count;
+    }
+}
+
+/**
+ * Check the calls made to a callback.
+ */
+static void
+check_calls(calls_t *calls, const char *name, int expected[NUM_LINES][2])
+{
+    int l;
+    int edge;
+
+    for (l = 0; l < NUM_LINES; l++) {
+	for (edge = 0; edge < 2; edge++) {
+	    if (calls->counts[l][edge] != expected[l][edge]) {
+		fprintf(stderr, "dispatch: %s called %d times for line %d "
+			"%s edges, expected %d\n", name,
+			calls->counts[l][edge], lines[l],
+			edge? "falling": "rising", expected[l][edge]);
+		exit(1);
+	    }
+	}
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    bgpio_request_t *req = calloc(1, sizeof(bgpio_request_t));
+    calls_t first = {{{0}}};
+    calls_t second = {{{0}}};
+    int fds[2];
+    int i;
+
+    (void) argv;
+    if (argc != 1) {
+	fprintf(stderr, "Usage: dispatch\n");
+	exit(EINVAL);
+    }
+    if (!req || pipe(fds)) {
+	fprintf(stderr, "dispatch: unable to create request: %s\n",
+		strerror(errno));
+	exit(errno);
+    }
+    req->req.fd = fds[0];
+    req->req.num_lines = NUM_LINES;
+    for (i = 0; i < NUM_LINES; i++) {
+	req->req.offsets[i] = lines[i];
+    }
+    if (bgpio_on_edge(req, 5, GPIO_V2_LINE_FLAG_EDGE_RISING, count_call,
+		      &first) != EINVAL) {
+	fprintf(stderr, "dispatch: registered a line not in the request\n");
+	exit(1);
+    }
+
+    /* Line 3 rising to first, line 7 both to first, and line 12
+     * falling to second.  Line 3 falling and line 12 rising have no
+     * callback. */
+    on_edge(req, 3, GPIO_V2_LINE_FLAG_EDGE_RISING, &first);
+    on_edge(req, 7, GPIO_V2_LINE_FLAG_EDGE_RISING |
+	    GPIO_V2_LINE_FLAG_EDGE_FALLING, &first);
+    on_edge(req, 12, GPIO_V2_LINE_FLAG_EDGE_FALLING, &second);
+    dispatch_round(req, fds[1]);
+    check_calls(&first, "first", (int [NUM_LINES][2]) {
+	    {REPEATS, 0}, {REPEATS, REPEATS}, {0, 0}});
+    check_calls(&second, "second", (int [NUM_LINES][2]) {
+	    {0, 0}, {0, 0}, {0, REPEATS}});
+    printf("dispatched events to their callbacks\n");
+
+    /* Line 7 falling now goes to second, and line 3 rising nowhere. */
+    on_edge(req, 7, GPIO_V2_LINE_FLAG_EDGE_FALLING, &second);
+    on_edge(req, 3, GPIO_V2_LINE_FLAG_EDGE_RISING, NULL);
+    dispatch_round(req, fds[1]);
+    check_calls(&first, "first", (int [NUM_LINES][2]) {
+	    {REPEATS, 0}, {2 * REPEATS, REPEATS}, {0, 0}});
+    check_calls(&second, "second", (int [NUM_LINES][2]) {
+	    {0, 0}, {0, REPEATS}, {0, 2 * REPEATS}});
+    printf("replaced and removed callbacks\n");
+    return 0;
+}
@@ -0,0 +1,166 @@
+/*
+ *     Copyright (c) 2023 Marc Munro
+ *     Fileset:	libbgpiod - basic/bloodnok gpio device library
+ *     Author:   Marc Munro
+ *     License:  GPL-3.0
+ *
+ */
+
+/**
+ * @file   drain.c
+ * @brief Test helper for draining queued events and for busy-poll mode.
+ *
+ * Usage: drain
+ *
+ * Writes edge events, in the kernel's format, to a pipe standing in for
+ * a line request's file descriptor, and drains them with
+ * bgpio_drain_events(): first a limited number, and then the rest.
+ * Every event must be drained, in order, and a drain with nothing
+ * queued must return at once, whether or not the request is
+ * non-blocking.  Busy-poll mode is entered and left along the way, and
+ * must leave the request as blocking or non-blocking as it found it.
+ * No gpio hardware is needed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "../lib/bgpiod.h"
+
+/**
+ * The number of events written, which is more than are read in a
+ * single batch.
+ */
+#define EVENT_COUNT (2 * BGPIO_DISPATCH_BATCH + 3)
+
+/**
+ * The number of events taken by the first, limited, drain.
+ */
+#define FIRST_DRAIN 5
+
+/**
+ * The ::bgpio_edge_fn that checks the order of drained events.
+ */
+static void
+check_order(bgpio_request_t *req, struct gpio_v2_line_event *event,
+	    void *ctx)
+{
+    uint32_t *p_seqno = (uint32_t *) ctx;
+
+    (void) req;
+    if (event->seqno != *p_seqno + 1) {
+	fprintf(stderr, "drain: event %u follows event %u\n",
+		event->seqno, *p_seqno);
+	exit(1);
+    }
+    *p_seqno = event->seqno;
+}
+
+/**
+ * Check that a request's file descriptor, and its record of it, agree
+ * on whether it is non-blocking.
+ */
+static void
+check_mode(bgpio_request_t *req, bool nonblocking, char *when)
+{
+    bool fd_nonblocking = (fcntl(req->req.fd, F_GETFL) & O_NONBLOCK) != 0;
+
+    if ((fd_nonblocking != nonblocking) || (req->nonblocking != nonblocking)) {
+	fprintf(stderr, "drain: request is %sblocking %s\n",
+		fd_nonblocking? "non-": "", when);
+	exit(1);
+    }
+}
+
+/**
+ * Enter and leave busy-poll mode, checking that the request's blocking
+ * mode is as it was before.
+ */
+static void
+busy_poll_round_trip(bgpio_request_t *req)
+{
+    bool nonblocking = req->nonblocking;
+
+    if (bgpio_request_busy_poll(req, true, 16)) {
+	fprintf(stderr, "drain: unable to enter busy-poll mode\n");
+	exit(1);
+    }
+    check_mode(req, true, "in busy-poll mode");
+    if (bgpio_request_busy_poll(req, false, 0)) {
+	fprintf(stderr, "drain: unable to leave busy-poll mode\n");
+	exit(1);
+    }
+    check_mode(req, nonblocking, "after busy-poll mode");
+}
+
+/**
+ * Drain whatever is queued, expecting a given number of events.
+ */
+static void
+drain(bgpio_request_t *req, int max, int expected, uint32_t *p_seqno)
+{
+    int count = bgpio_drain_events(req, check_order, p_seqno, max);
+
+    if (count != expected) {
+	fprintf(stderr, "drain: %d events drained, expected %d\n",
+		count, expected);
+	exit(1);
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    bgpio_request_t *req = calloc(1, sizeof(bgpio_request_t));
+    struct gpio_v2_line_event event;
+    uint32_t seqno = 0;
+    int fds[2];
+    int i;
+
+    (void) argv;
+    if (argc != 1) {
+	fprintf(stderr, "Usage: drain\n");
+	exit(EINVAL);
+    }
+    if (!req || pipe(fds)) {
+	fprintf(stderr, "drain: unable to create request: %s\n",
+		strerror(errno));
+	exit(errno);
+    }
+    req->req.fd = fds[0];
+    req->req.num_lines = 1;
+    req->req.offsets[0] = 10;
+
+    for (i = 0; i < EVENT_COUNT; i++) {
+	memset(&event, 0, sizeof(event));
+	event.timestamp_ns = 1000 + i * 10;
+	event.id = (i & 1)? GPIO_V2_LINE_EVENT_FALLING_EDGE:
+	    GPIO_V2_LINE_EVENT_RISING_EDGE;
+	event.offset = 10;
+	event.seqno = event.line_seqno = i + 1;
+	if (write(fds[1], &event, sizeof(event)) != sizeof(event)) {
+	    fprintf(stderr, "drain: unable to write event: %s\n",
+		    strerror(errno));
+	    exit(errno);
+	}
+    }
+
+    busy_poll_round_trip(req);
+    drain(req, FIRST_DRAIN, FIRST_DRAIN, &seqno);
+    drain(req, 0, EVENT_COUNT - FIRST_DRAIN, &seqno);
+    drain(req, 0, 0, &seqno);
+    printf("drained %u events in order\n", seqno);
+
+    if (bgpio_request_nonblocking(req, true)) {
+	fprintf(stderr, "drain: unable to make request non-blocking\n");
+	exit(1);
+    }
+    busy_poll_round_trip(req);
+    drain(req, 0, 0, &seqno);
+    printf("busy-poll mode restored blocking and non-blocking requests\n");
+    return 0;
+}
@@ -0,0 +1,171 @@
+/*
+ *     Copyright (c) 2023 Marc Munro
+ *     Fileset:	libbgpiod - basic/bloodnok gpio device library
+ *     Author:   Marc Munro
+ *     License:  GPL-3.0
+ *
+ */
+
+/**
+ * @file   flood.c
+ * @brief Test helper for the edge-storm rate guard.
+ *
+ * Usage: flood chip-path line
+ *
+ * Floods an unconnected input line with edges, by repeatedly switching
+ * its bias between pull-up and pull-down, until the rate guard
+ * throttles it.  The flood then stops, and the line must be restored
+ * once its cool-down has passed.  The result is zero if the line was
+ * both throttled and restored.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+
+#include "../lib/bgpiod.h"
+
+/**
+ * The maximum rate, in events per second, allowed by the guard.
+ */
+#define MAX_RATE 100
+
+/**
+ * How long, in milliseconds, a throttled line stays throttled.
+ */
+#define COOLDOWN_MSECS 100
+
+/**
+ * How long, in milliseconds, we wait for each of throttling and
+ * restoration before giving up.
+ */
+#define PATIENCE_MSECS 2000
+
+/**
+ * What the guard has reported.
+ */
+typedef struct flood_state {
+    int throttles;
+    int restores;
+    uint64_t throttle_count;
+} flood_state;
+
+/**
+ * The ::bgpio_guard_fn that records what the guard does.
+ */
+static void
+record(bgpio_request_t *req, int line, bool throttled, uint64_t count,
+       int err, void *ctx)
+{
+    flood_state *state = (flood_state *) ctx;
+
+    (void) req;
+    if (err) {
+	fprintf(stderr, "flood: unable to %s line %d: %s\n",
+		throttled? "throttle": "restore", line, strerror(err));
+	return;
+    }
+    if (throttled) {
+	state->throttles++;
+	state->throttle_count = count;
+    }
+    else {
+	state->restores++;
+    }
+}
+
+/**
+ * Switch the bias of the only line of a request between pull-up and
+ * pull-down, so that an unconnected line changes value.
+ */
+static int
+toggle_bias(bgpio_request_t *req)
+{
+    struct gpio_v2_line_config *config = &req->req.config;
+    uint64_t bias = GPIO_V2_LINE_FLAG_BIAS_PULL_UP |
+	GPIO_V2_LINE_FLAG_BIAS_PULL_DOWN;
+    int i;
+
+    for (i = 0; i < config->num_attrs; i++) {
+	if ((config->attrs[i].attr.id == GPIO_V2_LINE_ATTR_ID_FLAGS) &&
+	    BGPIO_BITVALUE(config->attrs[i].mask, 0)) {
+	    config->attrs[i].attr.flags ^= bias;
+	    return bgpio_reconfigure(req);
+	}
+    }
+    config->flags ^= bias;
+    return bgpio_reconfigure(req);
+}
+
+int
+main(int argc, char *argv[])
+{
+    bgpio_request_t *request;
+    flood_state state = {0, 0, 0};
+    uint64_t start;
+    char *line_name;
+    int line;
+    int wait;
+
+    if (argc != 3) {
+	fprintf(stderr, "Usage: flood chip-path line\n");
+	exit(EINVAL);
+    }
+    line = atoi(argv[2]);
+
+    if (!(request = bgpio_open_request(argv[1], "flood", 0))) {
+	fprintf(stderr, "flood: unable to open %s: %s\n",
+		argv[1], strerror(errno));
+	exit(errno);
+    }
+    line_name = bgpio_configure_line(
+	request, line, GPIO_V2_LINE_FLAG_INPUT |
+	GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING |
+	GPIO_V2_LINE_FLAG_BIAS_PULL_UP);
+    free(line_name);
+    if (bgpio_complete_request(request) ||
+	bgpio_request_nonblocking(request, true) ||
+	bgpio_enable_rate_guard(request, MAX_RATE, COOLDOWN_MSECS,
+				record, &state)) {
+	fprintf(stderr, "flood: unable to request line %d: %s\n",
+		line, strerror(errno));
+	exit(errno);
+    }
+
+    start = bgpio_now_ns();
+    while (!state.throttles &&
+	   (bgpio_now_ns() - start < PATIENCE_MSECS * 1000000ULL)) {
+	if (toggle_bias(request)) {
+	    fprintf(stderr, "flood: unable to change bias: %s\n",
+		    strerror(errno));
+	    exit(errno);
+	}
+	(void) poll(NULL, 0, 1);
+	(void) bgpio_drain_events(request, NULL, NULL, 0);
+    }
+    if (!state.throttles) {
+	fprintf(stderr, "flood: line %d was not throttled\n", line);
+	exit(1);
+    }
+    printf("line %d: throttled after %llu events\n",
+	   line, (unsigned long long) state.throttle_count);
+
+    start = bgpio_now_ns();
+    while (!state.restores &&
+	   (bgpio_now_ns() - start < PATIENCE_MSECS * 1000000ULL)) {
+	(void) bgpio_drain_events(request, NULL, NULL, 0);
+	wait = bgpio_guard_check(request);
+	(void) poll(NULL, 0, (wait < 0)? 10: wait);
+    }
+    if (!state.restores) {
+	fprintf(stderr, "flood: line %d was not restored\n", line);
+	exit(1);
+    }
+    printf("line %d: restored\n", line);
+
+    (void) bgpio_close_request(request);
+    return 0;
+}
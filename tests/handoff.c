@@ -0,0 +1,78 @@
+/*
+ *     Copyright (c) 2023 Marc Munro
+ *     Fileset:	libbgpiod - basic/bloodnok gpio device library
+ *     Author:   Marc Munro
+ *     License:  GPL-3.0
+ *
+ */
+
+/**
+ * @file   handoff.c
+ * @brief Test helper for bgpiodaemon's request handoff.
+ *
+ * Usage: handoff socket chip-index line
+ *
+ * Fetches the value of a line through bgpiodaemon, asks the daemon to
+ * hand off its request for the line's chip, and fetches the value
+ * again directly through the handed-off request.  The result is zero
+ * if both succeed and agree.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "../lib/bgpiod.h"
+
+int
+main(int argc, char *argv[])
+{
+    bgpio_client_t *client;
+    bgpio_request_t *request;
+    uint64_t mask;
+    uint64_t bits;
+    int chip;
+    int line;
+    int daemon_value;
+    int handoff_value;
+    int err;
+
+    if (argc != 4) {
+	fprintf(stderr, "Usage: handoff socket chip-index line\n");
+	exit(EINVAL);
+    }
+    chip = atoi(argv[2]);
+    line = atoi(argv[3]);
+
+    if (!(client = bgpio_client_open(argv[1]))) {
+	fprintf(stderr, "handoff: unable to connect to %s: %s\n",
+		argv[1], strerror(errno));
+	exit(errno);
+    }
+    if ((err = bgpio_client_lookup(client, chip, line, &mask)) ||
+	(err = bgpio_client_get(client, chip, mask, &bits))) {
+	fprintf(stderr, "handoff: unable to get line %d: %s\n",
+		line, strerror(err));
+	exit(err);
+    }
+    daemon_value = (bits & mask) && 1;
+
+    if (!(request = bgpio_client_handoff(client, chip))) {
+	err = errno;
+	fprintf(stderr, "handoff: handoff refused: %s\n", strerror(err));
+	exit(err);
+    }
+    if ((err = bgpio_fetch(request))) {
+	fprintf(stderr, "handoff: unable to fetch through handed-off "
+		"request: %s\n", strerror(err));
+	exit(err);
+    }
+    handoff_value = bgpio_fetched(request, line);
+    printf("line %d: daemon %d, handed off %d\n",
+	   line, daemon_value, handoff_value);
+
+    (void) bgpio_close_request(request);
+    bgpio_client_close(client);
+    return (daemon_value == handoff_value)? 0: 1;
+}
@@ -0,0 +1,134 @@
+/*
+ *     Copyright (c) 2023 Marc Munro
+ *     Fileset:	libbgpiod - basic/bloodnok gpio device library
+ *     Author:   Marc Munro
+ *     License:  GPL-3.0
+ *
+ */
+
+/**
+ * @file   merge.c
+ * @brief Test helper for the timestamp-ordered event merger.
+ *
+ * Usage: merge
+ *
+ * Feeds two requests with edge events whose timestamps interleave,
+ * writing each request's events, in the kernel's format, to a pipe
+ * standing in for its line request file descriptor.  The events of the
+ * second request are written first.  The merged stream must contain
+ * every event, in timestamp order, with none late.  No gpio hardware
+ * is needed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "../lib/bgpiod.h"
+
+/**
+ * The number of events written for each request.
+ */
+#define EVENTS_PER_SOURCE 8
+
+/**
+ * Create a request whose file descriptor is the read end of a pipe,
+ * so that events written to the pipe are read as if from the kernel.
+ *
+ * @param line The line to be recorded in the request.
+ *
+ * @param p_write_fd Where the pipe's write end will be stored.
+ *
+ * @result The request.
+ */
+static bgpio_request_t *
+piped_request(int line, int *p_write_fd)
+{
+    bgpio_request_t *req = calloc(1, sizeof(bgpio_request_t));
+    int fds[2];
+
+    if (!req || pipe(fds)) {
+	fprintf(stderr, "merge: unable to create request: %s\n",
+		strerror(errno));
+	exit(errno);
+    }
+    req->req.fd = fds[0];
+    req->req.num_lines = 1;
+    req->req.offsets[0] = line;
+    *p_write_fd = fds[1];
+    return req;
+}
+
+int
+main(int argc, char *argv[])
+{
+    bgpio_request_t *reqs[2];
+    struct gpio_v2_line_event event;
+    bgpio_merged_event_t merged;
+    bgpio_merger_t *merger;
+    int write_fds[2];
+    uint64_t last_ns = 0;
+    int timeout = 100;
+    int emitted = 0;
+    int err;
+    int src;
+    int i;
+
+    (void) argv;
+    if (argc != 1) {
+	fprintf(stderr, "Usage: merge\n");
+	exit(EINVAL);
+    }
+    reqs[0] = piped_request(10, &write_fds[0]);
+    reqs[1] = piped_request(20, &write_fds[1]);
+
+    /* Request 0 has the odd timestamps and request 1 the even ones. */
+    for (src = 1; src >= 0; src--) {
+	for (i = 0; i < EVENTS_PER_SOURCE; i++) {
+	    memset(&event, 0, sizeof(event));
+	    event.timestamp_ns = 1000 + (2 * i + src + 1) * 10;
+	    event.id = (i & 1)? GPIO_V2_LINE_EVENT_FALLING_EDGE:
+		GPIO_V2_LINE_EVENT_RISING_EDGE;
+	    event.offset = reqs[src]->req.offsets[0];
+	    event.seqno = event.line_seqno = i + 1;
+	    if (write(write_fds[src], &event, sizeof(event)) !=
+		sizeof(event)) {
+		fprintf(stderr, "merge: unable to write event: %s\n",
+			strerror(errno));
+		exit(errno);
+	    }
+	}
+    }
+
+    if (!(merger = bgpio_open_merger(reqs, 2, 1000000))) {
+	fprintf(stderr, "merge: unable to open merger: %s\n",
+		strerror(errno));
+	exit(errno);
+    }
+    while (!(err = bgpio_merge_next(merger, &merged, &timeout))) {
+	printf("%llu line %d%s\n",
+	       (unsigned long long) merged.event.timestamp_ns,
+	       merged.event.offset, merged.late? " late": "");
+	if (merged.event.timestamp_ns <= last_ns) {
+	    fprintf(stderr, "merge: event at %llu out of order\n",
+		    (unsigned long long) merged.event.timestamp_ns);
+	    exit(1);
+	}
+	last_ns = merged.event.timestamp_ns;
+	emitted++;
+    }
+    if (err != ETIMEDOUT) {
+	fprintf(stderr, "merge: unable to merge: %s\n", strerror(err));
+	exit(err);
+    }
+    if ((emitted != 2 * EVENTS_PER_SOURCE) || merger->late) {
+	fprintf(stderr, "merge: %d events merged, %llu late\n", emitted,
+		(unsigned long long) merger->late);
+	exit(1);
+    }
+    printf("merged %d events in order\n", emitted);
+    bgpio_close_merger(merger);
+    return 0;
+}
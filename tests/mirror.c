@@ -0,0 +1,147 @@
+/*
+ *     Copyright (c) 2023 Marc Munro
+ *     Fileset:	libbgpiod - basic/bloodnok gpio device library
+ *     Author:   Marc Munro
+ *     License:  GPL-3.0
+ *
+ */
+
+/**
+ * @file   mirror.c
+ * @brief Test helper for the event-maintained input mirror.
+ *
+ * Usage: mirror chip-path line
+ *
+ * Drives an unconnected input line up and down, by switching its bias
+ * between pull-up and pull-down, with the request's input mirror
+ * enabled.  After each change, the edge events are drained and the
+ * line is fetched.  Each fetch must be answered from the mirror,
+ * without an ioctl, and must agree with the value read directly from
+ * the device.  The result is zero if every fetch did so.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+
+#include "../lib/bgpiod.h"
+
+/**
+ * The number of times the line is changed.
+ */
+#define CHANGES 10
+
+/**
+ * How long, in milliseconds, we allow for the line to settle after
+ * its bias is changed.
+ */
+#define SETTLE_MSECS 10
+
+/**
+ * Switch the bias of the only line of a request between pull-up and
+ * pull-down, so that an unconnected line changes value.
+ */
+static int
+toggle_bias(bgpio_request_t *req)
+{
+    struct gpio_v2_line_config *config = &req->req.config;
+    uint64_t bias = GPIO_V2_LINE_FLAG_BIAS_PULL_UP |
+	GPIO_V2_LINE_FLAG_BIAS_PULL_DOWN;
+    int i;
+
+    for (i = 0; i < config->num_attrs; i++) {
+	if ((config->attrs[i].attr.id == GPIO_V2_LINE_ATTR_ID_FLAGS) &&
+	    BGPIO_BITVALUE(config->attrs[i].mask, 0)) {
+	    config->attrs[i].attr.flags ^= bias;
+	    return bgpio_reconfigure(req);
+	}
+    }
+    config->flags ^= bias;
+    return bgpio_reconfigure(req);
+}
+
+int
+main(int argc, char *argv[])
+{
+    bgpio_request_t *request;
+    struct gpio_v2_line_values values;
+    uint64_t fetches;
+    uint64_t served;
+    char *line_name;
+    int line;
+    int value;
+    int i;
+
+    if (argc != 3) {
+	fprintf(stderr, "Usage: mirror chip-path line\n");
+	exit(EINVAL);
+    }
+    line = atoi(argv[2]);
+
+    if (!(request = bgpio_open_request(argv[1], "mirror", 0))) {
+	fprintf(stderr, "mirror: unable to open %s: %s\n",
+		argv[1], strerror(errno));
+	exit(errno);
+    }
+    line_name = bgpio_configure_line(
+	request, line, GPIO_V2_LINE_FLAG_INPUT |
+	GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING |
+	GPIO_V2_LINE_FLAG_BIAS_PULL_UP);
+    free(line_name);
+    if (bgpio_complete_request(request) ||
+	bgpio_request_nonblocking(request, true)) {
+	fprintf(stderr, "mirror: unable to request line %d: %s\n",
+		line, strerror(errno));
+	exit(errno);
+    }
+    if (bgpio_enable_mirror(request, 0)) {
+	fprintf(stderr, "mirror: unable to mirror line %d: %s\n",
+		line, strerror(errno));
+	exit(errno);
+    }
+
+    for (i = 0; i < CHANGES; i++) {
+	if (toggle_bias(request)) {
+	    fprintf(stderr, "mirror: unable to change bias: %s\n",
+		    strerror(errno));
+	    exit(errno);
+	}
+	(void) poll(NULL, 0, SETTLE_MSECS);
+	(void) bgpio_drain_events(request, NULL, NULL, 0);
+
+	fetches = request->mirror.fetches;
+	served = request->mirror.served;
+	if (bgpio_fetch(request)) {
+	    fprintf(stderr, "mirror: unable to fetch line %d: %s\n",
+		    line, strerror(errno));
+	    exit(errno);
+	}
+	if ((request->mirror.served != served + 1) ||
+	    (request->mirror.fetches != fetches)) {
+	    fprintf(stderr, "mirror: fetch %d was not served by the mirror\n",
+		    i + 1);
+	    exit(1);
+	}
+	value = bgpio_fetched(request, line);
+
+	values = (struct gpio_v2_line_values) {0, 1};
+	if (ioctl(request->req.fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values)) {
+	    fprintf(stderr, "mirror: unable to read line %d: %s\n",
+		    line, strerror(errno));
+	    exit(errno);
+	}
+	if (value != (int) (values.bits & 1)) {
+	    fprintf(stderr, "mirror: fetch %d gave %d, but the line is %d\n",
+		    i + 1, value, (int) (values.bits & 1));
+	    exit(1);
+	}
+    }
+    printf("line %d: %d fetches served by the mirror\n", line, CHANGES);
+
+    (void) bgpio_close_request(request);
+    return 0;
+}
@@ -0,0 +1,167 @@
+/*
+ *     Copyright (c) 2023 Marc Munro
+ *     Fileset:	libbgpiod - basic/bloodnok gpio device library
+ *     Author:   Marc Munro
+ *     License:  GPL-3.0
+ *
+ */
+
+/**
+ * @file   uring.c
+ * @brief Test helper for reading events through io_uring.
+ *
+ * Usage: uring
+ *
+ * Writes edge events, in the kernel's format, to pipes standing in for
+ * the file descriptors of two line requests, and reads them back
+ * through a ::bgpio_uring_t.  Every event must be returned, with each
+ * request's events in order.  The write end of one pipe is then closed,
+ * so that its reads complete empty at once, and a wait for further
+ * events must still time out on time.
+ *
+ * If io_uring is unavailable, "io_uring unavailable" is printed and the
+ * result is 77, so that the test can be skipped.  No gpio hardware is
+ * needed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "../lib/bgpiod.h"
+
+/**
+ * The number of events written for each request.
+ */
+#define EVENTS_PER_SOURCE 8
+
+/**
+ * The timeout, in milliseconds, for the final wait.
+ */
+#define TIMEOUT_MSECS 200
+
+/**
+ * How much longer than #TIMEOUT_MSECS the final wait may take.
+ */
+#define SLACK_MSECS 300
+
+/**
+ * Create a request whose file descriptor is the read end of a pipe,
+ * so that events written to the pipe are read as if from the kernel.
+ *
+ * @param line The line to be recorded in the request.
+ *
+ * @param p_write_fd Where the pipe's write end will be stored.
+ *
+ * @result The request.
+ */
+static bgpio_request_t *
+piped_request(int line, int *p_write_fd)
+{
+    bgpio_request_t *req = calloc(1, sizeof(bgpio_request_t));
+    int fds[2];
+
+    if (!req || pipe(fds)) {
+	fprintf(stderr, "uring: unable to create request: %s\n",
+		strerror(errno));
+	exit(errno);
+    }
+    req->req.fd = fds[0];
+    req->req.num_lines = 1;
+    req->req.offsets[0] = line;
+    *p_write_fd = fds[1];
+    return req;
+}
+
+int
+main(int argc, char *argv[])
+{
+    bgpio_request_t *reqs[2];
+    bgpio_request_t *req;
+    struct gpio_v2_line_event event;
+    bgpio_uring_t *uring;
+    int write_fds[2];
+    uint32_t seqnos[2] = {0, 0};
+    uint64_t start;
+    uint64_t elapsed_msecs;
+    int timeout;
+    int received = 0;
+    int err;
+    int src;
+    int i;
+
+    (void) argv;
+    if (argc != 1) {
+	fprintf(stderr, "Usage: uring\n");
+	exit(EINVAL);
+    }
+    reqs[0] = piped_request(10, &write_fds[0]);
+    reqs[1] = piped_request(20, &write_fds[1]);
+
+    if (!(uring = bgpio_open_uring(reqs, 2))) {
+	fprintf(stderr, "uring: unable to open reader: %s\n",
+		strerror(errno));
+	exit(errno);
+    }
+    if (uring->fallback) {
+	printf("io_uring unavailable\n");
+	bgpio_close_uring(uring);
+	exit(77);
+    }
+
+    for (src = 0; src < 2; src++) {
+	for (i = 0; i < EVENTS_PER_SOURCE; i++) {
+	    memset(&event, 0, sizeof(event));
+	    event.timestamp_ns = 1000 + (2 * i + src + 1) * 10;
+	    event.id = GPIO_V2_LINE_EVENT_RISING_EDGE;
+	    event.offset = reqs[src]->req.offsets[0];
+	    event.seqno = event.line_seqno = i + 1;
+	    if (write(write_fds[src], &event, sizeof(event)) !=
+		sizeof(event)) {
+		fprintf(stderr, "uring: unable to write event: %s\n",
+			strerror(errno));
+		exit(errno);
+	    }
+	}
+    }
+
+    timeout = TIMEOUT_MSECS;
+    while (received < 2 * EVENTS_PER_SOURCE) {
+	if ((err = bgpio_uring_await_event(uring, &req, &timeout))) {
+	    fprintf(stderr, "uring: %d events received: %s\n",
+		    received, strerror(err));
+	    exit(err);
+	}
+	src = (req == reqs[0])? 0: 1;
+	if (req->event.line_seqno != seqnos[src] + 1) {
+	    fprintf(stderr, "uring: line %d event %u out of order\n",
+		    req->event.offset, req->event.line_seqno);
+	    exit(1);
+	}
+	seqnos[src] = req->event.line_seqno;
+	received++;
+    }
+    printf("received %d events in order\n", received);
+
+    close(write_fds[1]);
+    start = bgpio_now_ns();
+    err = bgpio_uring_await_event(uring, &req, &timeout);
+    elapsed_msecs = (bgpio_now_ns() - start) / 1000000;
+    if (err != ETIMEDOUT) {
+	fprintf(stderr, "uring: wait did not time out: %s\n",
+		err? strerror(err): "event received");
+	exit(1);
+    }
+    if (elapsed_msecs > TIMEOUT_MSECS + SLACK_MSECS) {
+	fprintf(stderr, "uring: %d msec timeout took %llu msecs\n",
+		TIMEOUT_MSECS, (unsigned long long) elapsed_msecs);
+	exit(1);
+    }
+    printf("timed out after %llu msecs\n",
+	   (unsigned long long) elapsed_msecs);
+
+    bgpio_close_uring(uring);
+    return 0;
+}
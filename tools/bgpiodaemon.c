@@ -0,0 +1,934 @@
+/*
+ *     Copyright (c) 2023 Marc Munro
+ *     Fileset:	bgpio - basic/bloodnok gpio library and tools
+ *     Author:  Marc Munro
+ *     License: GPL-3.0
+ *
+ */
+
+/**
+ * @file   bgpiodaemon.c
+ * @brief bgpiodaemon.  Long-running owner of gpio lines, serving
+ * get, set and subscribe requests from local clients.
+ *
+ * The daemon reserves the lines described in its configuration file
+ * once, at startup, and then serves requests made over a unix socket
+ * using the protocol described by ::bgpio_msg_t.  Clients will
+ * usually make their requests using the bgpio_client_xxx() functions
+ * from the library.
+ *
+ * Requests from all clients that are ready at the same time are
+ * gathered into a single set and a single fetch ioctl per chip, so
+ * that the cost of each ioctl is shared between clients.
+ */
+
+#define _GNU_SOURCE     // for accept4()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "../lib/bgpiod.h"
+#include "bgpiotools.h"
+
+/**
+ * The name of this executable.  Used for help text and other purposes.
+ */
+#define THIS_EXECUTABLE "bgpiodaemon"
+
+/**
+ * Summary line used by build to create the whatis entry for the man
+ * page.
+ */
+#define SUMMARY serve gpio lines to local clients
+
+/**
+ * The default configuration file.
+ */
+#define DEFAULT_CONFIG "/etc/bgpiodaemon.conf"
+
+/**
+ * The maximum number of messages we will read from a single client
+ * before moving on to the next.  This stops a single busy client from
+ * starving the others.
+ */
+#define MAX_MSGS_PER_CLIENT 32
+
+/**
+ * How often, in milliseconds, the input mirror of each chip (see
+ * bgpio_enable_mirror()) is refreshed by ioctl.
+ */
+#define MIRROR_RESYNC_MSECS 1000
+
+/**
+ * The maximum number of edge events read from a request fd in one go.
+ */
+#define EVENT_BATCH 16
+
+/**
+ * Everything we know about a chip whose lines we own.
+ */
+typedef struct daemon_chip {
+    bgpio_request_t *request;   /**< The completed line request */
+    uint64_t outputs;           /**< Bitmap of output lines */
+    uint64_t edges;             /**< Bitmap of edge-detecting lines */
+    uint64_t get_mask;          /**< Lines to fetch in this batch */
+    uint64_t set_mask;          /**< Lines to set in this batch */
+    uint64_t set_bits;          /**< Values to set in this batch */
+    bool     lost;              /**< Whether the chip has gone */
+} daemon_chip;
+
+/**
+ * A connected client.
+ */
+typedef struct daemon_client {
+    int fd;                     /**< Connected socket, or -1 */
+    uint64_t *subscribed;       /**< Per-chip bitmap of subscriptions */
+} daemon_client;
+
+/**
+ * A request that is waiting for its batch to be completed before it
+ * can be answered.
+ */
+typedef struct pending_reply {
+    int client;                 /**< Index into clients */
+    bgpio_msg_t msg;            /**< The request, updated to be the reply */
+} pending_reply;
+
+/**
+ * The chips whose lines we own, in configuration file order.
+ */
+static daemon_chip *chips = NULL;
+
+/**
+ * The number of entries in chips.
+ */
+static int num_chips = 0;
+
+/**
+ * The connected clients.  Entries with an fd of -1 are free.
+ */
+static daemon_client *clients = NULL;
+
+/**
+ * The number of entries in clients.
+ */
+static int num_clients = 0;
+
+/**
+ * Set by our signal handler to tell the main loop to exit.
+ */
+static volatile sig_atomic_t terminate = 0;
+
+/**
+ * Whether clients may be handed our line requests (see
+ * bgpio_client_handoff()).
+ */
+static int allow_handoff = true;
+
+/**
+ * Provide a usage message and exit.
+ *
+ * @param exitcode The value to be returned from gpsud by exit().
+ */
+static void
+usage(int exitcode)
+{
+    printf("\n"
+	   "Usage: " THIS_EXECUTABLE " [OPTIONS]\n\n"
+	   "Own GPIO lines and serve them to local clients.\n\n"
+	   "Options:\n"
+	   "  -c, --config=path:        configuration file\n"
+	   "                            (default=" DEFAULT_CONFIG ")\n"
+	   "  -h, --help:               display this help message.\n"
+	   "  -n, --name=our_name:      who has reserved our gpio lines \n"
+	   "      --no-handoff:         refuse to hand line requests to clients\n"
+	   "  -q, --quiet:              execute quietly\n"
+	   "  -s, --socket=path:        socket on which to listen\n"
+	   "                            (default=" BGPIO_DAEMON_SOCKET ")\n"
+	   "  -v, --version:            display the version.\n\n");
+    if (!exitcode) {
+	printf(
+	  "Each non-blank line of the configuration file, other than\n"
+	  "comments introduced by '#', is of the form:\n"
+	  "    <chip-id> <line-spec>...\n\n"
+	  "Chip-ids may be a full path to the gpiochip device, or an\n"
+	  "abbeviated suffix (eg \"chip0\") of a valid path.  Chips are\n"
+	  "numbered for clients in the order in which they first appear.\n\n"
+	  "Line-specs are of the form N[\"[\"line-flag[,line-flag...]\"]\"]\n"
+	  "for inputs, where line-flag may be a bias value, active-high,\n"
+	  "high, active-low, or an edge-detection value\n"
+	  "(" EDGE_ARGS_STR_COMMA "), or N[\"[\"line-flag...\"]\"]=B for\n"
+	  "outputs, where line-flag may be a bias value, output-drive\n"
+	  "value, active-high, high or active-low and B is the initial\n"
+	  "output value, 1 or 0.  N may be a line number or line name.\n\n"
+	  "Unless --no-handoff is given, clients may ask for a copy of a\n"
+	  "chip's line request, allowing them to get and set values\n"
+	  "directly rather than through the daemon.  The daemon retains\n"
+	  "ownership of the lines.\n");
+    }
+    exit(exitcode);
+}
+
+/**
+ * Signal handler for SIGTERM and SIGINT.  Tells the main loop to
+ * clean up and exit.
+ *
+ * @param signo The signal number (ignored).
+ */
+static void
+handle_signal(int signo)
+{
+    terminate = 1;
+}
+
+/**
+ * Find, or create, the ::daemon_chip entry for a chip-id from the
+ * configuration file.
+ *
+ * @param device A, possibly abbreviated, device spec as for the other
+ * bgpio tools.
+ *
+ * @param consumer  The name that will be associated with the gpio
+ * lines we reserve.
+ *
+ * @result Pointer to the ::daemon_chip for \p device.
+ */
+static daemon_chip *
+chip_for_device(char *device, char *consumer)
+{
+    char *path = path_for_arg(NULL, device);
+    int i;
+
+    if (!path) {
+	path = newstrcpy(device);
+	fprintf(stderr,
+		"%s: %s may not be a gpio device.  Trying anyway...\n",
+		THIS_EXECUTABLE, path);
+    }
+    for (i = 0; i < num_chips; i++) {
+	if (streq(chips[i].request->chardev_path, path)) {
+	    free(path);
+	    return &chips[i];
+	}
+    }
+    chips = realloc(chips, (num_chips + 1) * sizeof(daemon_chip));
+    if (!chips) {
+	fprintf(stderr, "%s: out of memory\n", THIS_EXECUTABLE);
+	exit(ENOMEM);
+    }
+    memset(&chips[num_chips], 0, sizeof(daemon_chip));
+    chips[num_chips].request = bgpio_open_request(path, consumer, 0);
+    if (!chips[num_chips].request) {
+	fprintf(stderr, "%s: unable to open %s (%s)\n",
+		THIS_EXECUTABLE, path, strerror(errno));
+	exit(errno);
+    }
+    free(path);
+    return &chips[num_chips++];
+}
+
+/**
+ * Configure a line, given by a line-spec from the configuration file,
+ * for a chip.
+ *
+ * @param chip The ::daemon_chip to which the line belongs.
+ *
+ * @param spec The line-spec.  See usage() for the format.
+ *
+ * @result true if the line-spec was valid.
+ */
+static bool
+configure_line(daemon_chip *chip, char *spec)
+{
+    char *equals = strchr(spec, '=');
+    uint64_t flags;
+    int line;
+    int value = 0;
+    int idx;
+    char *line_name;
+
+    if (equals) {
+	*equals = '\0';
+	flags = GPIO_V2_LINE_FLAG_OUTPUT;
+	if (!(read_int(equals + 1, &value) && ((value == 0) || (value == 1))
+	      && read_line_arg(spec, chip->request->chardev_path,
+			       &line, &flags,
+			       LINE_FLAG_BIAS_MASK |
+			       LINE_FLAG_OUTPUT_DRIVER_MASK |
+			       LINE_FLAG_ACTIVE_LOW_MASK))) {
+	    *equals = '=';
+	    return false;
+	}
+	*equals = '=';
+    }
+    else {
+	flags = GPIO_V2_LINE_FLAG_INPUT;
+	if (!read_line_arg(spec, chip->request->chardev_path,
+			   &line, &flags,
+			   LINE_FLAG_BIAS_MASK |
+			   LINE_FLAG_EDGE_MASK |
+			   LINE_FLAG_ACTIVE_LOW_MASK)) {
+	    return false;
+	}
+    }
+
+    if (bgpio_idx_for_line(chip->request, line) >= 0) {
+	fprintf(stderr, "%s: line %d configured more than once\n",
+		THIS_EXECUTABLE, line);
+	exit(EINVAL);
+    }
+    line_name = bgpio_configure_line(chip->request, line, flags, value);
+    if (!line_name) {
+	fprintf(stderr, "%s: unable to get line (%d) for chip %s\n",
+		THIS_EXECUTABLE, line, chip->request->chardev_path);
+	exit(EINVAL);
+    }
+    free(line_name);
+
+    /* The newly configured line will be the last one in the request. */
+    idx = chip->request->req.num_lines - 1;
+    if (equals) {
+	BGPIO_SETBIT(chip->outputs, idx);
+    }
+    if (BGPIO_MASKED_BITS(flags, LINE_FLAG_EDGE_MASK)) {
+	BGPIO_SETBIT(chip->edges, idx);
+    }
+    return true;
+}
+
+/**
+ * Read the configuration file, reserving and configuring each of the
+ * chips and lines that it describes.
+ *
+ * @param config_path The path to the configuration file.
+ *
+ * @param consumer  The name that will be associated with the gpio
+ * lines we reserve.
+ */
+static void
+read_config(char *config_path, char *consumer)
+{
+    FILE *config = fopen(config_path, "r");
+    char buf[1024];
+    int lineno = 0;
+    char *saveptr;
+    char *token;
+    daemon_chip *chip;
+    int i;
+
+    if (!config) {
+	fprintf(stderr, "%s: unable to open %s (%s)\n",
+		THIS_EXECUTABLE, config_path, strerror(errno));
+	exit(errno);
+    }
+    while (fgets(buf, sizeof(buf), config)) {
+	char *hash = strchr(buf, '#');
+	lineno++;
+	if (hash) {
+	    *hash = '\0';
+	}
+	token = strtok_r(buf, " \t\n", &saveptr);
+	if (!token) {
+	    continue;
+	}
+	chip = chip_for_device(token, consumer);
+	while ((token = strtok_r(NULL, " \t\n", &saveptr))) {
+	    if (!configure_line(chip, token)) {
+		fprintf(stderr, "%s: %s line %d: invalid line-spec \"%s\"\n",
+			THIS_EXECUTABLE, config_path, lineno, token);
+		exit(EINVAL);
+	    }
+	}
+    }
+    fclose(config);
+
+    if (!num_chips) {
+	fprintf(stderr, "%s: no gpio lines configured in %s\n",
+		THIS_EXECUTABLE, config_path);
+	exit(EINVAL);
+    }
+
+    for (i = 0; i < num_chips; i++) {
+	if (bgpio_complete_request(chips[i].request)) {
+	    fprintf(stderr, "%s: error completing bgpio_request for %s: %s\n",
+		    THIS_EXECUTABLE, chips[i].request->chardev_path,
+		    strerror(errno));
+	    exit(errno);
+	}
+	/* Once we are the only writer of our outputs, sets that would
+	 * change nothing need not reach the kernel.  Clients holding
+	 * handed-off requests could make our shadow stale. */
+	bgpio_set_output_mode(chips[i].request, !allow_handoff, 0);
+	/* As we read every edge event, fetches of lines detecting both
+	 * edges can be answered from memory.  Chips without such
+	 * lines simply fail to enable the mirror. */
+	(void) bgpio_enable_mirror(chips[i].request, MIRROR_RESYNC_MSECS);
+    }
+}
+
+/**
+ * Create the unix socket on which we will listen for clients.  A
+ * stale socket left by a previous instance is removed, but we refuse
+ * to remove anything else found at \p socket_path, including the
+ * socket of a daemon that is still running.
+ *
+ * @param socket_path The path for the socket.
+ *
+ * @result The listening socket's file descriptor.
+ */
+static int
+open_listener(char *socket_path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int probe;
+    int fd;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+	fprintf(stderr, "%s: socket path too long: %s\n",
+		THIS_EXECUTABLE, socket_path);
+	exit(ENAMETOOLONG);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+	fprintf(stderr, "%s: unable to create socket (%s)\n",
+		THIS_EXECUTABLE, strerror(errno));
+	exit(errno);
+    }
+    if (lstat(socket_path, &st) == 0) {
+	if (!S_ISSOCK(st.st_mode)) {
+	    fprintf(stderr, "%s: %s exists and is not a socket\n",
+		    THIS_EXECUTABLE, socket_path);
+	    exit(EEXIST);
+	}
+	probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if ((probe >= 0) &&
+	    connect(probe, (struct sockaddr *) &addr, sizeof(addr)) &&
+	    (errno == ECONNREFUSED)) {
+	    /* Nobody is listening: the socket is stale. */
+	    (void) unlink(socket_path);
+	}
+	else {
+	    fprintf(stderr, "%s: %s is in use by another daemon\n",
+		    THIS_EXECUTABLE, socket_path);
+	    exit(EADDRINUSE);
+	}
+	close(probe);
+    }
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+	listen(fd, 16)) {
+	fprintf(stderr, "%s: unable to listen on %s (%s)\n",
+		THIS_EXECUTABLE, socket_path, strerror(errno));
+	exit(errno);
+    }
+    return fd;
+}
+
+/**
+ * Accept a new client connection, adding it to clients.
+ *
+ * @param listener The listening socket.
+ */
+static void
+accept_client(int listener)
+{
+    int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    int i;
+
+    if (fd < 0) {
+	return;
+    }
+    for (i = 0; i < num_clients; i++) {
+	if (clients[i].fd < 0) {
+	    break;
+	}
+    }
+    if (i == num_clients) {
+	clients = realloc(clients, (num_clients + 1) * sizeof(daemon_client));
+	if (!clients) {
+	    fprintf(stderr, "%s: out of memory\n", THIS_EXECUTABLE);
+	    exit(ENOMEM);
+	}
+	clients[i].subscribed = NULL;
+	num_clients++;
+    }
+    clients[i].fd = fd;
+    free(clients[i].subscribed);
+    clients[i].subscribed = calloc(num_chips, sizeof(uint64_t));
+}
+
+/**
+ * Close a client connection, cancelling its subscriptions.
+ *
+ * @param client Index into clients of the client to be closed.
+ */
+static void
+drop_client(int client)
+{
+    close(clients[client].fd);
+    clients[client].fd = -1;
+    memset(clients[client].subscribed, 0, num_chips * sizeof(uint64_t));
+}
+
+/**
+ * Send a message to a client.  We never block here: if the client is
+ * not keeping up with its events, the message is discarded.
+ *
+ * @param client Index into clients of the recipient.
+ *
+ * @param msg The message to be sent.
+ */
+static void
+send_msg(int client, bgpio_msg_t *msg)
+{
+    if (clients[client].fd >= 0) {
+	(void) send(clients[client].fd, msg, sizeof(bgpio_msg_t),
+		    MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+}
+
+/**
+ * Deal with a request from a client.  Gets and sets are added to
+ * their chip's batch and to \p pending, to be answered once the batch
+ * is complete.  Everything else is answered immediately.
+ *
+ * @param client Index into clients of the requesting client.
+ *
+ * @param msg The request.
+ *
+ * @param pending Array of replies awaiting the completion of the
+ * batch.
+ *
+ * @param num_pending Pointer to the number of entries in \p pending.
+ */
+static void
+handle_request(int client, bgpio_msg_t *msg,
+	       pending_reply *pending, int *num_pending)
+{
+    daemon_chip *chip;
+    uint64_t all_lines;
+    int idx;
+
+    if (msg->chip >= num_chips) {
+	msg->status = ENODEV;
+	send_msg(client, msg);
+	return;
+    }
+    chip = &chips[msg->chip];
+    all_lines = (chip->request->req.num_lines == 64)? ~0ull:
+	BGPIO_BITMASK(chip->request->req.num_lines) - 1;
+    msg->status = 0;
+
+    if ((msg->mask & ~all_lines) && (msg->op != BGPIO_MSG_LOOKUP)) {
+	msg->status = EINVAL;
+	send_msg(client, msg);
+	return;
+    }
+
+    switch (msg->op) {
+    case BGPIO_MSG_LOOKUP:
+	msg->status = ENOENT;
+	for (idx = 0; idx < chip->request->req.num_lines; idx++) {
+	    if (chip->request->req.offsets[idx] == msg->bits) {
+		msg->mask = BGPIO_BITMASK(idx);
+		msg->status = 0;
+		break;
+	    }
+	}
+	break;
+    case BGPIO_MSG_GET:
+	chip->get_mask |= msg->mask;
+	pending[(*num_pending)++] = (pending_reply) {client, *msg};
+	return;
+    case BGPIO_MSG_SET:
+	if (msg->mask & ~chip->outputs) {
+	    msg->status = EPERM;
+	    break;
+	}
+	/* Later sets, in the same batch, override earlier ones. */
+	chip->set_mask |= msg->mask;
+	chip->set_bits = (chip->set_bits & ~msg->mask) |
+	    (msg->bits & msg->mask);
+	pending[(*num_pending)++] = (pending_reply) {client, *msg};
+	return;
+    case BGPIO_MSG_SUBSCRIBE:
+	if (msg->mask & ~chip->edges) {
+	    msg->status = EINVAL;
+	    break;
+	}
+	clients[client].subscribed[msg->chip] |= msg->mask;
+	break;
+    case BGPIO_MSG_UNSUBSCRIBE:
+	clients[client].subscribed[msg->chip] &= ~msg->mask;
+	break;
+    case BGPIO_MSG_HANDOFF:
+	if (!allow_handoff) {
+	    msg->status = EPERM;
+	    break;
+	}
+	/* The reply is immediately followed by the request itself. */
+	send_msg(client, msg);
+	if (bgpio_send_request(clients[client].fd, chip->request)) {
+	    drop_client(client);
+	}
+	return;
+    default:
+	msg->status = EINVAL;
+    }
+    send_msg(client, msg);
+}
+
+/**
+ * Read the waiting requests from a client.
+ *
+ * @param client Index into clients of the client.
+ *
+ * @param pending Array of replies awaiting the completion of the
+ * batch.
+ *
+ * @param num_pending Pointer to the number of entries in \p pending.
+ */
+static void
+read_client(int client, pending_reply *pending, int *num_pending)
+{
+    bgpio_msg_t msg;
+    ssize_t res;
+    int i;
+
+    for (i = 0; i < MAX_MSGS_PER_CLIENT; i++) {
+	res = recv(clients[client].fd, &msg, sizeof(msg), MSG_DONTWAIT);
+	if (res == sizeof(msg)) {
+	    handle_request(client, &msg, pending, num_pending);
+	}
+	else if ((res < 0) && ((errno == EAGAIN) || (errno == EINTR))) {
+	    return;
+	}
+	else {
+	    /* Disconnected, or talking some other protocol. */
+	    drop_client(client);
+	    return;
+	}
+    }
+}
+
+/**
+ * Perform the batched set and fetch ioctls for each chip, and answer
+ * all of the pending requests.
+ *
+ * @param pending Array of replies awaiting the completion of the
+ * batch.
+ *
+ * @param num_pending The number of entries in \p pending.
+ *
+ * @param quiet Whether to suppress error messages.
+ */
+static void
+complete_batch(pending_reply *pending, int num_pending, bool quiet)
+{
+    int set_err[num_chips];
+    int get_err[num_chips];
+    daemon_chip *chip;
+    bgpio_request_t *req;
+    int i;
+
+    for (i = 0; i < num_chips; i++) {
+	chip = &chips[i];
+	req = chip->request;
+	set_err[i] = get_err[i] = 0;
+	if (chip->set_mask) {
+	    req->line_values.mask = chip->set_mask;
+	    req->line_values.bits = chip->set_bits;
+	    if (bgpio_set(req)) {
+		set_err[i] = errno;
+	    }
+	}
+	if (chip->get_mask) {
+	    req->line_values.mask = chip->get_mask;
+	    if (bgpio_fetch(req)) {
+		get_err[i] = errno;
+	    }
+	}
+	if ((set_err[i] || get_err[i]) && !quiet) {
+	    fprintf(stderr, "%s: ioctl failed for %s: %s\n",
+		    THIS_EXECUTABLE, req->chardev_path,
+		    strerror(set_err[i]? set_err[i]: get_err[i]));
+	}
+    }
+
+    for (i = 0; i < num_pending; i++) {
+	bgpio_msg_t *msg = &pending[i].msg;
+	chip = &chips[msg->chip];
+	if (msg->op == BGPIO_MSG_GET) {
+	    msg->status = get_err[msg->chip];
+	    msg->bits = chip->request->line_values.bits & msg->mask;
+	}
+	else {
+	    msg->status = set_err[msg->chip];
+	}
+	send_msg(pending[i].client, msg);
+    }
+
+    for (i = 0; i < num_chips; i++) {
+	chips[i].get_mask = chips[i].set_mask = chips[i].set_bits = 0;
+    }
+}
+
+/**
+ * Read the waiting edge events for a chip and send them to each
+ * subscribed client.
+ *
+ * @param chip_idx Index into chips of the chip.
+ */
+static void
+distribute_events(int chip_idx)
+{
+    struct gpio_v2_line_event events[EVENT_BATCH];
+    bgpio_request_t *req = chips[chip_idx].request;
+    bgpio_msg_t msg = {BGPIO_MSG_EVENT, chip_idx, 0, 0, 0, 0};
+    ssize_t res;
+    int n;
+    int i;
+    int idx;
+    int client;
+
+    res = read(req->req.fd, events, sizeof(events));
+    if (res < 0) {
+	return;
+    }
+    n = res / sizeof(struct gpio_v2_line_event);
+    for (i = 0; i < n; i++) {
+	bgpio_note_event(req, &events[i]);
+	if ((idx = bgpio_idx_for_line(req, events[i].offset)) < 0) {
+	    continue;
+	}
+	msg.mask = BGPIO_BITMASK(idx);
+	msg.bits = (events[i].id == GPIO_V2_LINE_EVENT_RISING_EDGE);
+	msg.status = events[i].line_seqno;
+	msg.timestamp_ns = events[i].timestamp_ns;
+	for (client = 0; client < num_clients; client++) {
+	    if ((clients[client].fd >= 0) &&
+		(clients[client].subscribed[chip_idx] & msg.mask)) {
+		send_msg(client, &msg);
+	    }
+	}
+    }
+}
+
+/**
+ * Serve clients until we are terminated by a signal.
+ *
+ * @param listener The listening socket.
+ *
+ * @param quiet Whether to suppress error messages.
+ */
+static void
+serve(int listener, bool quiet)
+{
+    struct pollfd *fds = NULL;
+    pending_reply *pending = NULL;
+    int max_pending = 0;
+    int num_pending;
+    int nfds;
+    int res;
+    int i;
+
+    while (!terminate) {
+	/* The poll set is: the listener, each chip with edge lines,
+	 * then each connected client. */
+	fds = realloc(fds, (1 + num_chips + num_clients) *
+		      sizeof(struct pollfd));
+	if (max_pending < num_clients * MAX_MSGS_PER_CLIENT) {
+	    max_pending = num_clients * MAX_MSGS_PER_CLIENT;
+	    pending = realloc(pending, max_pending * sizeof(pending_reply));
+	}
+	if (!fds || (max_pending && !pending)) {
+	    fprintf(stderr, "%s: out of memory\n", THIS_EXECUTABLE);
+	    exit(ENOMEM);
+	}
+	nfds = 0;
+	fds[nfds++] = (struct pollfd) {listener, POLLIN, 0};
+	for (i = 0; i < num_chips; i++) {
+	    fds[nfds++] = (struct pollfd) {
+		(chips[i].edges && !chips[i].lost)?
+		chips[i].request->req.fd: -1, POLLIN, 0};
+	}
+	for (i = 0; i < num_clients; i++) {
+	    fds[nfds++] = (struct pollfd) {clients[i].fd, POLLIN, 0};
+	}
+
+	res = poll(fds, nfds, -1);
+	if (res < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    fprintf(stderr, "%s: poll failed: %s\n",
+		    THIS_EXECUTABLE, strerror(errno));
+	    exit(errno);
+	}
+
+	for (i = 0; i < num_chips; i++) {
+	    if (fds[1 + i].revents & (POLLERR | POLLHUP)) {
+		/* The chip has gone.  Stop polling it, or poll would
+		 * return at once forever.  Gets and sets of its lines
+		 * will now fail, and their errors are returned to our
+		 * clients. */
+		if (!quiet) {
+		    fprintf(stderr, "%s: lost chip %s\n", THIS_EXECUTABLE,
+			    chips[i].request->chardev_path);
+		}
+		chips[i].lost = true;
+	    }
+	    else if (fds[1 + i].revents & POLLIN) {
+		distribute_events(i);
+	    }
+	}
+
+	num_pending = 0;
+	for (i = 0; i < (nfds - (1 + num_chips)); i++) {
+	    if (fds[1 + num_chips + i].revents & (POLLIN | POLLHUP)) {
+		read_client(i, pending, &num_pending);
+	    }
+	}
+	if (num_pending) {
+	    complete_batch(pending, num_pending, quiet);
+	}
+
+	/* Accept new clients last, as this may resize clients. */
+	if (fds[0].revents & POLLIN) {
+	    accept_client(listener);
+	}
+    }
+    free(fds);
+    free(pending);
+}
+
+/**
+ * Process the command line, read the configuration, and serve our
+ * clients.
+ */
+int
+main(int argc, char *argv[])
+{
+    char *config_path = DEFAULT_CONFIG;
+    char *socket_path = BGPIO_DAEMON_SOCKET;
+    char *consumer_name = THIS_EXECUTABLE;
+    int quiet = false;
+    int listener;
+    int c;
+    int idx = 0;
+    int i;
+    struct sigaction action;
+
+    /**
+     * Command line options structure for getopt_long()
+     */
+    struct option options[] = {
+	{"config", required_argument, NULL, 0},
+	{"help",  no_argument, NULL, 0},
+	{"name", required_argument, NULL, 0},
+	{"no-handoff", no_argument, &allow_handoff, false},
+	{"quiet", no_argument, &quiet, true},
+	{"socket", required_argument, NULL, 0},
+	{"version", no_argument, NULL, 0},
+	{NULL, 0, NULL, 0}};
+
+    while ((c = getopt_long(argc, argv, "c:hn:qs:v",
+			    options, &idx)) != -1)
+    {
+	switch (c) {
+	case 0:
+	    if (streq("version", options[idx].name)) {
+		version(THIS_EXECUTABLE);
+	    }
+	    if (streq("help", options[idx].name)) {
+		usage(0);
+	    }
+	    if (streq("quiet", options[idx].name) ||
+		streq("no-handoff", options[idx].name)) {
+	    }
+	    else if (streq("config", options[idx].name)) {
+		config_path = optarg;
+	    }
+	    else if (streq("name", options[idx].name)) {
+		consumer_name = optarg;
+	    }
+	    else if (streq("socket", options[idx].name)) {
+		socket_path = optarg;
+	    }
+	    else {
+		fprintf(stderr, "%s: unhandled option: %s\n\n",
+			THIS_EXECUTABLE, options[idx].name);
+		usage(EINVAL);
+	    }
+	    break;
+	case 'c':
+	    config_path = optarg;
+	    continue;
+	case 'h':
+	    usage(0);
+	case 'n':
+	    consumer_name = optarg;
+	    continue;
+	case 'q':
+	    quiet = true;
+	    continue;
+	case 's':
+	    socket_path = optarg;
+	    continue;
+	case 'v':
+	    version(THIS_EXECUTABLE);
+	default:
+	    usage(EINVAL);
+	}
+    }
+    if (optind < argc) {
+	fprintf(stderr, "%s: unexpected argument: %s\n",
+		THIS_EXECUTABLE, argv[optind]);
+	usage(EINVAL);
+    }
+
+    read_config(config_path, consumer_name);
+    listener = open_listener(socket_path);
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_signal;
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!quiet) {
+	printf("%s: serving %d chip(s) on %s\n",
+	       THIS_EXECUTABLE, num_chips, socket_path);
+	fflush(stdout);
+    }
+    serve(listener, quiet);
+
+    close(listener);
+    (void) unlink(socket_path);
+    for (i = 0; i < num_clients; i++) {
+	if (clients[i].fd >= 0) {
+	    close(clients[i].fd);
+	}
+	free(clients[i].subscribed);
+    }
+    free(clients);
+    for (i = 0; i < num_chips; i++) {
+	(void) bgpio_close_request(chips[i].request);
+    }
+    free(chips);
+    exit(0);
+}
@@ -49,6 +49,7 @@ usage(int exitcode)
     printf("\nUsage: " THIS_EXECUTABLE " [OPTIONS] [gpiochip-id]...\n\n"
 	   "List GPIO chips, their labels and the the number of lines.\n\n"
 	   "Options:\n  -h, --help:     display this help message.\n"
+	   "  -j, --jobs=N:   examine up to N chips concurrently\n"
 	   "  -v, --version:  display the version.\n\n");
     if (!exitcode) {
 	printf(
@@ -60,28 +61,91 @@ usage(int exitcode)
 
 
 /**
- * Print, to stdout, a summary of information for the chip given by
- * \p path.
+ * The details of a single chip, as gathered by get_chip_details().
+ */
+typedef struct chip_details {
+    char *path;                 /**< The path to the chip device */
+    char  text[200];            /**< The summary line to be printed */
+    int   err;                  /**< errno from opening the chip */
+} chip_details;
+
+/**
+ * Gather a summary of information for one of a set of chips.  This
+ * is run, possibly concurrently, by run_jobs().
+ *
+ * @param idx  The index of the chip in \p ctx.
  *
- * @param path  String providing the full path to the gpio chip we
- * want to describe, eg "/dev/gpiochip0".
+ * @param ctx  Array of ::chip_details, with the path for each chip
+ * filled in.
  */
 static void
-print_chip_details(char *path)
+get_chip_details(int idx, void *ctx)
 {
-    bgpio_chip_t *chip = bgpio_open_chip(path);
+    chip_details *details = &((chip_details *) ctx)[idx];
+    bgpio_chip_t *chip = bgpio_open_chip(details->path);
     if (chip) {
-	printf("  %s:    %s [%s] (%d lines)\n",
-	       path, chip->info.name, chip->info.label, chip->info.lines);
+	snprintf(details->text, sizeof(details->text),
+		 "  %s:    %s [%s] (%d lines)\n", details->path,
+		 chip->info.name, chip->info.label, chip->info.lines);
 	bgpio_close_chip(chip);
     }
     else {
-	fprintf(stderr, "%s: unable to open %s (%s)\n",
-		THIS_EXECUTABLE, path, strerror(errno));
-	exit(errno);
+	details->err = errno;
     }
 }
 
+/**
+ * Print, to stdout, a summary of information for each of the chips
+ * given by \p paths, in order.
+ *
+ * @param paths  Array of strings providing the full paths to the gpio
+ * chips we want to describe, eg "/dev/gpiochip0".
+ *
+ * @param count  The number of entries in \p paths.
+ *
+ * @param jobs  The number of chips that may be examined concurrently.
+ */
+static void
+print_chip_details(char **paths, int count, int jobs)
+{
+    chip_details *details = calloc(count? count: 1, sizeof(chip_details));
+    int i;
+
+    for (i = 0; i < count; i++) {
+	details[i].path = paths[i];
+    }
+    run_jobs(count, jobs, get_chip_details, details);
+    for (i = 0; i < count; i++) {
+	if (details[i].err) {
+	    fprintf(stderr, "%s: unable to open %s (%s)\n",
+		    THIS_EXECUTABLE, details[i].path,
+		    strerror(details[i].err));
+	    exit(details[i].err);
+	}
+	fputs(details[i].text, stdout);
+    }
+    free(details);
+}
+
+
+/**
+ * Read the value for the jobs option.
+ *
+ * @param arg  A string containing the number of jobs.
+ *
+ * @result The number of chips that may be examined concurrently.
+ */
+static int
+get_jobs(char *arg)
+{
+    int jobs;
+    if (!read_jobs(arg, &jobs)) {
+	fprintf(stderr, "%s: invalid jobs value: %s\n",
+		THIS_EXECUTABLE, arg);
+	usage(EINVAL);
+    }
+    return jobs;
+}
 
 /**
  * Deal with command line arguments to print details of gpiochips.
@@ -94,16 +158,18 @@ main(int argc, char *argv[])
      */
     struct option options[] = {
     {"help",  no_argument, 0, 0},
+    {"jobs", required_argument, 0, 0},
     {"version", no_argument, 0, 0},
     {0, 0, 0, 0}};
     int c;
     int idx = 0;
     int arg;
+    int jobs = 1;
     svector *paths;
     char *match;
+    char **chips;
 
-    c = getopt_long(argc, argv, "hv", options, &idx);
-    if (c != -1) {
+    while ((c = getopt_long(argc, argv, "hj:v", options, &idx)) != -1) {
 	switch (c) {
 	case 0:
 	    if (streq("version", options[idx].name)) {
@@ -112,9 +178,16 @@ main(int argc, char *argv[])
 	    if (streq("help", options[idx].name)) {
 		usage(0);
 	    }
+	    if (streq("jobs", options[idx].name)) {
+		jobs = get_jobs(optarg);
+		continue;
+	    }
 	    fprintf(stderr, "%s: unhandled option: %s\n\n",
 		    THIS_EXECUTABLE, options[idx].name);
 	    usage(EINVAL);
+	case 'j':
+	    jobs = get_jobs(optarg);
+	    continue;
 	case 'v':
 	    version(THIS_EXECUTABLE);
 	case 'h':
@@ -125,26 +198,28 @@ main(int argc, char *argv[])
     }
 
     paths = get_chip_paths();
-    if (argc == 1) {
+    if (optind >= argc) {
 	/* No command line arguments */
-	for (idx = 0; idx < paths->elems; idx++) {
-	    print_chip_details(paths->str[idx]);
-	}
+	print_chip_details(paths->str, paths->elems, jobs);
     }
     else {
-	/* Let's handle the arguments one at a time. */
-	for (arg = 1; arg < argc; arg++) {
+	/* Resolve each argument to a path, then examine them all. */
+	chips = malloc((argc - optind) * sizeof(char *));
+	for (arg = optind; arg < argc; arg++) {
 	    match = path_for_arg(paths, argv[arg]);
-	    if (match) {
-		print_chip_details(match);
-	    }
-	    else {
+	    if (!match) {
 		fprintf(stderr,
 			"%s may not be a gpio device.  Trying anyway...\n",
 			argv[arg]);
-		print_chip_details(argv[arg]);
+		match = newstrcpy(argv[arg]);
 	    }
+	    chips[arg - optind] = match;
+	}
+	print_chip_details(chips, argc - optind, jobs);
+	for (arg = 0; arg < argc - optind; arg++) {
+	    free(chips[arg]);
 	}
+	free(chips);
     }
     free_chip_paths(paths);
 }    
@@ -45,18 +45,26 @@ static void
 usage(int exitcode)
 {
     printf("\n"
-	   "Usage: " THIS_EXECUTABLE " [OPTIONS] <chip-id> <line-spec>...\n\n"
+	   "Usage: " THIS_EXECUTABLE " [OPTIONS] <chip-id> [<chip-id>:]<line-spec>...\n\n"
 	   "Get input from GPIO lines.\n\n"
 	   "Options:\n  -b, --bias=[as-is|disable|pull-down|pull-up]\n"
 	   "                            set the line bias (default=as-is)\n"
+	   "      --cpu=N:              run on cpu N\n"
 	   "  -d, --delta:              report only when state changes\n"
 	   "  -h, --help:               display this help message.\n"
 	   "  -l, --active-low, --low:  "
 	   "make the line active-low (default).\n"
+	   "      --mlock:              lock all memory\n"
 	   "  -n, --name=our_name:      who has reserved our gpio lines \n"
 	   "  -p, --period=usecs:       period for loop (default=2000000)\n"
+	   "      --prefault:           prefault stack and heap\n"
+	   "      --publish=shm_name:   publish values to shared memory\n"
 	   "  -q, --quiet:              execute quietly\n"
+	   "      --reacquire:          re-acquire lines if the chip reappears\n"
 	   "  -r, --repeat=count:       how many times to fetch (default=1)\n"
+	   "      --rt-priority=N:      run with SCHED_FIFO priority N\n"
+	   "      --sequential:         fetch from several chips one after\n"
+	   "                            another rather than in parallel\n"
 	   "  -v, --version:            display the version.\n"
 	   "  -x, --exec=path:          command to execute on change\n\n");
     if (!exitcode) {
@@ -64,12 +72,30 @@ usage(int exitcode)
 	  "Gpiochip-ids may be a full path to the gpiochip device, or an\n"
 	  "abbeviated suffix (eg \"chip0\") of a valid path.\n\n"
 	  "Line-specs are of the form N[\"[\"line-flag[,line-flag]\"]\"]\n"
+	  "where N is a line number or line name, and\n"
 	  "where line-flag may be a bias value, active-high, high or \n"
-	  "active-low, eg 42[pull-down] 43[pull-up,active-high].\n\n"
+	  "active-low, eg 42[pull-down] 43[pull-up,active-high].\n"
+	  "A line-spec may be prefixed by a gpiochip-id and a colon, eg\n"
+	  "chip1:17, to fetch a line from a chip other than the first.\n\n"
+	  "When lines from several chips are fetched, all chips are read at\n"
+	  "once, by one thread per chip, and each sample is reported as a\n"
+	  "single row:\n"
+	  "  <start_ns> <window_ns> <chip>:<line>=<value>...\n"
+	  "where every value was read between CLOCK_MONOTONIC start_ns and\n"
+	  "start_ns + window_ns.\n\n"
 	  "Specifying a repeat value of zero means repeat forever.\n\n"
 	  "The command executed by the exec option will be passed the\n"
 	  "gpio device path, the gpio line number and the gpio line value\n"
 	  "as parameters.\n\n"
+	  "The publish option makes each fetched set of values available\n"
+	  "to other processes, which may read them without system calls\n"
+	  "from the named POSIX shared-memory object (see\n"
+	  "bgpio_attach_values()).  The object is removed on exit.\n\n"
+	  "With the reacquire option, if the gpio chip goes away, as USB\n"
+	  "gpio expanders may, we wait for a chip with the same label to\n"
+	  "appear and request the same lines again, rather than failing.\n"
+	  "The publish and reacquire options require a single chip.\n\n"
+	  RT_OPTIONS_HELP_TEXT "\n"
 	  "The result of the command will be the value of the last\n"
 	  "successful gpio fetch, or an errorcode if an error occurred.\n");
     }
@@ -167,7 +193,7 @@ get_gpio_request(char *device, char *consumer, uint64_t flags)
     char *path = path_for_arg(chip_paths, device);
 
     if (!path) {
-	path = device;
+	path = newstrcpy(device);
 	fprintf(stderr,
 		"%s: %s may not be a gpio device.  Trying anyway...\n",
 		THIS_EXECUTABLE, path);
@@ -179,14 +205,18 @@ get_gpio_request(char *device, char *consumer, uint64_t flags)
 		THIS_EXECUTABLE, path, strerror(errno));
 	exit(errno);
     }
+    free(path);
     return request;
 }
 
 /**
  * Fetch values from all of the gpio lines we are interested in.
  *
- * @param request  The completed ::bgpio_request with all required
- * gpio lines added.
+ * @param group  The ::bgpio_group_t of completed requests, one per
+ * chip, with all required gpio lines added.
+ *
+ * @param parallel  Whether to fetch from each chip in parallel rather
+ * than one after another.
  *
  * @param quiet  Whether to avoid printing our results to stdout.
  *
@@ -197,67 +227,162 @@ get_gpio_request(char *device, char *consumer, uint64_t flags)
  * line values.  This must take 2 parameters: the line number and the
  * line value.
  *
- * @param names Pointer to an array of names which will be populated
- * with the names of the lines on the first call only to this
- * function.
+ * @param names Array, by request, of arrays of line names, by line
+ * index.
+ *
+ * @param sup  A ::bgpio_supervisor_t for the group's only request if
+ * lines are to be re-acquired when the chip reappears, else NULL.
  *
  * @result An error code, or the value of the last line read (1 or
  * 0).
  */
 static int
-perform_fetches(bgpio_request_t *request,
+perform_fetches(bgpio_group_t *group, bool parallel,
 		bool quiet, bool report_delta,
-		char *exec, char *names[])
+		char *exec, char **names[], bgpio_supervisor_t *sup)
 {
-    static uint64_t previous;
+    static uint64_t previous[BGPIO_GROUP_MAX];
     static bool first_time = true;
+    bgpio_request_t *request;
+    char *chip;
+    bool row = group->count > 1;
+    bool changed = false;
     int result;
+    int r;
     int i;
     int val = 0;
     int line;
     bool report;
-    result =  bgpio_fetch(request);
+    if (sup) {
+	uint32_t recoveries = sup->recoveries;
+	result = bgpio_supervised_fetch(sup);
+	if (sup->recoveries != recoveries) {
+	    fprintf(stderr, "%s: re-acquired lines on %s after %.3f ms\n",
+		    THIS_EXECUTABLE, sup->req->chardev_path,
+		    (double) sup->last_gap_ns / 1000000.0);
+	}
+    }
+    else if ((result = bgpio_group_fetch(group, parallel))) {
+	errno = result;
+	result = -1;
+    }
     if (result < 0) {
 	fprintf(stderr, "%s: bgpio_failed (%s)\n",
 		THIS_EXECUTABLE, strerror(errno));
 	exit(errno);
     }
 
-    if (!(first_time && report_delta)) {
-	/* If we are reporting delta only, and this is the first time
-	 * through this function, we do not need to report anything,
-	 * so we do not execute this block of code. */
-	for (i = 0; i < request->req.num_lines; i++) {
-	    val = bgpio_fetched_by_idx(request, i, &line);
-	    if (report_delta) {
-		report = BGPIO_BITVALUE(previous, i) != val;
-	    }
-	    else {
-		report = true;
+    if (row && !quiet) {
+	/* A row reports every value, so it is needed if any changed. */
+	for (r = 0; r < group->count; r++) {
+	    changed |= previous[r] != group->reqs[r]->line_values.bits;
+	}
+	if (!(first_time && report_delta) && (changed || !report_delta)) {
+	    printf("%" PRIu64 " %" PRIu64, group->start_ns,
+		   group->end_ns - group->start_ns);
+	    for (r = 0; r < group->count; r++) {
+		request = group->reqs[r];
+		chip = strrchr(request->chardev_path, '/');
+		chip = chip? chip + 1: request->chardev_path;
+		for (i = 0; i < request->req.num_lines; i++) {
+		    val = bgpio_fetched_by_idx(request, i, &line);
+		    printf(" %s:%d=%d", chip, line, val);
+		}
 	    }
-	    if (report) {
-		if (!quiet) {
-		    printf("Line %d (%s) = %d\n", line, names[i], val);
+	    printf("\n");
+	}
+    }
+
+    for (r = 0; r < group->count; r++) {
+	request = group->reqs[r];
+	if (!(first_time && report_delta)) {
+	    /* If we are reporting delta only, and this is the first time
+	     * through this function, we do not need to report anything,
+	     * so we do not execute this block of code. */
+	    for (i = 0; i < request->req.num_lines; i++) {
+		val = bgpio_fetched_by_idx(request, i, &line);
+		if (report_delta) {
+		    report = BGPIO_BITVALUE(previous[r], i) != val;
 		}
-		if (exec) {
-		    char *command_str = malloc(strlen(exec) + 30);
-		    int err;
-		    sprintf(command_str, "%s %s %d %d", exec,
-			    request->chardev_path, line, val);
-		    err = system(command_str);
-		    if (err) {
-			fprintf(stderr, "%s: \"%s\" failed: %d\n\n",
-				THIS_EXECUTABLE, command_str, err);
+		else {
+		    report = true;
+		}
+		if (report) {
+		    if (!(quiet || row)) {
+			printf("Line %d (%s) = %d\n", line, names[r][i], val);
+		    }
+		    if (exec) {
+			char *command_str = malloc(strlen(exec) +
+						   strlen(request->chardev_path)
+						   + 30);
+			int err;
+			sprintf(command_str, "%s %s %d %d", exec,
+				request->chardev_path, line, val);
+			err = system(command_str);
+			if (err) {
+			    fprintf(stderr, "%s: \"%s\" failed: %d\n\n",
+				    THIS_EXECUTABLE, command_str, err);
+			}
+			free(command_str);
 		    }
 		}
 	    }
 	}
+	previous[r] = request->line_values.bits;
     }
     first_time = false;
-    previous = request->line_values.bits;
     return val;
 }
 
+/**
+ * Identify the request for a line-spec.  A line-spec with a chip
+ * prefix, as described by line_spec_chip(), names a line on a chip
+ * other than the first.  A request is opened for each chip the first
+ * time that it is named.
+ *
+ * @param arg Pointer to the line-spec.  If the line-spec has a chip
+ * prefix, this is updated to point past it.
+ *
+ * @param requests Array of requests, by chip, to which any newly
+ * opened request is added.
+ *
+ * @param num_requests Pointer to the number of entries in \p requests.
+ *
+ * @param consumer  The name that will be associated with the lines of
+ * any newly opened request.
+ *
+ * @result The ::bgpio_request_t for the line's chip.
+ */
+static bgpio_request_t *
+request_for_line(char **arg, bgpio_request_t **requests,
+		 int *num_requests, char *consumer)
+{
+    char *path = line_spec_chip(arg);
+    bgpio_request_t *request = NULL;
+    int i;
+
+    if (!path) {
+	return requests[0];
+    }
+    for (i = 0; i < *num_requests; i++) {
+	if (streq(path, requests[i]->chardev_path)) {
+	    request = requests[i];
+	    break;
+	}
+    }
+    if (!request) {
+	if (*num_requests >= BGPIO_GROUP_MAX) {
+	    fprintf(stderr, "%s: maximum gpio chips (%d) exceeded.\n",
+		    THIS_EXECUTABLE, BGPIO_GROUP_MAX);
+	    exit(EINVAL);
+	}
+	request = get_gpio_request(path, consumer, GPIO_V2_LINE_FLAG_INPUT);
+	requests[(*num_requests)++] = request;
+    }
+    free(path);
+    return request;
+}
+
 /**
  * Process and validate the provided command line arguments before
  * performing gpio fetches.
@@ -272,18 +397,27 @@ main(int argc, char *argv[])
     int quiet = false;
     int repeat = 1;
     int report_delta = false;
-    int num_lines;
-    int line_idx;
+    int reacquire = false;
+    int sequential = false;
+    rt_options rt = RT_OPTIONS_INIT;
+    bgpio_supervisor_t *sup = NULL;
     uint64_t default_bias = 0;
     uint64_t line_flags = 0;
-    char **names;
+    char **names[BGPIO_GROUP_MAX] = {NULL};
     int c;
     int idx = 0;
+    bgpio_request_t *requests[BGPIO_GROUP_MAX];
+    int num_requests;
     bgpio_request_t *request;
+    bgpio_group_t *group;
+    char *line_arg;
     int line;
     char *line_name;
+    int r;
     int line_value = 0;
     int err;
+    char *publish_name = NULL;
+    bgpio_publisher_t *publisher = NULL;
     
     /**
      * Command line options structure for getopt_long()
@@ -291,14 +425,21 @@ main(int argc, char *argv[])
     struct option options[] = {
 	{"bias", required_argument, NULL, 0},
 	{"active-low", no_argument, &active_low, true},
+	{"cpu", required_argument, NULL, 0},
 	{"delta", no_argument, &report_delta, true},
 	{"exec", required_argument, NULL, 0},
 	{"help",  no_argument, NULL, 0},
 	{"low", no_argument, &active_low, true},
+	{"mlock", no_argument, NULL, 0},
 	{"name", required_argument, NULL, 0},
 	{"period", required_argument, NULL, 0},
+	{"prefault", no_argument, NULL, 0},
+	{"publish", required_argument, NULL, 0},
 	{"quiet", no_argument, &quiet, true},
+	{"reacquire", no_argument, &reacquire, true},
 	{"repeat", required_argument, NULL, 0},
+	{"rt-priority", required_argument, NULL, 0},
+	{"sequential", no_argument, &sequential, true},
 	{"version", no_argument, NULL, 0},
 	{NULL, 0, NULL, 0}};
     
@@ -317,11 +458,20 @@ main(int argc, char *argv[])
 	    if (streq("active-low", options[idx].name) ||
 		streq("low", options[idx].name) ||
 		streq("delta", options[idx].name) ||
-		streq("quiet", options[idx].name)) {
+		streq("quiet", options[idx].name) ||
+		streq("reacquire", options[idx].name) ||
+		streq("sequential", options[idx].name)) {
 	    }
 	    else if (streq("bias", options[idx].name)) {
 		default_bias = get_bias(optarg);
 	    }
+	    else if (is_rt_option(options[idx].name)) {
+		if (!read_rt_option(options[idx].name, optarg, &rt)) {
+		    fprintf(stderr, "%s: invalid %s value: %s\n",
+			    THIS_EXECUTABLE, options[idx].name, optarg);
+		    usage(EINVAL);
+		}
+	    }
 	    else if (streq("exec", options[idx].name)) {
 		exec = optarg;
 	    }
@@ -331,6 +481,9 @@ main(int argc, char *argv[])
 	    else if (streq("period", options[idx].name)) {
 		period = get_period(optarg);
 	    }
+	    else if (streq("publish", options[idx].name)) {
+		publish_name = optarg;
+	    }
 	    else if (streq("repeat", options[idx].name)) {
 		repeat = get_repeat(optarg);
 	    }
@@ -384,30 +537,25 @@ main(int argc, char *argv[])
 	usage(EINVAL);
     }
 
-    request = get_gpio_request(
+    requests[0] = get_gpio_request(
 	argv[optind], consumer_name, GPIO_V2_LINE_FLAG_INPUT);
+    num_requests = 1;
 
     /* Now handle each line argument in turn. */
-    if (((argc - 1) - optind) > GPIO_V2_LINES_MAX) {
-	fprintf(stderr, "%s: maximum gpio lines (%d) exceeded.\n",
-		THIS_EXECUTABLE, GPIO_V2_LINES_MAX);
-	exit(EINVAL);
-    }
-
-    num_lines = (argc - optind) - 1;
-    names = (char **) malloc(num_lines * (sizeof(char *)));
-    line_idx = 0;
-    
     for (idx = optind + 1; idx < argc; idx++) {
 	line_flags = default_bias |
 	    GPIO_V2_LINE_FLAG_INPUT |
 	    (active_low? GPIO_V2_LINE_FLAG_ACTIVE_LOW: 0);
 
-	if (!read_line_arg(argv[idx], &line, &line_flags,
+	line_arg = argv[idx];
+	request = request_for_line(&line_arg, requests, &num_requests,
+				   consumer_name);
+	if (!read_line_arg(line_arg, request->chardev_path,
+			   &line, &line_flags,
 			   LINE_FLAG_BIAS_MASK |
 			   LINE_FLAG_ACTIVE_LOW_MASK))
 	{
-	    fprintf(stderr, "expecting numeric gpio line with "
+	    fprintf(stderr, "expecting gpio line number or name with "
 		    "optional bias: \"%s\"\n", argv[idx]);
 	    usage(EINVAL);
 	}
@@ -419,25 +567,77 @@ main(int argc, char *argv[])
 		    THIS_EXECUTABLE, line);
 	    exit(EINVAL);
 	}
-	names[line_idx] = malloc(strlen(line_name) + 1);
-	strcpy(names[line_idx], line_name);
-	line_idx++;
+	for (r = 0; requests[r] != request; r++) {
+	}
+	if (!names[r]) {
+	    names[r] = calloc(GPIO_V2_LINES_MAX, sizeof(char *));
+	}
+	free(names[r][bgpio_idx_for_line(request, line)]);
+	names[r][bgpio_idx_for_line(request, line)] = line_name;
     }
 
-    if (request->req.num_lines) {
-	err = bgpio_complete_request(request);
+    if ((num_requests > 1) && (publish_name || reacquire)) {
+	fprintf(stderr, "%s: publish and reacquire options require "
+		"a single chip\n", THIS_EXECUTABLE);
+	usage(EINVAL);
+    }
+
+    if (requests[0]->req.num_lines == 0) {
+	/* All lines were taken from other chips. */
+	(void) bgpio_close_request(requests[0]);
+	free(names[0]);
+	num_requests--;
+	memmove(requests, requests + 1, num_requests * sizeof(requests[0]));
+	memmove(names, names + 1, num_requests * sizeof(names[0]));
+    }
 
-	if (err) {
-	    fprintf(stderr, "%s: error completing bgpio_request: %s\n",
-		    THIS_EXECUTABLE, strerror(err));
-	    exit(err);
+    if (num_requests && requests[0]->req.num_lines) {
+	for (r = 0; r < num_requests; r++) {
+	    err = bgpio_complete_request(requests[r]);
+
+	    if (err) {
+		fprintf(stderr, "%s: error completing bgpio_request: %s\n",
+			THIS_EXECUTABLE, strerror(err));
+		exit(err);
+	    }
+	}
+
+	group = bgpio_open_group(requests, num_requests, rt.priority);
+	if (!group) {
+	    fprintf(stderr, "%s: unable to group requests (%s)\n",
+		    THIS_EXECUTABLE, strerror(errno));
+	    exit(errno);
+	}
+
+	if (publish_name) {
+	    publisher = bgpio_open_publisher(requests[0], publish_name);
+	    if (!publisher) {
+		fprintf(stderr, "%s: unable to publish to %s (%s)\n",
+			THIS_EXECUTABLE, publish_name, strerror(errno));
+		exit(errno);
+	    }
+	}
+
+	if (reacquire) {
+	    sup = bgpio_supervise_request(requests[0]);
+	    if (!sup) {
+		fprintf(stderr, "%s: unable to supervise %s (%s)\n",
+			THIS_EXECUTABLE, requests[0]->chardev_path,
+			strerror(errno));
+		exit(errno);
+	    }
 	}
 
+	(void) apply_rt_options(THIS_EXECUTABLE, &rt, NULL, 0);
+
 	idx = repeat;
 	while (idx >= 0) {
-	    line_value = perform_fetches(request, (bool) quiet,
+	    line_value = perform_fetches(group, !sequential, (bool) quiet,
 					 (bool) report_delta,
-					 exec, names);
+					 exec, names, sup);
+	    if (publisher) {
+		bgpio_publish(publisher);
+	    }
 	    if (repeat) {
 		/* If repeat is zero we want an infinite number of
 		 * repeats */
@@ -445,8 +645,21 @@ main(int argc, char *argv[])
 	    }
 	    usleep(period);
 	}
+	if (publisher) {
+	    bgpio_close_publisher(publisher);
+	}
+	if (sup) {
+	    bgpio_end_supervision(sup);
+	}
+	bgpio_close_group(group);
+    }
+    for (r = 1; r < num_requests; r++) {
+	(void) bgpio_close_request(requests[r]);
+    }
+    if (num_requests == 0) {
+	exit(line_value);
     }
-    err = bgpio_close_request(request);
+    err = bgpio_close_request(requests[0]);
     if (err) {
 	exit(err);
     }
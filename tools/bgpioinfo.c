@@ -22,6 +22,7 @@
 #include <string.h>
 #include <getopt.h>
 #include <errno.h>
+#include <stdarg.h>
 
 #include "../lib/bgpiod.h"
 #include "bgpiotools.h"
@@ -49,6 +50,7 @@ usage(int exitcode)
 	   "If no chip is specified, list for all chips.\n"
 	   "If no lines are specified list all lines.\n\n"
 	   "Options:\n  -h, --help:     display this help message.\n"
+	   "  -j, --jobs=N:   examine up to N chips concurrently\n"
 	   "  -v, --version:  display the version.\n\n");
     if (!exitcode) {
 	printf(
@@ -60,46 +62,117 @@ usage(int exitcode)
 
 
 /**
- * Append at or after a given character position, one string to another.
- * This is used to format a string into columns, while allowing for
- * long entries to overflow, preventing any data loss, and eliminating
- * the need for really wide columns.
- *
- * @param target  A string into which \p str will be appended.  This
- * must be large enough to accept the extra characters.
- * @param pos  The position in \p target after which \p str should be
- * appended.  If target is shorter than \p pos, spaces will be added
- * before appending \p str.
- * @param str  The string to be appended.
+ * A growable text buffer into which our output is rendered, so that
+ * it can be written with a single call.
+ */
+typedef struct textbuf {
+    char  *buf;                 /**< The text, not NUL-terminated */
+    size_t len;                 /**< The length of the text */
+    size_t size;                /**< The allocated size of buf */
+} textbuf;
+
+/**
+ * Ensure that there is room in a ::textbuf for \p n more characters.
+ *
+ * @param tb The ::textbuf.
+ *
+ * @param n The number of characters to be added.
  */
 static void
-append_at(char *target, int pos, char *str)
+tb_reserve(textbuf *tb, size_t n)
 {
-    int i;
-    if ((i = strlen(target)) < pos) {
-	for (; i < pos; i++) {
-	    target[i] = ' ';
+    if (tb->len + n > tb->size) {
+	size_t size = tb->size? tb->size: 4096;
+	while (tb->len + n > size) {
+	    size *= 2;
 	}
-	target[i] = '\0';
+	tb->buf = realloc(tb->buf, size);
+	if (!tb->buf) {
+	    fprintf(stderr, "%s: out of memory\n", THIS_EXECUTABLE);
+	    exit(ENOMEM);
+	}
+	tb->size = size;
     }
-    strcat(target + pos, str);
 }
 
+/**
+ * Append a string to a ::textbuf.
+ *
+ * @param tb The ::textbuf.
+ *
+ * @param str The string to be appended.
+ */
+static void
+tb_append(textbuf *tb, const char *str)
+{
+    size_t n = strlen(str);
+    tb_reserve(tb, n);
+    memcpy(tb->buf + tb->len, str, n);
+    tb->len += n;
+}
 
 /**
- * Append a description of a flag to \p target if the flag is set.
+ * Append formatted text to a ::textbuf.
+ *
+ * @param tb The ::textbuf.
+ *
+ * @param fmt A printf() format string, followed by its arguments.
+ */
+static void __attribute__ ((format (printf, 2, 3)))
+tb_printf(textbuf *tb, const char *fmt, ...)
+{
+    va_list args;
+    int n;
+
+    va_start(args, fmt);
+    n = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    tb_reserve(tb, n + 1);
+    va_start(args, fmt);
+    vsnprintf(tb->buf + tb->len, n + 1, fmt, args);
+    va_end(args);
+    tb->len += n;
+}
+
+/**
+ * Pad a ::textbuf with spaces up to a given column.  This is used to
+ * format lines into columns, while allowing for long entries to
+ * overflow, preventing any data loss, and eliminating the need for
+ * really wide columns.
+ *
+ * @param tb The ::textbuf.
+ *
+ * @param line_start The position in \p tb of the start of the
+ * current line.
+ *
+ * @param col The column, relative to \p line_start, to pad to.  If
+ * the line already extends beyond this, nothing is added.
+ */
+static void
+tb_pad_to(textbuf *tb, size_t line_start, size_t col)
+{
+    if (tb->len < line_start + col) {
+	size_t n = line_start + col - tb->len;
+	tb_reserve(tb, n);
+	memset(tb->buf + tb->len, ' ', n);
+	tb->len += n;
+    }
+}
+
+/**
+ * Append a description of a flag to \p tb if the flag is set.
  * This tests two flag bitmaps for a specific bitmask.  If either
- * flag entry contains the bit \p str will be appended to \p target.
+ * flag entry contains the bit \p str will be appended to \p tb.
  * If the bit is not set in \p base_flags, an asterisk is further
  * appended to indicate that the flag came from attribute flags.
  *
- * @param target  The string to possibly be appended into.
+ * @param tb  The ::textbuf to possibly be appended to.
  *
  * @param mask  A bitmap containing the bit to be tested in the flags
  * parameters.
  *
  * @param str  A string describing the flag.  This will be appended to
- * \p target, if the bit is set.
+ * \p tb, if the bit is set.
  *
  * @param base_flags  A bitmap containing all of the base flags,
  * against which \p mask will be tested.  The base_flags will apply to
@@ -111,13 +184,13 @@ append_at(char *target, int pos, char *str)
  */
 static void
 maybe_append_flags_str(
-    char *target, uint64_t mask, char *str,
+    textbuf *tb, uint64_t mask, char *str,
     uint64_t base_flags, uint64_t attr_flags)
 {
     if (BGPIO_MASKED_BITS(base_flags | attr_flags, mask)) {
-	strcat(target, str);
+	tb_append(tb, str);
 	if (!BGPIO_MASKED_BITS(base_flags, mask)) {
-	    strcat(target, "*");
+	    tb_append(tb, "*");
 	}
     }
 }
@@ -126,7 +199,7 @@ maybe_append_flags_str(
 /**
  * Check all flag values to identify which are set.
  * 
- * @param target  The string into which descriptions of set flags will
+ * @param tb  The ::textbuf to which descriptions of set flags will
  * be appended.
  *
  * @param base_flags  A bitmap containing all of the base flags,
@@ -138,84 +211,109 @@ maybe_append_flags_str(
  * flags that apply to all gpio lines in a request.
  */ 
 static void
-append_flags(char *target, uint64_t base_flags, uint64_t attr_flags)
+append_flags(textbuf *tb, uint64_t base_flags, uint64_t attr_flags)
 {
-    printf("BASE FLAGS: %" PRIx64 " ATTR FLAGS: %" PRIx64,
-	   base_flags, attr_flags);
-    
-    maybe_append_flags_str(target, GPIO_V2_LINE_FLAG_INPUT,
+    maybe_append_flags_str(tb, GPIO_V2_LINE_FLAG_INPUT,
 			   " input", base_flags, attr_flags);
-    maybe_append_flags_str(target, GPIO_V2_LINE_FLAG_OUTPUT,
+    maybe_append_flags_str(tb, GPIO_V2_LINE_FLAG_OUTPUT,
 			   " output", base_flags, attr_flags);
-    maybe_append_flags_str(target, GPIO_V2_LINE_FLAG_ACTIVE_LOW,
+    maybe_append_flags_str(tb, GPIO_V2_LINE_FLAG_ACTIVE_LOW,
 			   " active-low", base_flags, attr_flags);
-    maybe_append_flags_str(target, GPIO_V2_LINE_FLAG_EDGE_RISING,
+    maybe_append_flags_str(tb, GPIO_V2_LINE_FLAG_EDGE_RISING,
 			   " rising-edge", base_flags, attr_flags);
-    maybe_append_flags_str(target, GPIO_V2_LINE_FLAG_EDGE_FALLING,
+    maybe_append_flags_str(tb, GPIO_V2_LINE_FLAG_EDGE_FALLING,
 			   " falling-edge", base_flags, attr_flags);
-    maybe_append_flags_str(target, GPIO_V2_LINE_FLAG_OPEN_DRAIN,
+    maybe_append_flags_str(tb, GPIO_V2_LINE_FLAG_OPEN_DRAIN,
 			   " open-drain", base_flags, attr_flags);
-    maybe_append_flags_str(target, GPIO_V2_LINE_FLAG_OPEN_SOURCE,
+    maybe_append_flags_str(tb, GPIO_V2_LINE_FLAG_OPEN_SOURCE,
 			   " open-source", base_flags, attr_flags);
-    maybe_append_flags_str(target, GPIO_V2_LINE_FLAG_BIAS_PULL_UP,
+    maybe_append_flags_str(tb, GPIO_V2_LINE_FLAG_BIAS_PULL_UP,
 			   " pull-up", base_flags, attr_flags);
-    maybe_append_flags_str(target, GPIO_V2_LINE_FLAG_BIAS_PULL_DOWN,
+    maybe_append_flags_str(tb, GPIO_V2_LINE_FLAG_BIAS_PULL_DOWN,
 			   " pull-down", base_flags, attr_flags);
-    maybe_append_flags_str(target, GPIO_V2_LINE_FLAG_BIAS_DISABLED,
+    maybe_append_flags_str(tb, GPIO_V2_LINE_FLAG_BIAS_DISABLED,
 			   " bias-disabled", base_flags, attr_flags);
 }
 
 
 /**
- * Print details for a specified chip and line number to stdout.
+ * Render the details of a gpio line into a ::textbuf.
  *
- * @param chip A ::bgpio_chip_t struct as returned by
- * bgio_chip_open().
- * 
- * @param line_no The integer line number of the line for which we
- * wish to print details.
+ * @param tb The ::textbuf to which the details will be appended.
+ *
+ * @param info The line's information, as returned by
+ * bgpio_chip_snapshot().
  */
 static void
-print_gpioline(bgpio_chip_t *chip, int line_no)
+render_gpioline(textbuf *tb, struct gpio_v2_line_info *info)
 {
-    struct gpio_v2_line_info *info;
-    char line[200] = "";
-    uint64_t attr_flags;
     uint64_t output_values;
-    char o_val[32];
     uint32_t debounce;
+    size_t line_start;
 
-    line[0] = '\0';
-    info = bgpio_get_lineinfo(chip, line_no);
-    printf("%3d: ", line_no);
-    append_at(line, 0, info->name);
+    tb_printf(tb, "%3d: ", info->offset);
+    line_start = tb->len;
+    tb_append(tb, info->name);
+    tb_pad_to(tb, line_start, 20);
     if (BGPIO_MASKED_BITS(info->flags, GPIO_V2_LINE_FLAG_USED)) {
-	append_at(line, 20, "\"");
-	append_at(line, 21, info->consumer);
-	append_at(line, 20, "\"");
+	tb_printf(tb, "\"%s\"", info->consumer);
     }
     else {
-	append_at(line, 20, "unused");
+	tb_append(tb, "unused");
     }
-    append_at(line, 36, "");
-    attr_flags = bgpio_attr_flags(info);
-    append_flags(line, info->flags, attr_flags);
+    tb_pad_to(tb, line_start, 36);
+    append_flags(tb, info->flags, bgpio_attr_flags(info));
     if (bgpio_attr_output(info, &output_values)) {
-	sprintf(o_val, " [0x%" PRIx64 "]", output_values);
-	(void) strcat(line, o_val);
+	tb_printf(tb, " [0x%" PRIx64 "]", output_values);
     }
     if (bgpio_attr_debounce(info, &debounce)) {
-	sprintf(o_val, " (%dμsec)", debounce);
-	(void) strcat(line, o_val);
+	tb_printf(tb, " (%dμsec)", debounce);
+    }
+    tb_append(tb, "\n");
+}
+
+/**
+ * Fetch the details of a range of lines from a chip and render them
+ * into a ::textbuf.
+ *
+ * @param tb The ::textbuf to which the details will be appended.
+ *
+ * @param chip A ::bgpio_chip_t struct as returned by
+ * bgpio_open_chip().
+ *
+ * @param first The first line number.
+ *
+ * @param count The number of lines.
+ *
+ * @result Zero if successful, else an errno value.
+ */
+static int
+render_gpiolines(textbuf *tb, bgpio_chip_t *chip, int first, int count)
+{
+    struct gpio_v2_line_info *infos;
+    int i;
+
+    infos = malloc((count? count: 1) * sizeof(struct gpio_v2_line_info));
+    if (!infos) {
+	return ENOMEM;
     }
-    printf("%s\n", line);
-    free((void *) info);
+    if (bgpio_chip_snapshot(chip, first, count, infos) < 0) {
+	free(infos);
+	return errno;
+    }
+    for (i = 0; i < count; i++) {
+	render_gpioline(tb, &infos[i]);
+    }
+    free(infos);
+    return 0;
 }
 
 /**
  * Get a gpio line number from a supplied command line argument.
  *
- * @param arg The command line argument
+ * @param arg The command line argument, a line number or name.
+ *
+ * @param chip The path of the chip, used to resolve line names.
  *
  * @param lines The number of lines for the bgpio chip.  This is used
  * for validating the input.
@@ -223,10 +321,10 @@ print_gpioline(bgpio_chip_t *chip, int line_no)
  * @result The integer line number
  */
 static int
-get_gpio_line (char *arg, unsigned int lines)
+get_gpio_line (char *arg, const char *chip, unsigned int lines)
 {
     int result;
-    if (read_int(arg, &result)) {
+    if (read_line_id(arg, chip, &result)) {
 	if (result >= lines) {
 	    fprintf(stderr,
 		    "Argument (%d) out of range (0 .. %d).\n",
@@ -236,13 +334,83 @@ get_gpio_line (char *arg, unsigned int lines)
     }
     else {
 	fprintf(stderr,
-		"Argument (\"%s\") should be an integer.\n",
+		"Argument (\"%s\") should be a line number or name.\n",
 		arg);
 	exit(EINVAL);
     }
     return result;
 }
 
+/**
+ * The lines to be described for one chip, and the rendered result, as
+ * handled by describe_chip().
+ */
+typedef struct chip_job {
+    char    *path;              /**< The path to the chip device */
+    char   **lines;             /**< Line number arguments, if any */
+    int      nlines;            /**< The number of entries in lines */
+    textbuf  tb;                /**< The rendered description */
+    int      err;               /**< errno from describing the chip */
+    bool     opened;            /**< Whether the chip could be opened */
+} chip_job;
+
+/**
+ * Render a description of one of a set of chips.  This is run,
+ * possibly concurrently, by run_jobs().  Line number arguments are
+ * only given when a single chip has been specified, so their
+ * validation, which may exit, never happens in a worker thread.
+ *
+ * @param idx  The index of the chip in \p ctx.
+ *
+ * @param ctx  Array of ::chip_job.
+ */
+static void
+describe_chip(int idx, void *ctx)
+{
+    chip_job *job = &((chip_job *) ctx)[idx];
+    bgpio_chip_t *chip = bgpio_open_chip(job->path);
+    int line;
+    int i;
+
+    if (!chip) {
+	job->err = errno;
+	return;
+    }
+    job->opened = true;
+    tb_printf(&job->tb, "%s - %d lines\n",
+	      chip->info.name, chip->info.lines);
+    if (job->nlines) {
+	for (i = 0; (i < job->nlines) && !job->err; i++) {
+	    line = get_gpio_line(job->lines[i], chip->path,
+				 chip->info.lines);
+	    job->err = render_gpiolines(&job->tb, chip, line, 1);
+	}
+    }
+    else {
+	job->err = render_gpiolines(&job->tb, chip, 0, chip->info.lines);
+    }
+    bgpio_close_chip(chip);
+}
+
+/**
+ * Read the value for the jobs option.
+ *
+ * @param arg  A string containing the number of jobs.
+ *
+ * @result The number of chips that may be examined concurrently.
+ */
+static int
+get_jobs(char *arg)
+{
+    int jobs;
+    if (!read_jobs(arg, &jobs)) {
+	fprintf(stderr, "%s: invalid jobs value: %s\n",
+		THIS_EXECUTABLE, arg);
+	usage(EINVAL);
+    }
+    return jobs;
+}
+
 /** 
  * Print a summary of gpio line information for lines of a gpio chip.
  * If the caller has provided specific line numbers as parameters,
@@ -262,15 +430,18 @@ main(int argc, char *argv[])
      */
     static struct option options[] = {
 	{"help",  no_argument, 0, 0},
+	{"jobs", required_argument, 0, 0},
 	{"version", no_argument, 0, 0},
 	{0, 0, 0, 0}};
     
     int c;
     int idx = 0;
+    int jobs = 1;
     svector *paths;
+    chip_job *chips;
+    textbuf tb = {NULL, 0, 0};
     
-    c = getopt_long(argc, argv, "hv", options, &idx);
-    if (c != -1) {
+    while ((c = getopt_long(argc, argv, "hj:v", options, &idx)) != -1) {
 	switch (c) {
 	case 0:
 	    if (streq("version", options[idx].name)) {
@@ -279,11 +450,18 @@ main(int argc, char *argv[])
 	    if (streq("help", options[idx].name)) {
 		usage(0);
 	    }
+	    if (streq("jobs", options[idx].name)) {
+		jobs = get_jobs(optarg);
+		continue;
+	    }
 	    fprintf(stderr, "%s: unhandled option: %s\n\n",
 		    THIS_EXECUTABLE, options[idx].name);
 	    usage(EINVAL);
+	case 'j':
+	    jobs = get_jobs(optarg);
+	    continue;
 	case 'v':
-	    version("THIS_EXECUTABLE");
+	    version(THIS_EXECUTABLE);
 	case 'h':
 	    usage(0);
 	default:
@@ -293,17 +471,14 @@ main(int argc, char *argv[])
 
     paths = get_chip_paths();
 
-    if (argc > 1) {
+    if (optind < argc) {
 	char *device;
-	device = path_for_arg(paths, argv[1]);
-	if (device) {
-	    device = newstrcpy(device);
-	}
-	else {
-	    device = newstrcpy(argv[1]);
+	device = path_for_arg(paths, argv[optind]);
+	if (!device) {
+	    device = newstrcpy(argv[optind]);
 	    fprintf(stderr,
 		    "%s may not be a gpio device.  Trying anyway...\n",
-		    argv[1]);
+		    argv[optind]);
 	}
 	free_chip_paths(paths);
 	/* Replace the original paths ::svector with a version with
@@ -312,34 +487,48 @@ main(int argc, char *argv[])
 	paths = svector_add_elem(paths, device);
     }
 
+    chips = calloc(paths->elems? paths->elems: 1, sizeof(chip_job));
     for (idx = 0; idx < paths->elems; idx++) {
-	/* We pass in argc and argv so that specific lines can be
-	 * queried if the user has specified them. */
-	bgpio_chip_t *chip = bgpio_open_chip(paths->str[idx]);
-	int line;
-	if (chip) {
-	    printf("%s - %d lines\n",
-		   chip->info.name, chip->info.lines);
+	chips[idx].path = paths->str[idx];
+	if (optind + 1 < argc) {
+	    /* Specific lines have been requested. */
+	    chips[idx].lines = &argv[optind + 1];
+	    chips[idx].nlines = argc - optind - 1;
+	}
+    }
+    run_jobs(paths->elems, jobs, describe_chip, chips);
 
-	    if (argc > 2) {
-		int i;
-		for (i = 2; i < argc; i++) {
-		    line = get_gpio_line(argv[i], chip->info.lines);
-		    print_gpioline(chip, line);
-		}
+    /* Merge the results in chip order, stopping at the first error
+     * just as we would have done had the chips been examined one at
+     * a time. */
+    for (idx = 0; idx < paths->elems; idx++) {
+	chip_job *job = &chips[idx];
+	if (job->tb.len) {
+	    tb_reserve(&tb, job->tb.len);
+	    memcpy(tb.buf + tb.len, job->tb.buf, job->tb.len);
+	    tb.len += job->tb.len;
+	}
+	if (job->err) {
+	    if (tb.len) {
+		(void) fwrite(tb.buf, 1, tb.len, stdout);
+	    }
+	    fflush(stdout);
+	    if (job->opened) {
+		fprintf(stderr, "%s: unable to get lineinfo for %s (%s)\n",
+			THIS_EXECUTABLE, job->path, strerror(job->err));
 	    }
 	    else {
-		for (line = 0; line < chip->info.lines; line++) {
-		    print_gpioline(chip, line);
-		}
+		fprintf(stderr, "%s: unable to open %s (%s)\n",
+			THIS_EXECUTABLE, job->path, strerror(job->err));
 	    }
-	    bgpio_close_chip(chip);
-	}
-	else {
-	    fprintf(stderr, "%s: unable to open %s (%s)\n",
-		    THIS_EXECUTABLE, paths->str[idx], strerror(errno));
-	    exit(errno);
+	    exit(job->err);
 	}
+	free(job->tb.buf);
     }
+    free(chips);
     free_chip_paths(paths);
+    if (tb.len) {
+	(void) fwrite(tb.buf, 1, tb.len, stdout);
+    }
+    free(tb.buf);
 }
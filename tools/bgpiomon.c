@@ -23,6 +23,8 @@
 #include <string.h>
 #include <getopt.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <errno.h>
 
 #include "../lib/bgpiod.h"
@@ -47,6 +49,34 @@
  */
 #define SUMMARY monitor gpio line values
 
+/**
+ * The maximum number of ready requests returned by a single
+ * epoll_wait() call.
+ */
+#define EPOLL_BATCH 16
+
+/**
+ * The epoll data value of the deadline timer, distinguishing it from
+ * the request indexes.
+ */
+#define DEADLINE_IDX UINT32_MAX
+
+/**
+ * An edge event read by process_events(), with the index of the
+ * request it was read from.
+ */
+typedef struct mon_event_t {
+    struct gpio_v2_line_event event;
+    int                       req_idx;
+    uint64_t                  read_ns;
+} mon_event_t;
+
+/**
+ * The events read by a single call to process_events().  This is
+ * static so that it may be prefaulted by apply_rt_options().
+ */
+static mon_event_t mon_events[EPOLL_BATCH * BGPIO_DISPATCH_BATCH];
+
 /**
  * Provide a usage message and exit.
  * @param exitcode The value to be returned from gpsud by exit().
@@ -54,20 +84,34 @@
 static void
 usage(int exitcode)
 {
-    printf("Usage: " THIS_EXECUTABLE " [OPTIONS] [gpiochip id] [line-spec]...\n\n");
+    printf("Usage: " THIS_EXECUTABLE
+	   " [OPTIONS] [gpiochip id] [[gpiochip id:]line-spec]...\n\n");
     printf("Monitor GPIO lines for changes to input values."
 	   "Options:\n  -b, --bias=[as-is|disable|pull-down|pull-up]\n"
 	   "                           set the line bias (default=as-is)\n"
+	   "      --busy-poll[=N]:     spin awaiting events, with up to N\n"
+	   "                           cpu pauses between reads\n"
+	   "      --coalesce=usecs[,N]: deliver events in batches\n"
+	   "      --cpu=N:             run on cpu N\n"
 #ifndef DEBOUNCE_DISABLED	   
 	   "  -d, --debounce=N:        set debounce period to N usecs\n"
 #endif
+	   "      --deadline=duration: stop monitoring after duration\n"
 	   "  -e, --edge=[" EDGE_ARGS_STR_OR "]: \n"
 	   "                           set edge detection (default=rising)\n"
+	   "      --fanout=shm_name:   share events through shared memory\n"
 	   "  -h, --help:              display this help message.\n"
 	   "  -l, --active-low, --low: make the line active-low.\n"
+	   "      --latency:           report the receive latency of events\n"
+	   "      --max-rate=N[,ms]:   throttle lines exceeding N edges/sec\n"
+	   "      --merge=usecs:       order events across chips and wakeups\n"
+	   "      --mlock:             lock all memory\n"
 	   "  -n, --name=name:         name for line reservation\n"
+	   "      --prefault:          prefault stack and heap\n"
 	   "  -q, --quiet:             execute quietly\n"
+	   "      --reacquire:         re-acquire lines if the chip reappears\n"
 	   "  -r, --repeat=count       how many edges to detect (default=1)\n"
+	   "      --rt-priority=N:     run with SCHED_FIFO priority N\n"
 	   "  -t, --timeout=millisecs  Specify an inactivity timeout period.\n" 
 	   "  -v, --version:           display the version.\n"
 	   "  -x, --exec=path:         command to execute on detection\n\n");
@@ -78,12 +122,63 @@ usage(int exitcode)
 	  "Line-specs are of the form N[\"[\"line-flag[,line-flag...]\"]\"]=B\n"
 	  "where line-flag may be a bias value, active-high, high or \n"
 	  "active-low, or an edge-detection value (" EDGE_ARGS_STR_COMMA ").\n"
-	  "N is the gpio line number and B is the binary digit 1 or 0,\n"
-	  " eg \"84[pull-up,high,rising]=1\"\n\n" 
+	  "N is the gpio line number or name and B is the binary digit\n"
+	  "1 or 0, eg \"84[pull-up,high,rising]=1\"\n\n" 
+	  "A line-spec may be prefixed by a gpiochip-id and a colon, eg\n"
+	  "chip1:17, to monitor a line on a chip other than the first.\n"
+	  "Lines on any number of chips, and any number of lines on each\n"
+	  "chip, are monitored by a single process.  When more than one\n"
+	  "chip is monitored, each event reports its chip.\n\n"
 	  "The command executed by the exec option will be passed the\n"
 	  "gpio device path, the gpio line number, the presumed new line\n"
 	  "value (1 for rising, 0 for falling), the event timestamp, the\n"
 	  "line sequence number, and the event sequence number.\n\n"
+	  "The deadline option stops monitoring once the given time has\n"
+	  "passed, however many edges have been detected.  Durations are\n"
+	  "given in milliseconds, or with a unit of ns, us, ms or s, eg 2s.\n\n"
+	  "The fanout option also writes each event into the named POSIX\n"
+	  "shared-memory ring, from which any number of processes may\n"
+	  "read them (see bgpio_attach_ring()).  The ring is removed on\n"
+	  "exit.\n\n"
+	  "With the reacquire option, if the gpio chip goes away, as USB\n"
+	  "gpio expanders may, we wait for a chip with the same label to\n"
+	  "appear and request the same lines again, rather than failing.\n"
+	  "It cannot be combined with the fanout option.  Neither option\n"
+	  "may be used with lines on more than one chip, or with more than\n"
+	  "63 lines.\n\n"
+	  "The busy-poll option spins on a non-blocking read rather than\n"
+	  "sleeping until an event arrives, trading a cpu for the latency\n"
+	  "of a wakeup.  It is best combined with the rt-priority and cpu\n"
+	  "options, and requires a single chip and at most 63 lines.  It\n"
+	  "cannot be combined with the fanout option.\n\n"
+	  "The coalesce option, for lines with high edge rates, waits for\n"
+	  "up to usecs after the first event of a batch, or until N events\n"
+	  "(default 256) have been read, before reporting the batch, so\n"
+	  "that we wake less often.  Sparse events are reported at once.\n"
+	  "The distribution of batch sizes is reported on exit.  It has\n"
+	  "the same restrictions as the busy-poll option, and cannot be\n"
+	  "combined with it or with the reacquire option.\n\n"
+	  "The max-rate option protects against chattering lines.  A line\n"
+	  "that exceeds N edges per second has its edge detection removed,\n"
+	  "and is then sampled, until a cool-down of ms milliseconds\n"
+	  "(default 1000) passes in which its sampled rate is within N, when\n"
+	  "edge detection is restored.  Each change is reported on stderr.\n"
+	  "It cannot be combined with the fanout, reacquire, busy-poll or\n"
+	  "coalesce options.\n\n"
+	  "Events from several chips are normally ordered by timestamp\n"
+	  "only among those read in a single wakeup, which adds no delay.\n"
+	  "An event whose chip is slow to wake us may then be reported\n"
+	  "after a later event from another chip.  The merge option\n"
+	  "instead holds each event for up to usecs, until every chip has\n"
+	  "a later event, so that events are reported in timestamp order\n"
+	  "across wakeups.  An event arriving after a later one has been\n"
+	  "reported is marked as late.  It cannot be combined with the\n"
+	  "max-rate option.\n\n"
+	  "The latency option reports, with each event, the time between\n"
+	  "the kernel timestamping the event and our reading it, so that\n"
+	  "busy-polling and sleeping may be compared.  It is not\n"
+	  "available with the fanout option.\n\n"
+	  RT_OPTIONS_HELP_TEXT "\n"
 	  "The result of the command will be the value of the last event\n"
 	  "(1 or 0 as for exec), or an errorcode if an error occurred.\n");
     }
@@ -151,6 +246,164 @@ get_repeat(char *arg)
     return (long) repeat;
 }
 
+/**
+ * Read a duration from a string for a deadline.
+ *
+ * @param arg  A string containing the duration.
+ *
+ * @result The duration in nanoseconds.
+ */
+static uint64_t
+get_deadline(char *arg)
+{
+    uint64_t deadline;
+    if (!read_duration_ns(arg, &deadline)) {
+	fprintf(stderr, "%s: invalid deadline value: %s\n",
+		THIS_EXECUTABLE, arg);
+	usage(EINVAL);
+    }
+    return deadline;
+}
+
+/**
+ * Determine how long to wait for the next event, given an inactivity
+ * timeout and a deadline.  The time remaining before the deadline is
+ * rounded up to a whole millisecond, so that we do not wake just
+ * before it.
+ *
+ * @param timeout  The inactivity timeout in milliseconds, or -1.
+ *
+ * @param deadline  The CLOCK_MONOTONIC time, in nanoseconds, at which
+ * we stop monitoring, or 0.
+ *
+ * @param p_wait  Where the period to wait, in milliseconds, will be
+ * placed.
+ *
+ * @result \p p_wait, or NULL if we should wait indefinitely.
+ */
+static int *
+wait_msecs(int timeout, uint64_t deadline, int *p_wait)
+{
+    uint64_t now;
+    uint64_t remaining;
+
+    if (!deadline) {
+	*p_wait = timeout;
+	return (timeout == -1)? NULL: p_wait;
+    }
+    now = bgpio_now_ns();
+    remaining = (deadline > now)? (deadline - now + 999999) / 1000000: 0;
+    if ((timeout != -1) && ((uint64_t) timeout < remaining)) {
+	remaining = timeout;
+    }
+    *p_wait = (int) remaining;
+    return p_wait;
+}
+
+/**
+ * Read the maximum busy-poll backoff from a string.
+ *
+ * @param arg  A string containing the backoff value.
+ *
+ * @result The maximum number of cpu pauses between reads.
+ */
+static int
+get_backoff(char *arg)
+{
+    int backoff;
+    if (!read_int(arg, &backoff) || (backoff < 0)) {
+	fprintf(stderr, "%s: invalid busy-poll value: %s\n",
+		THIS_EXECUTABLE, arg);
+	usage(EINVAL);
+    }
+    return backoff;
+}
+
+/**
+ * Read coalescing settings, of the form usecs[,N], from a string.
+ *
+ * @param arg  A string containing the settings.
+ *
+ * @param p_window  Where the coalescing window, in microseconds, will
+ * be placed.
+ *
+ * @param p_max  Where the maximum batch size will be placed, or 0 if
+ * none is given.
+ */
+static void
+get_coalesce(char *arg, int *p_window, int *p_max)
+{
+    char *comma = strchr(arg, ',');
+    bool ok;
+
+    *p_max = 0;
+    if (comma) {
+	*comma = '\0';
+    }
+    ok = read_int(arg, p_window) && (*p_window > 0);
+    if (comma) {
+	*comma = ',';
+	ok = ok && read_int(comma + 1, p_max) &&
+	    (*p_max > 0) && (*p_max <= BGPIO_COALESCE_MAX);
+    }
+    if (!ok) {
+	fprintf(stderr, "%s: invalid coalesce value: %s\n",
+		THIS_EXECUTABLE, arg);
+	usage(EINVAL);
+    }
+}
+
+/**
+ * Read the merge window, in microseconds, from a string.
+ *
+ * @param arg  A string containing the window.
+ *
+ * @result The merge window in microseconds.
+ */
+static int
+get_merge(char *arg)
+{
+    int window;
+    if (!read_int(arg, &window) || (window <= 0)) {
+	fprintf(stderr, "%s: invalid merge value: %s\n",
+		THIS_EXECUTABLE, arg);
+	usage(EINVAL);
+    }
+    return window;
+}
+
+/**
+ * Read rate-guard settings, of the form N[,cooldown], from a string.
+ *
+ * @param arg  A string containing the settings.
+ *
+ * @param p_rate  Where the maximum number of edges per second will be
+ * placed.
+ *
+ * @param p_cooldown  Where the cool-down period, in milliseconds, will
+ * be placed, if one is given.
+ */
+static void
+get_max_rate(char *arg, int *p_rate, int *p_cooldown)
+{
+    char *comma = strchr(arg, ',');
+    bool ok;
+
+    if (comma) {
+	*comma = '\0';
+    }
+    ok = read_int(arg, p_rate) && (*p_rate > 0);
+    if (comma) {
+	*comma = ',';
+	ok = ok && read_int(comma + 1, p_cooldown) && (*p_cooldown > 0);
+    }
+    if (!ok) {
+	fprintf(stderr, "%s: invalid max-rate value: %s\n",
+		THIS_EXECUTABLE, arg);
+	usage(EINVAL);
+    }
+}
+
 /**
  * Read an integer value from a string for a timeout value.
  *
@@ -198,7 +451,7 @@ get_gpio_request(char *device, char *consumer, uint64_t flags)
     char *path = path_for_arg(chip_paths, device);
 
     if (!path) {
-	path = device;
+	path = newstrcpy(device);
 	fprintf(stderr,
 		"%s: %s may not be a gpio device.  Trying anyway...\n",
 		THIS_EXECUTABLE, path);
@@ -210,6 +463,7 @@ get_gpio_request(char *device, char *consumer, uint64_t flags)
 		THIS_EXECUTABLE, path, strerror(errno));
 	exit(errno);
     }
+    free(path);
     return request;
 }
 
@@ -233,13 +487,22 @@ get_debounce(char *arg)
 }
 
 /**
- * Wait for an event and process it when it arrives.
+ * Report an event, printing it and running the exec command as
+ * required.
  *
  * @param request The ::bgpio_request_t for our gpio operations.
  *
+ * @param p_event The event to be reported.
+ *
+ * @param chip The name of the chip to be reported with the event, or
+ * NULL if only one chip is being monitored.
+ *
  * @param quiet  Boolean identifying whether output is (not) to be
  * printed.
  *
+ * @param read_ns  The CLOCK_MONOTONIC time at which the event was
+ * read, if its latency is to be reported, else 0.
+ *
  * @param exec  Path to an executable to be run when an edge event is
  * encountered.  This executable will take the following parameters:
  *   - gpio device path;
@@ -252,37 +515,29 @@ get_debounce(char *arg)
  * @result 1 or 0 for the result of the event, or an errorcode.
  */
 static int
-process_edge(bgpio_request_t *request, bool quiet,
-	     char *exec, int *timeout)
+report_event(bgpio_request_t *request, struct gpio_v2_line_event *p_event,
+	     const char *chip, bool quiet, uint64_t read_ns, char *exec)
 {
-    struct gpio_v2_line_event *p_event = &(request->event);
     int result;
-    
-    if ((result = bgpio_await_event(request, timeout))) {
-	// TODO: Put in proper error message
-	if (result == ETIMEDOUT) {
-	    return 0;
-	}
-	fprintf(stdout, "%s: Await event error: %d\n",
-		THIS_EXECUTABLE, result);
-	exit(result);
-    }
 
     if (!quiet) {
-	fprintf(stdout, "GPIO EVENT at %" PRIu64 " on line %d (%d|%d) ",
-		(uint64_t)p_event->timestamp_ns, p_event->offset,
-		p_event->line_seqno, p_event->seqno);
+	fprintf(stdout, "GPIO EVENT at %" PRIu64 " on line %d ",
+		(uint64_t)p_event->timestamp_ns, p_event->offset);
+	if (chip) {
+	    fprintf(stdout, "of %s ", chip);
+	}
+	fprintf(stdout, "(%d|%d) ", p_event->line_seqno, p_event->seqno);
     }
     switch (p_event->id) {
     case GPIO_V2_LINE_EVENT_RISING_EDGE:
 	if (!quiet) {
-	    fprintf(stdout, "rising edge\n");
+	    fprintf(stdout, "rising edge");
 	}
 	result = 1;
 	break;
     case GPIO_V2_LINE_EVENT_FALLING_EDGE:
 	if (!quiet) {
-	    fprintf(stdout, "falling edge\n");
+	    fprintf(stdout, "falling edge");
 	}
 	result = 0;
 	break;
@@ -291,9 +546,18 @@ process_edge(bgpio_request_t *request, bool quiet,
 		THIS_EXECUTABLE, p_event->id);
 	return EINVAL;
     }
+    if (!quiet) {
+	if (read_ns) {
+	    fprintf(stdout, ", latency %.3f us",
+		    (double) (int64_t) (read_ns - p_event->timestamp_ns) /
+		    1000.0);
+	}
+	fprintf(stdout, "\n");
+    }
     
     if (exec) {
-	char *command_str = malloc(strlen(exec) + 80);
+	char *command_str = malloc(strlen(exec) +
+				   strlen(request->chardev_path) + 80);
 	int err;
 	sprintf(command_str, "%s %s %d %d %lld %d %d",
 		exec, request->chardev_path,
@@ -305,10 +569,498 @@ process_edge(bgpio_request_t *request, bool quiet,
 	    fprintf(stderr, "%s: \"%s\" failed: %d\n\n",
 		    THIS_EXECUTABLE, command_str, err);
 	}
+	free(command_str);
+    }
+    return result;
+}
+
+/**
+ * Wait for an event and process it when it arrives.
+ *
+ * @param request The ::bgpio_request_t for our gpio operations.
+ *
+ * @param sup  A ::bgpio_supervisor_t for \p request if lines are to be
+ * re-acquired when the chip reappears, else NULL.
+ *
+ * @param quiet  Boolean identifying whether output is (not) to be
+ * printed.
+ *
+ * @param exec  Path to an executable to be run when an edge event is
+ * encountered, as for report_event().
+ *
+ * @param timeout Pointer to a timeout in milliseconds, or NULL.
+ *
+ * @param latency  Whether the latency of the event is to be reported.
+ *
+ * @result 1 or 0 for the result of the event, or an errorcode.
+ */
+static int
+process_edge(bgpio_request_t *request, bgpio_supervisor_t *sup,
+	     bool quiet, char *exec, int *timeout, bool latency)
+{
+    int result;
+    
+    if (sup) {
+	uint32_t recoveries = sup->recoveries;
+	result = bgpio_supervised_await_event(sup, timeout);
+	if (sup->recoveries != recoveries) {
+	    fprintf(stderr, "%s: re-acquired lines on %s after %.3f ms\n",
+		    THIS_EXECUTABLE, request->chardev_path,
+		    (double) sup->last_gap_ns / 1000000.0);
+	}
+    }
+    else {
+	result = bgpio_await_event(request, timeout);
+    }
+    if (result) {
+	// TODO: Put in proper error message
+	if (result == ETIMEDOUT) {
+	    return 0;
+	}
+	fprintf(stdout, "%s: Await event error: %d\n",
+		THIS_EXECUTABLE, result);
+	exit(result);
+    }
+    return report_event(request, &(request->event), NULL, quiet,
+			latency? request->read_ns: 0, exec);
+}
+
+/**
+ * Wait for events, write them to the fan-out ring, and then process
+ * each of them.
+ *
+ * @param fanout The ::bgpio_fanout_t sharing our request's events.
+ *
+ * @param quiet  Boolean identifying whether output is (not) to be
+ * printed.
+ *
+ * @param exec  Path to an executable to be run when an edge event is
+ * encountered, as for report_event().
+ *
+ * @param timeout Pointer to a timeout in milliseconds, or NULL.
+ *
+ * @param p_count Where the number of events processed will be
+ * placed.
+ *
+ * @result 1 or 0 for the result of the last event, or an errorcode.
+ */
+static int
+process_fanout(bgpio_fanout_t *fanout, bool quiet,
+	       char *exec, int *timeout, int *p_count)
+{
+    bgpio_shm_ring_t *ring = fanout->ring;
+    uint64_t first = ring->head;
+    uint64_t pos;
+    int result;
+
+    *p_count = 0;
+    if ((result = bgpio_fanout_update(fanout, timeout))) {
+	if (result == ETIMEDOUT) {
+	    /* As for process_edge(), a timeout counts as a repeat. */
+	    *p_count = 1;
+	    return 0;
+	}
+	fprintf(stdout, "%s: Await event error: %d\n",
+		THIS_EXECUTABLE, result);
+	exit(result);
+    }
+    for (pos = first; pos < ring->head; pos++) {
+	result = report_event(
+	    fanout->req, &ring->events[pos & (BGPIO_RING_SLOTS - 1)],
+	    NULL, quiet, 0, exec);
+	(*p_count)++;
     }
     return result;
 }
 
+/**
+ * Wait for the next event, in timestamp order, from any of several
+ * requests, and process it.
+ *
+ * @param merger The ::bgpio_merger_t ordering our requests' events.
+ *
+ * @param quiet  Boolean identifying whether output is (not) to be
+ * printed.
+ *
+ * @param exec  Path to an executable to be run when an edge event is
+ * encountered, as for report_event().
+ *
+ * @param timeout Pointer to a timeout in milliseconds, or NULL.
+ *
+ * @param latency  Whether the latency of the event is to be reported.
+ *
+ * @result 1 or 0 for the result of the event, or an errorcode.
+ */
+static int
+process_merged(bgpio_merger_t *merger, bool quiet, char *exec,
+	       int *timeout, bool latency)
+{
+    bgpio_merged_event_t merged;
+    const char *chip;
+    int result;
+
+    if ((result = bgpio_merge_next(merger, &merged, timeout))) {
+	if (result == ETIMEDOUT) {
+	    return 0;
+	}
+	fprintf(stdout, "%s: Await event error: %d\n",
+		THIS_EXECUTABLE, result);
+	exit(result);
+    }
+    chip = strrchr(merged.req->chardev_path, '/');
+    chip = chip? chip + 1: merged.req->chardev_path;
+    if (merged.late && !quiet) {
+	fprintf(stderr, "%s: late event on %s line %d\n",
+		THIS_EXECUTABLE, chip, merged.event.offset);
+    }
+    return report_event(merged.req, &merged.event, chip, quiet,
+			latency? bgpio_now_ns(): 0, exec);
+}
+
+/**
+ * Wait for a batch of coalesced events, and then process each of them.
+ *
+ * @param request The ::bgpio_request_t for our gpio operations, with
+ * coalescing enabled.
+ *
+ * @param quiet  Boolean identifying whether output is (not) to be
+ * printed.
+ *
+ * @param exec  Path to an executable to be run when an edge event is
+ * encountered, as for report_event().
+ *
+ * @param timeout Pointer to a timeout in milliseconds, or NULL.
+ *
+ * @param latency  Whether the latency of each event is to be reported.
+ *
+ * @param p_count Where the number of events processed will be
+ * placed.
+ *
+ * @result 1 or 0 for the result of the last event, or an errorcode.
+ */
+static int
+process_batch(bgpio_request_t *request, bool quiet, char *exec,
+	      int *timeout, bool latency, int *p_count)
+{
+    struct gpio_v2_line_event *events;
+    uint64_t read_ns;
+    int result = 0;
+    int count;
+    int i;
+
+    count = bgpio_read_coalesced(request, &events, timeout);
+    if (count < 0) {
+	fprintf(stdout, "%s: Await event error: %d\n",
+		THIS_EXECUTABLE, errno);
+	exit(errno);
+    }
+    if (count == 0) {
+	/* As for process_edge(), a timeout counts as a repeat. */
+	*p_count = 1;
+	return 0;
+    }
+    read_ns = latency? bgpio_now_ns(): 0;
+    for (i = 0; i < count; i++) {
+	result = report_event(request, &events[i], NULL, quiet,
+			      read_ns, exec);
+    }
+    *p_count = count;
+    return result;
+}
+
+/**
+ * Report the distribution of the sizes of coalesced batches.
+ *
+ * @param coalesce The request's ::bgpio_coalesce_t.
+ */
+static void
+report_batches(bgpio_coalesce_t *coalesce)
+{
+    int bucket;
+    int low;
+
+    fprintf(stderr, "%s: %" PRIu64 " events in %" PRIu64 " batches "
+	    "(%" PRIu64 " immediate); batch sizes:",
+	    THIS_EXECUTABLE, coalesce->events, coalesce->batches,
+	    coalesce->immediate);
+    for (bucket = 0; bucket < BGPIO_COALESCE_BUCKETS; bucket++) {
+	if (coalesce->histogram[bucket]) {
+	    low = 1 << bucket;
+	    if (low == BGPIO_COALESCE_MAX) {
+		fprintf(stderr, " %d:", low);
+	    }
+	    else {
+		fprintf(stderr, " %d-%d:", low, (low * 2) - 1);
+	    }
+	    fprintf(stderr, "%" PRIu64, coalesce->histogram[bucket]);
+	}
+    }
+    fprintf(stderr, "\n");
+}
+
+/**
+ * Report the throttling or restoration of a line by a rate guard.
+ * This is the ::bgpio_guard_fn passed to bgpio_enable_rate_guard().
+ *
+ * @param request The ::bgpio_request_t to which the line belongs.
+ *
+ * @param line The gpio line number.
+ *
+ * @param throttled Whether the line was throttled, rather than
+ * restored.
+ *
+ * @param count The number of events, or sampled changes, that led to
+ * the change.
+ *
+ * @param err Zero, or the errno value with which the change failed.
+ *
+ * @param ctx Unused.
+ */
+static void
+report_guard(bgpio_request_t *request, int line, bool throttled,
+	     uint64_t count, int err, void *ctx)
+{
+    if (err) {
+	fprintf(stderr, "%s: unable to %s line %d of %s (%s)\n",
+		THIS_EXECUTABLE, throttled? "throttle": "restore",
+		line, request->chardev_path, strerror(err));
+    }
+    else if (throttled) {
+	fprintf(stderr, "%s: line %d of %s throttled after %" PRIu64
+		" edges\n", THIS_EXECUTABLE, line, request->chardev_path,
+		count);
+    }
+    else {
+	fprintf(stderr, "%s: line %d of %s restored (%" PRIu64
+		" changes while throttled)\n", THIS_EXECUTABLE, line,
+		request->chardev_path, count);
+    }
+}
+
+/**
+ * Sample and restore the throttled lines of each of our requests, as
+ * required, and find how long we may wait before doing so again.
+ *
+ * @param requests Array of ::bgpio_request_t requests, each with a
+ * rate guard.
+ *
+ * @param num_requests The number of entries in \p requests.
+ *
+ * @result The time in milliseconds until a rate guard next needs
+ * checking, or -1 if no lines are throttled.
+ */
+static int
+check_guards(bgpio_request_t **requests, int num_requests)
+{
+    int result = -1;
+    int wait;
+    int r;
+
+    for (r = 0; r < num_requests; r++) {
+	wait = bgpio_guard_check(requests[r]);
+	if ((wait >= 0) && ((result < 0) || (wait < result))) {
+	    result = wait;
+	}
+    }
+    return result;
+}
+
+/**
+ * Comparison function for qsort(), ordering events by timestamp.
+ * Events with equal timestamps are ordered by request and then by
+ * sequence number, which keeps each request's events in the order the
+ * kernel delivered them.
+ *
+ * @param a A ::mon_event_t.
+ *
+ * @param b Another ::mon_event_t.
+ *
+ * @result Negative, zero or positive as \p a is before, the same as or
+ * after \p b.
+ */
+static int
+event_cmp(const void *a, const void *b)
+{
+    const mon_event_t *ev_a = (const mon_event_t *) a;
+    const mon_event_t *ev_b = (const mon_event_t *) b;
+
+    if (ev_a->event.timestamp_ns != ev_b->event.timestamp_ns) {
+	return (ev_a->event.timestamp_ns < ev_b->event.timestamp_ns)? -1: 1;
+    }
+    if (ev_a->req_idx != ev_b->req_idx) {
+	return ev_a->req_idx - ev_b->req_idx;
+    }
+    return (int) (ev_a->event.seqno - ev_b->event.seqno);
+}
+
+/**
+ * Wait for events on any of our requests, read all that are pending on
+ * each ready request, and process them in timestamp order.  A single
+ * wakeup handles the events of every request that is ready, and up to
+ * BGPIO_DISPATCH_BATCH events from each with a single read.  Events
+ * are ordered only among those read by this wakeup, so that none is
+ * delayed; process_merged() orders them across wakeups, at the cost of
+ * holding each back for the merge window.
+ *
+ * @param requests Array of ::bgpio_request_t requests, the index of
+ * each having been registered with \p epfd.
+ *
+ * @param num_requests The number of entries in \p requests.
+ *
+ * @param epfd The epoll file descriptor.  A deadline timer may also
+ * be registered, with an index of DEADLINE_IDX, in which case it
+ * simply wakes us.
+ *
+ * @param show_chip  Whether to report the chip of each event.
+ *
+ * @param quiet  Boolean identifying whether output is (not) to be
+ * printed.
+ *
+ * @param exec  Path to an executable to be run when an edge event is
+ * encountered, as for report_event().
+ *
+ * @param timeout Pointer to a timeout in milliseconds, or NULL.
+ *
+ * @param latency  Whether the latency of each event is to be reported.
+ *
+ * @param guard_wake  Whether \p timeout is the time until our rate
+ * guards need checking, rather than the inactivity timeout, so that
+ * its expiry does not count as a repeat.
+ *
+ * @param max_events  The most events to be read from each request and
+ * processed, so that we process no more than the remaining repeat
+ * count, or 0 for no limit.
+ *
+ * @param p_count Where the number of events processed will be
+ * placed.
+ *
+ * @result 1 or 0 for the result of the last event, or an errorcode.
+ */
+static int
+process_events(bgpio_request_t **requests, int num_requests, int epfd,
+	       bool show_chip, bool quiet, char *exec, int *timeout,
+	       bool latency, bool guard_wake, int max_events, int *p_count)
+{
+    mon_event_t *events = mon_events;
+    struct gpio_v2_line_event buf[BGPIO_DISPATCH_BATCH];
+    struct epoll_event ready[EPOLL_BATCH];
+    bgpio_request_t *request;
+    const char *chip = NULL;
+    uint64_t read_ns;
+    int num_ready;
+    int num_events = 0;
+    int result = 0;
+    size_t batch = sizeof(buf);
+    ssize_t res;
+    int i;
+    int j;
+
+    if (max_events && (max_events < BGPIO_DISPATCH_BATCH)) {
+	batch = max_events * sizeof(struct gpio_v2_line_event);
+    }
+    *p_count = 0;
+    do {
+	num_ready = epoll_wait(epfd, ready, EPOLL_BATCH,
+			       timeout? *timeout: -1);
+    } while ((num_ready < 0) && (errno == EINTR));
+    if (num_ready < 0) {
+	fprintf(stdout, "%s: Await event error: %d\n",
+		THIS_EXECUTABLE, errno);
+	exit(errno);
+    }
+    if (num_ready == 0) {
+	/* As for process_edge(), a timeout counts as a repeat. */
+	*p_count = guard_wake? 0: 1;
+	return 0;
+    }
+
+    for (i = 0; i < num_ready; i++) {
+	if (ready[i].data.u32 == DEADLINE_IDX) {
+	    /* Our caller will notice that the deadline has passed. */
+	    continue;
+	}
+	request = requests[ready[i].data.u32];
+	do {
+	    res = read(request->req.fd, buf, batch);
+	} while ((res < 0) && (errno == EINTR));
+	if (res < 0) {
+	    fprintf(stdout, "%s: Await event error: %d\n",
+		    THIS_EXECUTABLE, errno);
+	    exit(errno);
+	}
+	read_ns = latency? bgpio_now_ns(): 0;
+	for (j = 0; j < res / sizeof(struct gpio_v2_line_event); j++) {
+	    bgpio_note_event(request, &buf[j]);
+	    events[num_events].event = buf[j];
+	    events[num_events].req_idx = ready[i].data.u32;
+	    events[num_events].read_ns = read_ns;
+	    num_events++;
+	}
+    }
+
+    if (num_ready > 1) {
+	qsort(events, num_events, sizeof(mon_event_t), event_cmp);
+    }
+    if (max_events && (num_events > max_events)) {
+	/* Only the earliest events of several requests are wanted. */
+	num_events = max_events;
+    }
+    for (i = 0; i < num_events; i++) {
+	request = requests[events[i].req_idx];
+	if (show_chip) {
+	    chip = strrchr(request->chardev_path, '/');
+	    chip = chip? chip + 1: request->chardev_path;
+	}
+	result = report_event(request, &events[i].event, chip, quiet,
+			      events[i].read_ns, exec);
+	(*p_count)++;
+    }
+    return result;
+}
+
+/**
+ * Find, or open, a request for a line on a given chip.  A request can
+ * hold no more than GPIO_V2_LINES_MAX - 1 lines, so once a chip's
+ * request is full, another is opened for the same chip.
+ *
+ * @param path  The path of the chip.
+ *
+ * @param consumer  The name that will be associated with the lines of
+ * any newly opened request.
+ *
+ * @param p_requests  Pointer to a dynamically allocated array of
+ * requests, to which any newly opened request is added.
+ *
+ * @param num_requests Pointer to the number of entries in \p
+ * p_requests.
+ *
+ * @result The ::bgpio_request_t to which the line should be added.
+ */
+static bgpio_request_t *
+request_for_chip(char *path, char *consumer,
+		 bgpio_request_t ***p_requests, int *num_requests)
+{
+    bgpio_request_t **requests = *p_requests;
+    int i;
+
+    for (i = *num_requests - 1; i >= 0; i--) {
+	if (streq(path, requests[i]->chardev_path)) {
+	    if (requests[i]->req.num_lines < GPIO_V2_LINES_MAX - 1) {
+		return requests[i];
+	    }
+	    break;
+	}
+    }
+    requests = realloc(requests, (*num_requests + 1) * sizeof(*requests));
+    if (!requests) {
+	fprintf(stderr, "%s: out of memory\n", THIS_EXECUTABLE);
+	exit(ENOMEM);
+    }
+    requests[*num_requests] = get_gpio_request(path, consumer, 0);
+    *p_requests = requests;
+    return requests[(*num_requests)++];
+}
+
 /**
  * Process and validate the provided command line arguments before
  * performing gpio fetches.
@@ -322,21 +1074,54 @@ main(int argc, char *argv[])
     int quiet = false;
     int repeat = 1;
     int timeout = -1;
+    int wait;
+    uint64_t deadline = 0;
+    int timer_fd = -1;
+    struct itimerspec timer_spec = {{0, 0}, {0, 0}};
+    int reacquire = false;
+    int busy_poll = false;
+    int backoff = 0;
+    int latency = false;
+    int coalesce_window = 0;
+    int coalesce_max = 0;
+    int max_rate = 0;
+    int cooldown = 1000;
+    int merge_window = 0;
+    bgpio_merger_t *merger = NULL;
+    int guard_wait;
+    uint64_t idle_deadline = 0;
+    rt_options rt = RT_OPTIONS_INIT;
+    bgpio_supervisor_t *sup = NULL;
     uint64_t default_bias = 0;
     uint64_t default_edge = GPIO_V2_LINE_FLAG_EDGE_RISING;
     unsigned long debounce_period = 0;
+    char *fanout_name = NULL;
+    bgpio_fanout_t *fanout = NULL;
+    int count;
 
     struct option options[] = {
 	{"active-low", no_argument, &active_low, true},
 	{"bias", required_argument, NULL, 0},
+	{"busy-poll", optional_argument, NULL, 0},
+	{"coalesce", required_argument, NULL, 0},
+	{"cpu", required_argument, NULL, 0},
+	{"deadline", required_argument, NULL, 0},
 	{"debounce", required_argument, NULL, 0},
 	{"edge", required_argument, NULL, 0},
 	{"exec", required_argument, NULL, 0},
+	{"fanout", required_argument, NULL, 0},
 	{"help",  no_argument, 0, 0},
+	{"latency", no_argument, &latency, true},
 	{"low", no_argument, &active_low, true},
+	{"max-rate", required_argument, NULL, 0},
+	{"merge", required_argument, NULL, 0},
+	{"mlock", no_argument, NULL, 0},
 	{"name", required_argument, NULL, 0},
+	{"prefault", no_argument, NULL, 0},
 	{"quiet", no_argument, &quiet, true},
+	{"reacquire", no_argument, &reacquire, true},
 	{"repeat", required_argument, NULL, 0},
+	{"rt-priority", required_argument, NULL, 0},
 	{"timeout", required_argument, NULL, 0},
 	{"version", no_argument, 0, 0},
 	{0, 0, 0, 0}
@@ -344,11 +1129,18 @@ main(int argc, char *argv[])
 
     int c;
     int idx = 0;
+    bgpio_request_t **requests;
+    int num_requests;
     bgpio_request_t *request;
     uint64_t line_flags;
-    uint64_t all_lines_mask = 0;
+    char *line_arg;
+    char *chip_path;
     char *line_name;
     int line;
+    int epfd = -1;
+    struct epoll_event epoll_ev;
+    bool show_chip = false;
+    int r;
     int result = 0;
     int err;
     
@@ -365,11 +1157,38 @@ main(int argc, char *argv[])
 	    }
 	    if (streq("active-low", options[idx].name) ||
 		streq("low", options[idx].name) ||
-		streq("quiet", options[idx].name)) {
+		streq("latency", options[idx].name) ||
+		streq("quiet", options[idx].name) ||
+		streq("reacquire", options[idx].name)) {
 	    }
 	    else if (streq("bias", options[idx].name)) {
 		default_bias = get_bias(optarg);
 	    }
+	    else if (streq("busy-poll", options[idx].name)) {
+		busy_poll = true;
+		if (optarg) {
+		    backoff = get_backoff(optarg);
+		}
+	    }
+	    else if (streq("coalesce", options[idx].name)) {
+		get_coalesce(optarg, &coalesce_window, &coalesce_max);
+	    }
+	    else if (streq("max-rate", options[idx].name)) {
+		get_max_rate(optarg, &max_rate, &cooldown);
+	    }
+	    else if (streq("merge", options[idx].name)) {
+		merge_window = get_merge(optarg);
+	    }
+	    else if (is_rt_option(options[idx].name)) {
+		if (!read_rt_option(options[idx].name, optarg, &rt)) {
+		    fprintf(stderr, "%s: invalid %s value: %s\n",
+			    THIS_EXECUTABLE, options[idx].name, optarg);
+		    usage(EINVAL);
+		}
+	    }
+	    else if (streq("deadline", options[idx].name)) {
+		deadline = get_deadline(optarg);
+	    }
 	    else if (streq("debounce", options[idx].name)) {
 		debounce_period = get_debounce(optarg);
 #ifndef DEBOUNCE_DISABLED
@@ -384,6 +1203,9 @@ main(int argc, char *argv[])
 	    else if (streq("exec", options[idx].name)) {
 		exec = optarg;
 	    }
+	    else if (streq("fanout", options[idx].name)) {
+		fanout_name = optarg;
+	    }
 	    else if (streq("name", options[idx].name)) {
 		consumer_name = optarg;
 	    }
@@ -445,27 +1267,62 @@ main(int argc, char *argv[])
 	usage(EINVAL);
     }
 
-    request = get_gpio_request(argv[optind], consumer_name, 0);
+    if (reacquire && fanout_name) {
+	fprintf(stderr, "%s: reacquire cannot be used with fanout.\n",
+		THIS_EXECUTABLE);
+	usage(EINVAL);
+    }
 
-    /* Now handle each line argument in turn. */
-    if (((argc - 1) - optind) > GPIO_V2_LINES_MAX) {
-	fprintf(stderr, "%s: maximum gpio lines (%d) exceeded.\n",
-		THIS_EXECUTABLE, GPIO_V2_LINES_MAX);
-	exit(EINVAL);
+    if (busy_poll && fanout_name) {
+	fprintf(stderr, "%s: busy-poll cannot be used with fanout.\n",
+		THIS_EXECUTABLE);
+	usage(EINVAL);
     }
-    
+
+    if (coalesce_window && (fanout_name || busy_poll || reacquire)) {
+	fprintf(stderr, "%s: coalesce cannot be used with fanout, "
+		"busy-poll or reacquire.\n", THIS_EXECUTABLE);
+	usage(EINVAL);
+    }
+
+    if (max_rate && (fanout_name || busy_poll || reacquire ||
+		     coalesce_window)) {
+	fprintf(stderr, "%s: max-rate cannot be used with fanout, "
+		"busy-poll, reacquire or coalesce.\n", THIS_EXECUTABLE);
+	usage(EINVAL);
+    }
+
+    if (merge_window && max_rate) {
+	fprintf(stderr, "%s: merge cannot be used with max-rate.\n",
+		THIS_EXECUTABLE);
+	usage(EINVAL);
+    }
+
+    requests = malloc(sizeof(*requests));
+    requests[0] = get_gpio_request(argv[optind], consumer_name, 0);
+    num_requests = 1;
+
+    /* Now handle each line argument in turn. */
     for (idx = optind + 1; idx < argc; idx++) {
 	line_flags = GPIO_V2_LINE_FLAG_INPUT |
 	    default_bias |
 	    default_edge |
 	    (active_low? GPIO_V2_LINE_FLAG_ACTIVE_LOW: 0);
 
-	if (!read_line_arg(argv[idx], &line, &line_flags,
+	line_arg = argv[idx];
+	chip_path = line_spec_chip(&line_arg);
+	request = request_for_chip(
+	    chip_path? chip_path: requests[0]->chardev_path,
+	    consumer_name, &requests, &num_requests);
+	free(chip_path);
+
+	if (!read_line_arg(line_arg, request->chardev_path,
+			   &line, &line_flags,
 			   LINE_FLAG_BIAS_MASK |
 			   LINE_FLAG_EDGE_MASK |
 			   LINE_FLAG_ACTIVE_LOW_MASK))
 	{
-	    fprintf(stderr, "expecting numeric gpio line with "
+	    fprintf(stderr, "expecting gpio line number or name with "
 		    "optional bias: \"%s\"\n", argv[idx]);
 	    usage(EINVAL);
 	}
@@ -477,55 +1334,267 @@ main(int argc, char *argv[])
 		    THIS_EXECUTABLE, line);
 	    exit(EINVAL);
 	}
+	free(line_name);
+    }
+
+    if (requests[0]->req.num_lines == 0 && num_requests > 1) {
+	/* All lines were taken from other chips. */
+	(void) bgpio_close_request(requests[0]);
+	num_requests--;
+	memmove(requests, requests + 1, num_requests * sizeof(*requests));
+    }
 
-	/* Add bits for each line into all_lines_mask */
-	all_lines_mask |= 1ull << (idx - (optind + 1));
+    if ((num_requests > 1) &&
+	(reacquire || fanout_name || busy_poll || coalesce_window)) {
+	fprintf(stderr, "%s: reacquire, fanout, busy-poll and coalesce "
+		"require a single chip and at most %d lines.\n",
+		THIS_EXECUTABLE, GPIO_V2_LINES_MAX - 1);
+	usage(EINVAL);
     }
+    request = requests[0];
 
 #ifdef DEBOUNCE_DISABLED
     // Keep the compiler from reporting an unused variable.
     debounce_period++;
 #else
     if (debounce_period) {
-	struct gpio_v2_line_config *config = &(request->req.config);
-	int attr = config->num_attrs;
-	/* For now we only allow a global debounce period rather than
-	 * different ones for different lines.
-         */
-	config->num_attrs++;
-	config->attrs[attr].attr.id = GPIO_V2_LINE_ATTR_ID_DEBOUNCE;
-	config->attrs[attr].attr.debounce_period_us = debounce_period;
-	config->attrs[attr].mask = all_lines_mask;
+	for (r = 0; r < num_requests; r++) {
+	    struct gpio_v2_line_config *config = &(requests[r]->req.config);
+	    int attr = config->num_attrs;
+	    /* For now we only allow a global debounce period rather than
+	     * different ones for different lines.
+	     */
+	    config->num_attrs++;
+	    config->attrs[attr].attr.id = GPIO_V2_LINE_ATTR_ID_DEBOUNCE;
+	    config->attrs[attr].attr.debounce_period_us = debounce_period;
+	    config->attrs[attr].mask =
+		(1ull << requests[r]->req.num_lines) - 1;
+	}
     }
 #endif
     if (request->req.num_lines) {
-	result = bgpio_complete_request(request);
+	for (r = 0; r < num_requests; r++) {
+	    result = bgpio_complete_request(requests[r]);
 
-	if (result) {
-	    fprintf(stderr, "%s: error completing bgpio_request: %s\n",
-		    THIS_EXECUTABLE, strerror(errno));
-	    exit(errno);
+	    if (result) {
+		fprintf(stderr, "%s: error completing bgpio_request: %s\n",
+			THIS_EXECUTABLE, strerror(errno));
+		exit(errno);
+	    }
+	}
+
+	if (reacquire) {
+	    sup = bgpio_supervise_request(request);
+	    if (!sup) {
+		fprintf(stderr, "%s: unable to supervise %s (%s)\n",
+			THIS_EXECUTABLE, request->chardev_path,
+			strerror(errno));
+		exit(errno);
+	    }
+	}
+
+	if (busy_poll) {
+	    err = bgpio_request_busy_poll(request, true, backoff);
+	    if (err) {
+		fprintf(stderr, "%s: unable to busy-poll %s (%s)\n",
+			THIS_EXECUTABLE, request->chardev_path,
+			strerror(err));
+		exit(err);
+	    }
+	}
+
+	if (coalesce_window) {
+	    err = bgpio_enable_coalescing(request, coalesce_window,
+					  coalesce_max);
+	    if (err) {
+		fprintf(stderr, "%s: unable to coalesce events (%s)\n",
+			THIS_EXECUTABLE, strerror(err));
+		exit(err);
+	    }
+	}
+
+	for (r = 0; max_rate && (r < num_requests); r++) {
+	    err = bgpio_enable_rate_guard(requests[r], max_rate, cooldown,
+					  report_guard, NULL);
+	    if (err) {
+		fprintf(stderr, "%s: unable to guard %s (%s)\n",
+			THIS_EXECUTABLE, requests[r]->chardev_path,
+			strerror(err));
+		exit(err);
+	    }
+	}
+
+	if (fanout_name) {
+	    fanout = bgpio_open_fanout(request, fanout_name);
+	    if (!fanout) {
+		fprintf(stderr, "%s: unable to fan out to %s (%s)\n",
+			THIS_EXECUTABLE, fanout_name, strerror(errno));
+		exit(errno);
+	    }
 	}
 
+	if (merge_window && (num_requests > 1)) {
+	    merger = bgpio_open_merger(requests, num_requests,
+				       (uint64_t) merge_window * 1000);
+	    if (!merger) {
+		fprintf(stderr, "%s: unable to merge events (%s)\n",
+			THIS_EXECUTABLE, strerror(errno));
+		exit(errno);
+	    }
+	    show_chip = true;
+	}
+	else if (!(sup || fanout || busy_poll || coalesce_window)) {
+	    epfd = epoll_create1(EPOLL_CLOEXEC);
+	    if (epfd < 0) {
+		fprintf(stderr, "%s: unable to create epoll instance (%s)\n",
+			THIS_EXECUTABLE, strerror(errno));
+		exit(errno);
+	    }
+	    for (r = 0; r < num_requests; r++) {
+		show_chip |= !streq(requests[r]->chardev_path,
+				    requests[0]->chardev_path);
+		epoll_ev.events = EPOLLIN;
+		epoll_ev.data.u32 = r;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, requests[r]->req.fd,
+			      &epoll_ev)) {
+		    fprintf(stderr, "%s: unable to poll %s (%s)\n",
+			    THIS_EXECUTABLE, requests[r]->chardev_path,
+			    strerror(errno));
+		    exit(errno);
+		}
+	    }
+	}
+
+	if (deadline) {
+	    /* The deadline runs from when we are ready to see events. */
+	    deadline += bgpio_now_ns();
+	    if (epfd >= 0) {
+		/* An absolute timer wakes epoll_wait() at the deadline
+		 * itself, rather than at the next whole millisecond. */
+		timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+		if (timer_fd < 0) {
+		    fprintf(stderr, "%s: unable to create timer (%s)\n",
+			    THIS_EXECUTABLE, strerror(errno));
+		    exit(errno);
+		}
+		timer_spec.it_value.tv_sec = deadline / 1000000000;
+		timer_spec.it_value.tv_nsec = deadline % 1000000000;
+		epoll_ev.events = EPOLLIN;
+		epoll_ev.data.u32 = DEADLINE_IDX;
+		if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME,
+				    &timer_spec, NULL) ||
+		    epoll_ctl(epfd, EPOLL_CTL_ADD, timer_fd, &epoll_ev)) {
+		    fprintf(stderr, "%s: unable to set deadline (%s)\n",
+			    THIS_EXECUTABLE, strerror(errno));
+		    exit(errno);
+		}
+	    }
+	}
+
+	(void) apply_rt_options(THIS_EXECUTABLE, &rt,
+				mon_events, sizeof(mon_events));
+
+	if (timeout != -1) {
+	    idle_deadline = bgpio_now_ns() + ((uint64_t) timeout * 1000000);
+	}
 	idx = repeat;
 	while (true) {
-	    result = process_edge(request, quiet, exec,
-				  (timeout == -1? NULL: &timeout));
+	    if (fanout) {
+		result = process_fanout(fanout, quiet, exec,
+					wait_msecs(timeout, deadline, &wait),
+					&count);
+	    }
+	    else if (coalesce_window) {
+		result = process_batch(request, quiet, exec,
+				       wait_msecs(timeout, deadline, &wait),
+				       latency, &count);
+	    }
+	    else if (merger) {
+		result = process_merged(merger, quiet, exec,
+					wait_msecs(timeout, deadline, &wait),
+					latency);
+		count = 1;
+	    }
+	    else if (sup || busy_poll) {
+		result = process_edge(request, sup, quiet, exec,
+				      wait_msecs(timeout, deadline, &wait),
+				      latency);
+		count = 1;
+	    }
+	    else if (max_rate) {
+		/* Wake to check our rate guards without restarting the
+		 * inactivity timeout. */
+		guard_wait = check_guards(requests, num_requests);
+		(void) wait_msecs(timeout, idle_deadline, &wait);
+		if ((guard_wait >= 0) && ((wait == -1) || (guard_wait < wait))) {
+		    result = process_events(requests, num_requests, epfd,
+					    show_chip, quiet, exec,
+					    &guard_wait, latency, true,
+					    repeat? idx: 0, &count);
+		}
+		else {
+		    result = process_events(requests, num_requests, epfd,
+					    show_chip, quiet, exec,
+					    (wait == -1? NULL: &wait),
+					    latency, false, repeat? idx: 0,
+					    &count);
+		}
+		if (count && (timeout != -1)) {
+		    idle_deadline = bgpio_now_ns() +
+			((uint64_t) timeout * 1000000);
+		}
+	    }
+	    else {
+		result = process_events(requests, num_requests, epfd,
+					show_chip, quiet, exec,
+					(timeout == -1? NULL: &timeout),
+					latency, false, repeat? idx: 0,
+					&count);
+	    }
+	    if (deadline && (bgpio_now_ns() >= deadline)) {
+		break;
+	    }
 	    if ((result == 0) || (result == 1)) {
 		
 		if (repeat) {
 		    /* If repeat is zero we want an infinite number of
 		     * repeats, so we don't do the decrement and
 		     * conditional break. */
-		    idx--;
+		    idx -= count;
 		    if (idx < 1) {
 			break;
 		    }
 		}
 	    }
 	}
+	if (coalesce_window && !quiet) {
+	    report_batches(request->coalesce);
+	}
+	if (timer_fd >= 0) {
+	    close(timer_fd);
+	}
+	if (epfd >= 0) {
+	    close(epfd);
+	}
+	if (fanout) {
+	    bgpio_close_fanout(fanout);
+	}
+	if (merger) {
+	    if (merger->late && !quiet) {
+		fprintf(stderr, "%s: %" PRIu64 " events arrived late\n",
+			THIS_EXECUTABLE, merger->late);
+	    }
+	    bgpio_close_merger(merger);
+	}
+	if (sup) {
+	    bgpio_end_supervision(sup);
+	}
+    }
+    for (r = 1; r < num_requests; r++) {
+	(void) bgpio_close_request(requests[r]);
     }
     err = bgpio_close_request(request);
+    free(requests);
     if (err) {
 	fprintf(stderr, "%s: error closing bgpio_request: %s\n",
 		THIS_EXECUTABLE, strerror(errno));
@@ -533,4 +1602,3 @@ main(int argc, char *argv[])
     }
     exit(result);
 }
-
@@ -52,10 +52,14 @@ usage(int exitcode)
 	   "Set GPIO line output values.\n\n"
 	   "Options:\n  -b, --bias=[as-is|disable|pull-down|pull-up]\n"
 	   "                            set the line bias (default=as-is)\n"
+	   "      --cpu=N:              run on cpu N\n"
 	   "  -h, --help:               display this help message.\n"
 	   "  -l, --active-low, --low:  make the line active-low (default).\n"
+	   "      --mlock:              lock all memory\n"
 	   "  -n, --name=our_name:      who has reserved our gpio lines \n"
 	   "  -o, --output-drive=[push-pull|open-drain|open_source]\n"
+	   "      --prefault:           prefault stack and heap\n"
+	   "      --rt-priority=N:      run with SCHED_FIFO priority N\n"
 	   "  -v, --version:            display the version.\n"
 	   "  -w, --wait=[seconds]:     keep the line(s) reserved.\n\n");
     if (!exitcode) {
@@ -64,8 +68,10 @@ usage(int exitcode)
 	  "abbeviated suffix (eg \"chip0\") of a valid path.\n\n"
 	  "Line-specs are of the form N[\"[\"line-flag[,line-flag...]\"]\"]=B\n"
 	  "where line-flag may be a bias value, output-drive-value, \n"
-	  "active-high, high or active-low, N is the gpio line number and B\n"
-	  "is the binary digit 1 or 0, eg \"84[open-drain,high]=1\"\n");
+	  "active-high, high or active-low, N is the gpio line number or\n"
+	  "name and B is the binary digit 1 or 0,\n"
+	  "eg \"84[open-drain,high]=1\"\n\n"
+	  RT_OPTIONS_HELP_TEXT);
     }
     exit(exitcode);
 }
@@ -142,7 +148,7 @@ get_gpio_request(char *device, char *consumer, uint64_t flags)
     char *path = path_for_arg(chip_paths, device);
 
     if (!path) {
-	path = device;
+	path = newstrcpy(device);
 	fprintf(stderr,
 		"%s: %s may not be a gpio device.  Trying anyway...\n",
 		THIS_EXECUTABLE, path);
@@ -154,6 +160,7 @@ get_gpio_request(char *device, char *consumer, uint64_t flags)
 		THIS_EXECUTABLE, path, strerror(errno));
 	exit(errno);
     }
+    free(path);
     return request;
 }
 
@@ -164,6 +171,9 @@ get_gpio_request(char *device, char *consumer, uint64_t flags)
  *
  * @param arg The command line argument as provided on the command line
  *
+ * @param chip The path of the chip to which the line belongs, used to
+ * resolve line names.
+ *
  * @param line  Where we will store the gpio line number read from \p
  * arg.
  *
@@ -178,24 +188,29 @@ get_gpio_request(char *device, char *consumer, uint64_t flags)
  * @result true if the argument was valid, else false.
  */
 static bool
-read_line_spec(char *arg, int *line, int *value,
+read_line_spec(char *arg, const char *chip, int *line, int *value,
 	       uint64_t *line_flags, uint64_t allowed)
 {
-    char flags_str[2];
+    char *end = arg + strcspn(arg, "[=");
+    char sep = *end;
+    bool found;
     int fields;
 
-    fields = sscanf(arg, "%d=%d", line, value);
-    if (fields == 2) {
-	return true;
+    *end = '\0';		/* Temporarily truncate string */
+    found = read_line_id(arg, chip, line);
+    *end = sep;			/* Restore arg to its orignal state. */
+    if (!found) {
+	return false;
+    }
+    if (sep == '=') {
+	fields = sscanf(end, "=%d", value);
+	return fields == 1;
     }
-    fields = sscanf(arg, "%d[%1s", line, flags_str);
-    if (fields == 2) {
-	char *bracket = strchr(arg, '[');
-	arg = bracket + 1;
-	if (!parse_lineflags(arg, line_flags, allowed)) {
+    if (sep == '[') {
+	char *bracket = strchr(end, ']');
+	if (!bracket || !parse_lineflags(end + 1, line_flags, allowed)) {
 	    return false;
 	}
-	bracket = strchr(arg, ']');
 	fields = sscanf(bracket, "]=%d", value);
 	if (fields == 1) {
 	    if ((*value == 0) || (*value == 1)) {
@@ -216,6 +231,7 @@ int main(int argc, char *argv[])
     uint64_t base_flags = GPIO_V2_LINE_FLAG_OUTPUT;
     uint64_t line_flags = 0;
     int line_value;
+    rt_options rt = RT_OPTIONS_INIT;
     
     /**
      * Command line options structure for getopt_long()
@@ -223,10 +239,14 @@ int main(int argc, char *argv[])
     struct option options[] = {
 	{"bias", required_argument, NULL, 0},
 	{"active-low", no_argument, &active_low, true},
+	{"cpu", required_argument, NULL, 0},
 	{"help",  no_argument, NULL, 0},
 	{"low", no_argument, &active_low, true},
+	{"mlock", no_argument, NULL, 0},
 	{"name", required_argument, NULL, 0},
 	{"output-drive", required_argument, NULL, 0},
+	{"prefault", no_argument, NULL, 0},
+	{"rt-priority", required_argument, NULL, 0},
 	{"version", no_argument, NULL, 0},
 	{"wait", required_argument, &wait, 0},
 	{NULL, 0, NULL, 0}};
@@ -256,6 +276,13 @@ int main(int argc, char *argv[])
 	    else if (streq("bias", options[idx].name)) {
 		base_flags |= get_bias(optarg);
 	    }
+	    else if (is_rt_option(options[idx].name)) {
+		if (!read_rt_option(options[idx].name, optarg, &rt)) {
+		    fprintf(stderr, "%s: invalid %s value: %s\n",
+			    THIS_EXECUTABLE, options[idx].name, optarg);
+		    usage(EINVAL);
+		}
+	    }
 	    else if (streq("name", options[idx].name)) {
 		consumer_name = optarg;
 	    }
@@ -330,11 +357,12 @@ int main(int argc, char *argv[])
     for (idx = optind + 1; idx < argc; idx++) {
 	line_flags = base_flags;
 
-	if (!read_line_spec(argv[idx], &line, &line_value, &line_flags,
+	if (!read_line_spec(argv[idx], request->chardev_path,
+			    &line, &line_value, &line_flags,
 			    LINE_FLAG_BIAS_MASK |
 			    LINE_FLAG_OUTPUT_DRIVER_MASK |
 			    LINE_FLAG_ACTIVE_LOW_MASK)) {
-	    fprintf(stderr, "expecting numeric gpio line with value and"
+	    fprintf(stderr, "expecting gpio line number or name with value and "
 		    "optional flags: \"%s\"\n", argv[idx]);
 	    usage(EINVAL);
 	}
@@ -348,6 +376,8 @@ int main(int argc, char *argv[])
     }
 
     if (request->req.num_lines) {
+	/* Completing the request is what sets the outputs. */
+	(void) apply_rt_options(THIS_EXECUTABLE, &rt, NULL, 0);
 	err = bgpio_complete_request(request);
 	if (err) {
 	    fprintf(stderr, "%s: error completing bgpio_request: %s\n",
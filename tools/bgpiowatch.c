@@ -43,6 +43,7 @@ usage(int exitcode)
 	   "Usage: " THIS_EXECUTABLE " [OPTIONS] <chip-id> <line-id>...\n\n"
 	   "Watch GPIO lines for reservation and configuration changes.\n\n"
 	   "Options:\n"
+	   "      --deadline=duration:  stop watching after duration\n"
 	   "  -h, --help:               display this help message.\n"
 	   "  -q, --quiet:              execute quietly\n"
 	   "  -r, --repeat=count:       how many times to fetch (default=1)\n"
@@ -53,10 +54,13 @@ usage(int exitcode)
 	printf(
 	  "Gpiochip-ids may be a full path to the gpiochip device, or an\n"
 	  "abbeviated suffix (eg \"chip0\") of a valid path.\n\n"
-	  "Line-ids are integer line numbers.\n"
+	  "Line-ids are integer line numbers or line names.\n"
 	  "Commands specified by --exec will be passed the chip path, the\n"
 	  "line number, an event description and the event timestamp.\n"
 	  "A repeat count of zero means repeat forever.\n"
+	  "The deadline option stops watching once the given time has\n"
+	  "passed, however many events have been seen.  Durations are given\n"
+	  "in milliseconds, or with a unit of ns, us, ms or s, eg 2s.\n"
 	  "The result of the command will be 0, or the value of the last\n"
 	  "executed script.\n");
     }
@@ -102,6 +106,57 @@ get_timeout(char *arg)
     return timeout;
 }
 
+/**
+ * Read a duration from a string for a deadline.
+ *
+ * @param arg  A string containing the duration.
+ *
+ * @result The duration in nanoseconds.
+ */
+static uint64_t
+get_deadline(char *arg)
+{
+    uint64_t deadline;
+    if (!read_duration_ns(arg, &deadline)) {
+	fprintf(stderr, "%s: invalid deadline value: %s\n",
+		THIS_EXECUTABLE, arg);
+	usage(EINVAL);
+    }
+    return deadline;
+}
+
+/**
+ * Await a change to a watched line, until either the timeout or the
+ * deadline expires.
+ *
+ * @param chip  The ::bgpio_chip_t struct opened by bgpio_open_chip()
+ *
+ * @param timeout  Pointer to an inactivity timeout in milliseconds, or
+ * NULL.
+ *
+ * @param deadline  The CLOCK_MONOTONIC time, in nanoseconds, at which
+ * we stop watching, or 0.
+ *
+ * @result As for bgpio_await_watched_lines().
+ */
+static struct gpio_v2_line_info_changed *
+await_change(bgpio_chip_t *chip, int *timeout, uint64_t deadline)
+{
+    uint64_t until = deadline;
+    uint64_t timeout_at;
+
+    if (!deadline) {
+	return bgpio_await_watched_lines(chip, timeout);
+    }
+    if (timeout) {
+	timeout_at = bgpio_now_ns() + ((uint64_t) *timeout * 1000000);
+	if (timeout_at < until) {
+	    until = timeout_at;
+	}
+    }
+    return bgpio_await_watched_lines_until(chip, until, NULL);
+}
+
 /**
  * Open a gpio chip.  
  *
@@ -120,7 +175,7 @@ get_gpio_chip(char *device)
     char *path = path_for_arg(chip_paths, device);
 
     if (!path) {
-	path = device;
+	path = newstrcpy(device);
 	fprintf(stderr,
 		"%s: %s may not be a gpio device.  Trying anyway...\n",
 		THIS_EXECUTABLE, path);
@@ -132,6 +187,7 @@ get_gpio_chip(char *device)
 		THIS_EXECUTABLE, path, strerror(errno));
 	exit(errno);
     }
+    free(path);
     return chip;
 }
 
@@ -152,17 +208,21 @@ get_gpio_chip(char *device)
  *
  * @param quiet  Whether to write to output.
  *
+ * @param deadline  The CLOCK_MONOTONIC time, in nanoseconds, at which
+ * we stop watching, or 0.
+ *
  * @result Integer error code, or 0 if completed successfully.
  */
 static int
 watch_lines(bgpio_chip_t *chip, int repeat, int *timeout,
-	    char *exec, bool quiet)
+	    char *exec, bool quiet, uint64_t deadline)
 {
     struct gpio_v2_line_info_changed *event;
     char *event_str;
     
     while (true) {
-	event = bgpio_await_watched_lines(chip, timeout);
+	errno = 0;
+	event = await_change(chip, timeout, deadline);
 	if (event) {
 	    switch (event->event_type) {
 	    case GPIO_V2_LINE_CHANGED_REQUESTED:
@@ -205,6 +265,12 @@ watch_lines(bgpio_chip_t *chip, int repeat, int *timeout,
 		}
 	    }
 	}
+	else if (errno == ETIMEDOUT) {
+	    /* A timeout counts as a repeat, but the deadline ends all. */
+	    if (deadline && (bgpio_now_ns() >= deadline)) {
+		return 0;
+	    }
+	}
 	else {
 	    if (errno) {
 		fprintf(stderr, "%s: Watch failed: %s\n",
@@ -234,12 +300,14 @@ main(int argc, char *argv[])
     int lines = 0;
     int err;
     int timeout = -1;
+    uint64_t deadline = 0;
     bgpio_chip_t *chip;
     
     /**
      * Command line options structure for getopt_long()
      */
     struct option options[] = {
+	{"deadline", required_argument, NULL, 0},
 	{"exec", required_argument, NULL, 0},
 	{"help",  no_argument, NULL, 0},
 	{"quiet", no_argument, &quiet, true},
@@ -261,6 +329,9 @@ main(int argc, char *argv[])
 	    }
 	    if (streq("quiet", options[idx].name)) {
 	    }
+	    else if (streq("deadline", options[idx].name)) {
+		deadline = get_deadline(optarg);
+	    }
 	    else if (streq("exec", options[idx].name)) {
 		exec = optarg;
 	    }
@@ -305,7 +376,7 @@ main(int argc, char *argv[])
     chip = get_gpio_chip(argv[optind]);
     if (chip) {
 	for (idx = optind + 1; idx < argc; idx++) {
-	    if (read_int(argv[idx], &line)) {
+	    if (read_line_id(argv[idx], chip->path, &line)) {
 		err = bgpio_watch_line(chip, line);
 		if (err) {
 		    fprintf(stderr, "%s: unable to watch line %d: %s.\n",
@@ -326,7 +397,8 @@ main(int argc, char *argv[])
 	if (lines) {
 	    err = watch_lines(chip, repeat,
 			      (timeout == -1)? NULL: &timeout,
-			      exec, quiet);
+			      exec, quiet,
+			      deadline? bgpio_now_ns() + deadline: 0);
 	}
 	bgpio_close_chip(chip);
     }
@@ -0,0 +1,117 @@
+/*
+ *     Copyright (c) 2023 Marc Munro
+ *     Fileset:	libbgpiod - basic/bloodnok gpio device library
+ *     Author:  Marc Munro
+ *     License: GPL-3.0
+ *
+ */
+
+/**
+ * @file   jobs.c
+ * @brief A minimal thread pool for tools that perform independent,
+ * blocking operations on several gpio chips.
+ *
+ * Each job is identified by its index.  Jobs must place their results
+ * in per-index storage so that the caller can report them, in index
+ * order, once all jobs are complete.  This keeps output deterministic
+ * regardless of the order in which jobs finish.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "../lib/bgpiod.h"
+#include "bgpiotools.h"
+
+/**
+ * The state shared by the threads of a call to run_jobs().
+ */
+typedef struct job_pool {
+    job_fn_t fn;                /**< The function to run for each job */
+    void    *ctx;               /**< Passed to fn */
+    int      count;             /**< The number of jobs */
+    int      next;              /**< The index of the next job to run */
+} job_pool;
+
+/**
+ * Thread body for run_jobs().  Claims and runs jobs until there are
+ * none left.
+ *
+ * @param arg The ::job_pool.
+ *
+ * @result NULL.
+ */
+static void *
+job_worker(void *arg)
+{
+    job_pool *pool = (job_pool *) arg;
+    int idx;
+
+    while ((idx = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) <
+	   pool->count) {
+	pool->fn(idx, pool->ctx);
+    }
+    return NULL;
+}
+
+/**
+ * Run \p count jobs using up to \p jobs threads, including the
+ * calling thread, returning once all are complete.  If \p jobs is 1 or
+ * less, or there is only one job, the jobs are run in order in the
+ * calling thread.
+ *
+ * @param count The number of jobs.
+ *
+ * @param jobs The maximum number of jobs to run concurrently.
+ *
+ * @param fn The function to be called for each job index.
+ *
+ * @param ctx Passed to \p fn.
+ */
+void
+run_jobs(int count, int jobs, job_fn_t fn, void *ctx)
+{
+    job_pool pool = {fn, ctx, count, 0};
+    pthread_t threads[MAX_JOBS - 1];
+    int started = 0;
+    int i;
+
+    if (jobs > MAX_JOBS) {
+	jobs = MAX_JOBS;
+    }
+    if (jobs > count) {
+	jobs = count;
+    }
+    /* The calling thread is one of the workers, so we start one fewer
+     * threads than jobs, and complete even if none could be started. */
+    for (i = 0; i < jobs - 1; i++) {
+	if (pthread_create(&threads[i], NULL, job_worker, &pool)) {
+	    break;
+	}
+	started++;
+    }
+    (void) job_worker(&pool);
+    for (i = 0; i < started; i++) {
+	pthread_join(threads[i], NULL);
+    }
+}
+
+/**
+ * Read the value for a --jobs option.
+ *
+ * @param arg The option argument.
+ *
+ * @param result Where the number of jobs will be placed.
+ *
+ * @result true if \p arg is a number between 1 and MAX_JOBS.
+ */
+bool
+read_jobs(char *arg, int *result)
+{
+    return read_int(arg, result) && (*result >= 1) && (*result <= MAX_JOBS);
+}
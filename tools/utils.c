@@ -12,13 +12,18 @@
  * bgpiod library.
  */
 
+#define _GNU_SOURCE     // for sched_setaffinity()
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
-#include <dirent.h>
+#include <ctype.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <malloc.h>
+#include <sys/mman.h>
 
 #include "../lib/bgpiod.h"
 #include "bgpiotools.h"
@@ -44,6 +49,46 @@ version(char *this_name)
 }
 
 
+/**
+ * Return the process-wide registry of gpio chips, creating it on
+ * first use and applying any changes reported since the last call.
+ *
+ * @result The ::bgpio_registry_t, or NULL if it could not be created.
+ */
+static bgpio_registry_t *
+chip_registry(void)
+{
+    static bgpio_registry_t *registry = NULL;
+
+    if (!registry) {
+	registry = bgpio_open_registry();
+    }
+    else {
+	(void) bgpio_registry_refresh(registry);
+    }
+    return registry;
+}
+
+/**
+ * Return the process-wide index of gpio line names, creating it on
+ * first use.  It is only created when a line is given by name, so
+ * tools given only line numbers pay nothing for it.
+ *
+ * @result The ::bgpio_line_index_t, or NULL if it could not be
+ * created.
+ */
+static bgpio_line_index_t *
+line_index(void)
+{
+    static bgpio_line_index_t *index = NULL;
+    bgpio_registry_t *registry;
+
+    if (!index && (registry = chip_registry())) {
+	index = bgpio_open_line_index(registry, BGPIO_LINE_CACHE);
+    }
+    return index;
+}
+
 /**
  * Return an ::svector containing the set of likely gpiochip devices.
  *
@@ -53,19 +98,18 @@ version(char *this_name)
 svector *
 get_chip_paths()
 {
-    DIR *dfd = opendir("/dev");
-    struct dirent *dir;
-    svector *paths = create_svector(8);
-    if(dfd) {
-	while((dir = readdir(dfd))) {
-	    if (strncmp(dir->d_name, "gpiochip", 8) == 0) {
-		/* File name begins with gpiochip */
-		char *path = malloc(strlen(dir->d_name) + 6);
-		sprintf(path, "/dev/%s", dir->d_name);
-		paths = svector_add_elem(paths, path);
-	    }
-	}
-	svector_sort(paths);
+    bgpio_registry_t *registry = chip_registry();
+    svector *paths;
+    int i;
+
+    if (!registry) {
+	return create_svector(0);
+    }
+    /* The registry keeps its chips sorted by path. */
+    paths = create_svector(registry->count);
+    for (i = 0; i < registry->count; i++) {
+	paths = svector_add_elem(paths,
+				 newstrcpy(registry->chips[i]->path));
     }
     return paths;
 }
@@ -89,33 +133,34 @@ free_chip_paths(svector *paths)
  * Return the full path for the gpio character device given by arg.
  * 
  * @param paths svector containing full paths to all gpio character
- * devices.  This may be NULL in which case path_for_arg() will call
- * get_chip_paths(). 
- * The matching string from this struct will be the returned
- * string.  The caller may not free it and should ensure that the
- * svector it comes from is not freed while the string is still in
- * use.
+ * devices, as returned by get_chip_paths().  This may be NULL.  It is
+ * only searched if the chip registry is unavailable, as otherwise
+ * the registry's index is used.
  *
  * @param arg The, possibly abbreviated, string identifying the
  * gpiochip device in question.  To match "/dev/gpiochip0", arg may
- * contain: "gpiochip0", "chip0", or just "0".
+ * contain: "gpiochip0", "chip0", or just "0".  The chip's label may
+ * also be used.
  *
- * @result The matching string from \p paths.  See the note above for
- * safety information on this result.  If no match is discovered the
- * program will abort with exit().
+ * @result The matching path, dynamically allocated so that the caller
+ * must free it, or NULL if there is no unique match.
  */
 char *
 path_for_arg(svector *paths, char *arg)
 {
+    bgpio_registry_t *registry;
+    bgpio_chip_entry_t *entry;
     finder_fn_t finder;
     int match;
     if (arg) {
+	if ((registry = chip_registry())) {
+	    /* The registry may free the entry when it is next
+	     * refreshed, so we return a copy of its path. */
+	    entry = bgpio_registry_find(registry, arg);
+	    return entry? newstrcpy(entry->path): NULL;
+	}
 	if (!paths) {
-	    /* Note that we do not free the svector returned from
-	     * here.  This is a conscious choice, doing so would
-	     * require much more code and buy us very little.
-             */
-	    paths = get_chip_paths();
+	    return NULL;
 	}
 	if (arg[0] == '/') {
 	    /* arg looks like a full path, so use strcmp as the
@@ -129,15 +174,13 @@ path_for_arg(svector *paths, char *arg)
 	if (match < 0) {
 	    return NULL;
 	}
-	return paths->str[match];
+	return newstrcpy(paths->str[match]);
     }
     return NULL;
 }
 
 /**
  * Return a dynamically allocated copy of a string.
- * This is specifically intended for copying the result of
- * path_for_arg() so that it may be safely freed.
  *
  * @param orig_str The string to be copied.
  *
@@ -176,6 +219,54 @@ read_int(char *arg, int *result)
     return (fields == 1);
 }
 
+/**
+ * Read a duration from a string, returning true if successful.  The
+ * duration is an integer followed by an optional unit: ns, us, ms or
+ * s.  If no unit is given, milliseconds are assumed.
+ *
+ * @param arg A string which we expect to contain a duration.
+ *
+ * @param result Pointer to the unsigned integer into which the
+ * duration, in nanoseconds, will be read.  Only use this value if the
+ * function returns true.
+ *
+ * @result true if \p arg contained a valid duration.
+ */
+bool
+read_duration_ns(char *arg, uint64_t *result)
+{
+    char *unit;
+    uint64_t value;
+
+    if (!isdigit(arg[0])) {
+	return false;
+    }
+    errno = 0;
+    value = strtoull(arg, &unit, 10);
+    if (errno) {
+	return false;
+    }
+    if (!*unit) {
+	unit = "ms";
+    }
+    if (streq(unit, "ns")) {
+	*result = value;
+    }
+    else if (streq(unit, "us")) {
+	*result = value * 1000;
+    }
+    else if (streq(unit, "ms")) {
+	*result = value * 1000000;
+    }
+    else if (streq(unit, "s")) {
+	*result = value * 1000000000;
+    }
+    else {
+	return false;
+    }
+    return true;
+}
+
 
 /**
  * Read a uint64_t integer from a string, returning true if successful.
@@ -421,6 +512,37 @@ parse_lineflags(char *arg, uint64_t *flags, uint64_t allowed_flags)
     return true;
 }
 
+/**
+ * Read a gpio line, given either as a number or as a line name, from
+ * a string.
+ *
+ * @param arg The string.
+ *
+ * @param chip The path of the chip on which the line must be, or NULL
+ * if the line may be on any chip.
+ *
+ * @param line Where the line number will be placed.
+ *
+ * @result true if \p arg is a number, or the unique name of a line on
+ * \p chip.
+ */
+bool
+read_line_id(char *arg, const char *chip, int *line)
+{
+    bgpio_line_index_t *index;
+    bgpio_line_entry_t *entry;
+
+    if (read_int(arg, line)) {
+	return true;
+    }
+    if (!(index = line_index()) ||
+	!(entry = bgpio_find_line_name(index, chip, arg))) {
+	return false;
+    }
+    *line = entry->offset;
+    return true;
+}
+
 /**
  * Parse a gpio line command line argument to get the line number and
  * any specified bias flags.  See usage() for a description of the
@@ -428,6 +550,9 @@ parse_lineflags(char *arg, uint64_t *flags, uint64_t allowed_flags)
  *
  * @param arg The command line argument as provided on the command line
  *
+ * @param chip The path of the chip to which the line belongs, used to
+ * resolve line names.  See read_line_id().
+ *
  * @param line  Where we will store the gpio line number read from \p
  * arg.
  *
@@ -439,22 +564,252 @@ parse_lineflags(char *arg, uint64_t *flags, uint64_t allowed_flags)
  * @result true if the argument was valid, else false.
  */
 bool
-read_line_arg(char *arg, int *line, uint64_t *line_flags, uint64_t allowed)
+read_line_arg(char *arg, const char *chip, int *line,
+	      uint64_t *line_flags, uint64_t allowed)
 {
-    char flags_str[2];
-    int fields;
+    char *bracket = strchr(arg, '[');
+    bool found;
+
+    if (bracket) {
+	*bracket = '\0';	/* Temporarily truncate string */
+    }
+    found = read_line_id(arg, chip, line);
+    if (bracket) {
+	*bracket = '[';		/* Restore arg to its orignal state. */
+	if (found && strchr(bracket, ']')) {
+	    return parse_lineflags(bracket + 1, line_flags, allowed);
+	}
+	return false;
+    }
+    return found;
+}
+
+
+/**
+ * Split a chip prefix from a line-spec.  A line-spec may be prefixed
+ * by a gpiochip-id and a colon, eg "chip1:17", to name a line on a
+ * chip other than the one given as the tool's first argument.
+ *
+ * @param arg Pointer to the line-spec.  If it has a chip prefix, this
+ * is updated to point past it.
+ *
+ * @result The path of the chip named by the prefix, which the caller
+ * must free, or NULL if there is no prefix.  A prefix that does not
+ * identify a chip is taken to be part of a line name.
+ */
+char *
+line_spec_chip(char **arg)
+{
+    char *colon = strchr(*arg, ':');
+    svector *chip_paths;
+    char *path;
 
-    fields = sscanf(arg, "%d[%1s", line, flags_str);
-    if (fields == 2) {
-	char *bracket = strchr(arg, '[');
-	arg = bracket + 1;
-	if (!parse_lineflags(arg, line_flags, allowed)) {
+    if (!colon) {
+	return NULL;
+    }
+    *colon = '\0';		/* Temporarily truncate string */
+    chip_paths = get_chip_paths();
+    path = path_for_arg(chip_paths, *arg);
+    *colon = ':';		/* Restore arg to its orignal state. */
+    if (path) {
+	*arg = colon + 1;
+    }
+    free_chip_paths(chip_paths);
+    return path;
+}
+
+
+/**
+ * The number of bytes of stack prefaulted by apply_rt_options().  This
+ * is generous for any of our tools' hot loops.
+ */
+#define RT_PREFAULT_STACK (256 * 1024)
+
+/**
+ * The number of bytes of heap prefaulted by apply_rt_options(), and
+ * thereafter retained by malloc() rather than returned to the system.
+ */
+#define RT_PREFAULT_HEAP (1024 * 1024)
+
+/**
+ * Predicate identifying the long options handled by read_rt_option().
+ *
+ * @param name The name of the long option.
+ *
+ * @result true if \p name is one of the real-time options.
+ */
+bool
+is_rt_option(const char *name)
+{
+    return streq(name, "cpu") || streq(name, "mlock") ||
+	streq(name, "prefault") || streq(name, "rt-priority");
+}
+
+/**
+ * Record a real-time option, as identified by is_rt_option(), in an
+ * ::rt_options struct.
+ *
+ * @param name The name of the long option.
+ *
+ * @param arg The option's argument, or NULL for those that take none.
+ *
+ * @param rt The ::rt_options struct to be updated.
+ *
+ * @result true if successful, false if \p arg is not valid.
+ */
+bool
+read_rt_option(const char *name, char *arg, rt_options *rt)
+{
+    int value;
+
+    if (streq(name, "mlock")) {
+	rt->mlock = true;
+	return true;
+    }
+    if (streq(name, "prefault")) {
+	rt->prefault = true;
+	return true;
+    }
+    if (!read_int(arg, &value)) {
+	return false;
+    }
+    if (streq(name, "cpu")) {
+	if ((value < 0) || (value >= CPU_SETSIZE)) {
+	    return false;
+	}
+	rt->cpu = value;
+	return true;
+    }
+    if (streq(name, "rt-priority")) {
+	if ((value < sched_get_priority_min(SCHED_FIFO)) ||
+	    (value > sched_get_priority_max(SCHED_FIFO))) {
 	    return false;
 	}
+	rt->priority = value;
+	return true;
+    }
+    return false;
+}
+
+/**
+ * Touch each page of a region of stack, so that the hot loop does not
+ * take page faults as its stack grows.
+ */
+static void
+prefault_stack(void)
+{
+    volatile char stack[RT_PREFAULT_STACK];
+    long page = sysconf(_SC_PAGESIZE);
+    size_t i;
+
+    for (i = 0; i < sizeof(stack); i += page) {
+	stack[i] = 0;
+    }
+}
+
+/**
+ * Touch each page of a buffer, without changing its contents.
+ *
+ * @param buf The buffer.
+ *
+ * @param size The size of \p buf in bytes.
+ */
+static void
+prefault_buffer(void *buf, size_t size)
+{
+    volatile char *bytes = (volatile char *) buf;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t i;
+
+    for (i = 0; i < size; i += page) {
+	bytes[i] = bytes[i];
+    }
+}
+
+/**
+ * Fault in a block of heap, and stop malloc() from returning it to
+ * the system or from satisfying later allocations with fresh mmap()ed
+ * memory.
+ *
+ * @result true if successful.
+ */
+static bool
+prefault_heap(void)
+{
+    char *heap;
+
+    if (!mallopt(M_TRIM_THRESHOLD, -1) || !mallopt(M_MMAP_MAX, 0)) {
+	return false;
     }
-    else if (fields != 1) {
+    if (!(heap = malloc(RT_PREFAULT_HEAP))) {
 	return false;
     }
+    prefault_buffer(heap, RT_PREFAULT_HEAP);
+    free(heap);
     return true;
 }
 
+/**
+ * Apply real-time execution settings to the calling process, before
+ * it enters its hot loop.  The cpu affinity is set first, so that
+ * memory is faulted in on that cpu's node, and the scheduling policy
+ * last, so that prefaulting does not run at real-time priority.  Each
+ * setting that cannot be applied, usually for lack of privilege, is
+ * reported on stderr, and the remaining settings are still applied.
+ *
+ * Note that only the calling thread is given SCHED_FIFO; threads it
+ * creates later inherit it by default.
+ *
+ * @param executable The name of the calling executable, for messages.
+ *
+ * @param rt The ::rt_options to apply.
+ *
+ * @param buf A buffer used by the hot loop, to be prefaulted, or NULL.
+ *
+ * @param size The size of \p buf in bytes.
+ *
+ * @result The number of settings that could not be applied.
+ */
+int
+apply_rt_options(const char *executable, rt_options *rt,
+		 void *buf, size_t size)
+{
+    struct sched_param param = {rt->priority};
+    cpu_set_t cpus;
+    int failures = 0;
+
+    if (rt->cpu >= 0) {
+	CPU_ZERO(&cpus);
+	CPU_SET(rt->cpu, &cpus);
+	if (sched_setaffinity(0, sizeof(cpus), &cpus)) {
+	    fprintf(stderr, "%s: unable to run on cpu %d (%s)\n",
+		    executable, rt->cpu, strerror(errno));
+	    failures++;
+	}
+    }
+    if (rt->mlock) {
+	if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+	    fprintf(stderr, "%s: unable to lock memory (%s)\n",
+		    executable, strerror(errno));
+	    failures++;
+	}
+    }
+    if (rt->prefault) {
+	prefault_stack();
+	if (buf) {
+	    prefault_buffer(buf, size);
+	}
+	if (!prefault_heap()) {
+	    fprintf(stderr, "%s: unable to prefault heap\n", executable);
+	    failures++;
+	}
+    }
+    if (rt->priority) {
+	if (sched_setscheduler(0, SCHED_FIFO, &param)) {
+	    fprintf(stderr, "%s: unable to set SCHED_FIFO priority %d (%s)\n",
+		    executable, rt->priority, strerror(errno));
+	    failures++;
+	}
+    }
+    return failures;
+}
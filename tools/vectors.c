@@ -41,7 +41,7 @@ static size_t
 vector_elements(size_t size)
 {
     // TODO: Some unit tests for all of this.
-    return SIZE_INCREMENT * ((size + SIZE_INCREMENT-1) % SIZE_INCREMENT);
+    return SIZE_INCREMENT * ((size + SIZE_INCREMENT-1) / SIZE_INCREMENT);
 }
 
 /**